@@ -257,6 +257,39 @@ _on_finish(MediaScan *s, void *userdata)
   }
 }
 
+static void
+_on_duplicates(MediaScan *s, MediaScanDuplicates *d, void *userdata)
+{
+  HV *selfh = (HV *)userdata;
+  SV *callback = NULL;
+  AV *paths;
+  int i;
+
+  if (!my_hv_exists(selfh, "on_duplicates"))
+    return;
+
+  callback = *(my_hv_fetch(selfh, "on_duplicates"));
+
+  paths = newAV();
+  for (i = 0; i < d->npaths; i++)
+    av_push(paths, newSVpv(d->paths[i], 0));
+
+  {
+    dSP;
+    PUSHMARK(SP);
+    XPUSHs(sv_2mortal(newRV_noinc((SV *)paths)));
+    XPUSHs(sv_2mortal(newSVuv(d->size)));
+    PUTBACK;
+    call_sv(callback, G_VOID | G_DISCARD | G_EVAL);
+
+    SPAGAIN;
+    if (SvTRUE(ERRSV)) {
+      warn("Error in on_duplicates callback (ignored): %s", SvPV_nolen(ERRSV));
+      POPs;
+    }
+  }
+}
+
 MODULE = Media::Scan		PACKAGE = Media::Scan		
 
 void
@@ -338,7 +371,8 @@ CODE:
         SV *f = *(my_hv_fetch(spec, "format"));
         if (SvPOK(f)) {
           const char *fs = SvPVX(f);
-          format = !strcmp(fs, "JPEG") ? THUMB_JPEG : !strcmp(fs, "PNG") ? THUMB_PNG : THUMB_AUTO;
+          format = !strcmp(fs, "JPEG") ? THUMB_JPEG : !strcmp(fs, "PNG") ? THUMB_PNG
+            : !strcmp(fs, "WebP") ? THUMB_WEBP : THUMB_AUTO;
         }
       }
       if (my_hv_exists(spec, "width")) {
@@ -408,6 +442,10 @@ CODE:
   ms_set_error_callback(s, _on_error);
   ms_set_progress_callback(s, _on_progress);
   ms_set_finish_callback(s, _on_finish);
+
+  // Duplicate detection reads files, only turn it on if asked for
+  if (my_hv_exists(selfh, "on_duplicates"))
+    ms_set_duplicate_callback(s, _on_duplicates);
   
   ms_set_userdata(s, (void *)selfh);
   
@@ -451,4 +489,5 @@ INCLUDE: xs/Error.xs
 INCLUDE: xs/Progress.xs
 INCLUDE: xs/Result.xs
 INCLUDE: xs/Video.xs
+INCLUDE: xs/Audio.xs
 INCLUDE: xs/Image.xs
\ No newline at end of file
@@ -23,13 +23,18 @@ use constant MS_RESCAN          => 1 << 2;
 use constant MS_INCLUDE_DELETED => 1 << 3;
 use constant MS_WATCH_CHANGES   => 1 << 4;
 use constant MS_CLEARDB         => 1 << 5;
+use constant MS_CACHE_RESULTS   => 1 << 6;
+use constant MS_SHARED_CACHE    => 1 << 7;
+use constant MS_IMAGE_SIGNATURES => 1 << 8;
+use constant MS_AUDIO_LOUDNESS  => 1 << 9;
 
 our $VERSION = '0.01';
 
 our @EXPORT = qw(
     MS_LOG_ERR MS_LOG_WARN MS_LOG_INFO MS_LOG_DEBUG MS_LOG_MEMORY
     MS_USE_EXTENSION MS_FULL_SCAN MS_RESCAN MS_INCLUDE_DELETED
-    MS_WATCH_CHANGES MS_CLEARDB
+    MS_WATCH_CHANGES MS_CLEARDB MS_CACHE_RESULTS MS_SHARED_CACHE
+    MS_IMAGE_SIGNATURES MS_AUDIO_LOUDNESS
 );
 
 require XSLoader;
@@ -76,6 +81,12 @@ An OR'ed list of flags, the possible flags are:
                          since the last scan.
     MS_WATCH_CHANGES   - Continue watching for changes after the scan has completed.
     MS_CLEARDB         - Wipe the internal libmediascan database before scanning.
+    MS_CACHE_RESULTS   - Store every result in a cache, and return the stored result for
+                         files that haven't changed instead of scanning them again.
+    MS_SHARED_CACHE    - The cachedir is used by other processes scanning at the same time.
+    MS_IMAGE_SIGNATURES - Compute a perceptual signature and average color for images and
+                         video frames from their smallest thumbnail.
+    MS_AUDIO_LOUDNESS  - Decode audio files to measure their EBU R128 loudness and true peak.
 
 =item ignore (default: none)
 
@@ -97,7 +108,7 @@ scanning process and are available within the result callback.
 
 The format of a thumbnail spec is:
 
-    { format => 'AUTO', # or JPEG or PNG
+    { format => 'AUTO', # or JPEG, PNG or WebP
       width => 100,
       height => 100,
       keep_aspect => 1,
@@ -128,6 +139,12 @@ during scanning.
 An optional callback that is called when scanning has finished. Nothing is currently passed
 to this callback, eventually a scanning summary and overall stats might be included here.
 
+=item on_duplicates
+
+An optional callback that turns on duplicate detection. Once all files have been scanned it is
+called for each group of files with identical content, and passed an arrayref of their paths
+and their size in bytes.
+
 =cut
 
 sub new {
@@ -5,4 +5,20 @@ use base qw(Media::Scan::Result);
 
 # Implementation is in xs/Audio.xs and xs/Result.xs
 
+sub as_hash {
+    my $self = shift;
+    
+    return {
+        %{ $self->SUPER::as_hash() },
+        codec        => $self->codec,
+        samplerate   => $self->samplerate,
+        channels     => $self->channels,
+        vbr          => $self->vbr,
+        audio_offset => $self->audio_offset,
+        audio_size   => $self->audio_size,
+        loudness     => $self->loudness,
+        true_peak    => $self->true_peak,
+    };
+}
+
 1;
\ No newline at end of file
@@ -10,6 +10,7 @@ sub as_hash {
     return {
         type         => $self->type,
         path         => $self->path,
+        moved_from   => $self->moved_from,
         mime_type    => $self->mime_type,
         dlna_profile => $self->dlna_profile,
         size         => $self->size,
@@ -17,6 +18,8 @@ sub as_hash {
         bitrate      => $self->bitrate,
         duration_ms  => $self->duration_ms,
         hash         => $self->hash,
+        signature    => $self->signature,
+        color        => $self->color,
         thumbnails   => $self->thumbnails,
     };
 }
@@ -0,0 +1,73 @@
+MODULE = Media::Scan		PACKAGE = Media::Scan::Audio
+
+SV *
+codec(MediaScanResult *r)
+CODE:
+{
+  RETVAL = newSVpv(r->audio->codec, 0);
+}
+OUTPUT:
+  RETVAL
+
+int
+samplerate(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->audio->samplerate;
+}
+OUTPUT:
+  RETVAL
+
+int
+channels(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->audio->channels;
+}
+OUTPUT:
+  RETVAL
+
+int
+vbr(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->audio->vbr;
+}
+OUTPUT:
+  RETVAL
+
+SV *
+audio_offset(MediaScanResult *r)
+CODE:
+{
+  RETVAL = newSVuv(r->audio->audio_offset);
+}
+OUTPUT:
+  RETVAL
+
+SV *
+audio_size(MediaScanResult *r)
+CODE:
+{
+  RETVAL = newSVuv(r->audio->audio_size);
+}
+OUTPUT:
+  RETVAL
+
+SV *
+loudness(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->audio->has_loudness ? newSVnv(r->audio->loudness) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
+
+SV *
+true_peak(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->audio->has_loudness ? newSVnv(r->audio->true_peak) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
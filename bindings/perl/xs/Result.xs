@@ -18,6 +18,33 @@ CODE:
 OUTPUT:
   RETVAL
 
+SV *
+moved_from(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->moved_from ? newSVpv(r->moved_from, 0) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
+
+SV *
+signature(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->has_signature ? newSVpvf("%016llx", (unsigned long long)r->signature) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
+
+SV *
+color(MediaScanResult *r)
+CODE:
+{
+  RETVAL = r->has_signature ? newSVuv(r->color) : &PL_sv_undef;
+}
+OUTPUT:
+  RETVAL
+
 SV *
 mime_type(MediaScanResult *r)
 CODE:
@@ -123,6 +150,11 @@ CODE:
   for (i = 0; i < count; i++) {
     const char *key, *value;
     ms_result_get_tag(r, i, &key, &value);
+
+    // Binary items such as pictures have no value, only a location in the file
+    if (!value)
+      continue;
+
     my_hv_store_ent(RETVAL, newSVpv(key, 0), newSVpv(value, 0));
   }
 }
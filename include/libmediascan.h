@@ -28,6 +28,13 @@
 #define MAX_TAG_ITEMS    256
 #define MAX_SUBSTRING_LEN 32
 
+// Storage class for state kept separately by each thread
+#ifdef _MSC_VER
+#define MS_THREAD_LOCAL __declspec(thread)
+#else
+#define MS_THREAD_LOCAL __thread
+#endif
+
 enum media_error {
   MS_ERROR_TYPE_UNKNOWN = -1,
   MS_ERROR_TYPE_INVALID_PARAMS = -2,
@@ -50,13 +57,39 @@ enum scan_flags {
   MS_RESCAN = 1 << 2,
   MS_INCLUDE_DELETED = 1 << 3,
   MS_WATCH_CHANGES = 1 << 4,
-  MS_CLEARDB = 1 << 5           /* DEBUG: Clear the BDB when ms_scan is called */
+  MS_CLEARDB = 1 << 5,          /* DEBUG: Clear the BDB when ms_scan is called */
+  MS_CACHE_RESULTS = 1 << 6,
+  MS_SHARED_CACHE = 1 << 7,
+  MS_IMAGE_SIGNATURES = 1 << 8,
+  MS_AUDIO_LOUDNESS = 1 << 9
 };
 
 enum thumb_format {
   THUMB_AUTO = 1,               //< Use JPEG for square thumbnails, transparent PNG for non-square
   THUMB_JPEG,
-  THUMB_PNG
+  THUMB_PNG,
+  THUMB_WEBP                    //< Lossy WebP, with alpha if needed, using the JPEG quality setting
+};
+
+enum thumb_flags {
+  THUMB_USE_EMBEDDED = 1,       //< Use an embedded preview (e.g. EXIF thumbnail) instead of decoding the full image
+  THUMB_FAST_ENCODE = 2         //< Favor encoding speed over output quality or size
+};
+
+enum thumb_png_filter {
+  THUMB_PNG_FILTER_NONE = 0x01,
+  THUMB_PNG_FILTER_SUB = 0x02,
+  THUMB_PNG_FILTER_UP = 0x04,
+  THUMB_PNG_FILTER_AVG = 0x08,
+  THUMB_PNG_FILTER_PAETH = 0x10,
+  THUMB_PNG_FILTER_ALL = 0x1F
+};
+
+enum thumb_png_strategy {
+  THUMB_PNG_STRATEGY_DEFAULT = 0,
+  THUMB_PNG_STRATEGY_FILTERED,  //< Better for photographic content
+  THUMB_PNG_STRATEGY_HUFFMAN,   //< Huffman coding only, no string matching
+  THUMB_PNG_STRATEGY_RLE        //< Run-length matches only, fast and good for flat areas such as padding
 };
 
 enum exif_orientation {
@@ -74,7 +107,8 @@ enum event_type {
   EVENT_TYPE_RESULT = 1,
   EVENT_TYPE_PROGRESS,
   EVENT_TYPE_ERROR,
-  EVENT_TYPE_FINISH
+  EVENT_TYPE_FINISH,
+  EVENT_TYPE_DUPLICATES
 };
 
 enum log_level {
@@ -103,7 +137,15 @@ typedef struct _Thread MediaScanThread;
 
 struct _TagItem {
   char *key;
-  char *value;                  // XXX may not be able to store all tag items as strings
+  char *value;                  // decoded the first time it is asked for, NULL for binary items
+  enum tag_value_type type;
+  uint64_t offset;              // where a binary item's data is in the file
+  uint32_t size;                // size of a binary item's data
+
+  // private
+  void *_raw;                   // undecoded text value
+  uint32_t _raw_size;
+  int _format;                  // encoding of _raw
 };
 typedef struct _TagItem MediaScanTagItem;
 
@@ -116,12 +158,15 @@ typedef struct _Tag MediaScanTag;
 
 struct _Audio {
   const char *codec;
-  uint64_t audio_offset;
+  uint64_t audio_offset;        ///< Start of the audio data, past any tags and headers
   uint64_t audio_size;
   int bitrate;
-  int vbr;
+  int vbr;                      ///< Set if the bitrate varies, bitrate is then the average
   int samplerate;
   int channels;
+  int has_loudness;             ///< Set if loudness and true_peak were measured, see MS_AUDIO_LOUDNESS
+  double loudness;              ///< EBU R128 integrated loudness in LUFS, the ReplayGain 2.0 gain is -18 - loudness
+  double true_peak;             ///< Highest true peak in dBTP
 };
 typedef struct _Audio MediaScanAudio;
 
@@ -134,6 +179,7 @@ struct _Image {
   int has_alpha;
   int offset;                   // byte offset to start of image
   enum exif_orientation orientation;
+  char *saved_path;             ///< For thumbnails written to disk (see ms_set_thumbnail_path), the file written
 
   // private members
   void *_dbuf;                  // Buffer for compressed image data
@@ -144,6 +190,7 @@ struct _Image {
   void *_png;                   // PNG-specific internal data
   void *_bmp;                   // BMP-specific internal data
   void *_gif;                   // GIF-specific internal data
+  void *_raw;                   // RAW-specific internal data
 #ifdef TIFF_SUPPORT
   void *_tiff;                  // TIFF-specific internal data
 #endif
@@ -183,6 +230,7 @@ struct _Result {
   int deleted;                  ///< Set if scan flag MS_INCLUDE_DELETED was used and this result is for a deleted file.
   /// NOTE: Only the type and path data will be set for deleted files.
   int changed;                  ///< Set if scan flag MS_RESCAN was used and this result is for a changed file.
+  char *moved_from;             ///< Previous path of a file that was moved or renamed since it was last scanned.
 
   const char *mime_type;
   const char *dlna_profile;
@@ -193,7 +241,11 @@ struct _Result {
 
   uint32_t hash;
 
-  // All media types have thumbnails
+  int has_signature;            ///< Set if signature and color were computed, see MS_IMAGE_SIGNATURES
+  uint64_t signature;           ///< Perceptual hash of the image or video frame, see ms_signature_distance
+  uint32_t color;               ///< Average color of the image or video frame, as 0xRRGGBB
+
+  // All media types have thumbnails, audio from its cover art and video from its cover art or a frame
   int nthumbnails;
 
   MediaScanAudio *audio;        ///< Audio-specific data, only present if type is TYPE_AUDIO or TYPE_VIDEO.
@@ -225,6 +277,13 @@ struct _Progress {
 };
 typedef struct _Progress MediaScanProgress;
 
+struct _Duplicates {
+  uint64_t size;                ///< size of each file in the group
+  int npaths;
+  char **paths;                 ///< files with identical content, sorted
+};
+typedef struct _Duplicates MediaScanDuplicates;
+
 typedef struct _ThumbSpec {
   enum thumb_format format;
   int width;
@@ -232,12 +291,18 @@ typedef struct _ThumbSpec {
   int keep_aspect;
   uint32_t bgcolor;
   int jpeg_quality;
+  int flags;                    ///< THUMB_* flags, see ms_set_thumbnail_spec_flags
+  int png_level;                ///< zlib level 0-9, or -1 for the default, see ms_set_thumbnail_spec_png
+  int png_filters;              ///< THUMB_PNG_FILTER_* mask, or 0 for the libpng default
+  int png_strategy;             ///< THUMB_PNG_STRATEGY_*
 
   // Internal data
   int width_padding;
   int width_inner;
   int height_padding;
   int height_inner;
+  void *_encoder;               // Encoder state reused for every thumbnail made from this spec
+  int _last_size;               // Size of the last thumbnail made from this spec
 } MediaScanThumbSpec;
 
 struct _Scan {
@@ -252,6 +317,9 @@ struct _Scan {
   int async;
   int async_fds[2];
   char *cachedir;
+  uint32_t dbcachesize;         ///< Berkeley DB cache size in bytes, see ms_set_db_cachesize
+  char *thumbpath;              ///< Path template for thumbnails written to disk, see ms_set_thumbnail_path
+  uint64_t thumbcache_size;     ///< Byte limit of the persistent thumbnail cache, 0 if disabled
   int flags;
   int watch_interval;
 
@@ -262,14 +330,19 @@ struct _Scan {
   void (*on_error) (struct _Scan *, MediaScanError *, void *);
   void (*on_progress) (struct _Scan *, MediaScanProgress *, void *);
   void (*on_finish) (struct _Scan *, void *);
+  void (*on_duplicates) (struct _Scan *, MediaScanDuplicates *, void *);
   void *userdata;
 
   DB *dbp;                      /* DB structure handle */
+  void *_dbstate;               // batched writes and prefetched entries for dbp, see database.c
 
   // private
   void *_dirq;                  // simple queue of all directories found
   void *_dlna;                  // libdlna instance
   int _want_abort;              // set when scan should abort as soon as possible
+  void *_thumbcache;            // persistent thumbnail cache, opened on first use
+  void *_resultcache;           // persistent result cache, opened on first use
+  void *_duplicates;            // files seen by the running scan, see duplicate.c
 };
 
 typedef struct _Scan MediaScan;
@@ -278,9 +351,10 @@ typedef void (*ResultCallback) (MediaScan *, MediaScanResult *, void *);
 typedef void (*ErrorCallback) (MediaScan *, MediaScanError *, void *);
 typedef void (*ProgressCallback) (MediaScan *, MediaScanProgress *, void *);
 typedef void (*FinishCallback) (MediaScan *, void *);
+typedef void (*DuplicateCallback) (MediaScan *, MediaScanDuplicates *, void *);
 
-///< libmediascan's errno
-extern int ms_errno;
+///< libmediascan's errno, like errno each thread has its own
+extern MS_THREAD_LOCAL int ms_errno;
 
 // This failure will be set if...
 enum {
@@ -296,7 +370,8 @@ enum {
 };
 
 /**
- * Set the logging level.
+ * Set the logging level of the calling thread. Threads started by the library, for async
+ * scans and directory watching, use the level of the thread that started them.
  * 1 - Error
  * 2 - Warn
  * 3 - Info
@@ -347,8 +422,9 @@ void ms_add_ignore_extension(MediaScan *s, const char *extension);
 /**
  * Specify a thumbnail to be created for all media containing an image, such as embedded images
  * in audio files, video frames, and normal images. Multiple thumbnails can be defined.
- * @param format One of THUMB_AUTO, THUMB_JPEG, or THUMB_PNG. Auto will use JPEG for square thumbnails
- * and transparent PNG for non-square images.
+ * @param format One of THUMB_AUTO, THUMB_JPEG, THUMB_PNG, or THUMB_WEBP. Auto will use JPEG for square
+ * thumbnails and transparent PNG for non-square images. WebP thumbnails are lossy but keep the
+ * transparency of the source, and of any padding when no bgcolor is given.
  * @param width If >0, the thumbnail width
  * @param height If >0, the thumbnail height. If only one of width or height are specified
  * the other dimension will be set to retain the original aspect ratio.
@@ -357,11 +433,36 @@ void ms_add_ignore_extension(MediaScan *s, const char *extension);
  * a different aspect ratio.
  * @param bgcolor If the image needs to be padded and is not transparent, specify a 24-bit bgcolor
  * such as 0xffffff (white) or 0x000000 (black).
- * @param quality For JPEG thumbnails, specify the desired quality. Defaults to 90 if set to 0.
+ * @param quality For JPEG and WebP thumbnails, specify the desired quality. Defaults to 90 if set to 0.
  */
 void ms_add_thumbnail_spec(MediaScan *s, enum thumb_format format, int width,
                            int height, int keep_aspect, uint32_t bgcolor, int quality);
 
+/**
+ * Set one or more THUMB_* flags ORed together on a thumbnail spec previously added with
+ * ms_add_thumbnail_spec.
+ * @param index The spec to change, 0 for the first spec added, 1 for the second, etc.
+ * @param flags Available flags are:
+ * THUMB_USE_EMBEDDED - If the image contains an embedded preview (such as the EXIF thumbnail
+ *   written by most cameras) that is at least as large as this thumbnail and has the same aspect
+ *   ratio, create the thumbnail from the preview and avoid decoding the full image.
+ * THUMB_FAST_ENCODE - Use the fastest JPEG DCT method. This is noticeably faster but slightly
+ *   less accurate, which is rarely visible at thumbnail sizes. For PNG thumbnails that have not
+ *   been configured with ms_set_thumbnail_spec_png, use the fastest zlib level, or run-length
+ *   encoding for thumbnails with padding, which compresses the flat padding very cheaply.
+ */
+void ms_set_thumbnail_spec_flags(MediaScan *s, int index, int flags);
+
+/**
+ * Control how PNG thumbnails are compressed for a spec previously added with ms_add_thumbnail_spec.
+ * @param index The spec to change, 0 for the first spec added, 1 for the second, etc.
+ * @param level zlib compression level from 0 (none) to 9 (smallest), or -1 for the zlib default.
+ * @param filters THUMB_PNG_FILTER_* values ORed together, the encoder picks the best of these
+ *   for each row. 0 uses the libpng default.
+ * @param strategy One of the THUMB_PNG_STRATEGY_* values.
+ */
+void ms_set_thumbnail_spec_png(MediaScan *s, int index, int level, int filters, int strategy);
+
 /**
  * By default, scans are synchronous. This means the call to ms_scan will
  * not return until the scan is finished. To enable background asynchronous
@@ -375,6 +476,38 @@ void ms_set_async(MediaScan *s, int enabled);
  */
 void ms_set_cachedir(MediaScan *s, const char *path);
 
+/**
+ * Set the size of the Berkeley DB memory pool used for the scan database (libmediascan.db).
+ * A larger pool avoids rereading database pages during a rescan of a large library.
+ * This must be called before ms_scan to take effect.
+ * @param bytes Cache size in bytes, or 0 for the Berkeley DB default.
+ */
+void ms_set_db_cachesize(MediaScan *s, uint32_t bytes);
+
+/**
+ * Write thumbnails to files instead of returning their data in the result. Each thumbnail's
+ * MediaScanImage will have saved_path set to the file it was written to, and
+ * ms_result_get_thumbnail_data will return no data for it. If a thumbnail can't be written, its
+ * data is returned in memory as usual. Missing directories are created.
+ * @param template Path template, or NULL for "%c/thumbs/%k-%i.%e". Available fields are:
+ * %c - The cache directory set with ms_set_cachedir
+ * %k - A 16 hex digit key derived from the path of the source file
+ * %i - The index of the thumbnail spec, 0 for the first spec added
+ * %w, %h - The thumbnail width and height
+ * %e - The file extension for the thumbnail format: jpg, png, or webp
+ * %% - A literal %
+ */
+void ms_set_thumbnail_path(MediaScan *s, const char *template);
+
+/**
+ * Keep every thumbnail created in a persistent cache (thumbcache.db in the cache directory), and
+ * reuse it when the same file is scanned again with the same thumbnail spec, even after a
+ * MS_FULL_SCAN. A file is considered the same if its path, size and modification time are
+ * unchanged. When the cache grows past max_bytes the least recently used thumbnails are removed.
+ * @param max_bytes Size limit of the cache, or 0 to disable it (the default).
+ */
+void ms_set_thumbnail_cache_size(MediaScan *s, uint64_t max_bytes);
+
 /**
  * Set one or more flags ORed together to alter the behavior of the scan. If ms_set_flags
  * is not called before ms_scan, a default set of flags is used. The default set is:
@@ -383,7 +516,8 @@ void ms_set_cachedir(MediaScan *s, const char *path);
  * @param flags Available flags are:
  * MS_USE_EXTENSION - Use a file's extension to determine file format. If unset, the scanner
  *   will try to detect a file's type by looking at the actual data. This method is also slower.
- * MS_FULL_SCAN - Scan all files found that are not specified in the ignore list.
+ * MS_FULL_SCAN - Scan all files found that are not specified in the ignore list. What the database
+ *   holds for files under the scanned paths is cleared first, entries for other paths are kept.
  * MS_RESCAN - Perform a fast rescan by only scanning files that are new, or have changed their
  *   size and/or modification timestamp since the last scan was run. If the database from a prior
  *   scan is not available (libmediascan.db), the scan is the same as a full scan. The result for a changed
@@ -391,12 +525,34 @@ void ms_set_cachedir(MediaScan *s, const char *path);
  * MS_INCLUDE_DELETED - It is often useful to know that a file has been deleted. With this flag,
  *   a file that was previously scanned but has since been deleted will be reported to the result_callback
  *   and the r->deleted value will be set. NOTE: Only r->type, r->path, and r->deleted are valid for deleted
- *   results. Also note that this cannot distinguish files that were simply renamed or moved.
+ *   results. A file that was renamed or moved is instead reported at its new path, with r->moved_from
+ *   set to the path it was last scanned at. Moves are recognized by the file's device and inode,
+ *   size, modification timestamp and a fingerprint of its content, and its cached result and
+ *   thumbnails are kept.
  * MS_WATCH_CHANGES - With this flag, after the scan has completed the path(s) will be monitored for changes.
  *   For files located on a local drive under OSX, Linux, or Windows, OS-native change detection will be used.
  *   For files on other systems or on remote network shares, the library will manually look for changes at regular
  *   intervals. Use ms_set_watch_interval() to configure this interval. To stop watching for changes, call
  *   ms_clear_watch().
+ * MS_CACHE_RESULTS - Keep a copy of every result (metadata, tags and thumbnails) in a separate cache
+ *   (results.db in the cache directory). When a file is scanned again and its size and modification
+ *   timestamp are unchanged, the stored result is returned without reading the file. This cache is
+ *   kept by MS_FULL_SCAN, so an application can quickly rebuild its own database from it. Thumbnails
+ *   written to disk with ms_set_thumbnail_path are stored as a reference to the file.
+ * MS_SHARED_CACHE - The cache directory is used by scanners in other processes at the same time,
+ *   typically each scanning different paths. The database is always opened with locking, this
+ *   flag additionally opens the thumbnail and result caches in the same locked environment (they
+ *   are then only used during ms_scan) and disables the in-memory key filter, which can't see
+ *   entries added by other processes.
+ * MS_IMAGE_SIGNATURES - Compute a perceptual signature for images and video frames while making
+ *   their smallest thumbnail, so no extra decoding is needed. r->signature is a 64-bit difference
+ *   hash (dHash) that changes little when an image is resized or recompressed, and r->color is the
+ *   average color. Requires at least one thumbnail spec. Compare signatures with ms_signature_distance.
+ * MS_AUDIO_LOUDNESS - Decode every audio file after reading its metadata and measure its EBU R128
+ *   integrated loudness and true peak (r->audio->loudness and r->audio->true_peak), which give
+ *   ReplayGain values without a separate pass over the files. This reads and decodes all of the
+ *   audio, so it's much slower than a normal scan. Use it with MS_CACHE_RESULTS so unchanged files
+ *   are only analyzed once.
  */
 void ms_set_flags(MediaScan *s, int flags);
 
@@ -439,6 +595,15 @@ void ms_set_progress_interval(MediaScan *s, int seconds);
  */
 void ms_set_finish_callback(MediaScan *s, FinishCallback callback);
 
+/**
+ * Set a callback that will be called for every group of files with identical content found by
+ * ms_scan, once all files have been scanned and before the finish callback. This callback is
+ * optional, setting it turns on duplicate detection. Every file is considered, including those
+ * a MS_RESCAN skips. Files are compared by size first, then by a hash of their first and last
+ * 64 KB, and only files matching both are read in full.
+ */
+void ms_set_duplicate_callback(MediaScan *s, DuplicateCallback callback);
+
 /**
  * Set an optional user pointer to be passed to all callbacks.
  */
@@ -501,10 +666,18 @@ MediaScanImage *ms_result_get_thumbnail(MediaScanResult *r, int index);
  * @param r MediaScanResult instance.
  * @param index 0-based index of the thumbnail to return. Check r->nthumbnails for the total number.
  * @param *length (OUT) Returns the length of the thumbnail data.
- * @return A pointer to the raw JPEG or PNG thumbnail data.
+ * @return A pointer to the raw JPEG or PNG thumbnail data, or NULL if the thumbnail was written to disk.
  */
 const uint8_t *ms_result_get_thumbnail_data(MediaScanResult *r, int index, int *length);
 
+/**
+ * Get the file a thumbnail was written to when using ms_set_thumbnail_path.
+ * @param r MediaScanResult instance.
+ * @param index 0-based index of the thumbnail. Check r->nthumbnails for the total number.
+ * @return The path of the thumbnail file, or NULL if the thumbnail is only in memory.
+ */
+const char *ms_result_get_thumbnail_path(MediaScanResult *r, int index);
+
 /**
  * Return the total number of tags for a given result.
  * @param r MediaScanResult instance.
@@ -517,10 +690,38 @@ int ms_result_get_tag_count(MediaScanResult *r);
  * @param r MediaScanResult instance.
  * @param index 0-based index of the tag to return. Check ms_result_get_tag_count for the total number.
  * @param key (OUT) Returns the key string.
- * @param value (OUT) Returns the value string.
+ * @param value (OUT) Returns the value string, or NULL for binary data (see ms_result_get_tag_data).
  */
 void ms_result_get_tag(MediaScanResult *r, int index, const char **key, const char **value);
 
+/**
+ * Get the value of the first tag with the given key. Keys are matched without regard to case.
+ * Text is only decoded for the tags that are asked for, so this is cheaper than walking every
+ * tag with ms_result_get_tag.
+ * @param r MediaScanResult instance.
+ * @param key Tag key, such as TIT2 for ID3v2, TITLE for Vorbis comments or ©nam for MP4.
+ * @return The value, or NULL if there is no such tag or it holds binary data.
+ */
+const char *ms_result_get_tag_value(MediaScanResult *r, const char *key);
+
+/**
+ * Get where the data of a binary tag is, such as ID3v2 APIC and lyrics or MP4 covr. These are
+ * left in the file rather than read during the scan.
+ * @param r MediaScanResult instance.
+ * @param index 0-based index of the tag. Check ms_result_get_tag_count for the total number.
+ * @param offset (OUT) File position of the data.
+ * @param size (OUT) Size of the data.
+ * @return 1 if the tag holds binary data, 0 if it holds text.
+ */
+int ms_result_get_tag_data(MediaScanResult *r, int index, uint64_t *offset, uint32_t *size);
+
+/**
+ * Compare two signatures computed with MS_IMAGE_SIGNATURES.
+ * @return The number of differing bits, from 0 to 64. Images within about 10 are usually
+ *   versions of the same picture.
+ */
+int ms_signature_distance(uint64_t a, uint64_t b);
+
 ///-------------------------------------------------------------------------------------------------
 ///  Watch a directory in the background.
 ///
@@ -1,25 +1,25 @@
 
 
 #include <libmediascan.h>
-
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef WIN32
 #include "mediascan_win32.h"
 #endif
 
-#ifdef _MSC_VER
-#pragma warning( disable: 4244 )
-#endif
-
-#include <libavformat/avformat.h>
-
-#ifdef _MSC_VER
-#pragma warning( default: 4244 )
-#endif
-
 #include "common.h"
+#include "buffer.h"
 #include "audio.h"
+#include "audio_asf.h"
+#include "audio_flac.h"
+#include "audio_mp4.h"
+#include "audio_mpeg.h"
+#include "audio_ogg.h"
+#include "audio_wav.h"
 #include "error.h"
+#include "tag_id3.h"
+#include "util.h"
 
 MediaScanAudio *audio_create(void) {
   MediaScanAudio *a = (MediaScanAudio *)calloc(sizeof(MediaScanAudio), 1);
@@ -33,6 +33,65 @@ MediaScanAudio *audio_create(void) {
   return a;
 }
 
+// Audio files are parsed natively from their headers, FFmpeg is never used to probe them.
+// Each parser sets the codec and whatever of duration, bitrate and audio offset/size its
+// format stores, anything it can't find is worked out from the rest below.
+int audio_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr = buffer_ptr(buf);
+  uint32_t len;
+  int ret = 0;
+
+  // An ID3v2 tag may come before MP3 or FLAC data, what follows it decides the format
+  if (bptr[0] == 'I' && bptr[1] == 'D' && bptr[2] == '3') {
+    uint32_t tag_size = tag_id3_index(r, buf, 0);
+
+    if (!tag_size || !buffer_check_load(buf, r->_fp, 4, BUF_SIZE))
+      goto out;
+
+    a->audio_offset = tag_size;
+    bptr = buffer_ptr(buf);
+  }
+
+  len = buffer_len(buf);
+
+  if (len >= 4 && !memcmp(bptr, "fLaC", 4)) {
+    ret = audio_flac_read_header(a, r);
+  }
+  else if (len >= 4 && !memcmp(bptr, "OggS", 4)) {
+    ret = audio_ogg_read_header(a, r);
+  }
+  else if (len >= 4 && (!memcmp(bptr, "RIFF", 4) || !memcmp(bptr, "FORM", 4))) {
+    ret = audio_wav_read_header(a, r);
+  }
+  else if (len >= 8 && !memcmp(bptr + 4, "ftyp", 4)) {
+    ret = audio_mp4_read_header(a, r);
+  }
+  else if (len >= 8 && !memcmp(bptr, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8)) {
+    ret = audio_asf_read_header(a, r);
+  }
+  else if (match_file_extension(r->path, "mp3,mp2,mpa") || (bptr[0] == 0xFF && (bptr[1] & 0xE0) == 0xE0)) {
+    // MP3 files may have junk before the first frame, so these are also tried by extension
+    ret = audio_mpeg_read_header(a, r);
+  }
+  else if (match_file_extension(r->path, "m4a,m4b,mp4,mov")) {
+    // Older MP4 files may start with another atom than ftyp
+    ret = audio_mp4_read_header(a, r);
+  }
+
+  if (!ret)
+    goto out;
+
+  if (!a->bitrate && a->audio_size && r->duration_ms)
+    a->bitrate = (int)(a->audio_size * 8000 / r->duration_ms);
+
+  if (!r->bitrate)
+    r->bitrate = a->bitrate;
+
+out:
+  return ret;
+}
+
 void audio_destroy(MediaScanAudio *a) {
   LOG_MEM("destroy MediaScanAudio @ %p\n", a);
   free(a);
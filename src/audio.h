@@ -3,6 +3,9 @@
 
 MediaScanAudio *audio_create(void);
 
+// Fills a from the native parser for the file's format, r->_buf must hold the start of the file
+int audio_read_header(MediaScanAudio *a, MediaScanResult *r);
+
 void audio_destroy(MediaScanAudio *a);
 
 #endif // _AUDIO_H
@@ -0,0 +1,142 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "audio_asf.h"
+#include "error.h"
+
+// GUIDs in file byte order
+// *INDENT-OFF*
+static const unsigned char ASF_Header_Object[16] =
+  { 0x30, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C };
+static const unsigned char ASF_Data_Object[16] =
+  { 0x36, 0x26, 0xB2, 0x75, 0x8E, 0x66, 0xCF, 0x11, 0xA6, 0xD9, 0x00, 0xAA, 0x00, 0x62, 0xCE, 0x6C };
+static const unsigned char ASF_File_Properties_Object[16] =
+  { 0xA1, 0xDC, 0xAB, 0x8C, 0x47, 0xA9, 0xCF, 0x11, 0x8E, 0xE4, 0x00, 0xC0, 0x0C, 0x20, 0x53, 0x65 };
+static const unsigned char ASF_Stream_Properties_Object[16] =
+  { 0x91, 0x07, 0xDC, 0xB7, 0xB7, 0xA9, 0xCF, 0x11, 0x8E, 0xE6, 0x00, 0xC0, 0x0C, 0x20, 0x53, 0x65 };
+static const unsigned char ASF_Audio_Media[16] =
+  { 0x40, 0x9E, 0x69, 0xF8, 0x4D, 0x5B, 0xCF, 0x11, 0xA8, 0xFD, 0x00, 0x80, 0x5F, 0x5C, 0x44, 0x2B };
+static const unsigned char ASF_Content_Encryption_Object[16] =
+  { 0xFB, 0xB3, 0x11, 0x22, 0x23, 0xBD, 0xD2, 0x11, 0xB4, 0xB7, 0x00, 0xA0, 0xC9, 0x03, 0x48, 0xAD };
+static const unsigned char ASF_Extended_Content_Encryption_Object[16] =
+  { 0x14, 0xE6, 0x8A, 0x29, 0x22, 0x26, 0x17, 0x4C, 0xB9, 0x35, 0xDA, 0xE0, 0x7E, 0xE9, 0x28, 0x9C };
+
+static const struct {
+  uint16_t id;
+  const char *codec;
+} asf_codecs[] = {
+  { 0x0001, "pcm_s16le" },
+  { 0x000A, "wmavoice" },
+  { 0x0055, "mp3" },
+  { 0x0160, "wmav1" },
+  { 0x0161, "wmav2" },
+  { 0x0162, "wmapro" },
+  { 0x0163, "wmalossless" },
+  { 0, NULL }
+};
+// *INDENT-ON*
+
+#define ASF_OBJECT_HEADER_SIZE 24
+#define ASF_DATA_HEADER_SIZE 50
+
+// The WAVEFORMATEX in an audio stream's properties
+static void asf_parse_stream(MediaScanAudio *a, unsigned char *bptr, uint32_t len) {
+  unsigned char *wfx = bptr + 54;
+  uint16_t codec_id;
+  int i;
+
+  if (len < 54 + 16 || memcmp(bptr, ASF_Audio_Media, 16) || a->codec)
+    return;
+
+  codec_id = get_u16le(wfx);
+
+  a->codec = "Unknown";
+  for (i = 0; asf_codecs[i].codec; i++) {
+    if (asf_codecs[i].id == codec_id) {
+      a->codec = asf_codecs[i].codec;
+      break;
+    }
+  }
+
+  a->channels = get_u16le(wfx + 2);
+  a->samplerate = get_u32le(wfx + 4);
+  a->bitrate = get_u32le(wfx + 8) * 8;
+}
+
+int audio_asf_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr;
+  uint64_t header_size;
+  uint32_t nobjects;
+
+  if (!buffer_check_load(buf, r->_fp, 30, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+  if (memcmp(bptr, ASF_Header_Object, 16))
+    return 0;
+
+  header_size = get_u64le(bptr + 16);
+  nobjects = get_u32le(bptr + 24);
+  buffer_consume(buf, 30);
+
+  while (nobjects--) {
+    uint64_t size;
+    uint32_t want;
+
+    if (!buffer_check_load(buf, r->_fp, ASF_OBJECT_HEADER_SIZE, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(buf);
+    size = get_u64le(bptr + 16);
+    if (size < ASF_OBJECT_HEADER_SIZE || size > header_size)
+      return 0;
+
+    want = (uint32_t)MIN(size, 128);
+
+    if (!buffer_check_load(buf, r->_fp, want, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(buf);
+
+    if (!memcmp(bptr, ASF_File_Properties_Object, 16) && want >= 104) {
+      // Play duration is in 100ns units and includes the preroll, in ms
+      uint64_t duration = get_u64le(bptr + ASF_OBJECT_HEADER_SIZE + 40) / 10000;
+      uint64_t preroll = get_u64le(bptr + ASF_OBJECT_HEADER_SIZE + 56);
+
+      r->duration_ms = (int)(duration > preroll ? duration - preroll : duration);
+    }
+    else if (!memcmp(bptr, ASF_Stream_Properties_Object, 16)) {
+      asf_parse_stream(a, bptr + ASF_OBJECT_HEADER_SIZE, want - ASF_OBJECT_HEADER_SIZE);
+    }
+    else if (!memcmp(bptr, ASF_Content_Encryption_Object, 16)
+             || !memcmp(bptr, ASF_Extended_Content_Encryption_Object, 16)) {
+      r->error = error_create(r->path, MS_ERROR_READ, "Skipping DRM-protected audio file");
+      return 0;
+    }
+
+    if (!buffer_skip(buf, r->_fp, (uint32_t)size))
+      return 0;
+  }
+
+  if (!a->codec) {
+    LOG_ERROR("Invalid ASF file: no audio stream found: %s\n", r->path);
+    return 0;
+  }
+
+  // Audio packets follow in the data object
+  if (buffer_check_load(buf, r->_fp, ASF_OBJECT_HEADER_SIZE, BUF_SIZE)) {
+    bptr = buffer_ptr(buf);
+    if (!memcmp(bptr, ASF_Data_Object, 16) && get_u64le(bptr + 16) >= ASF_DATA_HEADER_SIZE) {
+      a->audio_offset = header_size + ASF_DATA_HEADER_SIZE;
+      a->audio_size = get_u64le(bptr + 16) - ASF_DATA_HEADER_SIZE;
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef _AUDIO_ASF_H
+#define _AUDIO_ASF_H
+
+int audio_asf_read_header(MediaScanAudio *a, MediaScanResult *r);
+
+#endif // _AUDIO_ASF_H
@@ -0,0 +1,82 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "audio_flac.h"
+#include "result.h"
+#include "tag.h"
+#include "tag_vorbis.h"
+
+#define FLAC_STREAMINFO 0
+#define FLAC_VORBIS_COMMENT 4
+#define FLAC_PICTURE 6
+#define FLAC_STREAMINFO_SIZE 34
+
+int audio_flac_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  uint64_t offset = a->audio_offset + 4;
+  uint64_t total_samples = 0;
+  int last = 0;
+
+  buffer_consume(buf, 4);
+
+  // Walk the metadata blocks, audio frames start after the last one
+  while (!last) {
+    unsigned char *bptr;
+    uint32_t block_size;
+    int type;
+
+    if (!buffer_check_load(buf, r->_fp, 4, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(buf);
+    last = bptr[0] & 0x80;
+    type = bptr[0] & 0x7F;
+    block_size = get_u24(bptr + 1);
+    buffer_consume(buf, 4);
+    offset += 4 + block_size;
+
+    if (type == FLAC_STREAMINFO && block_size >= FLAC_STREAMINFO_SIZE) {
+      if (!buffer_check_load(buf, r->_fp, FLAC_STREAMINFO_SIZE, BUF_SIZE))
+        return 0;
+
+      // 20 bits sample rate, 3 bits channels - 1, 5 bits bits per sample - 1, 36 bits total samples
+      bptr = buffer_ptr(buf);
+      a->samplerate = (bptr[10] << 12) | (bptr[11] << 4) | (bptr[12] >> 4);
+      a->channels = ((bptr[12] >> 1) & 0x07) + 1;
+      total_samples = ((uint64_t)(bptr[13] & 0x0F) << 32) | get_u32(bptr + 14);
+    }
+    else if (type == FLAC_VORBIS_COMMENT) {
+      if (!tag_vorbis_index(r, buf, r->_fp, block_size, offset - block_size))
+        return 0;
+      continue;
+    }
+    else if (type == FLAC_PICTURE) {
+      // Left in the file, it's only read if it's wanted for a thumbnail
+      if (!r->_tag)
+        result_create_tag(r, "VorbisComment");
+
+      tag_add_binary_item(r->_tag, "PICTURE", offset - block_size, block_size);
+    }
+
+    if (!buffer_skip(buf, r->_fp, block_size))
+      return 0;
+  }
+
+  if (!a->samplerate) {
+    LOG_ERROR("Invalid FLAC file: missing or bad STREAMINFO block: %s\n", r->path);
+    return 0;
+  }
+
+  a->codec = "flac";
+  a->audio_offset = offset;
+  a->audio_size = r->size > offset ? r->size - offset : 0;
+
+  r->duration_ms = (int)(total_samples * 1000 / a->samplerate);
+
+  return 1;
+}
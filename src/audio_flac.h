@@ -0,0 +1,6 @@
+#ifndef _AUDIO_FLAC_H
+#define _AUDIO_FLAC_H
+
+int audio_flac_read_header(MediaScanAudio *a, MediaScanResult *r);
+
+#endif // _AUDIO_FLAC_H
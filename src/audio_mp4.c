@@ -0,0 +1,445 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "audio_mp4.h"
+#include "error.h"
+#include "result.h"
+#include "tag.h"
+
+// How much of a sample description is read, enough for the entry and its esds child
+#define MP4_STSD_READ_SIZE 512
+
+// Tag values bigger than this are left in the file like cover art
+#define MP4_MAX_TAG_SIZE 16384
+
+// Data atom types of images
+#define MP4_DATA_JPEG 13
+#define MP4_DATA_PNG  14
+#define MP4_DATA_BMP  27
+
+typedef struct {
+  MediaScanAudio *a;
+  MediaScanResult *r;
+  Buffer *buf;
+  uint64_t offset;              // file offset of the buffer start
+  uint32_t timescale;           // from mvhd
+  uint64_t duration;
+  uint32_t track_timescale;     // from the current track's mdhd
+  uint64_t track_duration;
+  int track_is_audio;
+  int found_audio;              // a sound track has been read, later ones are ignored
+  int exact_samplerate;         // set from a codec header, rather than the track's time scale
+} MP4Info;
+
+// *INDENT-OFF*
+static const struct {
+  const char *format;
+  const char *codec;
+} mp4_codecs[] = {
+  { "mp4a", "aac" },
+  { "alac", "alac" },
+  { "ac-3", "ac3" },
+  { "ec-3", "eac3" },
+  { "samr", "amr_nb" },
+  { "sawb", "amr_wb" },
+  { ".mp3", "mp3" },
+  { "lpcm", "pcm_s16le" },
+  { NULL, NULL }
+};
+// *INDENT-ON*
+
+static int mp4_skip(MP4Info *mp4, uint64_t bytes) {
+  mp4->offset += bytes;
+
+  // buffer_skip takes 32 bits at a time
+  while (bytes > 0x7FFFFFFF) {
+    if (!buffer_skip(mp4->buf, mp4->r->_fp, 0x7FFFFFFF))
+      return 0;
+    bytes -= 0x7FFFFFFF;
+  }
+
+  return buffer_skip(mp4->buf, mp4->r->_fp, (uint32_t)bytes);
+}
+
+// Read the time scale and duration from an mvhd or mdhd atom
+static void mp4_parse_duration(unsigned char *bptr, uint32_t *timescale, uint64_t *duration) {
+  if (bptr[0] == 1) {
+    *timescale = get_u32(bptr + 20);
+    *duration = get_u64(bptr + 24);
+  }
+  else {
+    *timescale = get_u32(bptr + 12);
+    *duration = get_u32(bptr + 16);
+  }
+}
+
+// Read an MPEG-4 descriptor's length, 7 bits per byte
+static uint32_t mp4_descr_len(unsigned char **bptr, unsigned char *end) {
+  uint32_t len = 0;
+  int i;
+
+  for (i = 0; i < 4 && *bptr < end; i++) {
+    unsigned char b = *(*bptr)++;
+    len = (len << 7) | (b & 0x7F);
+    if (!(b & 0x80))
+      break;
+  }
+
+  return len;
+}
+
+// The esds atom has the real codec of an mp4a entry and its average bitrate
+static void mp4_parse_esds(MP4Info *mp4, unsigned char *bptr, unsigned char *end) {
+  bptr += 4;                    // version/flags
+
+  if (bptr < end && *bptr++ == 0x03) {
+    uint8_t flags;
+
+    mp4_descr_len(&bptr, end);
+    if (bptr + 3 > end)
+      return;
+
+    flags = bptr[2];
+    bptr += 3;                  // ES_ID, flags
+    if (flags & 0x80)
+      bptr += 2;
+    if (flags & 0x40 && bptr < end)
+      bptr += 1 + *bptr;
+    if (flags & 0x20)
+      bptr += 2;
+  }
+
+  if (bptr < end && *bptr++ == 0x04) {
+    mp4_descr_len(&bptr, end);
+    if (bptr + 13 > end)
+      return;
+
+    // MP3 stored in MP4
+    if (bptr[0] == 0x69 || bptr[0] == 0x6B)
+      mp4->a->codec = "mp3";
+
+    mp4->a->bitrate = get_u32(bptr + 9);
+  }
+}
+
+static void mp4_parse_stsd(MP4Info *mp4, unsigned char *bptr, uint32_t len) {
+  unsigned char *end = bptr + len;
+  unsigned char *child;
+  int version;
+  int i;
+
+  // version/flags, entry count, then the first entry's size and format
+  if (len < 8 + 36)
+    return;
+
+  bptr += 8;
+
+  mp4->a->codec = "Unknown";
+  for (i = 0; mp4_codecs[i].format; i++) {
+    if (!memcmp(bptr + 4, mp4_codecs[i].format, 4)) {
+      mp4->a->codec = mp4_codecs[i].codec;
+      break;
+    }
+  }
+
+  if (!memcmp(bptr + 4, "drms", 4))
+    mp4->r->error = error_create(mp4->r->path, MS_ERROR_READ, "Skipping DRM-protected audio file");
+
+  // QuickTime sound description versions 1 and 2 have extra fields before any children
+  version = get_u16(bptr + 16);
+  mp4->a->channels = get_u16(bptr + 24);
+  mp4->a->samplerate = get_u16(bptr + 32);
+  child = bptr + 36 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+
+  while (child + 8 <= end) {
+    uint32_t size = get_u32(child);
+
+    if (size < 8 || child + size > end)
+      break;
+
+    if (!memcmp(child + 4, "esds", 4)) {
+      mp4_parse_esds(mp4, child + 8, child + size);
+    }
+    else if (!memcmp(child + 4, "alac", 4) && size >= 36) {
+      mp4->a->channels = child[8 + 13];
+      mp4->a->bitrate = get_u32(child + 8 + 20);
+      mp4->a->samplerate = get_u32(child + 8 + 24);
+      mp4->exact_samplerate = 1;
+    }
+
+    child += size;
+  }
+}
+
+// Index the iTunes metadata items, which each hold one or more data atoms. Values are copied but
+// not decoded, images are left in the file.
+static int mp4_parse_ilst(MP4Info *mp4, uint64_t len) {
+  MediaScanResult *r = mp4->r;
+
+  if (!r->_tag)
+    result_create_tag(r, "MP4");
+
+  while (len >= 8) {
+    unsigned char *bptr;
+    uint64_t size;
+    char key[64];
+    char *name;
+
+    if (!buffer_check_load(mp4->buf, r->_fp, 8, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(mp4->buf);
+    size = get_u32(bptr);
+    if (size < 8 || size > len)
+      break;
+
+    // Most item names start with a © in ISO-8859-1
+    name = tag_item_decode(NULL, bptr + 4, 4, TAG_FORMAT_LATIN1);
+    snprintf(key, sizeof(key), "%s", name);
+    free(name);
+
+    buffer_consume(mp4->buf, 8);
+    mp4->offset += 8;
+    len -= size;
+    size -= 8;
+
+    while (size >= 8) {
+      uint64_t child_size;
+      char type[5];
+
+      if (!buffer_check_load(mp4->buf, r->_fp, 8, BUF_SIZE))
+        return 0;
+
+      bptr = buffer_ptr(mp4->buf);
+      child_size = get_u32(bptr);
+      memcpy(type, bptr + 4, 4);
+      type[4] = '\0';
+
+      if (child_size < 8 || child_size > size)
+        break;
+
+      buffer_consume(mp4->buf, 8);
+      mp4->offset += 8;
+      size -= child_size;
+      child_size -= 8;
+
+      if (!strcmp(type, "name") && child_size > 4 && child_size < sizeof(key) + 4) {
+        // Free-form ---- items are named by this child, after its version and flags
+        if (!buffer_check_load(mp4->buf, r->_fp, (uint32_t)child_size, BUF_SIZE))
+          return 0;
+
+        bptr = buffer_ptr(mp4->buf);
+        memcpy(key, bptr + 4, child_size - 4);
+        key[child_size - 4] = '\0';
+      }
+      else if (!strcmp(type, "data") && child_size >= 8) {
+        uint32_t data_type;
+
+        if (!buffer_check_load(mp4->buf, r->_fp, 8, BUF_SIZE))
+          return 0;
+
+        data_type = get_u32(buffer_ptr(mp4->buf)) & 0xFFFFFF;
+
+        if (!strcmp(key, "covr") || data_type == MP4_DATA_JPEG || data_type == MP4_DATA_PNG
+            || data_type == MP4_DATA_BMP || child_size > MP4_MAX_TAG_SIZE) {
+          tag_add_binary_item(r->_tag, key, mp4->offset + 8, (uint32_t)child_size - 8);
+        }
+        else {
+          if (!buffer_check_load(mp4->buf, r->_fp, (uint32_t)child_size, BUF_SIZE))
+            return 0;
+
+          tag_add_raw_item(r->_tag, key, buffer_ptr(mp4->buf), (uint32_t)child_size, TAG_FORMAT_MP4);
+        }
+      }
+
+      if (!mp4_skip(mp4, child_size))
+        return 0;
+    }
+
+    if (!mp4_skip(mp4, size))
+      return 0;
+  }
+
+  return mp4_skip(mp4, len);
+}
+
+static int mp4_parse_atoms(MP4Info *mp4, uint64_t len) {
+  while (len >= 8) {
+    unsigned char *bptr;
+    uint64_t size;
+    uint32_t hsize = 8;
+    char type[5];
+
+    if (!buffer_check_load(mp4->buf, mp4->r->_fp, 8, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(mp4->buf);
+    size = get_u32(bptr);
+    memcpy(type, bptr + 4, 4);
+    type[4] = '\0';
+
+    if (size == 1) {
+      if (!buffer_check_load(mp4->buf, mp4->r->_fp, 16, BUF_SIZE))
+        return 0;
+      bptr = buffer_ptr(mp4->buf);
+      size = get_u64(bptr + 8);
+      hsize = 16;
+    }
+    else if (size == 0) {
+      // Runs to the end of the file
+      size = len;
+    }
+
+    // A truncated file still has the audio found so far
+    if (size > len && !strcmp(type, "mdat"))
+      size = len;
+
+    if (size < hsize || size > len) {
+      LOG_DEBUG("Invalid MP4 atom %s of size %llu\n", type, (unsigned long long)size);
+      return 0;
+    }
+
+    buffer_consume(mp4->buf, hsize);
+    mp4->offset += hsize;
+    len -= size;
+    size -= hsize;
+
+    LOG_DEBUG("MP4 atom %s size %llu\n", type, (unsigned long long)size);
+
+    if (!strcmp(type, "moov") || !strcmp(type, "mdia") || !strcmp(type, "minf") || !strcmp(type, "stbl")
+        || !strcmp(type, "udta")) {
+      if (!mp4_parse_atoms(mp4, size))
+        return 0;
+      continue;
+    }
+
+    if (!strcmp(type, "meta")) {
+      // Usually a full atom with a version and flags, but not when written by QuickTime
+      if (size >= 4) {
+        if (!buffer_check_load(mp4->buf, mp4->r->_fp, 4, BUF_SIZE))
+          return 0;
+
+        if (!get_u32(buffer_ptr(mp4->buf))) {
+          buffer_consume(mp4->buf, 4);
+          mp4->offset += 4;
+          size -= 4;
+        }
+      }
+
+      if (!mp4_parse_atoms(mp4, size))
+        return 0;
+      continue;
+    }
+
+    if (!strcmp(type, "ilst")) {
+      if (!mp4_parse_ilst(mp4, size))
+        return 0;
+      continue;
+    }
+
+    if (!strcmp(type, "trak")) {
+      mp4->track_is_audio = 0;
+      mp4->track_timescale = 0;
+
+      if (!mp4_parse_atoms(mp4, size))
+        return 0;
+
+      if (mp4->track_is_audio && !mp4->found_audio) {
+        mp4->found_audio = 1;
+        if (mp4->track_timescale) {
+          mp4->timescale = mp4->track_timescale;
+          mp4->duration = mp4->track_duration;
+
+          // A sound track's time scale is its sample rate, which the sample description can't
+          // hold above 65535 and some writers get wrong there
+          if (!mp4->exact_samplerate)
+            mp4->a->samplerate = mp4->track_timescale;
+        }
+      }
+      continue;
+    }
+
+    if (!strcmp(type, "mvhd") || !strcmp(type, "mdhd") || !strcmp(type, "hdlr")
+        || (!strcmp(type, "stsd") && mp4->track_is_audio && !mp4->found_audio)) {
+      uint32_t want = (uint32_t)MIN(size, MP4_STSD_READ_SIZE);
+
+      if (!buffer_check_load(mp4->buf, mp4->r->_fp, want, BUF_SIZE))
+        return 0;
+
+      bptr = buffer_ptr(mp4->buf);
+
+      if (!strcmp(type, "mvhd") && want >= (bptr[0] == 1 ? 32 : 20)) {
+        mp4_parse_duration(bptr, &mp4->timescale, &mp4->duration);
+      }
+      else if (!strcmp(type, "mdhd") && want >= (bptr[0] == 1 ? 32 : 20)) {
+        mp4_parse_duration(bptr, &mp4->track_timescale, &mp4->track_duration);
+      }
+      else if (!strcmp(type, "hdlr") && want >= 12) {
+        // QuickTime also has a data handler in minf, which mustn't reset this
+        if (!memcmp(bptr + 8, "soun", 4))
+          mp4->track_is_audio = 1;
+      }
+      else if (!strcmp(type, "stsd")) {
+        mp4_parse_stsd(mp4, bptr, want);
+      }
+    }
+    else if (!strcmp(type, "mdat") && size > mp4->a->audio_size) {
+      mp4->a->audio_offset = mp4->offset;
+      mp4->a->audio_size = size;
+    }
+
+    if (!mp4_skip(mp4, size))
+      return 0;
+  }
+
+  return 1;
+}
+
+int audio_mp4_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  MP4Info mp4;
+
+  memset(&mp4, 0, sizeof(mp4));
+  mp4.a = a;
+  mp4.r = r;
+  mp4.buf = (Buffer *)r->_buf;
+
+  // The moov atom may come after the audio, which is skipped without being read. A file that
+  // ends early still has whatever was found before that.
+  mp4_parse_atoms(&mp4, r->size);
+
+  if (r->error)
+    return 0;
+
+  if (!mp4.found_audio || !a->codec) {
+    LOG_ERROR("Invalid MP4 file: no audio track found: %s\n", r->path);
+    return 0;
+  }
+
+  if (mp4.timescale)
+    r->duration_ms = (int)(mp4.duration * 1000 / mp4.timescale);
+
+  // The extension may be one used for video
+  r->mime_type = "audio/mp4";
+
+  return 1;
+}
+
+int audio_mp4_read_tags(MediaScanResult *r) {
+  MediaScanAudio a;
+  MP4Info mp4;
+
+  memset(&a, 0, sizeof(a));
+  memset(&mp4, 0, sizeof(mp4));
+  mp4.a = &a;
+  mp4.r = r;
+  mp4.buf = (Buffer *)r->_buf;
+
+  mp4_parse_atoms(&mp4, r->size);
+
+  return r->_tag != NULL;
+}
@@ -0,0 +1,9 @@
+#ifndef _AUDIO_MP4_H
+#define _AUDIO_MP4_H
+
+int audio_mp4_read_header(MediaScanAudio *a, MediaScanResult *r);
+
+// Read only the iTunes tags, for video files whose streams FFmpeg has read. Returns 0 if there are none.
+int audio_mp4_read_tags(MediaScanResult *r);
+
+#endif // _AUDIO_MP4_H
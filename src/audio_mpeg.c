@@ -0,0 +1,223 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "audio_mpeg.h"
+#include "tag_ape.h"
+#include "util.h"
+
+// How far to look for the first frame, past any ID3v2 tag
+#define MP3_MAX_SYNC_SEARCH (64 * 1024)
+
+typedef struct {
+  int lsf;                      // MPEG-2 or 2.5, which halve the samples per layer III frame
+  int layer;
+  int bitrate;                  // bps
+  int samplerate;
+  int channels;
+  int frame_size;
+  int samples;                  // per frame
+} MP3Frame;
+
+// *INDENT-OFF*
+static const int mp3_bitrates[2][3][15] = {
+  { // MPEG-1
+    { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+  },
+  { // MPEG-2 and 2.5
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+  }
+};
+
+static const int mp3_samplerates[3] = { 44100, 48000, 32000 };
+// *INDENT-ON*
+
+static const char *mp3_codecs[3] = { "mp1", "mp2", "mp3" };
+
+// Decode a frame header, returns 0 if it isn't a valid one
+static int mp3_decode_header(uint32_t h, MP3Frame *f) {
+  int version = (h >> 19) & 3;  // 0 = 2.5, 1 = reserved, 2 = MPEG-2, 3 = MPEG-1
+  int layer = 4 - ((h >> 17) & 3);
+  int bitrate_index = (h >> 12) & 0xF;
+  int samplerate_index = (h >> 10) & 3;
+  int padding = (h >> 9) & 1;
+
+  // Free format streams are too rare to be worth supporting
+  if ((h & 0xFFE00000) != 0xFFE00000 || version == 1 || layer == 4 || !bitrate_index
+      || bitrate_index == 15 || samplerate_index == 3)
+    return 0;
+
+  f->lsf = version != 3;
+  f->layer = layer;
+  f->bitrate = mp3_bitrates[f->lsf][layer - 1][bitrate_index] * 1000;
+  f->samplerate = mp3_samplerates[samplerate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  f->channels = ((h >> 6) & 3) == 3 ? 1 : 2;
+
+  if (layer == 1) {
+    f->frame_size = (12 * f->bitrate / f->samplerate + padding) * 4;
+    f->samples = 384;
+  }
+  else if (layer == 3 && f->lsf) {
+    f->frame_size = 72 * f->bitrate / f->samplerate + padding;
+    f->samples = 576;
+  }
+  else {
+    f->frame_size = 144 * f->bitrate / f->samplerate + padding;
+    f->samples = 1152;
+  }
+
+  return 1;
+}
+
+// Find the first frame at or after offset, confirmed by a matching frame right after it so
+// stray sync bytes in junk data aren't mistaken for one. Leaves the frame at the buffer start.
+static int mp3_find_frame(MediaScanResult *r, Buffer *buf, uint64_t *offset, MP3Frame *f) {
+  int searched;
+
+  for (searched = 0; searched < MP3_MAX_SYNC_SEARCH; searched++) {
+    unsigned char *bptr;
+    MP3Frame next;
+
+    if (!buffer_check_load(buf, r->_fp, 4, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(buf);
+    if (bptr[0] == 0xFF && mp3_decode_header(get_u32(bptr), f)) {
+      // A single frame at the end of the file can't be confirmed
+      if (*offset + f->frame_size + 4 > r->size)
+        return 1;
+
+      if (buffer_check_load(buf, r->_fp, f->frame_size + 4, f->frame_size + BUF_SIZE)) {
+        bptr = buffer_ptr(buf);
+        if (mp3_decode_header(get_u32(bptr + f->frame_size), &next)
+            && next.lsf == f->lsf && next.layer == f->layer && next.samplerate == f->samplerate)
+          return 1;
+      }
+    }
+
+    buffer_consume(buf, 1);
+    (*offset)++;
+  }
+
+  return 0;
+}
+
+// Size of the ID3v1 and APEv2 tags at the end of the file
+static uint32_t mp3_trailing_tags(MediaScanResult *r) {
+  unsigned char tail[160];
+  uint32_t size = 0;
+
+  if (r->size < sizeof(tail) || SeekFile(r->_fp, (int64_t)(r->size - sizeof(tail)), SEEK_SET) != 0
+      || fread(tail, 1, sizeof(tail), r->_fp) != sizeof(tail))
+    return 0;
+
+  if (!memcmp(tail + 32, "TAG", 3))
+    size = 128;
+
+  // APEv2 footer, the size includes the footer but not the optional header
+  if (!memcmp(tail + sizeof(tail) - size - 32, "APETAGEX", 8)) {
+    unsigned char *footer = tail + sizeof(tail) - size - 32;
+    uint64_t footer_offset = r->size - size - 32;
+
+    size += get_u32le(footer + 12) + (footer[23] & 0x80 ? 32 : 0);
+    tag_ape_index(r, footer_offset);
+  }
+
+  return size;
+}
+
+int audio_mpeg_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr, *xing, *end;
+  uint64_t offset = a->audio_offset;
+  uint32_t frames = 0, bytes = 0, tags;
+  int delay = 0, padding = 0;
+  int side_info;
+  MP3Frame f;
+
+  if (!mp3_find_frame(r, buf, &offset, &f)) {
+    LOG_ERROR("Unable to find an MPEG audio frame: %s\n", r->path);
+    return 0;
+  }
+
+  a->codec = mp3_codecs[f.layer - 1];
+  a->samplerate = f.samplerate;
+  a->channels = f.channels;
+  a->audio_offset = offset;
+
+  // The mp2 extension is also used for video
+  r->mime_type = "audio/mpeg";
+
+  // The first frame may hold a Xing/Info or VBRI header in place of audio
+  bptr = buffer_ptr(buf);
+  end = bptr + MIN(buffer_len(buf), (uint32_t)f.frame_size);
+  side_info = f.lsf ? (f.channels == 1 ? 9 : 17) : (f.channels == 1 ? 17 : 32);
+  xing = bptr + 4 + side_info;
+
+  if (xing + 8 <= end && (!memcmp(xing, "Xing", 4) || !memcmp(xing, "Info", 4))) {
+    uint32_t flags = get_u32(xing + 4);
+
+    // Info is written by LAME for CBR files
+    a->vbr = xing[0] == 'X';
+    xing += 8;
+
+    if (flags & 1 && xing + 4 <= end) {
+      frames = get_u32(xing);
+      xing += 4;
+    }
+    if (flags & 2 && xing + 4 <= end) {
+      bytes = get_u32(xing);
+      xing += 4;
+    }
+    if (flags & 4)
+      xing += 100;              // seek table
+    if (flags & 8)
+      xing += 4;                // quality
+
+    // The LAME extension has the encoder delay and padding, for an exact duration
+    if (xing + 24 <= end && (!memcmp(xing, "LAME", 4) || !memcmp(xing, "Lavf", 4) || !memcmp(xing, "Lavc", 4))) {
+      delay = (xing[21] << 4) | (xing[22] >> 4);
+      padding = ((xing[22] & 0x0F) << 8) | xing[23];
+    }
+  }
+  else if (bptr + 36 + 18 <= end && !memcmp(bptr + 36, "VBRI", 4)) {
+    a->vbr = 1;
+    bytes = get_u32(bptr + 36 + 10);
+    frames = get_u32(bptr + 36 + 14);
+  }
+
+  tags = mp3_trailing_tags(r);
+  a->audio_size = r->size > offset + tags ? r->size - offset - tags : 0;
+  if (bytes && bytes <= a->audio_size)
+    a->audio_size = bytes;
+
+  if (frames) {
+    int64_t samples = (int64_t)frames * f.samples - delay - padding;
+
+    if (samples > 0)
+      r->duration_ms = (int)(samples * 1000 / f.samplerate);
+
+    // Frames of a CBR file all have the same bitrate, otherwise the average is worked out from
+    // the stream size, preferring the encoder's
+    if (!a->vbr)
+      a->bitrate = f.bitrate;
+    else if (bytes && r->duration_ms)
+      a->bitrate = (int)((uint64_t)bytes * 8000 / r->duration_ms);
+  }
+  else {
+    // Without a frame count only CBR files have a known duration, others are estimated from
+    // the first frame's bitrate like most players do
+    a->bitrate = f.bitrate;
+    r->duration_ms = (int)(a->audio_size * 8000 / f.bitrate);
+  }
+
+  return 1;
+}
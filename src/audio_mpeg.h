@@ -0,0 +1,6 @@
+#ifndef _AUDIO_MPEG_H
+#define _AUDIO_MPEG_H
+
+int audio_mpeg_read_header(MediaScanAudio *a, MediaScanResult *r);
+
+#endif // _AUDIO_MPEG_H
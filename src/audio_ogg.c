@@ -0,0 +1,218 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "audio_ogg.h"
+#include "tag_vorbis.h"
+#include "util.h"
+
+#define OGG_HEADER_SIZE 27
+#define OGG_MAX_PAGE_SIZE (OGG_HEADER_SIZE + 255 + 255 * 255)
+
+// Only this much of the comment packet is kept, it may hold pictures spread over many pages
+#define OGG_MAX_COMMENT_SIZE 65536
+
+// Sizes of the identification headers that are read, the first packet of the stream
+#define OGG_VORBIS_HEADER_SIZE 30
+#define OGG_OPUS_HEADER_SIZE 19
+
+// Opus always decodes at 48 kHz, granule positions count samples at that rate
+#define OPUS_SAMPLERATE 48000
+
+// Granule position of the last page of the stream, the total number of samples
+static uint64_t ogg_last_granule(MediaScanResult *r, uint32_t serial) {
+  Buffer tail;
+  uint32_t len = (uint32_t)MIN(r->size, OGG_MAX_PAGE_SIZE);
+  uint64_t granule = 0;
+  unsigned char *bptr;
+  int i;
+
+  buffer_init(&tail, len);
+
+  if (SeekFile(r->_fp, (int64_t)(r->size - len), SEEK_SET) != 0 || !buffer_check_load(&tail, r->_fp, len, len))
+    goto out;
+
+  bptr = buffer_ptr(&tail);
+  for (i = len - OGG_HEADER_SIZE; i >= 0; i--) {
+    if (bptr[i] == 'O' && !memcmp(bptr + i, "OggS", 4) && get_u32le(bptr + i + 14) == serial) {
+      granule = get_u64le(bptr + i + 6);
+      break;
+    }
+  }
+
+out:
+  buffer_free(&tail);
+
+  return granule;
+}
+
+// The comment packet starts with its type, the comments themselves are the same as in FLAC
+static void ogg_index_comments(MediaScanResult *r, Buffer *comments, uint64_t offset) {
+  unsigned char *bptr = buffer_ptr(comments);
+  uint32_t len = buffer_len(comments);
+  uint32_t skip;
+
+  if (len >= 7 && !memcmp(bptr, "\x03vorbis", 7))
+    skip = 7;
+  else if (len >= 8 && !memcmp(bptr, "OpusTags", 8))
+    skip = 8;
+  else
+    return;
+
+  buffer_consume(comments, skip);
+  tag_vorbis_index(r, comments, NULL, len - skip, offset ? offset + skip : 0);
+}
+
+int audio_ogg_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  Buffer comments;
+  uint64_t offset = 0;
+  uint64_t comment_offset = 0;
+  uint64_t comment_page = 0;
+  int comment_whole = 0;
+  int truncated = 0;
+  uint64_t granule;
+  uint32_t serial;
+  int preskip = 0;
+  int packet = 0;
+  int ret = 0;
+  unsigned char *bptr;
+  int nsegments;
+  int i;
+
+  if (!buffer_check_load(buf, r->_fp, OGG_HEADER_SIZE + 1, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+  serial = get_u32le(bptr + 14);
+  nsegments = bptr[26];
+
+  // The identification header is the first packet of the first page, the shorter Opus
+  // header is loaded first and the rest of a Vorbis one once the type is known
+  if (!buffer_check_load(buf, r->_fp, OGG_HEADER_SIZE + nsegments + OGG_OPUS_HEADER_SIZE, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf) + OGG_HEADER_SIZE + nsegments;
+
+  if (!memcmp(bptr, "\x01vorbis", 7)) {
+    if (!buffer_check_load(buf, r->_fp, OGG_HEADER_SIZE + nsegments + OGG_VORBIS_HEADER_SIZE, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(buf) + OGG_HEADER_SIZE + nsegments;
+    a->codec = "vorbis";
+    a->channels = bptr[11];
+    a->samplerate = get_u32le(bptr + 12);
+    a->bitrate = (int)get_u32le(bptr + 20);  // nominal
+    if (a->bitrate < 0)
+      a->bitrate = 0;
+  }
+  else if (!memcmp(bptr, "OpusHead", 8)) {
+    a->codec = "opus";
+    a->channels = bptr[9];
+    a->samplerate = OPUS_SAMPLERATE;
+    preskip = get_u16le(bptr + 10);
+  }
+  else {
+    LOG_ERROR("Unsupported Ogg stream: %s\n", r->path);
+    return 0;
+  }
+
+  if (!a->samplerate)
+    return 0;
+
+  buffer_init(&comments, 0);
+
+  // Audio starts with the first page that completes a packet of audio, header pages have a
+  // granule position of 0, or -1 while a long header packet continues on the next page.
+  // The comments are the second packet of the stream.
+  for (;;) {
+    uint32_t page_size = OGG_HEADER_SIZE;
+    int has_comments;
+
+    if (!buffer_check_load(buf, r->_fp, OGG_HEADER_SIZE, BUF_SIZE))
+      break;
+
+    bptr = buffer_ptr(buf);
+    if (memcmp(bptr, "OggS", 4)) {
+      LOG_ERROR("Invalid Ogg file: missing page at offset %llu: %s\n", (unsigned long long)offset, r->path);
+      goto out;
+    }
+
+    granule = get_u64le(bptr + 6);
+    if (granule != 0 && granule != (uint64_t)-1 && get_u32le(bptr + 14) == serial) {
+      a->audio_offset = offset;
+      break;
+    }
+
+    has_comments = packet < 2 && get_u32le(bptr + 14) == serial;
+
+    nsegments = bptr[26];
+    if (!buffer_check_load(buf, r->_fp, OGG_HEADER_SIZE + nsegments, BUF_SIZE))
+      break;
+
+    bptr = buffer_ptr(buf);
+    page_size += nsegments;
+    for (i = 0; i < nsegments; i++)
+      page_size += bptr[OGG_HEADER_SIZE + i];
+
+    if (has_comments) {
+      uint32_t seg_offset = OGG_HEADER_SIZE + nsegments;
+
+      // Once the comments are too big only the segment table is needed to find their end
+      if (!truncated && !buffer_check_load(buf, r->_fp, page_size, BUF_SIZE))
+        break;
+
+      bptr = buffer_ptr(buf);
+      for (i = 0; i < nsegments && packet < 2; i++) {
+        int lacing = bptr[OGG_HEADER_SIZE + i];
+
+        if (packet == 1) {
+          if (!buffer_len(&comments)) {
+            comment_offset = offset + seg_offset;
+            comment_page = offset;
+          }
+
+          if (!truncated && buffer_len(&comments) + lacing <= OGG_MAX_COMMENT_SIZE)
+            buffer_append(&comments, bptr + seg_offset, lacing);
+          else
+            truncated = 1;
+        }
+
+        // A lacing value under 255 ends a packet. The comments can only be found in the file
+        // when they start and end on the same page.
+        if (lacing < 255 && packet++ == 1)
+          comment_whole = !truncated && comment_page == offset;
+
+        seg_offset += lacing;
+      }
+    }
+
+    if (!buffer_skip(buf, r->_fp, page_size))
+      break;
+
+    offset += page_size;
+  }
+
+  ogg_index_comments(r, &comments, comment_whole ? comment_offset : 0);
+
+  a->audio_size = r->size - a->audio_offset;
+
+  granule = ogg_last_granule(r, serial);
+  if (granule > (uint64_t)preskip)
+    r->duration_ms = (int)((granule - preskip) * 1000 / a->samplerate);
+
+  // The real average is more useful than the nominal bitrate
+  if (r->duration_ms)
+    a->bitrate = (int)(a->audio_size * 8000 / r->duration_ms);
+
+  ret = 1;
+
+out:
+  buffer_free(&comments);
+
+  return ret;
+}
@@ -0,0 +1,6 @@
+#ifndef _AUDIO_OGG_H
+#define _AUDIO_OGG_H
+
+int audio_ogg_read_header(MediaScanAudio *a, MediaScanResult *r);
+
+#endif // _AUDIO_OGG_H
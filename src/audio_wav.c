@@ -0,0 +1,212 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "audio_wav.h"
+#include "tag_id3.h"
+
+#define WAVE_FORMAT_PCM         0x0001
+#define WAVE_FORMAT_IEEE_FLOAT  0x0003
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE
+
+// *INDENT-OFF*
+static const struct {
+  uint16_t id;
+  const char *codec;
+} wav_codecs[] = {
+  { 0x0002, "adpcm_ms" },
+  { 0x0006, "pcm_alaw" },
+  { 0x0007, "pcm_mulaw" },
+  { 0x0011, "adpcm_ima_wav" },
+  { 0x0055, "mp3" },
+  { 0, NULL }
+};
+// *INDENT-ON*
+
+static const char *wav_pcm_codec(int bits, int big_endian) {
+  switch (bits) {
+    case 8:
+      return "pcm_u8";
+    case 24:
+      return big_endian ? "pcm_s24be" : "pcm_s24le";
+    case 32:
+      return big_endian ? "pcm_s32be" : "pcm_s32le";
+    default:
+      return big_endian ? "pcm_s16be" : "pcm_s16le";
+  }
+}
+
+static void wav_parse_fmt(MediaScanAudio *a, unsigned char *bptr, uint32_t len) {
+  uint16_t format = get_u16le(bptr);
+  int bits = get_u16le(bptr + 14);
+  int i;
+
+  a->channels = get_u16le(bptr + 2);
+  a->samplerate = get_u32le(bptr + 4);
+  a->bitrate = get_u32le(bptr + 8) * 8;
+
+  // The real format is the start of the sub-format GUID
+  if (format == WAVE_FORMAT_EXTENSIBLE && len >= 26)
+    format = get_u16le(bptr + 24);
+
+  if (format == WAVE_FORMAT_PCM) {
+    a->codec = wav_pcm_codec(bits, 0);
+    return;
+  }
+
+  if (format == WAVE_FORMAT_IEEE_FLOAT) {
+    a->codec = bits == 64 ? "pcm_f64le" : "pcm_f32le";
+    return;
+  }
+
+  a->codec = "Unknown";
+  for (i = 0; wav_codecs[i].codec; i++) {
+    if (wav_codecs[i].id == format) {
+      a->codec = wav_codecs[i].codec;
+      break;
+    }
+  }
+}
+
+// Consumes the first 18 bytes of the chunk
+static void aiff_parse_comm(MediaScanAudio *a, MediaScanResult *r, Buffer *buf, uint32_t len) {
+  unsigned char *bptr = buffer_ptr(buf);
+  uint32_t frames = get_u32(bptr + 2);
+  int bits = get_u16(bptr + 6);
+
+  a->channels = get_u16(bptr);
+
+  // The sample rate is an 80-bit float
+  buffer_consume(buf, 8);
+  a->samplerate = (int)buffer_get_ieee_float(buf);
+
+  a->codec = wav_pcm_codec(bits, 1);
+
+  // AIFF-C names its compression, all common ones are some kind of PCM
+  if (len >= 22 && memcmp(bptr + 18, "NONE", 4)) {
+    if (!memcmp(bptr + 18, "sowt", 4))
+      a->codec = wav_pcm_codec(bits, 0);
+    else if (!memcmp(bptr + 18, "fl32", 4) || !memcmp(bptr + 18, "FL32", 4))
+      a->codec = "pcm_f32be";
+    else if (!memcmp(bptr + 18, "fl64", 4) || !memcmp(bptr + 18, "FL64", 4))
+      a->codec = "pcm_f64be";
+    else
+      a->codec = "Unknown";
+  }
+
+  a->bitrate = a->samplerate * a->channels * bits;
+
+  if (a->samplerate)
+    r->duration_ms = (int)((uint64_t)frames * 1000 / a->samplerate);
+}
+
+int audio_wav_read_header(MediaScanAudio *a, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr;
+  uint64_t offset = 12;
+  int big_endian;
+
+  if (!buffer_check_load(buf, r->_fp, 12, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+
+  if (!memcmp(bptr, "RIFF", 4) && !memcmp(bptr + 8, "WAVE", 4)) {
+    big_endian = 0;
+  }
+  else if (!memcmp(bptr, "FORM", 4) && (!memcmp(bptr + 8, "AIFF", 4) || !memcmp(bptr + 8, "AIFC", 4))) {
+    big_endian = 1;
+  }
+  else {
+    LOG_ERROR("Invalid WAV/AIFF file: missing WAVE or AIFF header: %s\n", r->path);
+    return 0;
+  }
+
+  buffer_consume(buf, 12);
+
+  // Walk every chunk, the audio data isn't always last
+  while (offset + 8 <= r->size) {
+    char chunk_id[5];
+    uint32_t chunk_size;
+    uint32_t consumed = 0;
+    uint32_t want;
+
+    if (!buffer_check_load(buf, r->_fp, 8, BUF_SIZE))
+      break;
+
+    bptr = buffer_ptr(buf);
+    memcpy(chunk_id, bptr, 4);
+    chunk_id[4] = '\0';
+    chunk_size = big_endian ? get_u32(bptr + 4) : get_u32le(bptr + 4);
+    buffer_consume(buf, 8);
+    offset += 8;
+
+    LOG_DEBUG("%s size %d\n", chunk_id, chunk_size);
+
+    if (!strcmp(chunk_id, "data") || !strcmp(chunk_id, "SSND")) {
+      uint32_t skip = 0;
+
+      // SSND starts with an offset to the sound data and a block size
+      if (big_endian) {
+        if (chunk_size < 8 || !buffer_check_load(buf, r->_fp, 8, BUF_SIZE))
+          break;
+        skip = 8 + get_u32(buffer_ptr(buf));
+      }
+
+      a->audio_offset = offset + skip;
+      a->audio_size = chunk_size > skip ? chunk_size - skip : 0;
+
+      // Some writers leave the size as 0 or too big, the data then runs to the end of the file
+      if (!a->audio_size || a->audio_offset + a->audio_size > r->size) {
+        LOG_DEBUG("Bad %s size %d, using file size\n", chunk_id, chunk_size);
+        a->audio_size = r->size > a->audio_offset ? r->size - a->audio_offset : 0;
+        break;
+      }
+    }
+    else if (!strcmp(chunk_id, "fmt ") || !strcmp(chunk_id, "COMM")) {
+      want = MIN(chunk_size, 40);
+
+      if (want < (big_endian ? 18 : 16) || !buffer_check_load(buf, r->_fp, want, BUF_SIZE))
+        break;
+
+      if (big_endian) {
+        aiff_parse_comm(a, r, buf, want);
+        consumed = 18;
+      }
+      else {
+        wav_parse_fmt(a, buffer_ptr(buf), want);
+      }
+    }
+
+    else if (!strcmp(chunk_id, "id3 ") || !strcmp(chunk_id, "ID3 ")) {
+      consumed = tag_id3_index(r, buf, offset);
+
+      // A tag that runs past its chunk leaves nowhere to carry on from
+      if (!consumed || consumed > chunk_size)
+        break;
+    }
+
+    // Chunks are padded to an even size
+    chunk_size += chunk_size & 1;
+
+    if (!buffer_skip(buf, r->_fp, chunk_size - consumed))
+      break;
+
+    offset += chunk_size;
+  }
+
+  if (!a->codec) {
+    LOG_ERROR("Invalid WAV/AIFF file: missing fmt or COMM chunk: %s\n", r->path);
+    return 0;
+  }
+
+  // WAV has no frame count outside of compressed formats, so the duration comes from the size
+  if (!r->duration_ms && a->bitrate)
+    r->duration_ms = (int)(a->audio_size * 8000 / a->bitrate);
+
+  return 1;
+}
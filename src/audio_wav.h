@@ -0,0 +1,6 @@
+#ifndef _AUDIO_WAV_H
+#define _AUDIO_WAV_H
+
+int audio_wav_read_header(MediaScanAudio *a, MediaScanResult *r);
+
+#endif // _AUDIO_WAV_H
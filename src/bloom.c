@@ -0,0 +1,213 @@
+
+#include <libmediascan.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include "common.h"
+#include "buffer.h"
+#include "bloom.h"
+#include "util.h"
+
+// Scalable Bloom filter: a chain of fixed-size filters, where a new filter with twice the
+// capacity is added once the newest one is full. Adding only touches the newest filter, a key
+// is possibly present if any filter matches. This keeps the false positive rate bounded while
+// a library grows from nothing during its first scan, without having to re-add every key.
+
+#define BLOOM_MAGIC 0x4642534D    // "MSBF"
+#define BLOOM_VERSION 1
+
+// 10 bits per key and 7 hash functions give about a 1% false positive rate per filter
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_NHASHES 7
+
+// Layers stop doubling at this size so the bit count fits in 32 bits
+#define BLOOM_MAX_CAPACITY (1 << 26)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nlayers;
+} BloomHeader;
+
+static void bloom_add_layer(Bloom *b, uint32_t capacity) {
+  BloomLayer *l = &b->layers[b->nlayers++];
+
+  l->capacity = capacity;
+  l->count = 0;
+  l->nbits = roundup(capacity * BLOOM_BITS_PER_KEY, 64);
+  l->bits = (uint64_t *)calloc(l->nbits / 64, sizeof(uint64_t));
+
+  LOG_MEM("new BloomLayer bits @ %p (%u bits)\n", l->bits, l->nbits);
+}
+
+Bloom *bloom_create(uint32_t capacity) {
+  Bloom *b = (Bloom *)calloc(sizeof(Bloom), 1);
+  if (b == NULL) {
+    ms_errno = MSENO_MEMERROR;
+    FATAL("Out of memory for new Bloom object\n");
+    return NULL;
+  }
+
+  LOG_MEM("new Bloom @ %p\n", b);
+
+  bloom_add_layer(b, MIN(MAX(capacity, BLOOM_MIN_CAPACITY), BLOOM_MAX_CAPACITY));
+
+  return b;
+}
+
+void bloom_destroy(Bloom *b) {
+  int x;
+
+  for (x = 0; x < b->nlayers; x++) {
+    LOG_MEM("destroy BloomLayer bits @ %p\n", b->layers[x].bits);
+    free(b->layers[x].bits);
+  }
+
+  LOG_MEM("destroy Bloom @ %p\n", b);
+  free(b);
+}
+
+// The k probe positions are derived from two hashes (Kirsch-Mitzenmacher double hashing)
+static int bloom_layer_check(BloomLayer *l, uint32_t h1, uint32_t h2, int set) {
+  int i;
+
+  for (i = 0; i < BLOOM_NHASHES; i++) {
+    uint32_t bit = (h1 + i * h2) % l->nbits;
+
+    if (set)
+      l->bits[bit / 64] |= 1ULL << (bit % 64);
+    else if (!(l->bits[bit / 64] & (1ULL << (bit % 64))))
+      return 0;
+  }
+
+  return 1;
+}
+
+void bloom_add(Bloom *b, const void *key, size_t len) {
+  BloomLayer *l = &b->layers[b->nlayers - 1];
+  uint32_t h1 = 0, h2 = 0;
+
+  if (l->count >= l->capacity && b->nlayers < BLOOM_MAX_LAYERS) {
+    bloom_add_layer(b, MIN(l->capacity * 2, BLOOM_MAX_CAPACITY));
+    l = &b->layers[b->nlayers - 1];
+  }
+
+  hashlittle2(key, len, &h1, &h2);
+  bloom_layer_check(l, h1, h2, 1);
+  l->count++;
+}
+
+// Returns 0 if key was definitely never added, 1 if it may have been
+int bloom_check(Bloom *b, const void *key, size_t len) {
+  uint32_t h1 = 0, h2 = 0;
+  int x;
+
+  hashlittle2(key, len, &h1, &h2);
+
+  for (x = b->nlayers - 1; x >= 0; x--) {
+    if (bloom_layer_check(&b->layers[x], h1, h2, 0))
+      return 1;
+  }
+
+  return 0;
+}
+
+uint32_t bloom_count(Bloom *b) {
+  uint32_t count = 0;
+  int x;
+
+  for (x = 0; x < b->nlayers; x++)
+    count += b->layers[x].count;
+
+  return count;
+}
+
+int bloom_save(Bloom *b, const char *path) {
+  BloomHeader hdr;
+  FILE *fp;
+  int x, ok;
+
+  fp = fopen(path, "wb");
+  if (!fp) {
+    LOG_WARN("Unable to write %s\n", path);
+    return 0;
+  }
+
+  hdr.magic = BLOOM_MAGIC;
+  hdr.version = BLOOM_VERSION;
+  hdr.nlayers = b->nlayers;
+  ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+
+  for (x = 0; ok && x < b->nlayers; x++) {
+    BloomLayer *l = &b->layers[x];
+    ok = fwrite(&l->capacity, sizeof(uint32_t), 1, fp) == 1
+      && fwrite(&l->count, sizeof(uint32_t), 1, fp) == 1
+      && fwrite(&l->nbits, sizeof(uint32_t), 1, fp) == 1
+      && fwrite(l->bits, sizeof(uint64_t), l->nbits / 64, fp) == l->nbits / 64;
+  }
+
+  if (fclose(fp) != 0)
+    ok = 0;
+
+  if (!ok) {
+    LOG_WARN("Unable to write %s\n", path);
+    remove(path);
+  }
+
+  return ok;
+}
+
+// Returns NULL if the file is missing or not a complete filter
+Bloom *bloom_load(const char *path) {
+  BloomHeader hdr;
+  Bloom *b = NULL;
+  FILE *fp;
+  uint32_t x;
+
+  fp = fopen(path, "rb");
+  if (!fp)
+    return NULL;
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != BLOOM_MAGIC || hdr.version != BLOOM_VERSION
+      || hdr.nlayers < 1 || hdr.nlayers > BLOOM_MAX_LAYERS)
+    goto err;
+
+  b = (Bloom *)calloc(sizeof(Bloom), 1);
+  if (b == NULL)
+    goto err;
+
+  LOG_MEM("new Bloom @ %p\n", b);
+
+  for (x = 0; x < hdr.nlayers; x++) {
+    BloomLayer *l = &b->layers[x];
+
+    // The bit count must be the one bloom_add_layer would have used, so a corrupt
+    // header can't ask for a huge allocation or a read past the end of the bits
+    if (fread(&l->capacity, sizeof(uint32_t), 1, fp) != 1 || fread(&l->count, sizeof(uint32_t), 1, fp) != 1
+        || fread(&l->nbits, sizeof(uint32_t), 1, fp) != 1 || !l->capacity || l->capacity > BLOOM_MAX_CAPACITY
+        || l->nbits != roundup(l->capacity * BLOOM_BITS_PER_KEY, 64))
+      goto err;
+
+    l->bits = (uint64_t *)malloc(l->nbits / 8);
+    if (l->bits == NULL)
+      goto err;
+
+    b->nlayers++;
+    if (fread(l->bits, sizeof(uint64_t), l->nbits / 64, fp) != l->nbits / 64)
+      goto err;
+  }
+
+  fclose(fp);
+  return b;
+
+err:
+  LOG_WARN("Ignoring invalid filter file %s\n", path);
+  if (b)
+    bloom_destroy(b);
+  fclose(fp);
+  return NULL;
+}
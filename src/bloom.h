@@ -0,0 +1,27 @@
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#define BLOOM_MAX_LAYERS 24
+#define BLOOM_MIN_CAPACITY 65536
+
+typedef struct {
+  uint32_t capacity;            // keys this layer is sized for
+  uint32_t count;               // keys added so far
+  uint32_t nbits;
+  uint64_t *bits;
+} BloomLayer;
+
+typedef struct {
+  int nlayers;
+  BloomLayer layers[BLOOM_MAX_LAYERS];
+} Bloom;
+
+Bloom *bloom_create(uint32_t capacity);
+void bloom_destroy(Bloom *b);
+void bloom_add(Bloom *b, const void *key, size_t len);
+int bloom_check(Bloom *b, const void *key, size_t len);
+uint32_t bloom_count(Bloom *b);
+int bloom_save(Bloom *b, const char *path);
+Bloom *bloom_load(const char *path);
+
+#endif // _BLOOM_H
@@ -27,6 +27,7 @@
 
 #include "common.h"
 #include "buffer.h"
+#include "util.h"
 
 #define  BUFFER_MAX_CHUNK       0x1400000
 #define  BUFFER_MAX_LEN         0x1400000
@@ -937,6 +938,10 @@ int buffer_check_load(Buffer *buf, FILE *fp, int min_wanted, int max_wanted) {
     uint32_t actual_wanted;
     unsigned char *tmp;
 
+    // Buffer holds in-memory data only (e.g. an embedded image), there is nothing more to read
+    if (fp == NULL)
+      return 0;
+
     if (min_wanted > max_wanted) {
       max_wanted = min_wanted;
     }
@@ -981,3 +986,20 @@ int buffer_check_load(Buffer *buf, FILE *fp, int min_wanted, int max_wanted) {
 
   return ret;
 }
+
+// Skip bytes, consuming what is already buffered and seeking past the rest
+int buffer_skip(Buffer *buf, FILE *fp, uint32_t bytes) {
+  uint32_t len = buffer_len(buf);
+
+  if (bytes <= len) {
+    buffer_consume(buf, bytes);
+    return 1;
+  }
+
+  buffer_clear(buf);
+
+  if (fp == NULL || SeekFile(fp, (int64_t)bytes - len, SEEK_CUR) != 0)
+    return 0;
+
+  return 1;
+}
@@ -108,5 +108,6 @@ void put_u32(void *vp, uint32_t v);
 uint32_t buffer_get_bits(Buffer *buffer, uint32_t bits);
 uint32_t buffer_get_syncsafe(Buffer *buffer, uint8_t bytes);
 int buffer_check_load(Buffer *buffer, FILE *fp, int min_wanted, int max_wanted);
+int buffer_skip(Buffer *buffer, FILE *fp, uint32_t bytes);
 
 #endif
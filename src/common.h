@@ -16,7 +16,7 @@
 # define unlikely(x) (x)
 #endif
 
-extern enum log_level Debug;
+extern MS_THREAD_LOCAL enum log_level Debug;
 
 
 #undef MAX_PATH
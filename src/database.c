@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <errno.h>
 
 #ifndef WIN32
 #include <dirent.h>
@@ -21,6 +22,7 @@
 
 #include "common.h"
 #include "database.h"
+#include "bloom.h"
 #include "buffer.h"
 #include "queue.h"
 #include "progress.h"
@@ -30,89 +32,1012 @@
 #include "thread.h"
 #include "util.h"
 
-DB_ENV *myEnv;                  /* Env structure handle */
+// The scan database holds two tables. "dirs" maps each directory path to a 64-bit id, and
+// "files" (s->dbp) maps the id of a file's directory plus its name to the file's hash. Long
+// shared path prefixes are then stored once per directory instead of once per file, and the
+// files of a directory form a single contiguous key range. A third table, "inodes", maps the
+// device and inode of each stored file to its path, size, modified time and a fingerprint of
+// its content, so a file seen at a new path can be recognized as one that was moved.
+
+// Cache updates are queued and written in one transaction per batch, so a crash leaves the
+// database as of the last committed batch and the scan thread syncs once per batch instead
+// of once per file.
+#define BDB_BATCH_SIZE 256
+
+// Several processes may share the database (MS_SHARED_CACHE), a transaction picked to resolve
+// a deadlock with another process is retried this many times
+#define BDB_MAX_RETRIES 8
+
+// Size of the buffer used for bulk reads
+#define BDB_BULK_SIZE (64 * 1024)
+
+// File keys start with the directory id, big-endian so ids sort numerically
+#define BDB_DIR_ID_LEN 8
+#define BDB_MAX_KEY_LEN (BDB_DIR_ID_LEN + MAX_PATH_STR_LEN)
+
+// Key in the dirs table holding the next unused directory id, no directory path is empty
+#define BDB_NEXT_ID_KEY ""
+
+// Inode keys are the device and inode numbers
+#define BDB_INODE_KEY_LEN 16
+
+#ifdef WIN32
+#define BDB_PATH_SEP '\\'
+#else
+#define BDB_PATH_SEP '/'
+#endif
+
+typedef struct {
+  char *name;                   // file name, relative to BDBState.dir
+  uint32_t hash;
+} BDBEntry;
+
+// Stored in the inodes table, followed by the file's path
+typedef struct {
+  uint64_t size;
+  int32_t mtime;
+  uint32_t fingerprint;
+} BDBInode;
+
+// Queued changes, see bdb_queue
+enum {
+  BDB_PUT_FILE,
+  BDB_PUT_INODE,
+  BDB_DEL_FILE
+};
+
+typedef struct {
+  DB_ENV *env;                  // environment of this scanner's database
+  DB *dirs;                     // directory path -> id
+  DB *inodes;                   // device and inode -> BDBInode and path
+
+  Buffer queue;                 // pending changes, see bdb_queue
+  int nqueued;
+
+  // Every file key in the database, so lookups that are sure to miss (all of them during
+  // the first scan of a library) don't have to touch the B-tree. Not used with a shared
+  // database, as other processes add keys it wouldn't know about.
+  Bloom *bloom;
+
+  // The last directory looked up, and the entries for its files once read by bdb_prefetch_dir
+  char dir[MAX_PATH_STR_LEN];
+  uint64_t dir_id;              // 0 if dir isn't stored
+  int prefetched;
+  BDBEntry *entries;
+  int nentries;
+  int maxentries;
+} BDBState;
+
+static void bdb_encode_id(unsigned char *buf, uint64_t id) {
+  int i;
+
+  for (i = BDB_DIR_ID_LEN - 1; i >= 0; i--, id >>= 8)
+    buf[i] = id & 0xFF;
+}
+
+// Build the files table key for name in directory dir_id, returns the key length
+static int bdb_file_key(unsigned char *key, uint64_t dir_id, const char *name) {
+  int len = strlen(name) + 1;
+
+  if (BDB_DIR_ID_LEN + len > BDB_MAX_KEY_LEN)
+    return 0;
+
+  bdb_encode_id(key, dir_id);
+  memcpy(key + BDB_DIR_ID_LEN, name, len);
+
+  return BDB_DIR_ID_LEN + len;
+}
+
+// Split path into its directory and file name, returns 0 if it has no directory
+static int bdb_split_path(const char *path, char *dir, const char **name) {
+  const char *sep = strrchr(path, BDB_PATH_SEP);
+
+  if (!sep || sep - path >= MAX_PATH_STR_LEN)
+    return 0;
+
+  memcpy(dir, path, sep - path);
+  dir[sep - path] = '\0';
+  *name = sep + 1;
+
+  return 1;
+}
+
+static void bdb_inode_key(unsigned char *key, uint64_t dev, uint64_t ino) {
+  memcpy(key, &dev, sizeof(dev));
+  memcpy(key + sizeof(dev), &ino, sizeof(ino));
+}
+
+static void bdb_clear_prefetch(BDBState *st) {
+  int x;
+
+  for (x = 0; x < st->nentries; x++)
+    free(st->entries[x].name);
+
+  st->nentries = 0;
+  st->prefetched = 0;
+}
+
+// Read the id stored for path in the dirs table, *id is set to 0 if there is none
+static int bdb_get_id(DB *dirs, DB_TXN *txn, const char *path, u_int32_t flags, uint64_t *id) {
+  DBT key, data;
+  int ret;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+  data.data = id;
+  data.ulen = sizeof(uint64_t);
+  data.flags = DB_DBT_USERMEM;
+
+  ret = dirs->get(dirs, txn, &key, &data, flags);
+  if (ret != 0 || data.size != sizeof(uint64_t))
+    *id = 0;
+
+  return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+static int bdb_put_id(DB *dirs, DB_TXN *txn, const char *path, uint64_t id) {
+  DBT key, data;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)path;
+  key.size = strlen(path) + 1;
+  data.data = &id;
+  data.size = sizeof(uint64_t);
+
+  return dirs->put(dirs, txn, &key, &data, 0);
+}
+
+// Give dir a new id. This is done in its own transaction, ahead of the batch holding the
+// directory's files, so processes sharing the database never hand out the same id.
+// Returns 0 on failure.
+static uint64_t bdb_new_dir_id(BDBState *st, const char *dir) {
+  DB_TXN *txn;
+  uint64_t id;
+  int ret, tries;
+
+  for (tries = 0; tries <= BDB_MAX_RETRIES; tries++) {
+    ret = st->env->txn_begin(st->env, NULL, &txn, 0);
+    if (ret != 0)
+      break;
+
+    // Another process may have added it since we looked
+    ret = bdb_get_id(st->dirs, txn, dir, DB_RMW, &id);
+    if (ret == 0 && !id) {
+      ret = bdb_get_id(st->dirs, txn, BDB_NEXT_ID_KEY, DB_RMW, &id);
+      if (!id)
+        id = 1;
+
+      if (ret == 0)
+        ret = bdb_put_id(st->dirs, txn, dir, id);
+      if (ret == 0)
+        ret = bdb_put_id(st->dirs, txn, BDB_NEXT_ID_KEY, id + 1);
+    }
+
+    if (ret == 0) {
+      // Not synced, the commit of the batch using the id flushes the log up to here
+      if ((ret = txn->commit(txn, DB_TXN_NOSYNC)) == 0)
+        return id;
+      break;
+    }
+
+    txn->abort(txn);
+    if (ret != DB_LOCK_DEADLOCK)
+      break;
+  }
+
+  LOG_ERROR("Unable to store cache directory %s: %s\n", dir, db_strerror(ret));
+  return 0;
+}
+
+// Make dir the current directory and return its id. If it isn't stored yet and create is
+// set it is given a new id, otherwise 0 is returned.
+static uint64_t bdb_dir_id(MediaScan *s, BDBState *st, const char *dir, int create) {
+  if (strcmp(st->dir, dir)) {
+    bdb_clear_prefetch(st);
+    strcpy(st->dir, dir);
+    bdb_get_id(st->dirs, NULL, dir, 0, &st->dir_id);
+  }
+
+  if (!st->dir_id && create)
+    st->dir_id = bdb_new_dir_id(st, dir);
+
+  return st->dir_id;
+}
+
+// Call fn for every entry in a table, reading them in bulk
+static int bdb_each(DB *dbp, void (*fn) (void *, const void *, uint32_t, const void *, uint32_t), void *ctx) {
+  DBC *cursor = NULL;
+  DBT key, data;
+  void *bulk;
+  int ret;
+
+  if ((ret = dbp->cursor(dbp, NULL, &cursor, 0)) != 0)
+    return ret;
+
+  bulk = malloc(BDB_BULK_SIZE);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  data.data = bulk;
+  data.ulen = BDB_BULK_SIZE;
+  data.flags = DB_DBT_USERMEM;
+
+  while ((ret = cursor->get(cursor, &key, &data, DB_NEXT | DB_MULTIPLE_KEY)) == 0) {
+    void *p, *k, *d;
+    u_int32_t klen, dlen;
+
+    DB_MULTIPLE_INIT(p, &data);
+    for (;;) {
+      DB_MULTIPLE_KEY_NEXT(p, &data, k, klen, d, dlen);
+      if (p == NULL)
+        break;
+
+      fn(ctx, k, klen, d, dlen);
+    }
+  }
+
+  cursor->close(cursor);
+  free(bulk);
+
+  return ret == DB_NOTFOUND ? 0 : ret;
+}
+
+static void bdb_count_key(void *ctx, const void *key, uint32_t klen, const void *data, uint32_t dlen) {
+  (*(uint32_t *)ctx)++;
+}
+
+static void bdb_bloom_add_key(void *ctx, const void *key, uint32_t klen, const void *data, uint32_t dlen) {
+  bloom_add((Bloom *)ctx, key, klen);
+}
+
+static void bdb_bloom_path(MediaScan *s, char *path, int size) {
+  snprintf(path, size, "%s/libmediascan.bloom", s->cachedir ? s->cachedir : ".");
+}
+
+// Load the filter saved by the last bdb_destroy, or rebuild it from the database. The saved
+// copy is removed once loaded, so if we don't exit cleanly it is rebuilt next time rather than
+// missing the keys added since.
+static void bdb_bloom_init(MediaScan *s, BDBState *st) {
+  char path[MAX_PATH_STR_LEN];
+  uint32_t count = 0;
+
+  bdb_bloom_path(s, path, sizeof(path));
+
+  st->bloom = bloom_load(path);
+  if (st->bloom) {
+    remove(path);
+    LOG_DEBUG("Loaded key filter with %u entries\n", bloom_count(st->bloom));
+    return;
+  }
+
+  if (bdb_each(s->dbp, bdb_count_key, &count) != 0)
+    return;
+
+  st->bloom = bloom_create(count);
+  if (bdb_each(s->dbp, bdb_bloom_add_key, st->bloom) != 0) {
+    bloom_destroy(st->bloom);
+    st->bloom = NULL;
+    return;
+  }
+
+  LOG_DEBUG("Built key filter for %u database entries\n", count);
+}
+
+// Delete the stored files of directory dir_id, in transactions of at most a batch so a large
+// directory doesn't hold locks other processes are waiting on for long
+static int bdb_clear_dir(MediaScan *s, BDBState *st, uint64_t dir_id) {
+  unsigned char start[BDB_DIR_ID_LEN];
+  DB_TXN *txn;
+  DBC *cursor;
+  DBT key, data;
+  int ret, n, tries = 0;
+
+  bdb_encode_id(start, dir_id);
+
+  memset(&data, 0, sizeof(DBT));
+  data.flags = DB_DBT_PARTIAL;  // only the keys are needed
+
+  do {
+    ret = st->env->txn_begin(st->env, NULL, &txn, 0);
+    if (ret != 0)
+      return ret;
+
+    ret = s->dbp->cursor(s->dbp, txn, &cursor, 0);
+    if (ret != 0) {
+      txn->abort(txn);
+      return ret;
+    }
+
+    memset(&key, 0, sizeof(DBT));
+    key.data = start;
+    key.size = sizeof(start);
+
+    n = 0;
+    ret = cursor->get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && key.size > BDB_DIR_ID_LEN && !memcmp(key.data, start, BDB_DIR_ID_LEN)) {
+      if ((ret = cursor->del(cursor, 0)) != 0)
+        break;
+
+      if (++n == BDB_BATCH_SIZE)
+        break;
+
+      ret = cursor->get(cursor, &key, &data, DB_NEXT);
+    }
+
+    cursor->close(cursor);
+
+    if (ret != 0 && ret != DB_NOTFOUND) {
+      txn->abort(txn);
+      if (ret != DB_LOCK_DEADLOCK || ++tries > BDB_MAX_RETRIES)
+        return ret;
+      n = BDB_BATCH_SIZE;       // retry
+      continue;
+    }
+
+    if ((ret = txn->commit(txn, DB_TXN_NOSYNC)) != 0)
+      return ret;
+  } while (n == BDB_BATCH_SIZE);
+
+  return 0;
+}
+
+// The directory path a scan of path stores its files under. Like recurse_dir, a relative path
+// is taken from the current directory, and a trailing separator is dropped.
+static void bdb_scan_path(const char *path, char *full, int size) {
+  int len;
+
+  full[0] = '\0';
+
+  if (!is_absolute_path(path)) {
+#ifdef WIN32
+    if (_getcwd(full, size) == NULL)
+#else
+    if (getcwd(full, size) == NULL)
+#endif
+      full[0] = '\0';
+    else
+      snprintf(full + strlen(full), size - strlen(full), "%c", BDB_PATH_SEP);
+  }
+
+  len = strlen(full);
+  snprintf(full + len, size - len, "%s", path);
+
+  len = strlen(full);
+  if (len > 1 && (full[len - 1] == '/' || full[len - 1] == BDB_PATH_SEP))
+    full[len - 1] = '\0';
+}
+
+// Forget every file under the scan paths, so a full scan starts over for its own paths
+// without touching what scans of other paths stored in the same database. The dirs table
+// is kept, a process scanning elsewhere may hold one of its ids.
+static void bdb_clear_paths(MediaScan *s, BDBState *st) {
+  char path[MAX_PATH_STR_LEN];
+  uint64_t *ids = NULL;
+  int nids = 0, maxids = 0;
+  DBC *cursor;
+  DBT key, data;
+  uint64_t id;
+  int i, x, len, ret;
+
+  for (i = 0; i < s->npaths; i++) {
+    if (st->dirs->cursor(st->dirs, NULL, &cursor, 0) != 0)
+      continue;
+
+    bdb_scan_path(s->paths[i], path, sizeof(path));
+    len = strlen(path);
+
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = path;
+    key.size = len;
+    data.data = &id;
+    data.ulen = sizeof(id);
+    data.flags = DB_DBT_USERMEM;
+
+    // The path itself and every directory below it, skipping siblings such as path-2
+    ret = cursor->get(cursor, &key, &data, DB_SET_RANGE);
+    while (ret == 0 && key.size > len && !memcmp(key.data, path, len)) {
+      char c = ((char *)key.data)[len];
+
+      if ((c == '\0' || c == BDB_PATH_SEP) && data.size == sizeof(id)) {
+        if (nids == maxids) {
+          maxids = maxids ? maxids * 2 : 256;
+          ids = (uint64_t *)realloc(ids, maxids * sizeof(uint64_t));
+        }
+        ids[nids++] = id;
+      }
+
+      ret = cursor->get(cursor, &key, &data, DB_NEXT);
+    }
+
+    cursor->close(cursor);
+  }
+
+  for (x = 0; x < nids; x++) {
+    if ((ret = bdb_clear_dir(s, st, ids[x])) != 0) {
+      LOG_ERROR("Unable to clear cache entries: %s\n", db_strerror(ret));
+      break;
+    }
+  }
+
+  LOG_INFO("Database cleared for %d directories\n", nids);
+
+  if (ids)
+    free(ids);
+}
 
 void reset_bdb(MediaScan *s) {
-  u_int32_t records;
+  BDBState *st = (BDBState *)s->_dbstate;
+  u_int32_t records, dirs;
+
+  buffer_clear(&st->queue);
+  st->nqueued = 0;
+  bdb_clear_prefetch(st);
+  st->dir[0] = '\0';
+  st->dir_id = 0;
+
+  if (st->bloom) {
+    bloom_destroy(st->bloom);
+    st->bloom = bloom_create(0);
+  }
 
   s->dbp->truncate(s->dbp, NULL, &records, 0);
+  st->dirs->truncate(st->dirs, NULL, &dirs, 0);
+  st->inodes->truncate(st->inodes, NULL, &dirs, 0);
 
   LOG_INFO("Database cleared. %d records deleted\n", records);
 }                               /* reset_bdb() */
 
+// Open one of the tables in the scan database
+static int bdb_open_table(DB_ENV *env, DB **dbp, const char *dbpath, const char *name) {
+  int ret;
+
+  ret = db_create(dbp, env, 0);
+  if (ret != 0) {
+    LOG_ERROR("Database creation failed: %s", db_strerror(ret));
+    return ret;
+  }
+
+  ret = (*dbp)->open(*dbp,      /* DB structure pointer */
+                     NULL,      /* Transaction pointer */
+                     dbpath,    /* On-disk file that holds the database. */
+                     name,      /* Logical database name */
+                     DB_BTREE,  /* Database access method */
+                     DB_CREATE, /* Open flags */
+                     0);        /* File mode (using defaults) */
+
+  if (ret != 0) {
+    (*dbp)->close(*dbp, 0);
+    *dbp = NULL;
+  }
+
+  return ret;
+}
+
 int init_bdb(MediaScan *s) {
+  BDBState *st;
   int ret;
-  int tmp_flags;
   char dbpath[MAX_PATH_STR_LEN];
 
   if (s->dbp)
     return 1;
 
-  // Create an environment object and initialize it for error reporting.
-  ret = db_env_create(&myEnv, 0);
+  st = (BDBState *)calloc(sizeof(BDBState), 1);
+  s->_dbstate = (void *)st;
+  LOG_MEM("new BDBState @ %p\n", st);
+  buffer_init(&st->queue, BUF_SIZE);
+
+  // Create an environment object and initialize it for error reporting. Each MediaScan object
+  // has its own handle, scanners in several processes can share the environment itself.
+  ret = db_env_create(&st->env, 0);
   if (ret != 0) {
     LOG_ERROR("Error creating database env handle: %s\n", db_strerror(ret));
-    return 0;
+    st->env = NULL;
+    goto err;
   }
 
-  // Open the environment.
-  ret = myEnv->open(myEnv,      // DB_ENV ptr
+  if (s->dbcachesize) {
+    ret = st->env->set_cachesize(st->env, 0, s->dbcachesize, 1);
+    if (ret != 0)
+      LOG_WARN("Unable to set database cache size to %u: %s\n", s->dbcachesize, db_strerror(ret));
+  }
+
+  // Remove log files once a checkpoint no longer needs them, and make writes
+  // outside of a batch (truncate, deletes) transactional too. Only batch commits sync the
+  // log, see bdb_flush.
+  st->env->log_set_config(st->env, DB_LOG_AUTO_REMOVE, 1);
+  st->env->set_flags(st->env, DB_AUTO_COMMIT, 1);
+  st->env->set_flags(st->env, DB_TXN_WRITE_NOSYNC, 1);
+
+  // Break deadlocks between processes sharing the database as soon as they happen
+  st->env->set_lk_detect(st->env, DB_LOCK_DEFAULT);
+
+  // Open the environment with a shared memory pool and locking. DB_REGISTER runs recovery
+  // only if a process using the environment died, e.g. in the middle of a batch, and never
+  // while another process is still using it.
+  ret = st->env->open(st->env,  // DB_ENV ptr
                     s->cachedir ? s->cachedir : ".",  // env home directory
-                    DB_CREATE | DB_INIT_MPOOL,  // Open flags
+                    DB_CREATE | DB_INIT_MPOOL | DB_INIT_TXN | DB_INIT_LOG | DB_INIT_LOCK | DB_REGISTER | DB_RECOVER,  // Open flags
                     0);         // File mode (default)
 
   if (ret != 0) {
     LOG_ERROR("Environment open failed: %s\n", db_strerror(ret));
-    return 0;
-  }
-
-  /* Initialize the structure. This
-   * database is opened in an environment,
-   * so the environment pointer is myEnv. */
-  ret = db_create(&s->dbp, myEnv, 0);
-  if (ret != 0) {
-    bdb_destroy(s);
-    ms_errno = MSENO_DBERROR;
-    LOG_ERROR("Database creation failed: %s", db_strerror(ret));
-    return 0;
+    st->env->close(st->env, 0);
+    st->env = NULL;
+    goto err;
   }
 
   /* open the database */
   sprintf(dbpath, "%s/libmediascan.db", s->cachedir ? s->cachedir : ".");
 
-  if (s->flags & MS_FULL_SCAN) {
-    tmp_flags = DB_CREATE | DB_TRUNCATE;
+  ret = bdb_open_table(st->env, &s->dbp, dbpath, "files");
+
+  // A database from before the directory table held a single unnamed table, start over
+  if (ret == EINVAL) {
+    char path[MAX_PATH_STR_LEN];
+
+    LOG_INFO("Recreating database %s in the current format\n", dbpath);
+    st->env->dbremove(st->env, NULL, dbpath, NULL, DB_AUTO_COMMIT);
+    bdb_bloom_path(s, path, sizeof(path));
+    remove(path);
+
+    ret = bdb_open_table(st->env, &s->dbp, dbpath, "files");
   }
-  else {
-    tmp_flags = DB_CREATE;
-  };
 
-  ret = s->dbp->open(s->dbp,    /* DB structure pointer */
-                     NULL,      /* Transaction pointer */
-                     dbpath,    /* On-disk file that holds the database. */
-                     NULL,      /* Optional logical database name */
-                     DB_BTREE,  /* Database access method */
-                     tmp_flags, /* Open flags */
-                     0);        /* File mode (using defaults) */
+  if (ret == 0)
+    ret = bdb_open_table(st->env, &st->dirs, dbpath, "dirs");
+  if (ret == 0)
+    ret = bdb_open_table(st->env, &st->inodes, dbpath, "inodes");
 
   if (ret != 0) {
-    bdb_destroy(s);
-    ms_errno = MSENO_DBERROR;
     LOG_ERROR("Database open failed: %s\n", db_strerror(ret));
-    return 0;
+    goto err;
   }
 
+  if (!(s->flags & MS_SHARED_CACHE))
+    bdb_bloom_init(s, st);
+
+  if (s->flags & MS_FULL_SCAN)
+    bdb_clear_paths(s, st);
+
   return 1;
+
+err:
+  bdb_destroy(s);
+  ms_errno = MSENO_DBERROR;
+  return 0;
 }                               /* init_bdb() */
 
+static int bdb_write_queue(MediaScan *s, BDBState *st, DB_TXN *txn) {
+  unsigned char *p = (unsigned char *)buffer_ptr(&st->queue);
+  unsigned char *end = p + buffer_len(&st->queue);
+  DBT key, data;
+  uint32_t len;
+  int op, ret;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+
+  while (p < end) {
+    op = *p++;
+    memcpy(&len, p, sizeof(len));
+    key.data = p + sizeof(len);
+    key.size = len;
+    p += sizeof(len) + len;
+    memcpy(&len, p, sizeof(len));
+    data.data = p + sizeof(len);
+    data.size = len;
+    p += sizeof(len) + len;
+
+    switch (op) {
+      case BDB_PUT_FILE:
+        ret = s->dbp->put(s->dbp, txn, &key, &data, 0);
+        break;
+      case BDB_PUT_INODE:
+        ret = st->inodes->put(st->inodes, txn, &key, &data, 0);
+        break;
+      default:
+        ret = s->dbp->del(s->dbp, txn, &key, 0);
+        if (ret == DB_NOTFOUND)
+          ret = 0;
+        break;
+    }
+
+    if (ret != 0)
+      return ret;
+  }
+
+  return 0;
+}
+
+// Write all queued changes in a single transaction
+void bdb_flush(MediaScan *s) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  DB_TXN *txn = NULL;
+  int ret, tries;
+
+  if (!st || !st->nqueued)
+    return;
+
+  for (tries = 0;; tries++) {
+    ret = st->env->txn_begin(st->env, NULL, &txn, 0);
+    if (ret != 0)
+      goto err;
+
+    ret = bdb_write_queue(s, st, txn);
+    if (ret == 0)
+      break;
+
+    txn->abort(txn);
+
+    // Picked to resolve a deadlock with another process, the queue is still intact
+    if (ret != DB_LOCK_DEADLOCK || tries == BDB_MAX_RETRIES)
+      goto err;
+
+    LOG_DEBUG("Cache update deadlocked, retrying\n");
+  }
+
+  ret = txn->commit(txn, DB_TXN_SYNC);
+  if (ret != 0)
+    goto err;
+
+  LOG_DEBUG("Committed %d cache updates\n", st->nqueued);
+
+  // Checkpoint once enough log has been written so old log files can be removed
+  st->env->txn_checkpoint(st->env, 1024, 0, 0);
+  goto out;
+
+err:
+  LOG_ERROR("Cache update failed: %s\n", db_strerror(ret));
+
+out:
+  buffer_clear(&st->queue);
+  st->nqueued = 0;
+}
+
+// Queue a change, written by bdb_flush. Each is an op byte followed by the key and data, both
+// prefixed with their length.
+static void bdb_queue(MediaScan *s, BDBState *st, int op, const void *key, uint32_t klen, const void *data,
+                      uint32_t dlen) {
+  unsigned char c = op;
+
+  buffer_append(&st->queue, &c, 1);
+  buffer_append(&st->queue, &klen, sizeof(klen));
+  buffer_append(&st->queue, key, klen);
+  buffer_append(&st->queue, &dlen, sizeof(dlen));
+  buffer_append(&st->queue, data, dlen);
+
+  if (++st->nqueued >= BDB_BATCH_SIZE)
+    bdb_flush(s);
+}
+
+// Queue a path -> hash update, written by bdb_flush
+void bdb_put(MediaScan *s, const char *path, uint32_t hash) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  char dir[MAX_PATH_STR_LEN];
+  unsigned char key[BDB_MAX_KEY_LEN];
+  const char *name;
+  uint64_t dir_id;
+  uint32_t len;
+
+  if (!st || !bdb_split_path(path, dir, &name))
+    return;
+
+  dir_id = bdb_dir_id(s, st, dir, 1);
+  if (!dir_id)
+    return;
+
+  len = bdb_file_key(key, dir_id, name);
+  if (!len)
+    return;
+
+  if (st->bloom)
+    bloom_add(st->bloom, key, len);
+
+  bdb_queue(s, st, BDB_PUT_FILE, key, len, &hash, sizeof(hash));
+}
+
+// Queue an update of the inodes table entry for path. id's fingerprint is computed if it
+// wasn't already.
+void bdb_put_file_id(MediaScan *s, const char *path, BDBFileId *id) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  unsigned char key[BDB_INODE_KEY_LEN];
+  unsigned char data[sizeof(BDBInode) + MAX_PATH_STR_LEN];
+  BDBInode ino;
+  int len = strlen(path) + 1;
+
+  if (!st || !id->ino || len > MAX_PATH_STR_LEN)
+    return;
+
+  if (!id->fingerprint)
+    id->fingerprint = FingerprintFile(path, id->size);
+
+  ino.size = id->size;
+  ino.mtime = id->mtime;
+  ino.fingerprint = id->fingerprint;
+
+  bdb_inode_key(key, id->dev, id->ino);
+  memcpy(data, &ino, sizeof(ino));
+  memcpy(data + sizeof(ino), path, len);
+
+  bdb_queue(s, st, BDB_PUT_INODE, key, sizeof(key), data, sizeof(ino) + len);
+}
+
+// Check whether the file at path, with id's size and modified time, was stored under another
+// path that it has since been moved from. Fills in id's device and inode, and its fingerprint
+// if that was needed. On a match old_path (MAX_PATH_STR_LEN) is set, the entry for the old path
+// is queued for removal and 1 is returned.
+int bdb_find_move(MediaScan *s, const char *path, BDBFileId *id, char *old_path) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  unsigned char k[BDB_INODE_KEY_LEN], fk[BDB_MAX_KEY_LEN];
+  unsigned char buf[sizeof(BDBInode) + MAX_PATH_STR_LEN];
+  char dir[MAX_PATH_STR_LEN];
+  const char *from, *name;
+  uint64_t dev, ino, dir_id;
+  BDBInode stored;
+  DBT key, data;
+  int len;
+
+  if (!st || !FileId(path, &id->dev, &id->ino))
+    return 0;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  bdb_inode_key(k, id->dev, id->ino);
+  key.data = k;
+  key.size = sizeof(k);
+  data.data = buf;
+  data.ulen = sizeof(buf);
+  data.flags = DB_DBT_USERMEM;
+
+  if (st->inodes->get(st->inodes, NULL, &key, &data, 0) != 0 || data.size <= sizeof(BDBInode)
+      || buf[data.size - 1] != '\0')
+    return 0;
+
+  memcpy(&stored, buf, sizeof(stored));
+  from = (const char *)buf + sizeof(BDBInode);
+
+  // A stale entry for a reused inode, or the file is where it was
+  if (stored.size != id->size || stored.mtime != id->mtime || !strcmp(from, path))
+    return 0;
+
+  // Still at the old path as well, i.e. a hard link
+  if (FileId(from, &dev, &ino) && dev == id->dev && ino == id->ino)
+    return 0;
+
+  if (!id->fingerprint)
+    id->fingerprint = FingerprintFile(path, id->size);
+
+  if (id->fingerprint != stored.fingerprint)
+    return 0;
+
+  strcpy(old_path, from);
+
+  // Forget the old path. This doesn't go through bdb_dir_id, which would drop the prefetched
+  // entries of the directory being scanned.
+  if (bdb_split_path(old_path, dir, &name) && bdb_get_id(st->dirs, NULL, dir, 0, &dir_id) == 0 && dir_id) {
+    len = bdb_file_key(fk, dir_id, name);
+    if (len)
+      bdb_queue(s, st, BDB_DEL_FILE, fk, len, NULL, 0);
+
+    // A rename within the directory being scanned
+    if (dir_id == st->dir_id)
+      bdb_clear_prefetch(st);
+  }
+
+  return 1;
+}
+
+// Remove path from the database
+void bdb_del(MediaScan *s, const char *path) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  char dir[MAX_PATH_STR_LEN];
+  unsigned char k[BDB_MAX_KEY_LEN];
+  const char *name;
+  uint64_t dir_id;
+  DBT key;
+  int ret;
+
+  if (!st || !bdb_split_path(path, dir, &name))
+    return;
+
+  // Make sure a queued put for this path can't bring it back
+  bdb_flush(s);
+
+  dir_id = bdb_dir_id(s, st, dir, 0);
+  if (!dir_id)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  key.data = k;
+  key.size = bdb_file_key(k, dir_id, name);
+
+  if (key.size && (ret = s->dbp->del(s->dbp, NULL, &key, 0)) == 0) {
+    LOG_INFO("db: %s: key was deleted.\n", path);
+  }
+  else if (key.size && ret != DB_NOTFOUND) {
+    s->dbp->err(s->dbp, ret, "DB->del");
+  }
+
+  bdb_clear_prefetch(st);
+}
+
+// Read the entries for every file in dir with bulk gets, so bdb_lookup can answer from memory.
+// A directory's file keys all start with its id, so this is a single range of the files table.
+void bdb_prefetch_dir(MediaScan *s, const char *dir) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  unsigned char start[BDB_DIR_ID_LEN];
+  DBC *cursor = NULL;
+  DBT key, data;
+  void *bulk = NULL;
+  uint64_t dir_id;
+  int flags, ret;
+
+  if (!st || strlen(dir) >= MAX_PATH_STR_LEN)
+    return;
+
+  if (!strcmp(st->dir, dir) && st->prefetched)
+    return;
+
+  // Nothing in this directory has been stored
+  dir_id = bdb_dir_id(s, st, dir, 0);
+  st->prefetched = 1;
+  if (!dir_id)
+    return;
+
+  if (s->dbp->cursor(s->dbp, NULL, &cursor, 0) != 0) {
+    st->prefetched = 0;
+    return;
+  }
+
+  bulk = malloc(BDB_BULK_SIZE);
+  bdb_encode_id(start, dir_id);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  data.data = bulk;
+  data.ulen = BDB_BULK_SIZE;
+  data.flags = DB_DBT_USERMEM;
+
+  key.data = start;
+  key.size = sizeof(start);
+  flags = DB_SET_RANGE | DB_MULTIPLE_KEY;
+
+  while ((ret = cursor->get(cursor, &key, &data, flags)) == 0) {
+    void *p, *k, *d;
+    u_int32_t klen, dlen;
+
+    flags = DB_NEXT | DB_MULTIPLE_KEY;
+
+    DB_MULTIPLE_INIT(p, &data);
+    for (;;) {
+      const char *name;
+
+      DB_MULTIPLE_KEY_NEXT(p, &data, k, klen, d, dlen);
+      if (p == NULL)
+        break;
+
+      // Past the end of this directory
+      if (klen <= BDB_DIR_ID_LEN || memcmp(k, start, BDB_DIR_ID_LEN))
+        goto done;
+
+      name = (char *)k + BDB_DIR_ID_LEN;
+      if (name[klen - BDB_DIR_ID_LEN - 1] != '\0' || dlen != sizeof(uint32_t))
+        continue;
+
+      if (st->nentries == st->maxentries) {
+        st->maxentries = st->maxentries ? st->maxentries * 2 : 256;
+        st->entries = (BDBEntry *)realloc(st->entries, st->maxentries * sizeof(BDBEntry));
+      }
+
+      st->entries[st->nentries].name = strdup(name);
+      memcpy(&st->entries[st->nentries].hash, d, sizeof(uint32_t));
+      st->nentries++;
+    }
+  }
+
+  if (ret != DB_NOTFOUND) {
+    LOG_WARN("Cache prefetch for %s failed: %s\n", dir, db_strerror(ret));
+    bdb_clear_prefetch(st);
+    goto out;
+  }
+
+done:
+  LOG_DEBUG("Prefetched %d cache entries for %s\n", st->nentries, dir);
+
+out:
+  cursor->close(cursor);
+  free(bulk);
+}
+
+static int bdb_entry_cmp(const void *key, const void *entry) {
+  return strcmp((const char *)key, ((const BDBEntry *)entry)->name);
+}
+
+// Returns 1 if path is stored with this hash, i.e. it hasn't changed since it was last scanned
+int bdb_lookup(MediaScan *s, const char *path, uint32_t hash) {
+  BDBState *st = (BDBState *)s->_dbstate;
+  char dir[MAX_PATH_STR_LEN];
+  unsigned char k[BDB_MAX_KEY_LEN];
+  const char *name;
+  uint64_t dir_id;
+  DBT key, data;
+
+  if (!st || !bdb_split_path(path, dir, &name))
+    return 0;
+
+  dir_id = bdb_dir_id(s, st, dir, 0);
+  if (!dir_id)
+    return 0;
+
+  // Answer from the prefetched directory
+  if (st->prefetched) {
+    BDBEntry *e = (BDBEntry *)bsearch(name, st->entries, st->nentries, sizeof(BDBEntry), bdb_entry_cmp);
+    return e && e->hash == hash;
+  }
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = k;
+  key.size = bdb_file_key(k, dir_id, name);
+  data.data = &hash;
+  data.size = sizeof(uint32_t);
+
+  if (!key.size || (st->bloom && !bloom_check(st->bloom, k, key.size)))
+    return 0;
+
+  // DB_GET_BOTH will only return OK if both key and data match, this avoids the need to check
+  // the returned data against hash
+  return s->dbp->get(s->dbp, NULL, &key, &data, DB_GET_BOTH) == 0;
+}
+
+// The scan database's environment, NULL until init_bdb has run
+DB_ENV *bdb_env(MediaScan *s) {
+  BDBState *st = (BDBState *)s->_dbstate;
+
+  return st ? st->env : NULL;
+}
+
 void bdb_destroy(MediaScan *s) {
+  BDBState *st = (BDBState *)s->_dbstate;
+
+  if (st) {
+    bdb_flush(s);
+    bdb_clear_prefetch(st);
+
+    if (st->bloom) {
+      char path[MAX_PATH_STR_LEN];
+
+      bdb_bloom_path(s, path, sizeof(path));
+      bloom_save(st->bloom, path);
+      bloom_destroy(st->bloom);
+    }
+
+    if (st->dirs)
+      st->dirs->close(st->dirs, 0);
+    if (st->inodes)
+      st->inodes->close(st->inodes, 0);
+  }
+
   if (s->dbp != NULL) {
     s->dbp->close(s->dbp, 0);
     s->dbp = NULL;
   }
 
-  if (myEnv != NULL) {
-    myEnv->close(myEnv, DB_FORCESYNC);
-    myEnv = NULL;
+  if (st) {
+    if (st->env != NULL) {
+      st->env->txn_checkpoint(st->env, 0, 0, 0);
+      st->env->close(st->env, DB_FORCESYNC);
+    }
+
+    if (st->entries)
+      free(st->entries);
+    buffer_free(&st->queue);
+    LOG_MEM("destroy BDBState @ %p\n", st);
+    free(st);
+    s->_dbstate = NULL;
   }
 }
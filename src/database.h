@@ -2,8 +2,25 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+// Identifies a file's content independently of its path, see bdb_find_move
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;                 // 0 if unknown
+  uint64_t size;
+  int mtime;
+  uint32_t fingerprint;         // 0 until computed
+} BDBFileId;
+
 int init_bdb(MediaScan *s);
 void reset_bdb(MediaScan *s);
 void bdb_destroy(MediaScan *s);
+void bdb_prefetch_dir(MediaScan *s, const char *dir);
+int bdb_lookup(MediaScan *s, const char *path, uint32_t hash);
+void bdb_put(MediaScan *s, const char *path, uint32_t hash);
+void bdb_del(MediaScan *s, const char *path);
+void bdb_put_file_id(MediaScan *s, const char *path, BDBFileId *id);
+int bdb_find_move(MediaScan *s, const char *path, BDBFileId *id, char *old_path);
+void bdb_flush(MediaScan *s);
+DB_ENV *bdb_env(MediaScan *s);
 
 #endif
@@ -0,0 +1,318 @@
+
+#include <libmediascan.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include "common.h"
+#include "duplicate.h"
+#include "mediascan.h"
+#include "progress.h"
+#include "util.h"
+
+// Duplicates are found in stages, each only looking at the files the previous one could not
+// tell apart: files are grouped by size, then by a fingerprint of their first and last 64 KB,
+// and only files still matching are hashed in full. Most files have a unique size, so the
+// whole library is rarely read.
+
+#define DUPLICATE_READ_SIZE (64 * 1024)
+
+typedef struct {
+  char *path;
+  uint64_t size;
+  int has_id;                   // dev and ino are set, see FileId
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t partial;             // FingerprintFile, 0 if unreadable
+  uint64_t full;                // hash of the whole file, 0 if unreadable
+} DuplicateEntry;
+
+typedef struct {
+  DuplicateEntry *entries;
+  int nentries;
+  int maxentries;
+} DuplicateState;
+
+static int duplicate_size_cmp(const void *a, const void *b) {
+  const DuplicateEntry *ea = (const DuplicateEntry *)a;
+  const DuplicateEntry *eb = (const DuplicateEntry *)b;
+
+  return ea->size < eb->size ? -1 : ea->size > eb->size;
+}
+
+static int duplicate_partial_cmp(const void *a, const void *b) {
+  const DuplicateEntry *ea = (const DuplicateEntry *)a;
+  const DuplicateEntry *eb = (const DuplicateEntry *)b;
+
+  return ea->partial < eb->partial ? -1 : ea->partial > eb->partial;
+}
+
+// The same file under another path, e.g. through a hard link, sorts next to itself
+static int duplicate_id_cmp(const void *a, const void *b) {
+  const DuplicateEntry *ea = (const DuplicateEntry *)a;
+  const DuplicateEntry *eb = (const DuplicateEntry *)b;
+
+  if (ea->has_id != eb->has_id)
+    return ea->has_id ? -1 : 1;
+
+  if (ea->has_id) {
+    if (ea->dev != eb->dev)
+      return ea->dev < eb->dev ? -1 : 1;
+    if (ea->ino != eb->ino)
+      return ea->ino < eb->ino ? -1 : 1;
+  }
+
+  return strcmp(ea->path, eb->path);
+}
+
+// Groups are reported in path order
+static int duplicate_full_cmp(const void *a, const void *b) {
+  const DuplicateEntry *ea = (const DuplicateEntry *)a;
+  const DuplicateEntry *eb = (const DuplicateEntry *)b;
+
+  if (ea->full != eb->full)
+    return ea->full < eb->full ? -1 : 1;
+
+  return strcmp(ea->path, eb->path);
+}
+
+// 64-bit hash of a file's whole content, 0 if it can't be read
+static uint64_t duplicate_hash_file(const char *path) {
+  unsigned char *buf;
+  uint32_t pc = 0, pb = 0;
+  uint64_t hash;
+  size_t len;
+  FILE *fp;
+
+  fp = fopen(path, "rb");
+  if (!fp) {
+    LOG_WARN("Unable to read %s for duplicate detection\n", path);
+    return 0;
+  }
+
+  buf = (unsigned char *)malloc(DUPLICATE_READ_SIZE);
+
+  // Each chunk is hashed starting from the previous chunk's result
+  while ((len = fread(buf, 1, DUPLICATE_READ_SIZE, fp)) > 0)
+    hashlittle2(buf, len, &pc, &pb);
+
+  // 0 means unreadable
+  if (ferror(fp))
+    hash = 0;
+  else if (!(hash = (uint64_t)pc << 32 | pb))
+    hash = 1;
+
+  free(buf);
+  fclose(fp);
+
+  return hash;
+}
+
+static void duplicate_send(MediaScan *s, DuplicateEntry *entries, int n) {
+  MediaScanDuplicates *d = (MediaScanDuplicates *)calloc(sizeof(MediaScanDuplicates), 1);
+  int x;
+
+  LOG_MEM("new MediaScanDuplicates @ %p\n", d);
+
+  d->size = entries[0].size;
+  d->npaths = n;
+  d->paths = (char **)malloc(n * sizeof(char *));
+
+  // The group takes over the paths
+  for (x = 0; x < n; x++) {
+    d->paths[x] = entries[x].path;
+    entries[x].path = NULL;
+  }
+
+  LOG_INFO("Found %d duplicates of %s\n", n - 1, d->paths[0]);
+
+  send_duplicates(s, d);
+}
+
+// Report the files of a run with the same size and fingerprint that are identical
+static void duplicate_check_full(MediaScan *s, DuplicateEntry *entries, int n) {
+  int i, j;
+
+  for (i = 0; i < n; i++)
+    entries[i].full = duplicate_hash_file(entries[i].path);
+
+  qsort(entries, n, sizeof(DuplicateEntry), duplicate_full_cmp);
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && entries[j].full == entries[i].full; j++);
+
+    if (j - i > 1 && entries[i].full)
+      duplicate_send(s, &entries[i], j - i);
+  }
+}
+
+static void duplicate_progress(MediaScan *s, const char *path) {
+  if (s->on_progress) {
+    s->progress->done++;
+
+    if (progress_update(s->progress, path))
+      send_progress(s);
+  }
+}
+
+// Drop the entries of a run that are the same file as another one: a path added twice, e.g.
+// a file and a symlink to it, or another link to the same (dev, inode). The files left are
+// moved to the start of the run, returns how many there are.
+static int duplicate_unique(DuplicateEntry *entries, int n) {
+  int i, m = 0;
+
+  for (i = 0; i < n; i++)
+    entries[i].has_id = FileId(entries[i].path, &entries[i].dev, &entries[i].ino);
+
+  qsort(entries, n, sizeof(DuplicateEntry), duplicate_id_cmp);
+
+  for (i = 0; i < n; i++) {
+    DuplicateEntry *prev = m ? &entries[m - 1] : NULL;
+
+    if (prev && (!strcmp(prev->path, entries[i].path)
+                 || (prev->has_id && entries[i].has_id && prev->dev == entries[i].dev
+                     && prev->ino == entries[i].ino))) {
+      LOG_DEBUG("%s is the same file as %s, not a duplicate\n", entries[i].path, prev->path);
+      free(entries[i].path);
+      entries[i].path = NULL;
+      continue;
+    }
+
+    if (m != i) {
+      entries[m] = entries[i];
+      entries[i].path = NULL;
+    }
+    m++;
+  }
+
+  return m;
+}
+
+// Narrow a run of files with the same size down by fingerprint
+static void duplicate_check_partial(MediaScan *s, DuplicateEntry *entries, int n) {
+  int i, j;
+
+  for (i = 0; i < n && !s->_want_abort; i++) {
+    entries[i].partial = FingerprintFile(entries[i].path, entries[i].size);
+    duplicate_progress(s, entries[i].path);
+  }
+
+  qsort(entries, n, sizeof(DuplicateEntry), duplicate_partial_cmp);
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && entries[j].partial == entries[i].partial; j++);
+
+    if (j - i > 1 && entries[i].partial)
+      duplicate_check_full(s, &entries[i], j - i);
+  }
+}
+
+// Start collecting the files of a scan, if a duplicate callback is set
+void duplicates_start(MediaScan *s) {
+  DuplicateState *ds;
+
+  duplicates_reset(s);
+
+  if (!s->on_duplicates)
+    return;
+
+  ds = (DuplicateState *)calloc(sizeof(DuplicateState), 1);
+  LOG_MEM("new DuplicateState @ %p\n", ds);
+  s->_duplicates = ds;
+}
+
+// Remember a scanned file, called for every file whether or not it is scanned again. Files
+// scanned outside of ms_scan, e.g. by ms_watch_directory, are not checked.
+void duplicates_add(MediaScan *s, const char *path, uint64_t size) {
+  DuplicateState *ds = (DuplicateState *)s->_duplicates;
+  DuplicateEntry *e;
+
+  if (!ds)
+    return;
+
+  if (ds->nentries == ds->maxentries) {
+    ds->maxentries = ds->maxentries ? ds->maxentries * 2 : 1024;
+    ds->entries = (DuplicateEntry *)realloc(ds->entries, ds->maxentries * sizeof(DuplicateEntry));
+  }
+
+  e = &ds->entries[ds->nentries++];
+  e->path = strdup(path);
+  e->size = size;
+  e->has_id = 0;
+  e->partial = 0;
+  e->full = 0;
+}
+
+// Find the duplicates among the files added since the last call and report each group
+void duplicates_finish(MediaScan *s) {
+  DuplicateState *ds = (DuplicateState *)s->_duplicates;
+  int i, j, n;
+
+  if (!ds)
+    return;
+
+  qsort(ds->entries, ds->nentries, sizeof(DuplicateEntry), duplicate_size_cmp);
+
+  // Only files sharing their size with another one are read, they make up the progress total
+  for (i = 0; i < ds->nentries; i = j) {
+    for (j = i + 1; j < ds->nentries && ds->entries[j].size == ds->entries[i].size; j++);
+
+    if (j - i > 1) {
+      n = duplicate_unique(&ds->entries[i], j - i);
+      if (n > 1)
+        s->progress->total += n;
+    }
+  }
+
+  for (i = 0; i < ds->nentries && !s->_want_abort; i = j) {
+    for (j = i + 1; j < ds->nentries && ds->entries[j].size == ds->entries[i].size; j++);
+
+    // duplicate_unique left the files to check at the start of the run
+    for (n = 0; i + n < j && ds->entries[i + n].path; n++);
+
+    if (n > 1)
+      duplicate_check_partial(s, &ds->entries[i], n);
+  }
+
+  if (s->on_progress) {
+    progress_update(s->progress, NULL);
+    send_progress(s);
+  }
+
+  duplicates_reset(s);
+}
+
+void duplicates_reset(MediaScan *s) {
+  DuplicateState *ds = (DuplicateState *)s->_duplicates;
+  int x;
+
+  if (!ds)
+    return;
+
+  for (x = 0; x < ds->nentries; x++) {
+    if (ds->entries[x].path)
+      free(ds->entries[x].path);
+  }
+
+  if (ds->entries)
+    free(ds->entries);
+
+  LOG_MEM("destroy DuplicateState @ %p\n", ds);
+  free(ds);
+  s->_duplicates = NULL;
+}
+
+void duplicates_destroy(MediaScanDuplicates *d) {
+  int x;
+
+  for (x = 0; x < d->npaths; x++)
+    free(d->paths[x]);
+
+  LOG_MEM("destroy MediaScanDuplicates @ %p\n", d);
+  free(d->paths);
+  free(d);
+}
@@ -0,0 +1,10 @@
+#ifndef _DUPLICATE_H
+#define _DUPLICATE_H
+
+void duplicates_start(MediaScan *s);
+void duplicates_add(MediaScan *s, const char *path, uint64_t size);
+void duplicates_finish(MediaScan *s);
+void duplicates_reset(MediaScan *s);
+void duplicates_destroy(MediaScanDuplicates *d);
+
+#endif // _DUPLICATE_H
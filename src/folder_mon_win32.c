@@ -30,32 +30,8 @@
 
 
 static void HandleRemovedFile(MediaScan *s, const char *filename) {
-  DBT data, key;
-  int ret;
-
-  // Zero out the DBTs before using them.
-  memset(&key, 0, sizeof(key));
-  memset(&data, 0, sizeof(DBT));
-
-  key.data = (char *)filename;
-  key.size = strlen(filename) + 1;
-
-  if (s->dbp != NULL) {
-
-    if ((ret = s->dbp->get(s->dbp, NULL, &key, &data, 0)) == 0) {
-      LOG_INFO("db: %s: key retrieved: data was %s.\n", (char *)key.data, (char *)data.data);
-
-      if ((ret = s->dbp->del(s->dbp, NULL, &key, 0)) == 0) {
-        LOG_INFO("db: %s: key was deleted.\n", (char *)key.data);
-      }
-      else {
-        s->dbp->err(s->dbp, ret, "DB->del");
-      }
-    }
-    else {
-      s->dbp->err(s->dbp, ret, "DB->get");
-    }
-  }
+  if (s->dbp != NULL)
+    bdb_del(s, filename);
 }                               /* HandleRemovedFile() */
 
 static BOOL WaitForFile(const char *sz, const DWORD dwWaitSecs) {
@@ -260,6 +236,9 @@ void WatchDirectory(void *thread_data) {
               break;
 */ }
 
+          // Changes are infrequent here, commit each one rather than waiting for a full batch
+          bdb_flush(s);
+
           if (!fni->NextEntryOffset)
             break;
           pBase += fni->NextEntryOffset;
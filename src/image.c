@@ -18,6 +18,7 @@
 #include "image_png.h"
 #include "image_gif.h"
 #include "image_bmp.h"
+#include "image_raw.h"
 
 #ifdef TIFF_SUPPORT
 #include "image_tiff.h"
@@ -38,6 +39,7 @@ MediaScanImage *image_create(void) {
   i->_bmp = NULL;
   i->_png = NULL;
   i->_jpeg = NULL;
+  i->_raw = NULL;
 #ifdef TIFF_SUPPORT
   i->_tiff = NULL;
 #endif
@@ -61,11 +63,16 @@ void image_destroy(MediaScanImage *i) {
     free(i->_dbuf);
   }
 
+  if (i->saved_path)
+    free(i->saved_path);
+
   LOG_MEM("destroy MediaScanImage @ %p\n", i);
   free(i);
 }
 
-int image_read_header(MediaScanImage *i, MediaScanResult *r) {
+// Read basic image details. If header_only is set, only the dimensions and metadata are read
+// by lightweight native parsers that create no decoder state, and image_load can't be used.
+int image_read_header(MediaScanImage *i, MediaScanResult *r, int header_only) {
   unsigned char *bptr;
   int ret = 1;
 
@@ -76,7 +83,7 @@ int image_read_header(MediaScanImage *i, MediaScanResult *r) {
     case 0xff:
       if (bptr[1] == 0xd8 && bptr[2] == 0xff) {
         i->codec = "JPEG";
-        if (!image_jpeg_read_header(i, r)) {
+        if (header_only ? !image_jpeg_probe(i, r) : !image_jpeg_read_header(i, r)) {
           ret = 0;
           goto out;
         }
@@ -86,7 +93,7 @@ int image_read_header(MediaScanImage *i, MediaScanResult *r) {
       if (bptr[1] == 'P' && bptr[2] == 'N' && bptr[3] == 'G'
           && bptr[4] == 0x0d && bptr[5] == 0x0a && bptr[6] == 0x1a && bptr[7] == 0x0a) {
         i->codec = "PNG";
-        if (!image_png_read_header(i, r)) {
+        if (header_only ? !image_png_probe(i, r) : !image_png_read_header(i, r)) {
           ret = 0;
           goto out;
         }
@@ -95,7 +102,8 @@ int image_read_header(MediaScanImage *i, MediaScanResult *r) {
     case 'G':
       if (bptr[1] == 'I' && bptr[2] == 'F' && bptr[3] == '8' && (bptr[4] == '7' || bptr[4] == '9') && bptr[5] == 'a') {
         i->codec = "GIF";
-        if (!image_gif_read_header(i, r, bptr[4] == '9')) { // Flag when file is GIF89, for DLNA
+        // Flag when file is GIF89, for DLNA
+        if (header_only ? !image_gif_probe(i, r, bptr[4] == '9') : !image_gif_read_header(i, r, bptr[4] == '9')) {
           ret = 0;
           goto out;
         }
@@ -104,23 +112,23 @@ int image_read_header(MediaScanImage *i, MediaScanResult *r) {
     case 'B':
       if (bptr[1] == 'M') {
         i->codec = "BMP";
-        if (!image_bmp_read_header(i, r)) {
+        if (header_only ? !image_bmp_probe(i, r) : !image_bmp_read_header(i, r)) {
           ret = 0;
           goto out;
         }
       }
       break;
-#ifdef TIFF_SUPPORT
     case 'I':
-      if (bptr[1] == 'I' && bptr[1] == '*') {
-        i->codec = "TIFF";
-        if (!image_tiff_read_header(i, r)) {
+    case 'M':
+      // Camera RAW formats are TIFF-based
+      if (image_raw_is_tiff(bptr)) {
+        i->codec = "RAW";
+        if (!image_raw_read_header(i, r)) {
           ret = 0;
           goto out;
         }
       }
       break;
-#endif
   }
 
   if (!i->codec) {
@@ -165,6 +173,11 @@ int image_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint) {
       goto out;
     }
   }
+  else if (!strcmp("RAW", i->codec)) {
+    // RAW sensor data is never decoded, thumbnails come from the embedded preview
+    ret = 0;
+    goto out;
+  }
 #ifdef TIFF_SUPPORT
   else if (!strcmp("TIFF", i->codec)) {
     if (!image_tiff_load(i)) {
@@ -178,6 +191,22 @@ out:
   return ret;
 }
 
+// Returns a new image for an embedded preview of i, if the format has one that was saved
+// while reading the header. The caller must destroy the returned image.
+MediaScanImage *image_get_embedded(MediaScanImage *i) {
+  if (!strcmp("JPEG", i->codec))
+    return image_jpeg_get_embedded(i);
+  else if (!strcmp("RAW", i->codec))
+    return image_raw_get_embedded(i);
+
+  return NULL;
+}
+
+// Returns true if image_load can decode the image itself, rather than only an embedded preview
+int image_is_decodable(MediaScanImage *i) {
+  return strcmp("RAW", i->codec) != 0;
+}
+
 void image_alloc_pixbuf(MediaScanImage *i, int width, int height) {
   int size = width * height * sizeof(uint32_t);
 
@@ -211,6 +240,9 @@ void image_unload(MediaScanImage *i) {
   if (i->_gif)
     image_gif_destroy(i);
 
+  if (i->_raw)
+    image_raw_destroy(i);
+
 #ifdef TIFF_SUPPORT
   if (i->_tiff)
     image_tiff_destroy(i);
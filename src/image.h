@@ -11,11 +11,16 @@
 #define COL_BLUE(col)  ((col >> 8) & 0xFF)
 #define COL_ALPHA(col) (col & 0xFF)
 
+// Used for lossy thumbnails when the spec has no quality
+#define DEFAULT_JPEG_QUALITY 90
+
 MediaScanImage *image_create(void);
 void image_destroy(MediaScanImage *i);
 void image_create_tag(MediaScanImage *i, const char *type);
-int image_read_header(MediaScanImage *i, MediaScanResult *r);
+int image_read_header(MediaScanImage *i, MediaScanResult *r, int header_only);
 int image_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint);
+MediaScanImage *image_get_embedded(MediaScanImage *i);
+int image_is_decodable(MediaScanImage *i);
 void image_alloc_pixbuf(MediaScanImage *i, int width, int height);
 void image_free_pixbuf(MediaScanImage *i);
 void image_unload(MediaScanImage *i);
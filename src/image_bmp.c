@@ -7,20 +7,24 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_bmp.h"
+#include "pixel.h"
 
 typedef struct BMPData {
   int flipped;
   int bpp;
   int compression;
   int palette_colors[256];
+  uint32_t masks[3];            // 16/32-bit color masks and shifts
+  uint32_t shifts[3];
+  uint32_t ncolors[3];
   Buffer *buf;
   FILE *fp;
 } BMPData;
 
 // 16-bit color masks and shifts, default is 5-5-5
-static uint32_t masks[3] = { 0x7c00, 0x3e0, 0x1f };
-static uint32_t shifts[3] = { 10, 5, 0 };
-static uint32_t ncolors[3] = { (1 << 5) - 1, (1 << 5) - 1, (1 << 5) - 1 };
+static const uint32_t default_masks[3] = { 0x7c00, 0x3e0, 0x1f };
+static const uint32_t default_shifts[3] = { 10, 5, 0 };
+static const uint32_t default_ncolors[3] = { (1 << 5) - 1, (1 << 5) - 1, (1 << 5) - 1 };
 
 int image_bmp_read_header(MediaScanImage *i, MediaScanResult *r) {
   int offset, palette_colors;
@@ -31,6 +35,10 @@ int image_bmp_read_header(MediaScanImage *i, MediaScanResult *r) {
   i->_bmp = (void *)bmp;
   LOG_MEM("new BMPData @ %p\n", i->_bmp);
 
+  memcpy(bmp->masks, default_masks, sizeof(bmp->masks));
+  memcpy(bmp->shifts, default_shifts, sizeof(bmp->shifts));
+  memcpy(bmp->ncolors, default_ncolors, sizeof(bmp->ncolors));
+
   buffer_consume(bmp->buf, 10);
 
   offset = buffer_get_int_le(bmp->buf);
@@ -107,43 +115,43 @@ int image_bmp_read_header(MediaScanImage *i, MediaScanResult *r) {
     if (bmp->bpp == 16) {
       // Read 16-bit bitfield masks
       for (x = 0; x < 3; x++) {
-        masks[x] = buffer_get_int_le(bmp->buf);
+        bmp->masks[x] = buffer_get_int_le(bmp->buf);
 
         // Determine shift value
         pos = 0;
-        bit = masks[x] & -masks[x];
+        bit = bmp->masks[x] & -bmp->masks[x];
         while (bit) {
           pos++;
           bit >>= 1;
         }
-        shifts[x] = pos - 1;
+        bmp->shifts[x] = pos - 1;
 
         // green can be 6 bits
         if (x == 1) {
-          if (masks[1] == 0x7e0)
-            ncolors[1] = (1 << 6) - 1;
+          if (bmp->masks[1] == 0x7e0)
+            bmp->ncolors[1] = (1 << 6) - 1;
           else
-            ncolors[1] = (1 << 5) - 1;
+            bmp->ncolors[1] = (1 << 5) - 1;
         }
 
-        LOG_DEBUG("16bpp mask %d: %08x >> %d, ncolors %d\n", x, masks[x], shifts[x], ncolors[x]);
+        LOG_DEBUG("16bpp mask %d: %08x >> %d, ncolors %d\n", x, bmp->masks[x], bmp->shifts[x], bmp->ncolors[x]);
       }
     }
     else {                      // 32-bit bitfields
       // Read 32-bit bitfield masks
       for (x = 0; x < 3; x++) {
-        masks[x] = buffer_get_int_le(bmp->buf);
+        bmp->masks[x] = buffer_get_int_le(bmp->buf);
 
         // Determine shift value
         pos = 0;
-        bit = masks[x] & -masks[x];
+        bit = bmp->masks[x] & -bmp->masks[x];
         while (bit) {
           pos++;
           bit >>= 1;
         }
-        shifts[x] = pos - 1;
+        bmp->shifts[x] = pos - 1;
 
-        LOG_DEBUG("32bpp mask %d: %08x >> %d\n", x, masks[x], shifts[x]);
+        LOG_DEBUG("32bpp mask %d: %08x >> %d\n", x, bmp->masks[x], bmp->shifts[x]);
       }
     }
   }
@@ -153,6 +161,41 @@ int image_bmp_read_header(MediaScanImage *i, MediaScanResult *r) {
   return 1;
 }
 
+// Read dimensions from the info header directly, without reading the palette or masks.
+// Used when no thumbnails are wanted, the image can't be loaded afterwards.
+int image_bmp_probe(MediaScanImage *i, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr;
+  int compression;
+
+  if (!buffer_check_load(buf, r->_fp, 34, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+
+  // OS/2 1.x headers have 16-bit dimensions and no compression
+  if (get_u32le(bptr + 14) == 12) {
+    i->width = get_u16le(bptr + 18);
+    i->height = get_u16le(bptr + 20);
+    compression = 0;
+  }
+  else {
+    i->width = (int32_t)get_u32le(bptr + 18);
+    i->height = abs((int32_t)get_u32le(bptr + 22));
+    compression = get_u32le(bptr + 30);
+  }
+
+  if (compression > 3) {        // JPEG/PNG
+    LOG_WARN("Unsupported BMP compression type: %d (%s)\n", compression, r->path);
+    return 0;
+  }
+
+  // Not used during reading, but lets output PNG be correct
+  i->channels = 4;
+
+  return 1;
+}
+
 int image_bmp_load(MediaScanImage *i) {
   int offset = 0;
   int paddingbits = 0;
@@ -204,6 +247,26 @@ int image_bmp_load(MediaScanImage *i) {
 
   y = starty;
 
+  // 24 and 32-bit rows are converted a whole row at a time
+  if (bmp->bpp == 24 || bmp->bpp == 32) {
+    pixel_row_func convert = bmp->bpp == 24 ? pixel_bgr_to_pix : pixel_bgrx_to_pix;
+
+    while (y != lasty) {
+      if (!buffer_check_load(bmp->buf, bmp->fp, linebytes, linebytes > BUF_SIZE ? linebytes : BUF_SIZE)) {
+        image_bmp_destroy(i);
+        LOG_WARN("Unable to read entire BMP file (%s)\n", i->path);
+        return 0;
+      }
+
+      convert(&i->_pixbuf[y * i->width], buffer_ptr(bmp->buf), i->width);
+      buffer_consume(bmp->buf, linebytes);
+
+      y += incy;
+    }
+
+    goto out;
+  }
+
   if (bmp->bpp == 1)
     mask = 0x80;
   else if (bmp->bpp == 4)
@@ -253,15 +316,15 @@ int image_bmp_load(MediaScanImage *i) {
 
             /*
                LOG_DEBUG("p %x (r %02x g %02x b %02x)\n", p,
-               ((p & masks[0]) >> shifts[0]) * 255 / ncolors[0],
-               ((p & masks[1]) >> shifts[1]) * 255 / ncolors[1],
-               ((p & masks[2]) >> shifts[2]) * 255 / ncolors[2]);
+               ((p & bmp->masks[0]) >> bmp->shifts[0]) * 255 / bmp->ncolors[0],
+               ((p & bmp->masks[1]) >> bmp->shifts[1]) * 255 / bmp->ncolors[1],
+               ((p & bmp->masks[2]) >> bmp->shifts[2]) * 255 / bmp->ncolors[2]);
              */
 
-            i->_pixbuf[j] = COL(((p & masks[0]) >> shifts[0]) * 255 /
-                                ncolors[0],
-                                ((p & masks[1]) >> shifts[1]) * 255 /
-                                ncolors[1], ((p & masks[2]) >> shifts[2]) * 255 / ncolors[2]
+            i->_pixbuf[j] = COL(((p & bmp->masks[0]) >> bmp->shifts[0]) * 255 /
+                                bmp->ncolors[0],
+                                ((p & bmp->masks[1]) >> bmp->shifts[1]) * 255 /
+                                bmp->ncolors[1], ((p & bmp->masks[2]) >> bmp->shifts[2]) * 255 / bmp->ncolors[2]
               );
 
             offset += 2;
@@ -338,6 +401,7 @@ int image_bmp_load(MediaScanImage *i) {
     y += incy;
   }
 
+out:
   // Set channels to 4 so we write a color PNG, unless bpp is 1
   // XXX channels is always 4...
   if (bmp->bpp > 1)
@@ -12,6 +12,7 @@ enum bmp_compression {
 };
 
 int image_bmp_read_header(MediaScanImage *i, MediaScanResult *r);
+int image_bmp_probe(MediaScanImage *i, MediaScanResult *r);
 int image_bmp_load(MediaScanImage *i);
 void image_bmp_destroy(MediaScanImage *i);
 
@@ -9,6 +9,7 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_gif.h"
+#include "pixel.h"
 
 typedef struct GIFData {
   Buffer *buf;
@@ -69,8 +70,30 @@ int image_gif_read_header(MediaScanImage *i, MediaScanResult *r, int is_gif89) {
   return 1;
 }
 
+// Read dimensions from the logical screen descriptor directly, without opening giflib.
+// Used when no thumbnails are wanted, the image can't be loaded afterwards.
+int image_gif_probe(MediaScanImage *i, MediaScanResult *r, int is_gif89) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr;
+
+  if (!buffer_check_load(buf, r->_fp, 10, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+  i->width = get_u16le(bptr + 6);
+  i->height = get_u16le(bptr + 8);
+  r->mime_type = "image/gif";
+
+  // Check for DLNA compatibility
+  if (is_gif89 && i->width <= 1600 && i->height <= 1200) {
+    r->dlna_profile = "GIF_LRG";
+  }
+
+  return 1;
+}
+
 int image_gif_load(MediaScanImage *i) {
-  int x, y, ofs;
+  int x, ofs;
   GifRecordType RecordType;
   GifPixelType *line = NULL;
   GifByteType *ExtData;
@@ -80,6 +103,7 @@ int image_gif_load(MediaScanImage *i) {
   int trans_index = 0;          // transparent index if any
   ColorMapObject *ColorMap;
   GifColorType *ColorMapEntry;
+  uint32_t palette[256];
   int ret = 1;
 
   GIFData *g = (GIFData *)i->_gif;
@@ -117,6 +141,13 @@ int image_gif_load(MediaScanImage *i) {
           goto err;
         }
 
+        // Convert the colormap to pix values once, with the transparent color
+        memset(palette, 0, sizeof(palette));
+        for (x = 0; x < ColorMap->ColorCount && x < 256; x++) {
+          ColorMapEntry = &ColorMap->Colors[x];
+          palette[x] = COL_FULL(ColorMapEntry->Red, ColorMapEntry->Green, ColorMapEntry->Blue, trans_index == x ? 0 : 255);
+        }
+
         // Allocate storage for decompressed image
         if (!i->_pixbuf_size)
           image_alloc_pixbuf(i, i->width, i->height);
@@ -135,12 +166,7 @@ int image_gif_load(MediaScanImage *i) {
                 goto err;
               }
 
-              for (y = 0; y < i->width; y++) {
-                ColorMapEntry = &ColorMap->Colors[line[y]];
-                i->_pixbuf[ofs++] = COL_FULL(ColorMapEntry->Red,
-                                             ColorMapEntry->Green,
-                                             ColorMapEntry->Blue, trans_index == line[y] ? 0 : 255);
-              }
+              pixel_palette_to_pix(&i->_pixbuf[ofs], line, i->width, palette);
             }
           }
         }
@@ -153,11 +179,8 @@ int image_gif_load(MediaScanImage *i) {
               goto err;
             }
 
-            for (y = 0; y < i->width; y++) {
-              ColorMapEntry = &ColorMap->Colors[line[y]];
-              i->_pixbuf[ofs++] = COL_FULL(ColorMapEntry->Red,
-                                           ColorMapEntry->Green, ColorMapEntry->Blue, trans_index == line[y] ? 0 : 255);
-            }
+            pixel_palette_to_pix(&i->_pixbuf[ofs], line, i->width, palette);
+            ofs += i->width;
           }
         }
 
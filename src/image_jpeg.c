@@ -15,13 +15,22 @@
 #include "buffer.h"
 #include "image.h"
 #include "image_jpeg.h"
+#include "thumb.h"
+#include "pixel.h"
 #include "tag.h"
 #include "result.h"
 
 #include "libdlna/dlna_internals.h"
 #include "libdlna/profiles.h"
 
-#define DEFAULT_JPEG_QUALITY 90
+// libjpeg-turbo output colorspace matching the in-memory layout of pix values, alpha is set to 0xFF
+#ifdef JCS_ALPHA_EXTENSIONS
+# if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#  define JCS_PIX JCS_EXT_RGBA
+# else
+#  define JCS_PIX JCS_EXT_ABGR
+# endif
+#endif
 
 // Forward declarations
 static void parse_exif_ifd(ExifContent * content, void *data);
@@ -84,38 +93,47 @@ static const struct {
   NULL, 0, 0}
 };
 
-// Unfortunately we need a global variable in order to display the filename
-// during libjpeg output messages
-#define FILENAME_LEN 1024
-char Filename[FILENAME_LEN + 1];
+// libjpeg error manager with the state needed to recover from an error, each decompressor and
+// compressor has its own so images can be processed in several threads at once
+typedef struct JPEGError {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+  const char *path;             // file being processed, for libjpeg output messages
+} JPEGError;
 
 typedef struct JPEGData {
   struct jpeg_decompress_struct *cinfo;
-  struct jpeg_error_mgr *jpeg_error_pub;
+  JPEGError *jpeg_error;
+  Buffer *embedded;             // copy of the EXIF thumbnail, if wanted
+  Buffer *membuf;               // in-memory source data owned by this image, if not reading from a file
 } JPEGData;
 
-jmp_buf setjmp_buffer;
-
 typedef struct buf_src_mgr {
   struct jpeg_source_mgr jsrc;
   Buffer *buf;
   FILE *fp;
+  JOCTET eoi[4];                // fake EOI marker used when the data runs out
 } buf_src_mgr;
 
 struct buf_dst_mgr {
   struct jpeg_destination_mgr jdst;
   Buffer *dbuf;
-  JOCTET *buf;
-  JOCTET *off;
 };
 
+// Compressor reused for every JPEG thumbnail made from a spec, see ThumbEncoder
+typedef struct JPEGEncoder {
+  struct jpeg_compress_struct cinfo;
+  JPEGError jpeg_error;
+  JSAMPROW *rows;
+  int nrows;
+} JPEGEncoder;
+
 // Source manager to read JPEG from buffer
 static void buf_src_init(j_decompress_ptr cinfo) {
   // Nothing
 }
 
 static boolean buf_src_fill_input_buffer(j_decompress_ptr cinfo) {
-  static JOCTET mybuffer[4];
   buf_src_mgr *src = (buf_src_mgr *)cinfo->src;
 
   // Consume the entire buffer, even if bytes are still in bytes_in_buffer
@@ -133,10 +151,10 @@ eof:
   // Insert a fake EOI marker if we can't read enough data
   LOG_DEBUG("  EOF filling input buffer, returning EOI marker\n");
 
-  mybuffer[0] = (JOCTET)0xFF;
-  mybuffer[1] = (JOCTET)JPEG_EOI;
+  src->eoi[0] = (JOCTET)0xFF;
+  src->eoi[1] = (JOCTET)JPEG_EOI;
 
-  cinfo->src->next_input_byte = mybuffer;
+  cinfo->src->next_input_byte = src->eoi;
   cinfo->src->bytes_in_buffer = 2;
 
 ok:
@@ -169,7 +187,7 @@ static void buf_src_term_source(j_decompress_ptr cinfo) {
   // Nothing
 }
 
-static void image_jpeg_buf_src(MediaScanImage *i, MediaScanResult *r) {
+static void image_jpeg_buf_src(MediaScanImage *i, Buffer *buf, FILE *fp) {
   JPEGData *j = (JPEGData *)i->_jpeg;
   j_decompress_ptr cinfo = (j_decompress_ptr)j->cinfo;
   buf_src_mgr *src;
@@ -181,8 +199,8 @@ static void image_jpeg_buf_src(MediaScanImage *i, MediaScanResult *r) {
 
   src = (buf_src_mgr *)cinfo->src;
 
-  src->buf = (Buffer *)r->_buf;
-  src->fp = r->_fp;
+  src->buf = buf;
+  src->fp = fp;
 
   src->jsrc.init_source = buf_src_init;
   src->jsrc.fill_input_buffer = buf_src_fill_input_buffer;
@@ -195,36 +213,25 @@ static void image_jpeg_buf_src(MediaScanImage *i, MediaScanResult *r) {
   LOG_DEBUG("Init JPEG buffer src, %ld bytes in buffer\n", src->jsrc.bytes_in_buffer);
 }
 
-// Destination manager to copy compressed data to a buffer
+// Destination manager that compresses directly into a Buffer
 static void buf_dst_mgr_init(j_compress_ptr cinfo) {
   struct buf_dst_mgr *dst = (void *)cinfo->dest;
 
-  // Temporary internal buffer
-  dst->buf = (JOCTET *)malloc(BUF_SIZE);
-  LOG_MEM("new JPEG buf @ %p\n", dst->buf);
-
-  // Storage for full compressed data
-  dst->dbuf = (Buffer *)malloc(sizeof(Buffer));
-  LOG_MEM("new JPEG dbuf @ %p\n", dst->dbuf);
-  buffer_init(dst->dbuf, BUF_SIZE);
-
-  dst->off = dst->buf;
-  dst->jdst.next_output_byte = dst->off;
-  dst->jdst.free_in_buffer = BUF_SIZE;
+  // The buffer was pre-sized by thumb_encoder_buffer, hand all of it to libjpeg
+  dst->jdst.free_in_buffer = dst->dbuf->alloc;
+  dst->jdst.next_output_byte = (JOCTET *)buffer_append_space(dst->dbuf, dst->dbuf->alloc);
 }
 
 static boolean buf_dst_mgr_empty(j_compress_ptr cinfo) {
   struct buf_dst_mgr *dst = (void *)cinfo->dest;
 
-  // Copy tmp buffer to image buffer
-  buffer_append(dst->dbuf, dst->buf, BUF_SIZE);
+  // The buffer is full, double its size
+  size_t sz = buffer_len(dst->dbuf);
 
-  // Reuse the tmp buffer for the next chunk
-  dst->off = dst->buf;
-  dst->jdst.next_output_byte = dst->off;
-  dst->jdst.free_in_buffer = BUF_SIZE;
+  dst->jdst.next_output_byte = (JOCTET *)buffer_append_space(dst->dbuf, sz);
+  dst->jdst.free_in_buffer = sz;
 
-  LOG_MEM("buf_dst_mgr_empty, copied %d bytes (total now %d)\n", BUF_SIZE, buffer_len(dst->dbuf));
+  LOG_MEM("buf_dst_mgr_empty, grew JPEG dbuf by %ld bytes (total now %d)\n", sz, buffer_len(dst->dbuf));
 
   return TRUE;
 }
@@ -232,21 +239,15 @@ static boolean buf_dst_mgr_empty(j_compress_ptr cinfo) {
 static void buf_dst_mgr_term(j_compress_ptr cinfo) {
   struct buf_dst_mgr *dst = (void *)cinfo->dest;
 
-  size_t sz = BUF_SIZE - dst->jdst.free_in_buffer;
-
-  if (sz > 0) {
-    // Copy final buffer to image data
-    buffer_append(dst->dbuf, dst->buf, sz);
-  }
+  // Drop the unused space at the end
+  buffer_consume_end(dst->dbuf, dst->jdst.free_in_buffer);
 
-  LOG_MEM("destroy JPEG buf @ %p\n", dst->buf);
-  free(dst->buf);
-
-  LOG_MEM("buf_dst_mgr_term, copied final %ld bytes (total bytes %d)\n", sz, buffer_len(dst->dbuf));
+  LOG_MEM("buf_dst_mgr_term, total bytes %d\n", buffer_len(dst->dbuf));
 }
 
-static void image_jpeg_buf_dest(j_compress_ptr cinfo, struct buf_dst_mgr *dst) {
+static void image_jpeg_buf_dest(j_compress_ptr cinfo, struct buf_dst_mgr *dst, Buffer *dbuf) {
   memset(dst, 0, sizeof(struct buf_dst_mgr));
+  dst->dbuf = dbuf;
   dst->jdst.init_destination = buf_dst_mgr_init;
   dst->jdst.empty_output_buffer = buf_dst_mgr_empty;
   dst->jdst.term_destination = buf_dst_mgr_term;
@@ -255,7 +256,7 @@ static void image_jpeg_buf_dest(j_compress_ptr cinfo, struct buf_dst_mgr *dst) {
 
 static void libjpeg_error_handler(j_common_ptr cinfo) {
   cinfo->err->output_message(cinfo);
-  longjmp(setjmp_buffer, 1);
+  longjmp(((JPEGError *)cinfo->err)->setjmp_buffer, 1);
   return;
 }
 
@@ -265,40 +266,87 @@ static void libjpeg_output_message(j_common_ptr cinfo) {
   /* Create the message */
   (*cinfo->err->format_message) (cinfo, buffer);
 
-  LOG_WARN("libjpeg error: %s (%s)\n", buffer, Filename);
+  LOG_WARN("libjpeg error: %s (%s)\n", buffer, ((JPEGError *)cinfo->err)->path);
 }
 
-int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
-  int ret = 1;
-  int x;
-
+static JPEGData *image_jpeg_data_create(MediaScanImage *i) {
   JPEGData *j = malloc(sizeof(JPEGData));
   i->_jpeg = (void *)j;
   LOG_MEM("new JPEGData @ %p\n", i->_jpeg);
 
   j->cinfo = malloc(sizeof(struct jpeg_decompress_struct));
-  j->jpeg_error_pub = malloc(sizeof(struct jpeg_error_mgr));
+  j->jpeg_error = malloc(sizeof(JPEGError));
   LOG_MEM("new JPEG cinfo @ %p\n", j->cinfo);
-  LOG_MEM("new JPEG error_pub @ %p\n", j->jpeg_error_pub);
+  LOG_MEM("new JPEG error @ %p\n", j->jpeg_error);
 
-  j->cinfo->err = jpeg_std_error(j->jpeg_error_pub);
-  j->jpeg_error_pub->error_exit = libjpeg_error_handler;
-  j->jpeg_error_pub->output_message = libjpeg_output_message;
+  j->cinfo->err = jpeg_std_error(&j->jpeg_error->pub);
+  j->jpeg_error->pub.error_exit = libjpeg_error_handler;
+  j->jpeg_error->pub.output_message = libjpeg_output_message;
+  j->jpeg_error->path = i->path;
 
-  if (setjmp(setjmp_buffer)) {
-    image_jpeg_destroy(i);
-    return 0;
+  j->embedded = NULL;
+  j->membuf = NULL;
+
+  return j;
+}
+
+// Keep a copy of a JPEG-compressed EXIF thumbnail so it can be used by image_jpeg_get_embedded
+static void image_jpeg_save_embedded(JPEGData *j, unsigned char *data, unsigned int size) {
+  if (j->embedded || size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    return;
+
+  j->embedded = (Buffer *)malloc(sizeof(Buffer));
+  LOG_MEM("new JPEG embedded buf @ %p\n", j->embedded);
+  buffer_init(j->embedded, size);
+  buffer_append(j->embedded, data, size);
+
+  LOG_DEBUG("Saved %d byte EXIF thumbnail\n", size);
+}
+
+// Parse an EXIF block, beginning with the "Exif\0\0" header, into a tag on the result.
+// If j is not NULL, the IFD1 thumbnail is also kept when any thumbnail spec may use it.
+static void parse_exif(MediaScanResult *r, JPEGData *j, const unsigned char *data, unsigned int len) {
+  ExifData *exif;
+
+  result_create_tag(r, "Exif");
+
+  LOG_DEBUG("Parsing EXIF tag of size %d\n", len);
+  exif = exif_data_new_from_data(data, len);
+  LOG_MEM("new EXIF data @ %p\n", exif);
+  if (exif != NULL) {
+    exif_data_foreach_content(exif, parse_exif_ifd, (void *)r);
+
+    if (j && exif->data && exif->size && thumb_want_embedded((MediaScan *)r->_scan))
+      image_jpeg_save_embedded(j, exif->data, exif->size);
+
+    LOG_MEM("destroy EXIF data @ %p\n", exif);
+    exif_data_free(exif);
   }
+}
+
+// Parse EXIF data found outside of a JPEG file, such as the TIFF header of a RAW file
+void image_jpeg_parse_exif(MediaScanResult *r, const unsigned char *data, unsigned int len) {
+  parse_exif(r, NULL, data, len);
+}
+
+int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
+  int ret = 1;
+  int x;
+
+  JPEGData *j = image_jpeg_data_create(i);
 
   // Save filename in case any warnings/errors occur
-  strncpy(Filename, r->path, FILENAME_LEN);
-  if (strlen(r->path) > FILENAME_LEN)
-    Filename[FILENAME_LEN] = 0;
+  j->jpeg_error->path = r->path;
+
+  if (setjmp(j->jpeg_error->setjmp_buffer)) {
+    image_jpeg_destroy(i);
+    return 0;
+  }
 
   jpeg_create_decompress(j->cinfo);
 
   // Init custom source manager to read from existing buffer
-  image_jpeg_buf_src(i, r);
+  image_jpeg_buf_src(i, (Buffer *)r->_buf, r->_fp);
 
   // Save APP1 marker for EXIF
   jpeg_save_markers(j->cinfo, 0xE1, 1024 * 64);
@@ -325,19 +373,7 @@ int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
     while (marker != NULL) {
       if (marker->marker == 0xE1
           && marker->data[0] == 'E' && marker->data[1] == 'x' && marker->data[2] == 'i' && marker->data[3] == 'f') {
-        ExifData *exif;
-
-        result_create_tag(r, "Exif");
-
-        LOG_DEBUG("Parsing EXIF tag of size %d\n", marker->data_length);
-        exif = exif_data_new_from_data(marker->data, marker->data_length);
-        LOG_MEM("new EXIF data @ %p\n", exif);
-        if (exif != NULL) {
-          exif_data_foreach_content(exif, parse_exif_ifd, (void *)r);
-          LOG_MEM("destroy EXIF data @ %p\n", exif);
-          exif_data_free(exif);
-        }
-
+        parse_exif(r, j, marker->data, marker->data_length);
         break;
       }
 
@@ -348,14 +384,181 @@ int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r) {
   return ret;
 }
 
+// Read dimensions and EXIF data by walking the JPEG markers directly, without creating any
+// libjpeg state. Used when no thumbnails are wanted, the image can't be loaded afterwards.
+int image_jpeg_probe(MediaScanImage *i, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr;
+  int x, marker, len;
+  int have_exif = 0;
+
+  // Skip SOI
+  buffer_consume(buf, 2);
+
+  while (1) {
+    if (!buffer_check_load(buf, r->_fp, 4, BUF_SIZE))
+      goto err;
+
+    bptr = buffer_ptr(buf);
+    if (bptr[0] != 0xFF)
+      goto err;
+
+    marker = bptr[1];
+
+    // Fill byte before a marker
+    if (marker == 0xFF) {
+      buffer_consume(buf, 1);
+      continue;
+    }
+
+    // Image data or the end of the image before any frame header
+    if (marker == 0xDA || marker == 0xD9)
+      goto err;
+
+    len = get_u16(bptr + 2);
+    if (len < 2)
+      goto err;
+
+    // SOF0-SOF15, except DHT (C4), JPG (C8), and DAC (CC)
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      if (len < 8 || !buffer_check_load(buf, r->_fp, 10, BUF_SIZE))
+        goto err;
+
+      bptr = buffer_ptr(buf);
+      i->height = get_u16(bptr + 5);
+      i->width = get_u16(bptr + 7);
+      i->channels = bptr[9];
+      break;
+    }
+
+    if (marker == 0xE1 && !have_exif) {
+      if (!buffer_check_load(buf, r->_fp, len + 2, len + 2))
+        goto err;
+
+      bptr = buffer_ptr(buf);
+      if (len >= 8 && !memcmp(bptr + 4, "Exif\0\0", 6)) {
+        parse_exif(r, NULL, bptr + 4, len - 2);
+        have_exif = 1;
+      }
+    }
+
+    if (!buffer_skip(buf, r->_fp, len + 2))
+      goto err;
+  }
+
+  r->mime_type = MIME_IMAGE_JPEG;
+
+  // Match with DLNA profile
+  for (x = 0; jpeg_profiles_mapping[x].profile; x++) {
+    if (i->width <= jpeg_profiles_mapping[x].max_width && i->height <= jpeg_profiles_mapping[x].max_height) {
+      r->dlna_profile = jpeg_profiles_mapping[x].profile->id;
+      break;
+    }
+  }
+
+  return 1;
+
+err:
+  LOG_WARN("Unable to find JPEG frame header (%s)\n", r->path);
+  return 0;
+}
+
+// Create a new image for JPEG data embedded in image i, such as an EXIF thumbnail or a RAW
+// preview. Data is read from buf, then from fp at its current position (if not NULL) once buf
+// is exhausted. The new image takes ownership of buf. Only the header of the embedded image is
+// read, call image_load to decode it. The new image shares the orientation of i and must be
+// destroyed by the caller.
+MediaScanImage *image_jpeg_create_embedded(MediaScanImage *i, Buffer *buf, FILE *fp) {
+  JPEGData *pj;
+  MediaScanImage *p;
+
+  p = image_create();
+  p->path = i->path;
+  p->codec = "JPEG";
+  p->orientation = i->orientation;
+
+  pj = image_jpeg_data_create(p);
+  pj->membuf = buf;
+
+  if (setjmp(pj->jpeg_error->setjmp_buffer)) {
+    image_destroy(p);
+    return NULL;
+  }
+
+  jpeg_create_decompress(pj->cinfo);
+
+  image_jpeg_buf_src(p, pj->membuf, fp);
+
+  jpeg_read_header(pj->cinfo, TRUE);
+
+  p->width = pj->cinfo->image_width;
+  p->height = pj->cinfo->image_height;
+  p->channels = pj->cinfo->num_components;
+
+  LOG_DEBUG("Embedded JPEG preview is %d x %d\n", p->width, p->height);
+
+  return p;
+}
+
+// Create a new image from the EXIF thumbnail saved by image_jpeg_read_header
+MediaScanImage *image_jpeg_get_embedded(MediaScanImage *i) {
+  JPEGData *j = (JPEGData *)i->_jpeg;
+  Buffer *buf;
+
+  if (j == NULL || j->embedded == NULL)
+    return NULL;
+
+  // The new image takes ownership of the saved data
+  buf = j->embedded;
+  j->embedded = NULL;
+
+  return image_jpeg_create_embedded(i, buf, NULL);
+}
+
+// Determine the smallest libjpeg output size that is still at least as large as the
+// thumbnail described by spec_hint. libjpeg 7+ and libjpeg-turbo can scale by any M/8
+// in the IDCT, older versions only support 1/1, 1/2, 1/4, and 1/8.
+static void image_jpeg_set_scale(MediaScanImage *i, j_decompress_ptr cinfo, MediaScanThumbSpec *spec_hint) {
+  int m, tw, th;
+  int iw = cinfo->image_width;
+  int ih = cinfo->image_height;
+
+  thumb_get_source_size(i, spec_hint, &tw, &th);
+
+  if (!tw && !th) {
+    jpeg_calc_output_dimensions(cinfo);
+    return;
+  }
+
+#if JPEG_LIB_VERSION >= 70 || defined(LIBJPEG_TURBO_VERSION)
+  for (m = 1; m < 8; m++) {
+    // Same rounding as jpeg_calc_output_dimensions: jdiv_round_up(image_size * M, 8)
+    if ((iw * m + 7) / 8 >= tw && (ih * m + 7) / 8 >= th)
+      break;
+  }
+
+  cinfo->scale_num = m;
+  cinfo->scale_denom = 8;
+#else
+  for (m = 8; m > 1; m >>= 1) {
+    if ((iw + m - 1) / m >= tw && (ih + m - 1) / m >= th)
+      break;
+  }
+
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = m;
+#endif
+
+  jpeg_calc_output_dimensions(cinfo);
+}
+
 int image_jpeg_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint) {
-  float scale_factor;
-  int x, w, h, ofs;
+  int w, h;
   unsigned char *line[1], *ptr = NULL;
 
   JPEGData *j = (JPEGData *)i->_jpeg;
 
-  if (setjmp(setjmp_buffer)) {
+  if (setjmp(j->jpeg_error->setjmp_buffer)) {
     // See if we have partially decoded an image and hit a fatal error, but still have a usable image
     if (ptr != NULL) {
       LOG_MEM("destroy JPEG load ptr @ %p\n", ptr);
@@ -385,18 +588,19 @@ int image_jpeg_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint) {
 
   // XXX If reusing the object a second time, we need to read the header again
 
+  // Disabling fancy upsampling before calculating the output size also lets libjpeg
+  // produce chroma at full size through a larger IDCT instead of a separate upsampling pass
   j->cinfo->do_fancy_upsampling = FALSE;
   j->cinfo->do_block_smoothing = FALSE;
 
+#ifdef JCS_PIX
+  // Decode straight into the pixbuf, libjpeg-turbo can't convert from CMYK
+  if (j->cinfo->jpeg_color_space != JCS_CMYK && j->cinfo->jpeg_color_space != JCS_YCCK)
+    j->cinfo->out_color_space = JCS_PIX;
+#endif
+
   // Choose optimal scaling factor
-  jpeg_calc_output_dimensions(j->cinfo);
-  scale_factor = (float)j->cinfo->output_width / spec_hint->width;
-  if (scale_factor > ((float)j->cinfo->output_height / spec_hint->height))
-    scale_factor = (float)j->cinfo->output_height / spec_hint->height;
-  if (scale_factor > 1) {       // Avoid divide by 0
-    j->cinfo->scale_denom *= (unsigned int)scale_factor;
-    jpeg_calc_output_dimensions(j->cinfo);
-  }
+  image_jpeg_set_scale(i, j->cinfo, spec_hint);
 
   w = j->cinfo->output_width;
   h = j->cinfo->output_height;
@@ -408,78 +612,82 @@ int image_jpeg_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint) {
   LOG_DEBUG("Using JPEG scale factor %d/%d, new source dimensions %d x %d\n",
             j->cinfo->scale_num, j->cinfo->scale_denom, w, h);
 
-  // Save filename in case any warnings/errors occur
-  strncpy(Filename, i->path, FILENAME_LEN);
-  if (strlen(i->path) > FILENAME_LEN)
-    Filename[FILENAME_LEN] = 0;
-
-  // Note: I tested libjpeg-turbo's JCS_EXT_XBGR but it writes zeros
-  // instead of FF for alpha, doesn't support CMYK, etc
-
   jpeg_start_decompress(j->cinfo);
 
   // Allocate storage for decompressed image
   image_alloc_pixbuf(i, w, h);
 
-  ofs = 0;
-
-  ptr = (unsigned char *)malloc(w * j->cinfo->output_components);
-  line[0] = ptr;
-  LOG_MEM("new JPEG load ptr @ %p\n", ptr);
-
-  if (j->cinfo->output_components == 3) { // RGB
+#ifdef JCS_PIX
+  if (j->cinfo->out_color_space == JCS_PIX) {
     while (j->cinfo->output_scanline < j->cinfo->output_height) {
+      line[0] = (unsigned char *)&i->_pixbuf[j->cinfo->output_scanline * w];
       jpeg_read_scanlines(j->cinfo, line, 1);
-      for (x = 0; x < w; x++) {
-        i->_pixbuf[ofs++] = COL(ptr[x + x + x], ptr[x + x + x + 1], ptr[x + x + x + 2]);
-      }
     }
   }
-  else if (j->cinfo->output_components == 4) {  // CMYK inverted (Photoshop)
-    while (j->cinfo->output_scanline < j->cinfo->output_height) {
-      JSAMPROW row = *line;
-      jpeg_read_scanlines(j->cinfo, line, 1);
-      for (x = 0; x < w; x++) {
-        int c = *row++;
-        int m = *row++;
-        int y = *row++;
-        int k = *row++;
+  else
+#endif
+  {
+    pixel_row_func convert;
+
+    if (j->cinfo->output_components == 3) // RGB
+      convert = pixel_rgb_to_pix;
+    else if (j->cinfo->output_components == 4)  // CMYK inverted (Photoshop)
+      convert = pixel_cmyk_to_pix;
+    else                        // grayscale
+      convert = pixel_gray_to_pix;
+
+    ptr = (unsigned char *)malloc(w * j->cinfo->output_components);
+    line[0] = ptr;
+    LOG_MEM("new JPEG load ptr @ %p\n", ptr);
 
-        i->_pixbuf[ofs++] = COL((c * k) / MAXJSAMPLE, (m * k) / MAXJSAMPLE, (y * k) / MAXJSAMPLE);
-      }
-    }
-  }
-  else {                        // grayscale
     while (j->cinfo->output_scanline < j->cinfo->output_height) {
+      uint32_t *dst = &i->_pixbuf[j->cinfo->output_scanline * w];
       jpeg_read_scanlines(j->cinfo, line, 1);
-      for (x = 0; x < w; x++) {
-        i->_pixbuf[ofs++] = COL(ptr[x], ptr[x], ptr[x]);
-      }
+      convert(dst, ptr, w);
     }
-  }
 
-  LOG_MEM("destroy JPEG load ptr @ %p\n", ptr);
-  free(ptr);
+    LOG_MEM("destroy JPEG load ptr @ %p\n", ptr);
+    free(ptr);
+  }
 
   jpeg_finish_decompress(j->cinfo);
 
   return 1;
 }
 
+static JPEGEncoder *image_jpeg_encoder(MediaScanThumbSpec *spec) {
+  ThumbEncoder *enc = (ThumbEncoder *)spec->_encoder;
+  JPEGEncoder *je = (JPEGEncoder *)enc->jpeg;
+
+  if (!je) {
+    je = (JPEGEncoder *)calloc(sizeof(JPEGEncoder), 1);
+    LOG_MEM("new JPEGEncoder @ %p\n", je);
+
+    je->cinfo.err = jpeg_std_error(&je->jpeg_error.pub);
+    je->jpeg_error.pub.error_exit = libjpeg_error_handler;
+    je->jpeg_error.pub.output_message = libjpeg_output_message;
+    jpeg_create_compress(&je->cinfo);
+
+    enc->jpeg = (void *)je;
+  }
+
+  return je;
+}
+
 // Compress the data from i->_pixbuf to i->data.
 // Uses libjpeg-turbo if available (JCS_EXTENSIONS) for better performance
+// The compressor is kept on the spec and reused, it is only reset between images
 int image_jpeg_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  JPEGEncoder *je;
+  struct jpeg_compress_struct *cinfo;
   struct buf_dst_mgr dst;
+  Buffer *dbuf;
   int quality = spec->jpeg_quality;
   int x;
-#ifdef JCS_EXTENSIONS
-  JSAMPROW *data = NULL;
-#else
-  volatile unsigned char *data = NULL;  // volatile = won't be rolled back if longjmp is called
+#ifndef JCS_EXTENSIONS
+  unsigned char *data;
   JSAMPROW row_pointer[1];
-  int y, row_stride;
+  int y;
 #endif
 
   if (!i->_pixbuf_size) {
@@ -491,76 +699,95 @@ int image_jpeg_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
   if (!quality)
     quality = DEFAULT_JPEG_QUALITY;
 
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
-  image_jpeg_buf_dest(&cinfo, &dst);
+  je = image_jpeg_encoder(spec);
+  cinfo = &je->cinfo;
 
-  cinfo.image_width = i->width;
-  cinfo.image_height = i->height;
-  cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB; // output is always RGB even if source was grayscale
+  dbuf = thumb_encoder_buffer(spec);
+  image_jpeg_buf_dest(cinfo, &dst, dbuf);
 
-  if (setjmp(setjmp_buffer)) {
-    if (data != NULL) {
-      LOG_MEM("destroy JPEG data row @ %p\n", data);
-      free((void *)data);
-    }
+  cinfo->image_width = i->width;
+  cinfo->image_height = i->height;
+  cinfo->input_components = 3;
+  cinfo->in_color_space = JCS_RGB;      // output is always RGB even if source was grayscale
+
+  // Save filename in case any warnings/errors occur
+  je->jpeg_error.path = i->path;
+
+  if (setjmp(je->jpeg_error.setjmp_buffer)) {
+    // Leave the compressor ready for the next image
+    jpeg_abort_compress(cinfo);
+    buffer_free(dbuf);
+    free(dbuf);
     return 0;
   }
 
 #ifdef JCS_EXTENSIONS
   // Use libjpeg-turbo support for direct reading from source buffer
-  cinfo.input_components = 4;
-  cinfo.in_color_space = JCS_EXT_XBGR;
+  cinfo->input_components = 4;
+  cinfo->in_color_space = JCS_EXT_XBGR;
 #endif
 
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_quality(&cinfo, quality, TRUE);
-  jpeg_start_compress(&cinfo, TRUE);
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, quality, TRUE);
+
+  if (spec->flags & THUMB_FAST_ENCODE)
+    cinfo->dct_method = JDCT_FASTEST;
+
+  jpeg_start_compress(cinfo, TRUE);
 
 #ifdef JCS_EXTENSIONS
-  data = (JSAMPROW *)malloc(i->height * sizeof(JSAMPROW));
-  LOG_MEM("new JPEG data row @ %p\n", data);
+  if (je->nrows < i->height) {
+    je->rows = (JSAMPROW *)realloc(je->rows, i->height * sizeof(JSAMPROW));
+    je->nrows = i->height;
+    LOG_MEM("new JPEG data rows @ %p\n", je->rows);
+  }
 
   for (x = 0; x < i->height; x++)
-    data[x] = (JSAMPROW)&i->_pixbuf[x * i->width];
+    je->rows[x] = (JSAMPROW)&i->_pixbuf[x * i->width];
 
-  while (cinfo.next_scanline < cinfo.image_height) {
-    jpeg_write_scanlines(&cinfo, &data[cinfo.next_scanline], cinfo.image_height - cinfo.next_scanline);
+  while (cinfo->next_scanline < cinfo->image_height) {
+    jpeg_write_scanlines(cinfo, &je->rows[cinfo->next_scanline], cinfo->image_height - cinfo->next_scanline);
   }
 
 #else
   // Normal libjpeg
-  row_stride = cinfo.image_width * 3;
-  data = (unsigned char *)malloc(row_stride);
-  LOG_MEM("new JPEG data row @ %p\n", data);
+  data = thumb_encoder_row(spec, cinfo->image_width * 3);
 
   y = 0;
-  while (cinfo.next_scanline < cinfo.image_height) {
-    for (x = 0; x < cinfo.image_width; x++) {
+  while (cinfo->next_scanline < cinfo->image_height) {
+    for (x = 0; x < cinfo->image_width; x++) {
       data[x + x + x] = COL_RED(i->_pixbuf[y]);
       data[x + x + x + 1] = COL_GREEN(i->_pixbuf[y]);
       data[x + x + x + 2] = COL_BLUE(i->_pixbuf[y]);
       y++;
     }
-    row_pointer[0] = (unsigned char *)data;
-    jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    row_pointer[0] = data;
+    jpeg_write_scanlines(cinfo, row_pointer, 1);
   }
 #endif
 
-  jpeg_finish_compress(&cinfo);
-
-  LOG_MEM("destroy JPEG data row @ %p\n", data);
-  free((void *)data);
-
-  jpeg_destroy_compress(&cinfo);
+  jpeg_finish_compress(cinfo);
 
   // Attach compressed buffer to image
-  i->_dbuf = (void *)dst.dbuf;
+  i->_dbuf = (void *)dbuf;
 
   return 1;
 }
 
+void image_jpeg_encoder_destroy(void *enc) {
+  JPEGEncoder *je = (JPEGEncoder *)enc;
+
+  jpeg_destroy_compress(&je->cinfo);
+
+  if (je->rows) {
+    LOG_MEM("destroy JPEG data rows @ %p\n", je->rows);
+    free(je->rows);
+  }
+
+  LOG_MEM("destroy JPEGEncoder @ %p\n", je);
+  free(je);
+}
+
 void image_jpeg_destroy(MediaScanImage *i) {
   if (i->_jpeg) {
     JPEGData *j = (JPEGData *)i->_jpeg;
@@ -568,8 +795,20 @@ void image_jpeg_destroy(MediaScanImage *i) {
     jpeg_destroy_decompress(j->cinfo);
     LOG_MEM("destroy JPEG cinfo @ %p\n", j->cinfo);
     free(j->cinfo);
-    LOG_MEM("destroy JPEG error_pub @ %p\n", j->jpeg_error_pub);
-    free(j->jpeg_error_pub);
+    LOG_MEM("destroy JPEG error @ %p\n", j->jpeg_error);
+    free(j->jpeg_error);
+
+    if (j->embedded) {
+      buffer_free(j->embedded);
+      LOG_MEM("destroy JPEG embedded buf @ %p\n", j->embedded);
+      free(j->embedded);
+    }
+
+    if (j->membuf) {
+      buffer_free(j->membuf);
+      LOG_MEM("destroy JPEG membuf @ %p\n", j->membuf);
+      free(j->membuf);
+    }
 
     LOG_MEM("destroy JPEGData @ %p\n", i->_jpeg);
     free(i->_jpeg);
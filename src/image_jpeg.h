@@ -2,8 +2,13 @@
 #define _IMAGE_JPEG_H
 
 int image_jpeg_read_header(MediaScanImage *i, MediaScanResult *r);
+int image_jpeg_probe(MediaScanImage *i, MediaScanResult *r);
+void image_jpeg_parse_exif(MediaScanResult *r, const unsigned char *data, unsigned int len);
+MediaScanImage *image_jpeg_create_embedded(MediaScanImage *i, Buffer *buf, FILE *fp);
+MediaScanImage *image_jpeg_get_embedded(MediaScanImage *i);
 int image_jpeg_load(MediaScanImage *i, MediaScanThumbSpec *spec_hint);
 int image_jpeg_compress(MediaScanImage *i, MediaScanThumbSpec *spec);
+void image_jpeg_encoder_destroy(void *enc);
 void image_jpeg_destroy(MediaScanImage *i);
 
 #endif // _IMAGE_JPEG_H
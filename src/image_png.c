@@ -1,12 +1,16 @@
 #include <libmediascan.h>
 
 #include <png.h>
+#include <zlib.h>
+#include <string.h>
 #include <setjmp.h>
 
 #include "common.h"
 #include "buffer.h"
 #include "image.h"
 #include "image_png.h"
+#include "thumb.h"
+#include "pixel.h"
 
 #include "libdlna/dlna_internals.h"
 #include "libdlna/profiles.h"
@@ -134,6 +138,64 @@ int image_png_read_header(MediaScanImage *i, MediaScanResult *r) {
   return 1;
 }
 
+// Read dimensions from the IHDR chunk directly, without creating any libpng state.
+// Used when no thumbnails are wanted, the image can't be loaded afterwards.
+int image_png_probe(MediaScanImage *i, MediaScanResult *r) {
+  Buffer *buf = (Buffer *)r->_buf;
+  unsigned char *bptr;
+  int x;
+
+  // Signature, chunk length and type, then the 13 bytes of IHDR
+  if (!buffer_check_load(buf, r->_fp, 29, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+  if (memcmp(bptr + 12, "IHDR", 4)) {
+    LOG_WARN("PNG file does not start with IHDR (%s)\n", r->path);
+    return 0;
+  }
+
+  i->width = get_u32(bptr + 16);
+  i->height = get_u32(bptr + 20);
+  if (!i->width || !i->height) {
+    LOG_WARN("Invalid PNG dimensions (%s)\n", r->path);
+    return 0;
+  }
+
+  i->has_alpha = 1;
+  r->mime_type = MIME_IMAGE_PNG;
+
+  // Channels for each color type: gray, -, RGB, palette, gray+alpha, -, RGBA
+  switch (bptr[25]) {
+    case 0:
+    case 3:
+      i->channels = 1;
+      break;
+    case 4:
+      i->channels = 2;
+      break;
+    case 2:
+      i->channels = 3;
+      break;
+    default:
+      i->channels = 4;
+      break;
+  }
+
+  // Match with DLNA profile
+  // DLNA does not support interlaced images
+  if (bptr[28] == 0) {
+    for (x = 0; png_profiles_mapping[x].profile; x++) {
+      if (i->width <= png_profiles_mapping[x].max_width && i->height <= png_profiles_mapping[x].max_height) {
+        r->dlna_profile = png_profiles_mapping[x].profile->id;
+        break;
+      }
+    }
+  }
+
+  return 1;
+}
+
 static void
 image_png_interlace_pass_gray(MediaScanImage *i, unsigned char *ptr,
                               int start_y, int stride_y, int start_x, int stride_x) {
@@ -172,7 +234,7 @@ image_png_interlace_pass(MediaScanImage *i, unsigned char *ptr, int start_y, int
 }
 
 int image_png_load(MediaScanImage *i) {
-  int bit_depth, color_type, num_passes, x, y;
+  int bit_depth, color_type, num_passes, y;
   int ofs;
   volatile unsigned char *ptr = NULL; // volatile = won't be rolled back if longjmp is called
   PNGData *p = (PNGData *)i->_png;
@@ -225,9 +287,8 @@ int image_png_load(MediaScanImage *i) {
     if (num_passes == 1) {      // Non-interlaced
       for (y = 0; y < i->height; y++) {
         png_read_row(p->png_ptr, (unsigned char *)ptr, NULL);
-        for (x = 0; x < i->width; x++) {
-          i->_pixbuf[ofs++] = COL_FULL(ptr[x * 2], ptr[x * 2], ptr[x * 2], ptr[x * 2 + 1]);
-        }
+        pixel_graya_to_pix(&i->_pixbuf[ofs], (unsigned char *)ptr, i->width);
+        ofs += i->width;
       }
     }
     else if (num_passes == 7) { // Interlaced
@@ -244,9 +305,8 @@ int image_png_load(MediaScanImage *i) {
     if (num_passes == 1) {      // Non-interlaced
       for (y = 0; y < i->height; y++) {
         png_read_row(p->png_ptr, (unsigned char *)ptr, NULL);
-        for (x = 0; x < i->width; x++) {
-          i->_pixbuf[ofs++] = COL_FULL(ptr[x * 4], ptr[x * 4 + 1], ptr[x * 4 + 2], ptr[x * 4 + 3]);
-        }
+        pixel_rgba_to_pix(&i->_pixbuf[ofs], (unsigned char *)ptr, i->width);
+        ofs += i->width;
       }
     }
     else if (num_passes == 7) { // Interlaced
@@ -305,10 +365,48 @@ static void image_png_flush_buf(png_structp png_ptr) {
   // Nothing
 }
 
+// Apply the spec's compression options, or the fast preset if asked for and nothing was set
+static void image_png_set_compression(png_structp png_ptr, MediaScanThumbSpec *spec) {
+  int level = spec->png_level;
+  int filters = spec->png_filters;
+  int strategy = spec->png_strategy;
+
+  if ((spec->flags & THUMB_FAST_ENCODE) && level == -1 && !filters && !strategy) {
+    if (spec->width_padding || spec->height_padding) {
+      // Mostly flat padding, Sub turns each padding row into zeros that RLE stores almost for free
+      filters = THUMB_PNG_FILTER_SUB;
+      strategy = THUMB_PNG_STRATEGY_RLE;
+    }
+    else {
+      level = 1;
+    }
+  }
+
+  if (level != -1)
+    png_set_compression_level(png_ptr, level);
+
+  // The THUMB_PNG_FILTER_* values are libpng's PNG_FILTER_* bits shifted down by 3
+  if (filters)
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters << 3);
+
+  switch (strategy) {
+    case THUMB_PNG_STRATEGY_FILTERED:
+      png_set_compression_strategy(png_ptr, Z_FILTERED);
+      break;
+    case THUMB_PNG_STRATEGY_HUFFMAN:
+      png_set_compression_strategy(png_ptr, Z_HUFFMAN_ONLY);
+      break;
+    case THUMB_PNG_STRATEGY_RLE:
+      png_set_compression_strategy(png_ptr, Z_RLE);
+      break;
+  }
+}
+
+// libpng can't reset a write struct, so only the output buffer and row are reused between thumbnails
 int image_png_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
   int j, x, y;
   int color_space = PNG_COLOR_TYPE_RGB_ALPHA;
-  volatile unsigned char *ptr = NULL;
+  unsigned char *ptr;
   png_structp png_ptr;
   png_infop info_ptr;
   Buffer *buf;
@@ -330,15 +428,13 @@ int image_png_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
   }
 
   // Initialize buffer for compressed data
-  buf = (Buffer *)malloc(sizeof(Buffer));
-  buffer_init(buf, BUF_SIZE);
+  buf = thumb_encoder_buffer(spec);
   i->_dbuf = (void *)buf;
 
   png_set_write_fn(png_ptr, buf, image_png_write_buf, image_png_flush_buf);
 
   if (setjmp(png_jmpbuf(png_ptr))) {
-    if (ptr != NULL)
-      free((void *)ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
     return 0;
   }
 
@@ -359,9 +455,11 @@ int image_png_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
   png_set_IHDR(png_ptr, info_ptr, spec->width, spec->height, 8, color_space,
                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
+  image_png_set_compression(png_ptr, spec);
+
   png_write_info(png_ptr, info_ptr);
 
-  ptr = (unsigned char *)malloc(png_get_rowbytes(png_ptr, info_ptr));
+  ptr = thumb_encoder_row(spec, png_get_rowbytes(png_ptr, info_ptr));
 
   j = 0;
 
@@ -388,8 +486,6 @@ int image_png_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
     }
   }
 
-  free((void *)ptr);
-
   png_write_end(png_ptr, info_ptr);
 
   png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -0,0 +1,338 @@
+
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "image.h"
+#include "image_jpeg.h"
+#include "image_raw.h"
+#include "util.h"
+
+// Camera RAW formats (CR2, NEF, ARW, DNG) are all TIFF-based. Only the IFD structure is parsed,
+// to find dimensions, orientation, EXIF tags and the largest embedded JPEG preview. Thumbnails
+// are created from the preview by the JPEG loader, the sensor data itself is never decoded.
+
+// Limits to protect against corrupt or malicious files
+#define RAW_MAX_IFDS        32
+#define RAW_MAX_DEPTH       4
+#define RAW_MAX_ENTRIES     1024
+#define RAW_MAX_SUBIFDS     8
+
+// Amount of the file handed to the EXIF parser. In a JPEG the EXIF block is an APP1 segment,
+// whose 16-bit length limits it to 64K, so that is all the parser expects to see.
+#define RAW_EXIF_SIZE       (65536 - 8)
+
+// TIFF tags
+#define TAG_NEW_SUBFILE_TYPE      0x00FE
+#define TAG_IMAGE_WIDTH           0x0100
+#define TAG_IMAGE_LENGTH          0x0101
+#define TAG_COMPRESSION           0x0103
+#define TAG_PHOTOMETRIC           0x0106
+#define TAG_STRIP_OFFSETS         0x0111
+#define TAG_ORIENTATION           0x0112
+#define TAG_STRIP_BYTE_COUNTS     0x0117
+#define TAG_SUB_IFDS              0x014A
+#define TAG_JPEG_IF_OFFSET        0x0201
+#define TAG_JPEG_IF_BYTE_COUNT    0x0202
+#define TAG_EXIF_IFD              0x8769
+#define TAG_PIXEL_X_DIMENSION     0xA002
+#define TAG_PIXEL_Y_DIMENSION     0xA003
+#define TAG_CR2_SLICE             0xC640
+
+// Compression types that may hold a JPEG preview
+#define COMPRESSION_OJPEG         6
+#define COMPRESSION_JPEG          7
+
+// Photometric types for raw sensor data, which may use lossless JPEG that libjpeg can't decode
+#define PHOTOMETRIC_CFA           32803
+#define PHOTOMETRIC_LINEAR_RAW    34892
+
+typedef struct RAWData {
+  FILE *fp;
+  int big_endian;
+  int nifds;
+  uint64_t file_size;
+  uint32_t preview_offset;
+  uint32_t preview_length;
+} RAWData;
+
+typedef struct RAWIFD {
+  uint32_t subfile_type;
+  uint32_t width;
+  uint32_t height;
+  uint32_t compression;
+  uint32_t photometric;
+  uint32_t strip_offset;
+  uint32_t strip_length;
+  uint32_t jpeg_offset;
+  uint32_t jpeg_length;
+  uint32_t exif_ifd;
+  uint32_t sub_ifds[RAW_MAX_SUBIFDS];
+  int nsub_ifds;
+  int is_slice;
+} RAWIFD;
+
+static void parse_ifd(MediaScanImage *i, RAWData *raw, uint32_t offset, int depth);
+
+int image_raw_is_tiff(const unsigned char *bptr) {
+  return (bptr[0] == 'I' && bptr[1] == 'I' && bptr[2] == 42 && bptr[3] == 0)
+         || (bptr[0] == 'M' && bptr[1] == 'M' && bptr[2] == 0 && bptr[3] == 42);
+}
+
+static inline uint32_t raw_u16(RAWData *raw, const unsigned char *p) {
+  return raw->big_endian ? get_u16(p) : get_u16le(p);
+}
+
+static inline uint32_t raw_u32(RAWData *raw, const unsigned char *p) {
+  return raw->big_endian ? get_u32(p) : get_u32le(p);
+}
+
+static int raw_read(RAWData *raw, uint32_t offset, void *buf, uint32_t len) {
+  if ((uint64_t)offset + len > raw->file_size)
+    return 0;
+
+  if (SeekFile(raw->fp, (int64_t)offset, SEEK_SET) != 0)
+    return 0;
+
+  return fread(buf, 1, len, raw->fp) == len;
+}
+
+// Offer a JPEG stream as the preview, the largest valid one wins
+static void add_preview(RAWData *raw, uint32_t offset, uint32_t length) {
+  unsigned char soi[3];
+
+  if (length <= raw->preview_length)
+    return;
+
+  if (!raw_read(raw, offset, soi, 3) || soi[0] != 0xFF || soi[1] != 0xD8 || soi[2] != 0xFF)
+    return;
+
+  LOG_DEBUG("RAW JPEG preview candidate @ %d, %d bytes\n", offset, length);
+
+  raw->preview_offset = offset;
+  raw->preview_length = length;
+}
+
+// Read the value of a SHORT or LONG entry. Single values are stored inline in the entry.
+static uint32_t entry_value(RAWData *raw, const unsigned char *entry) {
+  return raw_u16(raw, entry + 2) == 3 ? raw_u16(raw, entry + 8) : raw_u32(raw, entry + 8);
+}
+
+static void parse_entry(MediaScanImage *i, RAWData *raw, RAWIFD *ifd, const unsigned char *entry, int depth) {
+  uint32_t tag = raw_u16(raw, entry);
+  uint32_t count = raw_u32(raw, entry + 4);
+
+  switch (tag) {
+    case TAG_NEW_SUBFILE_TYPE:
+      ifd->subfile_type = entry_value(raw, entry);
+      break;
+    case TAG_IMAGE_WIDTH:
+    case TAG_PIXEL_X_DIMENSION:
+      ifd->width = entry_value(raw, entry);
+      break;
+    case TAG_IMAGE_LENGTH:
+    case TAG_PIXEL_Y_DIMENSION:
+      ifd->height = entry_value(raw, entry);
+      break;
+    case TAG_COMPRESSION:
+      ifd->compression = entry_value(raw, entry);
+      break;
+    case TAG_PHOTOMETRIC:
+      ifd->photometric = entry_value(raw, entry);
+      break;
+    case TAG_STRIP_OFFSETS:
+      // A preview is always stored as a single strip
+      if (count == 1)
+        ifd->strip_offset = entry_value(raw, entry);
+      break;
+    case TAG_STRIP_BYTE_COUNTS:
+      if (count == 1)
+        ifd->strip_length = entry_value(raw, entry);
+      break;
+    case TAG_ORIENTATION:
+      // Only IFD0 describes the main image
+      if (depth == 0 && raw->nifds == 1) {
+        uint32_t o = entry_value(raw, entry);
+        if (o >= ORIENTATION_NORMAL && o <= ORIENTATION_270_CCW)
+          i->orientation = o;
+      }
+      break;
+    case TAG_SUB_IFDS:
+      if (ifd->nsub_ifds) {
+        break;
+      }
+      else if (count == 1) {
+        ifd->sub_ifds[ifd->nsub_ifds++] = raw_u32(raw, entry + 8);
+      }
+      else if (count > 1) {
+        unsigned char offsets[RAW_MAX_SUBIFDS * 4];
+        uint32_t x;
+
+        if (count > RAW_MAX_SUBIFDS)
+          count = RAW_MAX_SUBIFDS;
+
+        if (raw_read(raw, raw_u32(raw, entry + 8), offsets, count * 4)) {
+          for (x = 0; x < count; x++)
+            ifd->sub_ifds[ifd->nsub_ifds++] = raw_u32(raw, offsets + x * 4);
+        }
+      }
+      break;
+    case TAG_JPEG_IF_OFFSET:
+      ifd->jpeg_offset = entry_value(raw, entry);
+      break;
+    case TAG_JPEG_IF_BYTE_COUNT:
+      ifd->jpeg_length = entry_value(raw, entry);
+      break;
+    case TAG_EXIF_IFD:
+      ifd->exif_ifd = entry_value(raw, entry);
+      break;
+    case TAG_CR2_SLICE:
+      ifd->is_slice = 1;
+      break;
+  }
+}
+
+static void parse_ifd(MediaScanImage *i, RAWData *raw, uint32_t offset, int depth) {
+  unsigned char count_buf[4];
+  unsigned char *entries;
+  uint32_t count, next, x;
+  RAWIFD ifd;
+
+  while (offset) {
+    if (depth > RAW_MAX_DEPTH || raw->nifds >= RAW_MAX_IFDS)
+      return;
+
+    raw->nifds++;
+
+    if (!raw_read(raw, offset, count_buf, 2))
+      return;
+
+    count = raw_u16(raw, count_buf);
+    if (!count || count > RAW_MAX_ENTRIES)
+      return;
+
+    entries = (unsigned char *)malloc(count * 12);
+    LOG_MEM("new RAW IFD entries @ %p\n", entries);
+
+    if (!raw_read(raw, offset + 2, entries, count * 12)) {
+      LOG_MEM("destroy RAW IFD entries @ %p\n", entries);
+      free(entries);
+      return;
+    }
+
+    memset(&ifd, 0, sizeof(RAWIFD));
+    for (x = 0; x < count; x++)
+      parse_entry(i, raw, &ifd, entries + x * 12, depth);
+
+    LOG_MEM("destroy RAW IFD entries @ %p\n", entries);
+    free(entries);
+
+    // Offset of the next IFD follows the entries
+    next = 0;
+    if (raw_read(raw, offset + 2 + count * 12, count_buf, 4))
+      next = raw_u32(raw, count_buf);
+
+    LOG_DEBUG("RAW IFD @ %d: type %d, %d x %d, compression %d, photometric %d\n",
+              offset, ifd.subfile_type, ifd.width, ifd.height, ifd.compression, ifd.photometric);
+
+    // JPEGInterchangeFormat (NEF, ARW, DNG) or a JPEG-compressed strip (CR2, DNG)
+    if (ifd.jpeg_offset && ifd.jpeg_length)
+      add_preview(raw, ifd.jpeg_offset, ifd.jpeg_length);
+
+    if ((ifd.compression == COMPRESSION_OJPEG || ifd.compression == COMPRESSION_JPEG)
+        && ifd.strip_offset && ifd.strip_length && !ifd.is_slice
+        && ifd.photometric != PHOTOMETRIC_CFA && ifd.photometric != PHOTOMETRIC_LINEAR_RAW)
+      add_preview(raw, ifd.strip_offset, ifd.strip_length);
+
+    // The full-resolution image is the largest one not flagged as a reduced-resolution copy
+    if (!(ifd.subfile_type & 1) && (uint64_t)ifd.width * ifd.height > (uint64_t)i->width * i->height) {
+      i->width = ifd.width;
+      i->height = ifd.height;
+    }
+
+    for (x = 0; x < (uint32_t)ifd.nsub_ifds; x++)
+      parse_ifd(i, raw, ifd.sub_ifds[x], depth + 1);
+
+    if (ifd.exif_ifd)
+      parse_ifd(i, raw, ifd.exif_ifd, depth + 1);
+
+    // Only the main IFD chain is followed
+    if (depth > 0)
+      return;
+
+    offset = next;
+  }
+}
+
+int image_raw_read_header(MediaScanImage *i, MediaScanResult *r) {
+  unsigned char *bptr = buffer_ptr((Buffer *)r->_buf);
+  unsigned char *exif;
+  uint32_t exif_len;
+  int64_t size;
+  RAWData *raw = (RAWData *)calloc(sizeof(RAWData), 1);
+
+  raw->fp = r->_fp;
+  raw->big_endian = bptr[0] == 'M';
+  i->_raw = (void *)raw;
+  LOG_MEM("new RAWData @ %p\n", i->_raw);
+
+  if (SeekFile(raw->fp, 0, SEEK_END) == 0 && (size = TellFile(raw->fp)) > 0)
+    raw->file_size = (uint64_t)size;
+
+  parse_ifd(i, raw, raw_u32(raw, bptr + 4), 0);
+
+  LOG_DEBUG("RAW image %d x %d, orientation %d, preview @ %d (%d bytes)\n",
+            i->width, i->height, i->orientation, raw->preview_offset, raw->preview_length);
+
+  if (!i->width || !i->height) {
+    LOG_WARN("Unable to find image dimensions in RAW file (%s)\n", r->path);
+    return 0;
+  }
+
+  // All RAW formats are decoded as RGB from the preview
+  i->channels = 3;
+
+  // The TIFF header and IFD0 are an EXIF block without the "Exif\0\0" prefix
+  exif_len = raw->file_size < RAW_EXIF_SIZE ? (uint32_t)raw->file_size : RAW_EXIF_SIZE;
+  exif = (unsigned char *)malloc(exif_len + 6);
+  LOG_MEM("new RAW EXIF data @ %p\n", exif);
+
+  memcpy(exif, "Exif\0\0", 6);
+  if (raw_read(raw, 0, exif + 6, exif_len))
+    image_jpeg_parse_exif(r, exif, exif_len + 6);
+
+  LOG_MEM("destroy RAW EXIF data @ %p\n", exif);
+  free(exif);
+
+  return 1;
+}
+
+// Create a new JPEG image for the largest embedded preview. The preview is read directly from
+// the RAW file, and must be destroyed by the caller.
+MediaScanImage *image_raw_get_embedded(MediaScanImage *i) {
+  RAWData *raw = (RAWData *)i->_raw;
+  Buffer *buf;
+
+  if (raw == NULL || !raw->preview_length)
+    return NULL;
+
+  if (SeekFile(raw->fp, (int64_t)raw->preview_offset, SEEK_SET) != 0)
+    return NULL;
+
+  buf = (Buffer *)malloc(sizeof(Buffer));
+  LOG_MEM("new RAW preview buf @ %p\n", buf);
+  buffer_init(buf, BUF_SIZE);
+
+  return image_jpeg_create_embedded(i, buf, raw->fp);
+}
+
+void image_raw_destroy(MediaScanImage *i) {
+  if (i->_raw) {
+    LOG_MEM("destroy RAWData @ %p\n", i->_raw);
+    free(i->_raw);
+    i->_raw = NULL;
+  }
+}
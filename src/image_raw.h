@@ -0,0 +1,9 @@
+#ifndef _IMAGE_RAW_H
+#define _IMAGE_RAW_H
+
+int image_raw_is_tiff(const unsigned char *bptr);
+int image_raw_read_header(MediaScanImage *i, MediaScanResult *r);
+MediaScanImage *image_raw_get_embedded(MediaScanImage *i);
+void image_raw_destroy(MediaScanImage *i);
+
+#endif // _IMAGE_RAW_H
@@ -0,0 +1,87 @@
+
+#include <libmediascan.h>
+#include <stdlib.h>
+#include <webp/encode.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include "common.h"
+#include "buffer.h"
+#include "image.h"
+#include "image_webp.h"
+#include "thumb.h"
+
+static int image_webp_write_buf(const uint8_t *data, size_t len, const WebPPicture *pic) {
+  Buffer *buf = (Buffer *)pic->custom_ptr;
+
+  // Copy buffer
+  buffer_append(buf, data, len);
+
+  return 1;
+}
+
+// Compress the data from i->_pixbuf to i->data as lossy WebP, with alpha if the image has any.
+// Quality is taken from the spec's jpeg_quality
+int image_webp_compress(MediaScanImage *i, MediaScanThumbSpec *spec) {
+  WebPConfig config;
+  WebPPicture pic;
+  Buffer *buf;
+  int quality = spec->jpeg_quality;
+  int x, y, ret = 0;
+
+  if (!i->_pixbuf_size) {
+    LOG_WARN("WebP compression requires pixbuf data (%s)\n", i->path);
+    return 0;
+  }
+
+  if (!quality)
+    quality = DEFAULT_JPEG_QUALITY;
+
+  if (!WebPConfigPreset(&config, WEBP_PRESET_PHOTO, quality) || !WebPPictureInit(&pic)) {
+    LOG_ERROR("Could not initialize libwebp\n");
+    return 0;
+  }
+
+  // Method 0 is the fastest, the default of 4 trades speed for size
+  if (spec->flags & THUMB_FAST_ENCODE)
+    config.method = 0;
+
+  pic.use_argb = 1;
+  pic.width = i->width;
+  pic.height = i->height;
+
+  if (!WebPPictureAlloc(&pic)) {
+    LOG_ERROR("Unable to allocate WebP picture for %d x %d image (%s)\n", i->width, i->height, i->path);
+    return 0;
+  }
+
+  // libwebp wants ARGB, rotate the alpha byte to the top
+  for (y = 0; y < i->height; y++) {
+    pix *src = &i->_pixbuf[y * i->width];
+    uint32_t *dst = &pic.argb[y * pic.argb_stride];
+
+    for (x = 0; x < i->width; x++)
+      dst[x] = (src[x] >> 8) | (src[x] << 24);
+  }
+
+  // Initialize buffer for compressed data
+  buf = thumb_encoder_buffer(spec);
+  i->_dbuf = (void *)buf;
+
+  pic.writer = image_webp_write_buf;
+  pic.custom_ptr = (void *)buf;
+
+  if (!WebPEncode(&config, &pic)) {
+    LOG_WARN("WebP compression failed, error %d (%s)\n", pic.error_code, i->path);
+    goto out;
+  }
+
+  ret = 1;
+
+out:
+  WebPPictureFree(&pic);
+
+  return ret;
+}
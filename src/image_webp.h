@@ -0,0 +1,6 @@
+#ifndef _IMAGE_WEBP_H
+#define _IMAGE_WEBP_H
+
+int image_webp_compress(MediaScanImage *i, MediaScanThumbSpec *spec);
+
+#endif // _IMAGE_WEBP_H
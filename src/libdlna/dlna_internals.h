@@ -48,6 +48,8 @@ struct dlna_s {
   int check_extensions;
   /* linked-list of registered DLNA profiles */
   void *first_profile;
+  /* registered profiles by container and codecs, and recent probe results */
+  void *profile_index;
 };
 
 #ifdef WIN32
@@ -19,6 +19,7 @@
  * Foundation, Inc, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -46,6 +47,119 @@ extern dlna_registered_profile_t dlna_profile_av_mpeg4_part2;
 extern dlna_registered_profile_t dlna_profile_av_mpeg4_part10;
 extern dlna_registered_profile_t dlna_profile_av_wmv9;
 
+#define DLNA_MAX_PROFILES 16
+#define DLNA_INDEX_SIZE 64 /* (container, video codec, audio codec) slots */
+#define DLNA_MEMO_SIZE 256 /* stream signatures with a known result */
+#define DLNA_NO_STREAM -1
+
+/*
+ * Containers and codecs each profile's probe can accept, so a stream is only
+ * probed by the profiles that may match it. An empty list accepts anything,
+ * and a profile without video codecs is audio only. These are supersets of
+ * the checks at the start of each probe, keep them in sync.
+ */
+static const struct {
+  dlna_media_profile_t id;
+  dlna_container_type_t containers[8];
+  enum CodecID vcodecs[8];
+  enum CodecID acodecs[4];
+} dlna_profile_streams[] = {
+  { DLNA_PROFILE_AUDIO_AC3,
+    { CT_AC3 }, { CODEC_ID_NONE }, { CODEC_ID_AC3 } },
+  { DLNA_PROFILE_AUDIO_AMR,
+    { CT_AMR, CT_3GP, CT_MP4 }, { CODEC_ID_NONE },
+    { CODEC_ID_AMR_NB, CODEC_ID_AMR_WB } },
+  { DLNA_PROFILE_AUDIO_ATRAC3,
+    { CT_UNKNOWN }, { CODEC_ID_NONE }, { CODEC_ID_ATRAC3 } },
+  { DLNA_PROFILE_AUDIO_LPCM,
+    { CT_UNKNOWN }, { CODEC_ID_NONE },
+    { CODEC_ID_PCM_S16BE, CODEC_ID_PCM_S16LE } },
+  { DLNA_PROFILE_AUDIO_MP3,
+    { CT_MP3 }, { CODEC_ID_NONE }, { CODEC_ID_MP3 } },
+  { DLNA_PROFILE_AUDIO_MPEG4,
+    { CT_UNKNOWN }, { CODEC_ID_NONE }, { CODEC_ID_AAC } },
+  { DLNA_PROFILE_AUDIO_WMA,
+    { CT_ASF }, { CODEC_ID_NONE }, { CODEC_ID_WMAV1, CODEC_ID_WMAV2 } },
+  { DLNA_PROFILE_AV_MPEG1,
+    { CT_UNKNOWN }, { CODEC_ID_MPEG1VIDEO }, { CODEC_ID_MP2 } },
+  { DLNA_PROFILE_AV_MPEG2,
+    { CT_MPEG_ELEMENTARY_STREAM, CT_MPEG_PROGRAM_STREAM,
+      CT_MPEG_TRANSPORT_STREAM, CT_MPEG_TRANSPORT_STREAM_DLNA,
+      CT_MPEG_TRANSPORT_STREAM_DLNA_NO_TS },
+    { CODEC_ID_MPEG2VIDEO }, { CODEC_ID_NONE } },
+  { DLNA_PROFILE_AV_MPEG4_PART2,
+    { CT_ASF, CT_3GP, CT_MP4, CT_MPEG_TRANSPORT_STREAM,
+      CT_MPEG_TRANSPORT_STREAM_DLNA, CT_MPEG_TRANSPORT_STREAM_DLNA_NO_TS },
+    { CODEC_ID_H263, CODEC_ID_H263I, CODEC_ID_H263P, CODEC_ID_MPEG4,
+      CODEC_ID_MSMPEG4V1, CODEC_ID_MSMPEG4V2, CODEC_ID_MSMPEG4V3 },
+    { CODEC_ID_NONE } },
+  { DLNA_PROFILE_AV_MPEG4_PART10,
+    { CT_3GP, CT_MP4, CT_MPEG_TRANSPORT_STREAM,
+      CT_MPEG_TRANSPORT_STREAM_DLNA, CT_MPEG_TRANSPORT_STREAM_DLNA_NO_TS },
+    { CODEC_ID_H264 }, { CODEC_ID_NONE } },
+  { DLNA_PROFILE_AV_WMV9,
+    { CT_ASF }, { CODEC_ID_WMV3 }, { CODEC_ID_NONE } }
+};
+
+/* Registered profiles that apply to one (container, video codec, audio codec) */
+typedef struct dlna_index_entry_s {
+  int used;
+  dlna_container_type_t st;
+  int vcodec;
+  int acodec;
+  dlna_registered_profile_t *candidates[DLNA_MAX_PROFILES + 1];
+} dlna_index_entry_t;
+
+/* Everything the probes look at, identical encodes have the same signature */
+typedef struct dlna_stream_sig_s {
+  dlna_container_type_t st;
+  char ext[16];
+  int vcodec;
+  int width;
+  int height;
+  int vbit_rate;
+  int fps_num;
+  int fps_den;
+  int acodec;
+  int sample_rate;
+  int channels;
+  int abit_rate;
+  int aextra_size;
+  unsigned char aextra[4];
+  int bit_rate; /* H.264 levels depend on the overall bitrate */
+} dlna_stream_sig_t;
+
+typedef struct dlna_memo_entry_s {
+  int used;
+  dlna_stream_sig_t sig;
+  dlna_profile_t *profile;
+} dlna_memo_entry_t;
+
+typedef struct dlna_profile_index_s {
+  dlna_index_entry_t index[DLNA_INDEX_SIZE];
+  dlna_memo_entry_t memo[DLNA_MEMO_SIZE];
+} dlna_profile_index_t;
+
+static unsigned int
+dlna_hash (const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  unsigned int h = 2166136261U;
+
+  while (len--)
+    h = (h ^ *p++) * 16777619U;
+
+  return h;
+}
+
+/* forget what was indexed and probed, the registered profiles have changed */
+static void
+dlna_profile_index_reset (dlna_t *dlna)
+{
+  if (dlna->profile_index)
+    memset (dlna->profile_index, 0, sizeof (dlna_profile_index_t));
+}
+
 static void
 dlna_register_profile (dlna_t *dlna, dlna_registered_profile_t *profile)
 {
@@ -66,6 +180,8 @@ dlna_register_profile (dlna_t *dlna, dlna_registered_profile_t *profile)
   }
   *p = profile;
   profile->next = NULL;
+
+  dlna_profile_index_reset (dlna);
 }
 
 void
@@ -162,6 +278,7 @@ dlna_init (void)
   dlna->inited = 1;
   dlna->verbosity = 0;
   dlna->first_profile = NULL;
+  dlna->profile_index = NULL;
   
   /* register all FFMPEG demuxers */
   av_register_all ();
@@ -179,6 +296,7 @@ dlna_uninit (dlna_t *dlna)
   if (dlna->verbosity)
     fprintf (stderr, "DLNA: uninit\n");
   dlna->first_profile = NULL;
+  free (dlna->profile_index);
   free (dlna);
 }
 
@@ -278,7 +396,6 @@ dlna_profile_t *
 dlna_guess_media_profile (dlna_t *dlna, const char *filename)
 {
   AVFormatContext *ctx;
-  dlna_registered_profile_t *p;
   dlna_profile_t *profile = NULL;
   dlna_container_type_t st;
   av_codecs_t *codecs;
@@ -315,24 +432,229 @@ dlna_guess_media_profile (dlna_t *dlna, const char *filename)
   /* check for container type */
   st = stream_get_container (ctx);
   
-  p = dlna->first_profile;
-  while (p)
+  profile = dlna_probe_media_profile (dlna, ctx, st, codecs, filename,
+                                      dlna->check_extensions);
+
+  av_close_input_file (ctx);
+  free (codecs);
+  return profile;
+}
+
+static int
+dlna_profile_applies (dlna_registered_profile_t *p, dlna_container_type_t st,
+                      int vcodec, int acodec)
+{
+  int i, j;
+
+  for (i = 0; i < (int) (sizeof (dlna_profile_streams) /
+                         sizeof (dlna_profile_streams[0])); i++)
   {
-    dlna_profile_t *prof;
-    
-    if (dlna->check_extensions)
+    if (dlna_profile_streams[i].id != p->id)
+      continue;
+
+    if (dlna_profile_streams[i].containers[0] != CT_UNKNOWN)
+    {
+      for (j = 0; j < 8 && dlna_profile_streams[i].containers[j] != CT_UNKNOWN; j++)
+        if (dlna_profile_streams[i].containers[j] == st)
+          break;
+      if (j == 8 || dlna_profile_streams[i].containers[j] == CT_UNKNOWN)
+        return 0;
+    }
+
+    /* audio profiles want no video, AV profiles want both */
+    if (acodec == DLNA_NO_STREAM)
+      return 0;
+
+    if (dlna_profile_streams[i].vcodecs[0] == CODEC_ID_NONE)
+    {
+      if (vcodec != DLNA_NO_STREAM)
+        return 0;
+    }
+    else
+    {
+      for (j = 0; j < 8 && dlna_profile_streams[i].vcodecs[j] != CODEC_ID_NONE; j++)
+        if ((int) dlna_profile_streams[i].vcodecs[j] == vcodec)
+          break;
+      if (j == 8 || dlna_profile_streams[i].vcodecs[j] == CODEC_ID_NONE)
+        return 0;
+    }
+
+    if (dlna_profile_streams[i].acodecs[0] != CODEC_ID_NONE)
+    {
+      for (j = 0; j < 4 && dlna_profile_streams[i].acodecs[j] != CODEC_ID_NONE; j++)
+        if ((int) dlna_profile_streams[i].acodecs[j] == acodec)
+          break;
+      if (j == 4 || dlna_profile_streams[i].acodecs[j] == CODEC_ID_NONE)
+        return 0;
+    }
+
+    return 1;
+  }
+
+  /* nothing is known about this one, always probe it */
+  return 1;
+}
+
+static void
+dlna_index_fill (dlna_t *dlna, dlna_index_entry_t *e)
+{
+  dlna_registered_profile_t *p;
+  int n = 0;
+
+  for (p = dlna->first_profile; p && n < DLNA_MAX_PROFILES; p = p->next)
+    if (dlna_profile_applies (p, e->st, e->vcodec, e->acodec))
+      e->candidates[n++] = p;
+
+  e->candidates[n] = NULL;
+  e->used = 1;
+}
+
+/* Find the candidate profiles of a stream, in registration order */
+static dlna_index_entry_t *
+dlna_index_lookup (dlna_t *dlna, dlna_profile_index_t *idx,
+                   dlna_container_type_t st, int vcodec, int acodec,
+                   dlna_index_entry_t *tmp)
+{
+  int key[3];
+  unsigned int h;
+  int i;
+
+  key[0] = st;
+  key[1] = vcodec;
+  key[2] = acodec;
+  h = dlna_hash (key, sizeof (key));
+
+  for (i = 0; idx && i < DLNA_INDEX_SIZE; i++)
+  {
+    dlna_index_entry_t *e = &idx->index[(h + i) % DLNA_INDEX_SIZE];
+
+    if (!e->used)
     {
-      if (p->extensions)
-      {
-        /* check for valid file extension */
-        if (!match_file_extension (filename, p->extensions))
-        {
-          p = p->next;
-          continue;
-        }
-      }
+      e->st = st;
+      e->vcodec = vcodec;
+      e->acodec = acodec;
+      dlna_index_fill (dlna, e);
+      return e;
     }
-    
+
+    if (e->st == st && e->vcodec == vcodec && e->acodec == acodec)
+      return e;
+  }
+
+  /* full, work it out every time */
+  memset (tmp, 0, sizeof (*tmp));
+  tmp->st = st;
+  tmp->vcodec = vcodec;
+  tmp->acodec = acodec;
+  dlna_index_fill (dlna, tmp);
+
+  return tmp;
+}
+
+/* Returns 0 if the result of probing may depend on more than the signature */
+static int
+dlna_stream_signature (dlna_stream_sig_t *sig, AVFormatContext *ctx,
+                       dlna_container_type_t st, av_codecs_t *codecs,
+                       const char *filename, int check_extensions)
+{
+  /* ADTS files are read again by the AAC probe */
+  if (st == CT_AAC)
+    return 0;
+
+  /* zero the padding too, signatures are compared with memcmp */
+  memset (sig, 0, sizeof (*sig));
+  sig->st = st;
+  sig->bit_rate = ctx->bit_rate;
+
+  if (check_extensions)
+  {
+    char *ext = filename ? get_file_extension (filename) : NULL;
+    int i;
+
+    if (ext)
+    {
+      if (strlen (ext) >= sizeof (sig->ext))
+        return 0;
+      for (i = 0; ext[i]; i++)
+        sig->ext[i] = tolower ((unsigned char) ext[i]);
+    }
+  }
+
+  sig->vcodec = DLNA_NO_STREAM;
+  if (codecs->vc)
+  {
+    sig->vcodec = codecs->vc->codec_id;
+    sig->width = codecs->vc->width;
+    sig->height = codecs->vc->height;
+    sig->vbit_rate = codecs->vc->bit_rate;
+  }
+
+  if (codecs->vs)
+  {
+    sig->fps_num = codecs->vs->r_frame_rate.num;
+    sig->fps_den = codecs->vs->r_frame_rate.den;
+  }
+
+  sig->acodec = DLNA_NO_STREAM;
+  if (codecs->ac)
+  {
+    sig->acodec = codecs->ac->codec_id;
+    sig->sample_rate = codecs->ac->sample_rate;
+    sig->channels = codecs->ac->channels;
+    sig->abit_rate = codecs->ac->bit_rate;
+    sig->aextra_size = codecs->ac->extradata_size;
+    if (codecs->ac->extradata)
+      memcpy (sig->aextra, codecs->ac->extradata,
+              codecs->ac->extradata_size < (int) sizeof (sig->aextra) ?
+              codecs->ac->extradata_size : (int) sizeof (sig->aextra));
+  }
+
+  return 1;
+}
+
+dlna_profile_t *
+dlna_probe_media_profile (dlna_t *dlna, AVFormatContext *ctx,
+                          dlna_container_type_t st, av_codecs_t *codecs,
+                          const char *filename, int check_extensions)
+{
+  dlna_profile_index_t *idx;
+  dlna_index_entry_t *e, tmp;
+  dlna_memo_entry_t *m = NULL;
+  dlna_stream_sig_t sig;
+  dlna_profile_t *profile = NULL;
+  int i;
+
+  if (!dlna)
+    return NULL;
+
+  if (!dlna->profile_index)
+    dlna->profile_index = calloc (1, sizeof (dlna_profile_index_t));
+  idx = dlna->profile_index;
+
+  /* identical encodes, such as episodes of a series, probe the same */
+  if (idx && dlna_stream_signature (&sig, ctx, st, codecs,
+                                    filename, check_extensions))
+  {
+    m = &idx->memo[dlna_hash (&sig, sizeof (sig)) % DLNA_MEMO_SIZE];
+    if (m->used && !memcmp (&m->sig, &sig, sizeof (sig)))
+      return m->profile;
+  }
+
+  e = dlna_index_lookup (dlna, idx, st,
+                         codecs->vc ? (int) codecs->vc->codec_id : DLNA_NO_STREAM,
+                         codecs->ac ? (int) codecs->ac->codec_id : DLNA_NO_STREAM,
+                         &tmp);
+
+  for (i = 0; e->candidates[i]; i++)
+  {
+    dlna_registered_profile_t *p = e->candidates[i];
+    dlna_profile_t *prof;
+
+    /* check for valid file extension */
+    if (check_extensions && p->extensions &&
+        !match_file_extension (filename, p->extensions))
+      continue;
+
     prof = p->probe (ctx, st, codecs);
     if (prof)
     {
@@ -340,11 +662,15 @@ dlna_guess_media_profile (dlna_t *dlna, const char *filename)
       profile->class = p->class;
       break;
     }
-    p = p->next;
   }
 
-  av_close_input_file (ctx);
-  free (codecs);
+  if (m)
+  {
+    m->used = 1;
+    m->sig = sig;
+    m->profile = profile;
+  }
+
   return profile;
 }
 
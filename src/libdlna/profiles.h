@@ -158,6 +158,13 @@ audio_profile_t audio_profile_guess_wma (AVCodecContext *ac);
 
 av_codecs_t * av_profile_get_codecs (AVFormatContext *ctx);
 
+/* run the probes of the registered profiles that apply to the stream */
+dlna_profile_t * dlna_probe_media_profile (dlna_t *dlna, AVFormatContext *ctx,
+                                           dlna_container_type_t st,
+                                           av_codecs_t *codecs,
+                                           const char *filename,
+                                           int check_extensions);
+
 /* stream context check routines */
 int stream_ctx_is_image (AVFormatContext *ctx,
                          av_codecs_t *codecs, dlna_container_type_t st);
@@ -0,0 +1,546 @@
+#include <libmediascan.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#pragma warning( disable: 4244 )
+#endif
+
+#include <libavformat/avformat.h>
+
+#ifdef _MSC_VER
+#pragma warning( default: 4244 )
+#endif
+
+#include "common.h"
+#include "buffer.h"
+#include "loudness.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LOUDNESS_SSE
+#include <xmmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define LOUDNESS_MAX_CHANNELS 8
+
+// Gating blocks are 400ms long and start every 100ms, ITU-R BS.1770
+#define LOUDNESS_SUB_BLOCKS 4
+#define LOUDNESS_ABSOLUTE_GATE -70.0
+#define LOUDNESS_RELATIVE_GATE -10.0
+
+// The true peak is found by oversampling 4 times below 96 kHz with this many taps per phase
+#define TRUE_PEAK_MAX_FACTOR 4
+#define TRUE_PEAK_TAPS 12
+
+typedef struct {
+  int channels;
+  int samplerate;
+  double weight[LOUDNESS_MAX_CHANNELS];
+
+  // K-weighting, a high shelf followed by a high pass, and each channel's state for both
+  double pre_b[3], pre_a[3];
+  double rlb_b[3], rlb_a[3];
+  double z[LOUDNESS_MAX_CHANNELS][4];
+
+  // Weighted mean squares of the last 100ms sub-blocks, a gating block is the last 4
+  double sub[LOUDNESS_SUB_BLOCKS];
+  int nsub;
+  double energy;                // of the current sub-block so far
+  int sub_len;
+  int sub_pos;
+
+  double *blocks;               // mean square of every gating block
+  int nblocks;
+  int blocks_size;
+
+  // Interpolation filter, each phase is stored reversed so it runs over the samples in order
+  int factor;
+  float fir[TRUE_PEAK_MAX_FACTOR][TRUE_PEAK_TAPS];
+  float hist[LOUDNESS_MAX_CHANNELS][TRUE_PEAK_TAPS - 1];
+  float peak;
+
+  // Planar samples of the current frame, after the previous TRUE_PEAK_TAPS - 1 of each channel
+  float *planar[LOUDNESS_MAX_CHANNELS];
+  int planar_size;
+} Loudness;
+
+// FFmpeg orders 5.1 and 7.1 as L R C LFE and then the surrounds, which count for more
+static double loudness_channel_weight(int channels, int c) {
+  if (channels == 6 || channels == 8)
+    return c == 3 ? 0.0 : (c > 3 ? 1.41 : 1.0);
+  if (channels == 5)
+    return c > 2 ? 1.41 : 1.0;
+
+  return 1.0;
+}
+
+// The K-weighting filters for any sample rate, from the 48 kHz ones in BS.1770
+static void loudness_init_filters(Loudness *l) {
+  double f0, q, k, vh, vb, a0;
+
+  f0 = 1681.974450955533;
+  q = 0.7071752369554196;
+  k = tan(M_PI * f0 / l->samplerate);
+  vh = pow(10.0, 3.999843853973347 / 20.0);
+  vb = pow(vh, 0.4996667741545416);
+  a0 = 1.0 + k / q + k * k;
+
+  l->pre_b[0] = (vh + vb * k / q + k * k) / a0;
+  l->pre_b[1] = 2.0 * (k * k - vh) / a0;
+  l->pre_b[2] = (vh - vb * k / q + k * k) / a0;
+  l->pre_a[1] = 2.0 * (k * k - 1.0) / a0;
+  l->pre_a[2] = (1.0 - k / q + k * k) / a0;
+
+  f0 = 38.13547087602444;
+  q = 0.5003270373238773;
+  k = tan(M_PI * f0 / l->samplerate);
+  a0 = 1.0 + k / q + k * k;
+
+  l->rlb_b[0] = 1.0;
+  l->rlb_b[1] = -2.0;
+  l->rlb_b[2] = 1.0;
+  l->rlb_a[1] = 2.0 * (k * k - 1.0) / a0;
+  l->rlb_a[2] = (1.0 - k / q + k * k) / a0;
+}
+
+// A Hann windowed sinc, each phase scaled to a gain of 1
+static void loudness_init_fir(Loudness *l) {
+  int n = l->factor * TRUE_PEAK_TAPS;
+  double center = (n - 1) / 2.0;
+  int p, t;
+
+  for (p = 0; p < l->factor; p++) {
+    double sum = 0;
+
+    for (t = 0; t < TRUE_PEAK_TAPS; t++) {
+      int i = p + t * l->factor;
+      double x = (i - center) / l->factor;
+      double h = fabs(x) < 1e-9 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+
+      h *= 0.5 - 0.5 * cos(2 * M_PI * (i + 0.5) / n);
+      l->fir[p][TRUE_PEAK_TAPS - 1 - t] = (float)h;
+      sum += h;
+    }
+
+    for (t = 0; t < TRUE_PEAK_TAPS; t++)
+      l->fir[p][t] = (float)(l->fir[p][t] / sum);
+  }
+}
+
+static Loudness *loudness_create(int channels, int samplerate) {
+  Loudness *l = (Loudness *)calloc(sizeof(Loudness), 1);
+  int c;
+
+  if (l == NULL) {
+    ms_errno = MSENO_MEMERROR;
+    FATAL("Out of memory for new Loudness object\n");
+    return NULL;
+  }
+
+  LOG_MEM("new Loudness @ %p\n", l);
+
+  l->channels = channels;
+  l->samplerate = samplerate;
+  l->sub_len = samplerate / 10;
+  l->factor = samplerate < 96000 ? 4 : (samplerate < 192000 ? 2 : 1);
+
+  for (c = 0; c < channels; c++)
+    l->weight[c] = loudness_channel_weight(channels, c);
+
+  loudness_init_filters(l);
+  loudness_init_fir(l);
+
+  return l;
+}
+
+static void loudness_destroy(Loudness *l) {
+  int c;
+
+  for (c = 0; c < l->channels; c++)
+    free(l->planar[c]);
+
+  if (l->blocks)
+    free(l->blocks);
+
+  LOG_MEM("destroy Loudness @ %p\n", l);
+  free(l);
+}
+
+static void loudness_add_block(Loudness *l, double energy) {
+  if (l->nblocks == l->blocks_size) {
+    double *blocks = (double *)realloc(l->blocks, (l->blocks_size ? l->blocks_size * 2 : 1024) * sizeof(double));
+
+    if (!blocks)
+      return;
+
+    l->blocks = blocks;
+    l->blocks_size = l->blocks_size ? l->blocks_size * 2 : 1024;
+  }
+
+  l->blocks[l->nblocks++] = energy;
+}
+
+static void loudness_end_sub_block(Loudness *l) {
+  double sum = 0;
+  int i;
+
+  l->sub[l->nsub++ % LOUDNESS_SUB_BLOCKS] = l->energy / l->sub_len;
+  l->energy = 0;
+  l->sub_pos = 0;
+
+  if (l->nsub < LOUDNESS_SUB_BLOCKS)
+    return;
+
+  for (i = 0; i < LOUDNESS_SUB_BLOCKS; i++)
+    sum += l->sub[i];
+
+  loudness_add_block(l, sum / LOUDNESS_SUB_BLOCKS);
+}
+
+// K-weight len samples of a channel, returns their sum of squares
+static double loudness_filter(Loudness *l, int c, const float *x, int len) {
+  double *z = l->z[c];
+  double sum = 0;
+  int n;
+
+  for (n = 0; n < len; n++) {
+    double y1 = l->pre_b[0] * x[n] + z[0];
+    double y2;
+
+    z[0] = l->pre_b[1] * x[n] - l->pre_a[1] * y1 + z[1];
+    z[1] = l->pre_b[2] * x[n] - l->pre_a[2] * y1;
+
+    y2 = y1 + z[2];
+    z[2] = l->rlb_b[1] * y1 - l->rlb_a[1] * y2 + z[3];
+    z[3] = y1 - l->rlb_a[2] * y2;
+
+    sum += y2 * y2;
+  }
+
+  return sum;
+}
+
+// Highest interpolated peak of a channel. x is preceded by the channel's last TRUE_PEAK_TAPS - 1
+// samples, and the inner loop is a plain dot product the compiler can vectorize.
+static float true_peak(Loudness *l, const float *x, int len) {
+  float peak = 0;
+  int n, p, t;
+
+  for (n = 0; n < len; n++) {
+    const float *w = x + n;
+
+    for (p = 0; p < l->factor; p++) {
+      float acc = 0;
+
+      for (t = 0; t < TRUE_PEAK_TAPS; t++)
+        acc += l->fir[p][t] * w[t];
+
+      if (fabsf(acc) > peak)
+        peak = fabsf(acc);
+    }
+  }
+
+  return peak;
+}
+
+#if defined(LOUDNESS_SSE) && TRUE_PEAK_MAX_FACTOR == 4 && TRUE_PEAK_TAPS == 12
+
+#define LOUDNESS_TARGET __attribute__((target("sse")))
+
+// Computes all 4 phases of an output sample together, 3 vectors of taps each. Phases past
+// l->factor have all-zero taps, so they produce 0 and can't raise the peak.
+LOUDNESS_TARGET static float true_peak_sse(Loudness *l, const float *x, int len) {
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 fir[TRUE_PEAK_MAX_FACTOR][3];
+  __m128 peak = _mm_setzero_ps();
+  float out[4];
+  int n, p;
+
+  // Without oversampling 3 of the 4 lanes would be wasted
+  if (l->factor == 1)
+    return true_peak(l, x, len);
+
+  for (p = 0; p < TRUE_PEAK_MAX_FACTOR; p++) {
+    fir[p][0] = _mm_loadu_ps(l->fir[p]);
+    fir[p][1] = _mm_loadu_ps(l->fir[p] + 4);
+    fir[p][2] = _mm_loadu_ps(l->fir[p] + 8);
+  }
+
+  for (n = 0; n < len; n++) {
+    __m128 w0 = _mm_loadu_ps(x + n);
+    __m128 w1 = _mm_loadu_ps(x + n + 4);
+    __m128 w2 = _mm_loadu_ps(x + n + 8);
+    __m128 s[TRUE_PEAK_MAX_FACTOR];
+
+    for (p = 0; p < TRUE_PEAK_MAX_FACTOR; p++)
+      s[p] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fir[p][0], w0), _mm_mul_ps(fir[p][1], w1)), _mm_mul_ps(fir[p][2], w2));
+
+    // After the transpose lane p of each vector holds partial sums of phase p
+    _MM_TRANSPOSE4_PS(s[0], s[1], s[2], s[3]);
+    s[0] = _mm_add_ps(_mm_add_ps(s[0], s[1]), _mm_add_ps(s[2], s[3]));
+    peak = _mm_max_ps(peak, _mm_andnot_ps(sign, s[0]));
+  }
+
+  _mm_storeu_ps(out, peak);
+
+  return MAX(MAX(out[0], out[1]), MAX(out[2], out[3]));
+}
+
+#else
+#undef LOUDNESS_SSE
+#endif
+
+static float (*loudness_true_peak) (Loudness *l, const float *x, int len) = true_peak;
+
+// Add a frame of len interleaved samples per channel from FFmpeg
+static void loudness_add(Loudness *l, const void *samples, int len, enum AVSampleFormat fmt) {
+  int total = TRUE_PEAK_TAPS - 1 + len;
+  int c, n, pos;
+
+  if (total > l->planar_size) {
+    for (c = 0; c < l->channels; c++)
+      l->planar[c] = (float *)realloc(l->planar[c], total * sizeof(float));
+    l->planar_size = total;
+  }
+
+  for (c = 0; c < l->channels; c++) {
+    float *out = l->planar[c] + TRUE_PEAK_TAPS - 1;
+    int i = c;
+
+    memcpy(l->planar[c], l->hist[c], sizeof(l->hist[c]));
+
+    switch (fmt) {
+      case AV_SAMPLE_FMT_U8:
+        for (n = 0; n < len; n++, i += l->channels)
+          out[n] = (((const uint8_t *)samples)[i] - 128) / 128.0f;
+        break;
+      case AV_SAMPLE_FMT_S16:
+        for (n = 0; n < len; n++, i += l->channels)
+          out[n] = ((const int16_t *)samples)[i] / 32768.0f;
+        break;
+      case AV_SAMPLE_FMT_S32:
+        for (n = 0; n < len; n++, i += l->channels)
+          out[n] = (float)(((const int32_t *)samples)[i] / 2147483648.0);
+        break;
+      case AV_SAMPLE_FMT_FLT:
+        for (n = 0; n < len; n++, i += l->channels)
+          out[n] = ((const float *)samples)[i];
+        break;
+      case AV_SAMPLE_FMT_DBL:
+        for (n = 0; n < len; n++, i += l->channels)
+          out[n] = (float)((const double *)samples)[i];
+        break;
+      default:
+        return;
+    }
+
+    if (l->factor > 1) {
+      float peak = loudness_true_peak(l, l->planar[c], len);
+      if (peak > l->peak)
+        l->peak = peak;
+    }
+    else {
+      for (n = 0; n < len; n++) {
+        if (fabsf(out[n]) > l->peak)
+          l->peak = fabsf(out[n]);
+      }
+    }
+
+    memcpy(l->hist[c], l->planar[c] + len, sizeof(l->hist[c]));
+  }
+
+  // Filter up to each sub-block boundary, one channel at a time
+  for (pos = 0; pos < len;) {
+    int seg = MIN(len - pos, l->sub_len - l->sub_pos);
+
+    for (c = 0; c < l->channels; c++) {
+      double sum = loudness_filter(l, c, l->planar[c] + TRUE_PEAK_TAPS - 1 + pos, seg);
+      l->energy += l->weight[c] * sum;
+    }
+
+    pos += seg;
+    l->sub_pos += seg;
+
+    if (l->sub_pos == l->sub_len)
+      loudness_end_sub_block(l);
+  }
+}
+
+// Gate the blocks, returns 0 if there was nothing above the absolute gate
+static int loudness_finish(Loudness *l, double *loudness, double *true_peak) {
+  double abs_gate = pow(10.0, (LOUDNESS_ABSOLUTE_GATE + 0.691) / 10.0);
+  double rel_gate, sum = 0;
+  int i, n = 0;
+
+  // A file shorter than a gating block is measured as a single block of all of it
+  if (!l->nblocks && (l->nsub || l->sub_pos)) {
+    for (i = 0; i < l->nsub; i++)
+      sum += l->sub[i] * l->sub_len;
+
+    loudness_add_block(l, (sum + l->energy) / (l->nsub * l->sub_len + l->sub_pos));
+    sum = 0;
+  }
+
+  for (i = 0; i < l->nblocks; i++) {
+    if (l->blocks[i] > abs_gate) {
+      sum += l->blocks[i];
+      n++;
+    }
+  }
+
+  if (!n)
+    return 0;
+
+  rel_gate = sum / n * pow(10.0, LOUDNESS_RELATIVE_GATE / 10.0);
+  sum = 0;
+  n = 0;
+
+  for (i = 0; i < l->nblocks; i++) {
+    if (l->blocks[i] > abs_gate && l->blocks[i] > rel_gate) {
+      sum += l->blocks[i];
+      n++;
+    }
+  }
+
+  *loudness = -0.691 + 10.0 * log10(sum / n);
+  *true_peak = 20.0 * log10(l->peak);
+
+  return 1;
+}
+
+int loudness_scan(MediaScanResult *r) {
+  AVFormatContext *avf = (AVFormatContext *)r->_avf;
+  AVCodecContext *c = NULL;
+  AVCodec *codec;
+  AVPacket packet;
+  Loudness *l = NULL;
+  int16_t *samples = NULL;
+  int opened = 0;
+  int stream = -1;
+  int ret = 0;
+  unsigned int x;
+
+  // Audio files are read natively, so FFmpeg has only opened the ones that looked like video
+  if (!avf) {
+    if (avformat_open_input(&avf, r->path, NULL, NULL) != 0) {
+      LOG_WARN("Unable to open %s for loudness analysis\n", r->path);
+      return 0;
+    }
+    opened = 1;
+
+    if (av_find_stream_info(avf) < 0)
+      goto out;
+  }
+
+  for (x = 0; x < avf->nb_streams; x++) {
+    if (avf->streams[x]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+      stream = x;
+      break;
+    }
+  }
+
+  if (stream < 0)
+    goto out;
+
+  c = avf->streams[stream]->codec;
+  if (c->channels < 1 || c->channels > LOUDNESS_MAX_CHANNELS || c->sample_rate < 8000) {
+    LOG_DEBUG("Unable to analyze loudness of %d channels at %d Hz\n", c->channels, c->sample_rate);
+    c = NULL;
+    goto out;
+  }
+
+  codec = avcodec_find_decoder(c->codec_id);
+  if (!codec || avcodec_open(c, codec) < 0) {
+    LOG_WARN("Unable to open audio decoder for loudness analysis of %s\n", r->path);
+    c = NULL;
+    goto out;
+  }
+
+  l = loudness_create(c->channels, c->sample_rate);
+  samples = (int16_t *)av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+  if (!l || !samples)
+    goto out;
+
+  av_init_packet(&packet);
+
+  while (av_read_frame(avf, &packet) >= 0) {
+    AVPacket pkt = packet;
+
+    // A packet may hold several frames
+    while (packet.stream_index == stream && pkt.size > 0) {
+      int size = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+      int len = avcodec_decode_audio3(c, samples, &size, &pkt);
+
+      if (len < 0)
+        break;
+
+      if (size > 0 && c->channels == l->channels) {
+        int nsamples = size / c->channels;
+
+        switch (c->sample_fmt) {
+          case AV_SAMPLE_FMT_U8:
+            break;
+          case AV_SAMPLE_FMT_S16:
+            nsamples /= 2;
+            break;
+          case AV_SAMPLE_FMT_DBL:
+            nsamples /= 8;
+            break;
+          default:
+            nsamples /= 4;
+            break;
+        }
+
+        loudness_add(l, samples, nsamples, c->sample_fmt);
+      }
+
+      pkt.data += len;
+      pkt.size -= len;
+    }
+
+    av_free_packet(&packet);
+  }
+
+  if (loudness_finish(l, &r->audio->loudness, &r->audio->true_peak)) {
+    r->audio->has_loudness = 1;
+    LOG_DEBUG("Loudness %.2f LUFS, true peak %.2f dBTP (%s)\n", r->audio->loudness, r->audio->true_peak, r->path);
+  }
+
+  ret = 1;
+
+out:
+  if (samples)
+    av_free(samples);
+
+  if (l)
+    loudness_destroy(l);
+
+  if (c)
+    avcodec_close(c);
+
+  if (opened)
+    av_close_input_file(avf);
+
+  return ret;
+}
+
+void loudness_init(void) {
+#ifdef LOUDNESS_SSE
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse")) {
+    LOG_DEBUG("Using SSE true peak filter\n");
+    loudness_true_peak = true_peak_sse;
+  }
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef _LOUDNESS_H
+#define _LOUDNESS_H
+
+// Measure the EBU R128 integrated loudness and true peak of the first audio stream of r by decoding
+// all of it with FFmpeg, see MS_AUDIO_LOUDNESS. The results are set in r->audio. Returns 0 if the
+// audio can't be decoded.
+int loudness_scan(MediaScanResult *r);
+
+// Select the fastest true peak filter for this CPU, called once by the library initialization
+void loudness_init(void);
+
+#endif // _LOUDNESS_H
@@ -45,6 +45,13 @@
 #include "thread.h"
 #include "util.h"
 #include "database.h"
+#include "pixel.h"
+#include "loudness.h"
+#include "thumb.h"
+#include "thumbcache.h"
+#include "resultcache.h"
+#include "duplicate.h"
+#include "tag.h"
 
 // If we are on MSVC, disable some stupid MSVC warnings
 #ifdef _MSC_VER
@@ -55,10 +62,15 @@
 // DLNA support
 #include "libdlna/dlna_internals.h"
 
-// Global log level flag
-enum log_level Debug = ERR;
+// Log level of the current thread
+MS_THREAD_LOCAL enum log_level Debug = ERR;
+MS_THREAD_LOCAL int ms_errno = 0;
+
+#ifndef WIN32
+static pthread_once_t InitOnce = PTHREAD_ONCE_INIT;
+#else
 static int Initialized = 0;
-int ms_errno = 0;
+#endif
 
 #ifdef WIN32
 WSADATA wsaData;
@@ -77,7 +89,9 @@ WSADATA wsaData;
  
  Audio support
  -------------
- TODO
+ Read natively without FFmpeg:
+ 
+ Formats:      MP3/MP2/MP1, FLAC, MPEG-4 (AAC, ALAC), Ogg (Vorbis, Opus), WMA, WAV, AIFF
  
  Image support
  -------------
@@ -86,10 +100,10 @@ WSADATA wsaData;
 */
 
 // File extensions to look for (leading/trailing comma are required)
-static const char *AudioExts = ",aif,aiff,wav,";
+static const char *AudioExts = ",aif,aiff,aifc,wav,mp3,mp2,mpa,flac,fla,m4a,m4b,ogg,oga,opus,wma,";
 static const char *VideoExts =
   ",asf,avi,divx,flv,hdmov,m1v,m2p,m2t,m2ts,m2v,m4v,mkv,mov,mpg,mpeg,mpe,mp2p,mp2t,mp4,mts,pes,ps,ts,vob,webm,wmv,xvid,3gp,3g2,3gp2,3gpp,mjpg,";
-static const char *ImageExts = ",jpg,png,gif,bmp,jpeg,jpe,";
+static const char *ImageExts = ",jpg,png,gif,bmp,jpeg,jpe,cr2,nef,arw,dng,";
 static const char *LnkExts = ",lnk,";
 
 #define REGISTER_DECODER(X,x) { \
@@ -202,6 +216,45 @@ static void register_formats(void) {
   REGISTER_PROTOCOL(FILE, file);
 }                               /* register_formats() */
 
+///-------------------------------------------------------------------------------------------------
+///  Lock manager for FFmpeg, which needs one for avcodec_open/avcodec_close (also called from
+///  av_find_stream_info) to be safe when several scans run at once.
+///
+/// @param [in,out] mutex The mutex FFmpeg keeps for this lock.
+/// @param op             The operation.
+///
+/// @return 0 on success.
+///-------------------------------------------------------------------------------------------------
+
+static int av_lock_manager(void **mutex, enum AVLockOp op) {
+  switch (op) {
+    case AV_LOCK_CREATE:
+      *mutex = malloc(sizeof(pthread_mutex_t));
+      if (!*mutex)
+        return 1;
+      if (pthread_mutex_init((pthread_mutex_t *)*mutex, NULL) != 0) {
+        free(*mutex);
+        *mutex = NULL;
+        return 1;
+      }
+      return 0;
+
+    case AV_LOCK_OBTAIN:
+      return pthread_mutex_lock((pthread_mutex_t *)*mutex) != 0;
+
+    case AV_LOCK_RELEASE:
+      return pthread_mutex_unlock((pthread_mutex_t *)*mutex) != 0;
+
+    case AV_LOCK_DESTROY:
+      pthread_mutex_destroy((pthread_mutex_t *)*mutex);
+      free(*mutex);
+      *mutex = NULL;
+      return 0;
+  }
+
+  return 1;
+}                               /* av_lock_manager() */
+
 ///-------------------------------------------------------------------------------------------------
 ///  Initialises ffmpeg.
 ///
@@ -211,16 +264,15 @@ static void register_formats(void) {
 /// ### remarks .
 ///-------------------------------------------------------------------------------------------------
 
-static void _init(void) {
+static void _init_once(void) {
 #ifdef WIN32
   int iResult;
 #endif
 
-  if (Initialized)
-    return;
-
   register_codecs();
   register_formats();
+  pixel_init();
+  loudness_init();
 #ifdef WIN32
   pthread_win32_process_attach_np();
   pthread_win32_thread_attach_np();
@@ -233,10 +285,26 @@ static void _init(void) {
   }
   CoInitialize(NULL);           // To initialize the COM library on the current thread
 #endif
-  Initialized = 1;
-  ms_errno = 0;
 
+  // After pthreads-win32 is attached above, the lock manager uses its mutexes
+  if (av_lockmgr_register(av_lock_manager) != 0) {
+    LOG_ERROR("Unable to register FFmpeg lock manager\n");
+  }
+}
+
+static void _init(void) {
+#ifndef WIN32
+  // MediaScan objects may be created from several threads at once
+  pthread_once(&InitOnce, _init_once);
+#else
+  // pthreads-win32 can't be used until _init_once has attached it
+  if (!Initialized) {
+    _init_once();
+    Initialized = 1;
+  }
+#endif
 
+  ms_errno = 0;
 }                               /* _init() */
 
 ///-------------------------------------------------------------------------------------------------
@@ -359,17 +427,25 @@ void ms_destroy(MediaScan *s) {
   }
 
   for (i = 0; i < s->nthumbspecs; i++) {
+    thumb_encoder_destroy(s->thumbspecs[i]);
     free(s->thumbspecs[i]);
   }
 
   progress_destroy(s->progress);
 
   free(s->_dirq);
-  free(s->_dlna);
+  dlna_uninit((dlna_t *)s->_dlna);
 
   if (s->cachedir)
     free(s->cachedir);
 
+  if (s->thumbpath)
+    free(s->thumbpath);
+
+  thumbcache_destroy(s);
+  resultcache_destroy(s);
+  duplicates_reset(s);
+
   /* When we're done with the database, close it. */
   bdb_destroy(s);
 
@@ -519,6 +595,7 @@ ms_add_thumbnail_spec(MediaScan *s, enum thumb_format format, int width,
     spec->keep_aspect = keep_aspect;
     spec->bgcolor = bgcolor;
     spec->jpeg_quality = quality;
+    spec->png_level = -1;
 
     LOG_DEBUG("ms_add_thumbnail_spec width %d height %d\n", spec->width, spec->height);
 
@@ -526,6 +603,68 @@ ms_add_thumbnail_spec(MediaScan *s, enum thumb_format format, int width,
   }
 }                               /* ms_add_thumbnail_spec() */
 
+///-------------------------------------------------------------------------------------------------
+///  Set flags on an existing thumbnail spec.
+///
+/// @param [in,out] s If non-null, the.
+/// @param index      Zero-based index of the spec, in the order specs were added.
+/// @param flags      THUMB_* flags.
+///-------------------------------------------------------------------------------------------------
+
+void ms_set_thumbnail_spec_flags(MediaScan *s, int index, int flags) {
+  if (s == NULL) {
+    ms_errno = MSENO_NULLSCANOBJ;
+    LOG_ERROR("MediaScan = NULL, aborting\n");
+    return;
+  }
+
+  if (index < 0 || index >= s->nthumbspecs) {
+    ms_errno = MSENO_ILLEGALPARAMETER;
+    LOG_ERROR("Invalid thumbnail spec index %d\n", index);
+    return;
+  }
+
+  s->thumbspecs[index]->flags = flags;
+}                               /* ms_set_thumbnail_spec_flags() */
+
+///-------------------------------------------------------------------------------------------------
+///  Set the PNG compression options of an existing thumbnail spec.
+///
+/// @param [in,out] s If non-null, the.
+/// @param index      Zero-based index of the spec, in the order specs were added.
+/// @param level      zlib level 0-9, or -1 for the default.
+/// @param filters    THUMB_PNG_FILTER_* mask, or 0 for the default.
+/// @param strategy   THUMB_PNG_STRATEGY_* value.
+///-------------------------------------------------------------------------------------------------
+
+void ms_set_thumbnail_spec_png(MediaScan *s, int index, int level, int filters, int strategy) {
+  MediaScanThumbSpec *spec;
+
+  if (s == NULL) {
+    ms_errno = MSENO_NULLSCANOBJ;
+    LOG_ERROR("MediaScan = NULL, aborting\n");
+    return;
+  }
+
+  if (index < 0 || index >= s->nthumbspecs) {
+    ms_errno = MSENO_ILLEGALPARAMETER;
+    LOG_ERROR("Invalid thumbnail spec index %d\n", index);
+    return;
+  }
+
+  if (level < -1 || level > 9 || (filters & ~THUMB_PNG_FILTER_ALL)
+      || strategy < THUMB_PNG_STRATEGY_DEFAULT || strategy > THUMB_PNG_STRATEGY_RLE) {
+    ms_errno = MSENO_ILLEGALPARAMETER;
+    LOG_ERROR("Invalid PNG options: level %d, filters %x, strategy %d\n", level, filters, strategy);
+    return;
+  }
+
+  spec = s->thumbspecs[index];
+  spec->png_level = level;
+  spec->png_filters = filters;
+  spec->png_strategy = strategy;
+}                               /* ms_set_thumbnail_spec_png() */
+
 ///-------------------------------------------------------------------------------------------------
 ///  By default, scans are synchronous. This means the call to ms_scan will not return until
 ///   the scan is finished. To enable background asynchronous scanning, pass a true value to
@@ -554,6 +693,21 @@ void ms_set_cachedir(MediaScan *s, const char *path) {
   s->cachedir = strdup(path);
 }
 
+void ms_set_db_cachesize(MediaScan *s, uint32_t bytes) {
+  s->dbcachesize = bytes;
+}
+
+void ms_set_thumbnail_path(MediaScan *s, const char *template) {
+  if (s->thumbpath)
+    free(s->thumbpath);
+
+  s->thumbpath = strdup(template ? template : DEFAULT_THUMB_PATH);
+}
+
+void ms_set_thumbnail_cache_size(MediaScan *s, uint64_t max_bytes) {
+  s->thumbcache_size = max_bytes;
+}
+
 void ms_set_flags(MediaScan *s, int flags) {
   s->flags = flags;
 }
@@ -673,6 +827,20 @@ void ms_set_finish_callback(MediaScan *s, FinishCallback callback) {
   s->on_finish = callback;
 }
 
+///-------------------------------------------------------------------------------------------------
+/// Set a callback that will be called for each group of duplicate files found by a scan. This
+/// callback is optional, duplicate detection only runs when it is set.
+///-------------------------------------------------------------------------------------------------
+
+void ms_set_duplicate_callback(MediaScan *s, DuplicateCallback callback) {
+  if (s == NULL) {
+    ms_errno = MSENO_NULLSCANOBJ;
+    LOG_ERROR("MediaScan = NULL, aborting\n");
+    return;
+  }
+  s->on_duplicates = callback;
+}
+
 ///-------------------------------------------------------------------------------------------------
 ///  Set userdata.
 ///
@@ -727,6 +895,11 @@ void ms_async_process(MediaScan *s) {
         case EVENT_TYPE_FINISH:
           s->on_finish(s, s->userdata);
           break;
+
+        case EVENT_TYPE_DUPLICATES:
+          s->on_duplicates(s, (MediaScanDuplicates *)data, s->userdata);
+          duplicates_destroy((MediaScanDuplicates *)data);
+          break;
       }
     }
   }
@@ -962,6 +1135,18 @@ void send_result(MediaScan *s, MediaScanResult *r) {
   }
 }
 
+// Callback or notify about a group of duplicate files
+void send_duplicates(MediaScan *s, MediaScanDuplicates *d) {
+  if (s->thread) {
+    thread_queue_event(s->thread, EVENT_TYPE_DUPLICATES, (void *)d);
+  }
+  else {
+    // Call duplicate callback directly
+    s->on_duplicates(s, d, s->userdata);
+    duplicates_destroy(d);
+  }
+}
+
 // Callback or notify about scan being finished
 void send_finish(MediaScan *s) {
   if (s->thread) {
@@ -1001,6 +1186,8 @@ static void *do_scan(void *userdata) {
     goto out;
   }
 
+  duplicates_start(s);
+
   // Build a list of all directories and paths
   // We do this first so we can present an accurate scan eta later
   progress_start_phase(s->progress, "Discovering");
@@ -1016,11 +1203,16 @@ static void *do_scan(void *userdata) {
   while (!SIMPLEQ_EMPTY(dir_head)) {
     dir_entry = SIMPLEQ_FIRST(dir_head);
 
+    // Read the cache entries for the whole directory at once
+    if ((s->flags & MS_RESCAN) || (s->flags & MS_FULL_SCAN))
+      bdb_prefetch_dir(s, dir_entry->dir);
+
     file_head = dir_entry->files;
     while (!SIMPLEQ_EMPTY(file_head)) {
       // check if the scan has been aborted
       if (s->_want_abort) {
         LOG_DEBUG("Aborting scan\n");
+        bdb_flush(s);
         goto aborted;
       }
 
@@ -1064,6 +1256,17 @@ static void *do_scan(void *userdata) {
 
   LOG_DEBUG("Finished scanning\n");
 
+  // Commit the last batch of cache updates
+  bdb_flush(s);
+
+  if (s->_duplicates) {
+    // duplicates_finish counts the files it has to read
+    progress_start_phase(s->progress, "Finding duplicates");
+    s->progress->total = 0;
+    s->progress->done = 0;
+    duplicates_finish(s);
+  }
+
 out:
   if (s->on_finish)
     send_finish(s);
@@ -1144,12 +1347,13 @@ out:
 void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
   MediaScanError *e = NULL;
   MediaScanResult *r = NULL;
-  int ret;
+  int cached;
   uint32_t hash;
   int mtime = 0;
   uint64_t size = 0;
-  DBT key, data;
   char tmp_full_path[MAX_PATH_STR_LEN];
+  char old_path[MAX_PATH_STR_LEN];
+  BDBFileId fid;
 
 #ifdef WIN32
   char *ext = strrchr(full_path, '.');
@@ -1209,25 +1413,14 @@ void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
     return;
   }
 
-  // Setup DBT values
-  memset(&key, 0, sizeof(DBT));
-  memset(&data, 0, sizeof(DBT));
-  key.data = (char *)tmp_full_path;
-  key.size = strlen(tmp_full_path) + 1;
-  data.data = &hash;
-  data.size = sizeof(uint32_t);
+  duplicates_add(s, tmp_full_path, size);
 
   if ((s->flags & MS_RESCAN) || (s->flags & MS_FULL_SCAN)) {
     // s->dbp will be null if this function is called directly, if not check if this file is
     // already scanned.
-    if (s->dbp != NULL) {
-      // DB_GET_BOTH will only return OK if both key and data match, this avoids the need to check
-      // the returned data against hash
-      int ret = s->dbp->get(s->dbp, NULL, &key, &data, DB_GET_BOTH);
-      if (ret != DB_NOTFOUND) {
-        //  LOG_INFO("File %s already scanned, skipping\n", tmp_full_path);
-        return;
-      }
+    if (bdb_lookup(s, tmp_full_path, hash)) {
+      //  LOG_INFO("File %s already scanned, skipping\n", tmp_full_path);
+      return;
     }
   }
 
@@ -1253,23 +1446,34 @@ void ms_scan_file(MediaScan *s, const char *full_path, enum media_type type) {
   r->type = type;
   r->path = strdup(tmp_full_path);
 
-  if (result_scan(r)) {
-    // These were determined by HashFile
-    r->mtime = mtime;
-    r->size = size;
-    r->hash = hash;
-
-    // Store path -> hash data in cache
-    if (s->dbp != NULL) {
-      memset(&data, 0, sizeof(DBT));
-      data.data = &hash;
-      data.size = sizeof(uint32_t);
-
-      ret = s->dbp->put(s->dbp, NULL, &key, &data, 0);
-      if (ret != 0) {
-        s->dbp->err(s->dbp, ret, "Cache store failed: %s", db_strerror(ret));
-      }
-    }
+  // These were determined by HashFile, and identify the file to the thumbnail and result caches
+  r->mtime = mtime;
+  r->size = size;
+  r->hash = hash;
+
+  // A file that was moved keeps its stored result and thumbnails
+  memset(&fid, 0, sizeof(fid));
+  fid.size = size;
+  fid.mtime = mtime;
+
+  if (bdb_find_move(s, tmp_full_path, &fid, old_path)) {
+    LOG_INFO("File %s was moved from %s\n", tmp_full_path, old_path);
+    r->moved_from = strdup(old_path);
+    resultcache_move(s, r, old_path);
+    thumbcache_move(s, r, old_path);
+  }
+
+  // An unchanged file's stored result is replayed instead of scanning it again
+  cached = resultcache_get(s, r);
+
+  if (cached || result_scan(r)) {
+    if (!cached)
+      resultcache_put(s, r);
+
+    // Store path -> hash data in cache, written in batches by bdb_flush
+    bdb_put(s, tmp_full_path, hash);
+    bdb_put_file_id(s, tmp_full_path, &fid);
+
     send_result(s, r);
   }
   else {
@@ -1322,7 +1526,7 @@ void result_add_thumbnail(MediaScanResult *r, MediaScanImage *thumb) {
 MediaScanImage *ms_result_get_thumbnail(MediaScanResult *r, int index) {
   MediaScanImage *thumb = NULL;
 
-  if (r->nthumbnails >= index) {
+  if (index >= 0 && index < r->nthumbnails) {
     thumb = r->_thumbs[index];
   }
 
@@ -1333,7 +1537,7 @@ const uint8_t *ms_result_get_thumbnail_data(MediaScanResult *r, int index, int *
   uint8_t *ret = NULL;
   *length = 0;
 
-  if (r->nthumbnails >= index) {
+  if (index >= 0 && index < r->nthumbnails) {
     MediaScanImage *thumb = r->_thumbs[index];
     if (thumb->_dbuf) {
       Buffer *buf = (Buffer *)thumb->_dbuf;
@@ -1345,6 +1549,13 @@ const uint8_t *ms_result_get_thumbnail_data(MediaScanResult *r, int index, int *
   return (const uint8_t *)ret;
 }
 
+const char *ms_result_get_thumbnail_path(MediaScanResult *r, int index) {
+  if (index >= 0 && index < r->nthumbnails)
+    return r->_thumbs[index]->saved_path;
+
+  return NULL;
+}
+
 int ms_result_get_tag_count(MediaScanResult *r) {
   if (r->_tag)
     return r->_tag->nitems;
@@ -1355,9 +1566,34 @@ int ms_result_get_tag_count(MediaScanResult *r) {
 void ms_result_get_tag(MediaScanResult *r, int index, const char **key, const char **value) {
   MediaScanTag *t = r->_tag;
 
-  if (t && t->nitems >= index) {
+  if (t && index >= 0 && index < t->nitems) {
     MediaScanTagItem *ti = t->items[index];
     *key = (const char *)ti->key;
-    *value = (const char *)ti->value;
+    *value = tag_item_get_value(ti);
   }
 }
+
+const char *ms_result_get_tag_value(MediaScanResult *r, const char *key) {
+  MediaScanTagItem *ti;
+
+  if (!r->_tag || !(ti = tag_find_item(r->_tag, key)))
+    return NULL;
+
+  return tag_item_get_value(ti);
+}
+
+int ms_result_get_tag_data(MediaScanResult *r, int index, uint64_t *offset, uint32_t *size) {
+  MediaScanTag *t = r->_tag;
+
+  if (!t || index < 0 || index >= t->nitems || t->items[index]->type != TYPE_BINARY)
+    return 0;
+
+  *offset = t->items[index]->offset;
+  *size = t->items[index]->size;
+
+  return 1;
+}
+
+int ms_signature_distance(uint64_t a, uint64_t b) {
+  return popcount64(a ^ b);
+}
@@ -140,6 +140,8 @@ void send_result(MediaScan *s, MediaScanResult *r);
 
 void send_finish(MediaScan *s);
 
+void send_duplicates(MediaScan *s, MediaScanDuplicates *d);
+
 #ifdef WIN32
 
 ///-------------------------------------------------------------------------------------------------
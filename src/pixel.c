@@ -0,0 +1,239 @@
+
+#include <libmediascan.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "image.h"
+#include "pixel.h"
+
+// Row converters from the decoders' output formats into packed pix values.
+// Each has a portable version built on the COL macros, and an SSSE3 version
+// selected at runtime by pixel_init() on x86 CPUs that support it.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_SSSE3
+#include <tmmintrin.h>
+#endif
+
+static void rgb_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 3)
+    dst[x] = COL(src[0], src[1], src[2]);
+}
+
+static void bgr_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 3)
+    dst[x] = COL(src[2], src[1], src[0]);
+}
+
+static void bgrx_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 4)
+    dst[x] = COL(src[2], src[1], src[0]);
+}
+
+static void rgba_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 4)
+    dst[x] = COL_FULL(src[0], src[1], src[2], src[3]);
+}
+
+static void gray_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++)
+    dst[x] = COL(src[x], src[x], src[x]);
+}
+
+static void graya_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 2)
+    dst[x] = COL_FULL(src[0], src[0], src[0], src[1]);
+}
+
+static void cmyk_to_pix(uint32_t *dst, const unsigned char *src, int width) {
+  int x;
+
+  for (x = 0; x < width; x++, src += 4) {
+    int k = src[3];
+    dst[x] = COL((src[0] * k) / 255, (src[1] * k) / 255, (src[2] * k) / 255);
+  }
+}
+
+#ifdef PIXEL_SSSE3
+
+// x86 is little-endian, so a pix value is stored as the bytes A, B, G, R.
+// The shuffles below build that order directly, with 0x80 producing a zero
+// byte that is then filled with 0xFF alpha.
+
+#define PIXEL_TARGET __attribute__((target("ssse3")))
+
+PIXEL_TARGET static void rgb_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i shuf = _mm_setr_epi8(-128, 2, 1, 0, -128, 5, 4, 3, -128, 8, 7, 6, -128, 11, 10, 9);
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x = 0;
+
+  // Each load reads 16 bytes but only uses 12, stop while a full load still fits in the row
+  for (; x + 6 <= width; x += 4, src += 12) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+  }
+
+  rgb_to_pix(dst + x, src, width - x);
+}
+
+PIXEL_TARGET static void bgr_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i shuf = _mm_setr_epi8(-128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11);
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x = 0;
+
+  for (; x + 6 <= width; x += 4, src += 12) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+  }
+
+  bgr_to_pix(dst + x, src, width - x);
+}
+
+PIXEL_TARGET static void bgrx_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i shuf = _mm_setr_epi8(-128, 0, 1, 2, -128, 4, 5, 6, -128, 8, 9, 10, -128, 12, 13, 14);
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x = 0;
+
+  for (; x + 4 <= width; x += 4, src += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+  }
+
+  bgrx_to_pix(dst + x, src, width - x);
+}
+
+PIXEL_TARGET static void rgba_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i shuf = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  int x = 0;
+
+  for (; x + 4 <= width; x += 4, src += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_shuffle_epi8(v, shuf));
+  }
+
+  rgba_to_pix(dst + x, src, width - x);
+}
+
+PIXEL_TARGET static void gray_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i shuf0 = _mm_setr_epi8(-128, 0, 0, 0, -128, 1, 1, 1, -128, 2, 2, 2, -128, 3, 3, 3);
+  const __m128i shuf1 = _mm_setr_epi8(-128, 4, 4, 4, -128, 5, 5, 5, -128, 6, 6, 6, -128, 7, 7, 7);
+  const __m128i shuf2 = _mm_setr_epi8(-128, 8, 8, 8, -128, 9, 9, 9, -128, 10, 10, 10, -128, 11, 11, 11);
+  const __m128i shuf3 = _mm_setr_epi8(-128, 12, 12, 12, -128, 13, 13, 13, -128, 14, 14, 14, -128, 15, 15, 15);
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  int x = 0;
+
+  for (; x + 16 <= width; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_shuffle_epi8(v, shuf0), alpha));
+    _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_or_si128(_mm_shuffle_epi8(v, shuf1), alpha));
+    _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_or_si128(_mm_shuffle_epi8(v, shuf2), alpha));
+    _mm_storeu_si128((__m128i *)(dst + x + 12), _mm_or_si128(_mm_shuffle_epi8(v, shuf3), alpha));
+  }
+
+  gray_to_pix(dst + x, src + x, width - x);
+}
+
+PIXEL_TARGET static void graya_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i shuf0 = _mm_setr_epi8(1, 0, 0, 0, 3, 2, 2, 2, 5, 4, 4, 4, 7, 6, 6, 6);
+  const __m128i shuf1 = _mm_setr_epi8(9, 8, 8, 8, 11, 10, 10, 10, 13, 12, 12, 12, 15, 14, 14, 14);
+  int x = 0;
+
+  for (; x + 8 <= width; x += 8, src += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_shuffle_epi8(v, shuf0));
+    _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_shuffle_epi8(v, shuf1));
+  }
+
+  graya_to_pix(dst + x, src, width - x);
+}
+
+// Exact x / 255 for x <= 255 * 255
+PIXEL_TARGET static inline __m128i div255_epi16(__m128i x) {
+  x = _mm_add_epi16(x, _mm_add_epi16(_mm_set1_epi16(1), _mm_srli_epi16(x, 8)));
+  return _mm_srli_epi16(x, 8);
+}
+
+PIXEL_TARGET static void cmyk_to_pix_ssse3(uint32_t *dst, const unsigned char *src, int width) {
+  const __m128i kshuf = _mm_setr_epi8(3, 3, 3, 3, 7, 7, 7, 7, 11, 11, 11, 11, 15, 15, 15, 15);
+  const __m128i shuf = _mm_setr_epi8(-128, 2, 1, 0, -128, 6, 5, 4, -128, 10, 9, 8, -128, 14, 13, 12);
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+
+  for (; x + 4 <= width; x += 4, src += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i k = _mm_shuffle_epi8(v, kshuf);
+    __m128i lo = div255_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpacklo_epi8(k, zero)));
+    __m128i hi = div255_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), _mm_unpackhi_epi8(k, zero)));
+    v = _mm_packus_epi16(lo, hi);
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+  }
+
+  cmyk_to_pix(dst + x, src, width - x);
+}
+
+#endif // PIXEL_SSSE3
+
+pixel_row_func pixel_rgb_to_pix = rgb_to_pix;
+pixel_row_func pixel_bgr_to_pix = bgr_to_pix;
+pixel_row_func pixel_bgrx_to_pix = bgrx_to_pix;
+pixel_row_func pixel_rgba_to_pix = rgba_to_pix;
+pixel_row_func pixel_gray_to_pix = gray_to_pix;
+pixel_row_func pixel_graya_to_pix = graya_to_pix;
+pixel_row_func pixel_cmyk_to_pix = cmyk_to_pix;
+
+// Palette lookups don't vectorize without a gather, so this is just an unrolled loop
+void pixel_palette_to_pix(uint32_t *dst, const unsigned char *src, int width, const uint32_t *palette) {
+  int x = 0;
+
+  for (; x + 4 <= width; x += 4) {
+    dst[x] = palette[src[x]];
+    dst[x + 1] = palette[src[x + 1]];
+    dst[x + 2] = palette[src[x + 2]];
+    dst[x + 3] = palette[src[x + 3]];
+  }
+
+  for (; x < width; x++)
+    dst[x] = palette[src[x]];
+}
+
+// Go back to the portable converters, the tests compare them with the SIMD ones
+void pixel_init_portable(void) {
+  pixel_rgb_to_pix = rgb_to_pix;
+  pixel_bgr_to_pix = bgr_to_pix;
+  pixel_bgrx_to_pix = bgrx_to_pix;
+  pixel_rgba_to_pix = rgba_to_pix;
+  pixel_gray_to_pix = gray_to_pix;
+  pixel_graya_to_pix = graya_to_pix;
+  pixel_cmyk_to_pix = cmyk_to_pix;
+}
+
+void pixel_init(void) {
+#ifdef PIXEL_SSSE3
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("ssse3")) {
+    LOG_DEBUG("Using SSSE3 pixel converters\n");
+    pixel_rgb_to_pix = rgb_to_pix_ssse3;
+    pixel_bgr_to_pix = bgr_to_pix_ssse3;
+    pixel_bgrx_to_pix = bgrx_to_pix_ssse3;
+    pixel_rgba_to_pix = rgba_to_pix_ssse3;
+    pixel_gray_to_pix = gray_to_pix_ssse3;
+    pixel_graya_to_pix = graya_to_pix_ssse3;
+    pixel_cmyk_to_pix = cmyk_to_pix_ssse3;
+  }
+#endif
+}
@@ -0,0 +1,19 @@
+#ifndef _PIXEL_H
+#define _PIXEL_H
+
+// Convert one row of width pixels from a decoder's output format to packed pix values
+typedef void (*pixel_row_func) (uint32_t *dst, const unsigned char *src, int width);
+
+extern pixel_row_func pixel_rgb_to_pix;     // R, G, B
+extern pixel_row_func pixel_bgr_to_pix;     // B, G, R
+extern pixel_row_func pixel_bgrx_to_pix;    // B, G, R, unused
+extern pixel_row_func pixel_rgba_to_pix;    // R, G, B, A
+extern pixel_row_func pixel_gray_to_pix;    // Y
+extern pixel_row_func pixel_graya_to_pix;   // Y, A
+extern pixel_row_func pixel_cmyk_to_pix;    // Inverted C, M, Y, K as written by Photoshop
+
+void pixel_palette_to_pix(uint32_t *dst, const unsigned char *src, int width, const uint32_t *palette);
+void pixel_init(void);
+void pixel_init_portable(void);
+
+#endif // _PIXEL_H
@@ -31,8 +31,11 @@
 #include "error.h"
 #include "video.h"
 #include "audio.h"
+#include "audio_mp4.h"
+#include "loudness.h"
 #include "image.h"
 #include "thumb.h"
+#include "thumbcache.h"
 #include "util.h"
 #include "mediascan.h"
 #include "tag.h"
@@ -41,44 +44,8 @@
 #include "libdlna/dlna.h"
 #include "libdlna/profiles.h"
 
-// Audio formats
-//#include "wav.h"
-
 const char CODEC_MP1[] = "mp1";
 
-// *INDENT-OFF*
-static type_ext audio_types[] = {
-/*
-  {"mp4", {"mp4", "m4a", "m4b", "m4p", "m4v", "m4r", "k3g", "skm", "3gp", "3g2", "mov", 0}},
-  {"aac", {"aac", 0}},
-  {"mp3", {"mp3", "mp2", 0}},
-  {"ogg", {"ogg", "oga", 0}},
-  {"mpc", {"mpc", "mp+", "mpp", 0}},
-  {"ape", {"ape", "apl", 0}},
-  {"flc", {"flc", "flac", "fla", 0}},
-  {"asf", {"wma", "asf", "wmv", 0}},
-*/
-  {"wav", {"wav", "aif", "aiff", 0}},
-//  {"wvp", {"wv", 0}},
-  {0, {0, 0}}
-};
-
-static type_handler audio_handlers[] = {
-/*
-  { "mp4", get_mp4tags, 0, mp4_find_frame, mp4_find_frame_return_info },
-  { "aac", get_aacinfo, 0, 0, 0 },
-  { "mp3", get_mp3tags, get_mp3fileinfo, mp3_find_frame, 0 },
-  { "ogg", get_ogg_metadata, 0, ogg_find_frame, 0 },
-  { "mpc", get_ape_metadata, get_mpcfileinfo, 0, 0 },
-  { "ape", get_ape_metadata, get_macfileinfo, 0, 0 },
-  { "flc", get_flac_metadata, 0, flac_find_frame, 0 },
-  { "asf", get_asf_metadata, 0, asf_find_frame, 0 },
-  { "wav", wav_scan },
-  { "wvp", get_ape_metadata, get_wavpack_info, 0 },
-*/
-  {NULL, 0}
-};
-
 // MIME type extension mappings
 static const struct {
   const char *extensions;
@@ -94,8 +61,8 @@ static const struct {
 // http://wiki.xiph.org/MIME_Types_and_File_Extensions
 // The following MIME types are now officially registered with IANA and specified with the IETF as RFC 5334
 // http://tools.ietf.org/html/rfc5215
-	{ "flac",											"audio/flac" },
-	{ "oga,ogg,spx",									"audio/ogg" },
+	{ "flac,fla",										"audio/flac" },
+	{ "oga,ogg,spx,opus",								"audio/ogg" },
 	{ "ogv",											"video/ogg" },
 
 	{ "mov",											"video/x-quicktime" },
@@ -122,6 +89,7 @@ static const struct {
 
 // http://tools.ietf.org/html/rfc2361
   { "wav",											"audio/vnd.wave" },
+  { "aif,aiff,aifc",						"audio/x-aiff" },
 	
 // http://real.custhelp.com/cgi-bin/real.cfg/php/enduser/std_adp.php?p_faqid=2559&p_created=&p_sid=uz4Tpoti&p_lva=1085179956&p_sp=2559&p_li=cF9zcmNoPTEmcF9zb3J0X2J5PSZwX2dyaWRzb3J0PSZwX3Jvd19jbnQ9MSZwX3Byb2RzPTMsMTEmcF9jYXRzPSZwX3B2PTIuMTEmcF9jdj0mcF9zZWFyY2hfdHlwZT1hbnN3ZXJzLmFfaWQmcF9wYWdlPTEmcF9zZWFyY2hfdGV4dD0yNTU5cF9zcmNoPTEmcF9zb3J0X2J5PSZwX2dyaWRzb3J0PSZwX3Jvd19jbnQ9MyZwX3Byb2RzPTMsMTEmcF9jYXRzPSZwX3B2PTIuMTEmcF9jdj0mcF9zZWFyY2hfdHlwZT1hbnN3ZXJzLnNlYXJjaF9ubCZwX3BhZ2U9MSZwX3NlYXJjaF90ZXh0PU1JTUU*&p_prod_lvl1=3&p_prod_lvl2=11&tabName=tab0&p_topview=1
   { "ra,ram",										"audio/vnd.rn-realaudio" },
@@ -171,6 +139,12 @@ static const struct {
 	// http://en.wikipedia.org/wiki/BMP_file_format
   { "bmp",											"image/x-ms-bmp"   },
 
+	// Camera RAW formats, none of these are registered
+  { "cr2",                      "image/x-canon-cr2" },
+  { "nef",                      "image/x-nikon-nef" },
+  { "arw",                      "image/x-sony-arw" },
+  { "dng",                      "image/x-adobe-dng" },
+
   { NULL, 0 }
 };
 // *INDENT-ON*
@@ -186,36 +160,16 @@ static const struct {
 ///-------------------------------------------------------------------------------------------------
 
 static void scan_dlna_profile(MediaScanResult *r, av_codecs_t *codecs) {
-  dlna_registered_profile_t *p;
-  dlna_profile_t *profile = NULL;
+  dlna_profile_t *profile;
   dlna_container_type_t st;
   AVFormatContext *avf = (AVFormatContext *)r->_avf;
   dlna_t *dlna = (dlna_t *)((MediaScan *)r->_scan)->_dlna;
 
   st = stream_get_container(avf);
 
-  p = dlna->first_profile;
-  while (p) {
-    dlna_profile_t *prof = NULL;
-
-    if (r->flags & MS_USE_EXTENSION) {
-      if (p->extensions) {
-        /* check for valid file extension */
-        if (!match_file_extension(r->path, p->extensions)) {
-          p = p->next;
-          continue;
-        }
-      }
-    }
-
-    prof = p->probe(avf, st, codecs);
-    if (prof) {
-      profile = prof;
-      profile->class = p->class;
-      break;
-    }
-    p = p->next;
-  }
+  // Only the profiles indexed for this container and codecs are probed, and files encoded
+  // the same way as a recent one reuse its result
+  profile = dlna_probe_media_profile(dlna, avf, st, codecs, r->path, r->flags & MS_USE_EXTENSION);
 
   if (profile) {
     r->mime_type = profile->mime;
@@ -275,6 +229,296 @@ static const char *find_mime_type(const char *path) {
   return NULL;
 }
 
+// Add a thumbnail made from spec index to the result, writing it to disk first if wanted
+static void add_thumbnail(MediaScan *s, MediaScanResult *r, MediaScanImage *thumb, int index) {
+  if (s->thumbpath)
+    thumb_save(s, thumb, index);
+
+  result_add_thumbnail(r, thumb);
+}
+
+// Index of the spec the signature is computed with, the smallest, or -1 if signatures are off
+static int signature_spec(MediaScan *s) {
+  int x, area, best = -1, best_area = 0;
+
+  if (!(s->flags & MS_IMAGE_SIGNATURES))
+    return -1;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    MediaScanThumbSpec *spec = s->thumbspecs[x];
+    int w = spec->width ? spec->width : spec->height;
+    int h = spec->height ? spec->height : spec->width;
+
+    area = w * h;
+    if (best < 0 || area < best_area) {
+      best = x;
+      best_area = area;
+    }
+  }
+
+  return best;
+}
+
+// Create the thumbnail for spec index from src, and keep a copy in the thumbnail cache
+static void create_thumbnail(MediaScan *s, MediaScanResult *r, MediaScanImage *src, int index) {
+  MediaScanImage *thumb = thumb_create_from_image(src, s->thumbspecs[index], index == signature_spec(s) ? r : NULL);
+
+  if (thumb) {
+    thumbcache_put(s, r, index, thumb);
+    add_thumbnail(s, r, thumb, index);
+  }
+}
+
+// Look up every spec in the thumbnail cache, returns the number of thumbnails that still need creating
+static int get_cached_thumbnails(MediaScan *s, MediaScanResult *r, MediaScanImage **cached) {
+  int x, missing = 0;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    cached[x] = thumbcache_get(s, r, x);
+    if (!cached[x])
+      missing++;
+  }
+
+  // The signature is computed while making the smallest thumbnail, so it has to be made again
+  // if it was cached without one
+  x = signature_spec(s);
+  if (x >= 0 && cached[x] && !r->has_signature) {
+    image_destroy(cached[x]);
+    cached[x] = NULL;
+    missing++;
+  }
+
+  return missing;
+}
+
+// Find the largest spec that will be created from the given source image
+static MediaScanThumbSpec *largest_spec_for(MediaScan *s, MediaScanImage **src, MediaScanImage *i) {
+  int x;
+  MediaScanThumbSpec *largest_spec = NULL;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    int sw = s->thumbspecs[x]->width;
+    int sh = s->thumbspecs[x]->height;
+
+    if (src[x] != i)
+      continue;
+
+    if (!largest_spec || (sw > largest_spec->width || sh > largest_spec->height))
+      largest_spec = s->thumbspecs[x];
+  }
+
+  return largest_spec;
+}
+
+// Create every thumbnail that wasn't cached from an embedded picture, at offset in the file of r,
+// or in data if offset is 0. Returns 0 if the picture can't be decoded, nothing is added then.
+// The picture is read through a result of its own, so the image readers don't change the mime
+// type or DLNA profile of r.
+static int create_thumbnails_from_picture(MediaScan *s, MediaScanResult *r, MediaScanImage **cached,
+                                          Buffer *data, uint64_t offset) {
+  MediaScanResult pr;
+  MediaScanImage *i = NULL;
+  MediaScanImage *src[MAX_THUMBS];
+  MediaScanThumbSpec *largest_spec;
+  Buffer buf;
+  int x, ret = 0;
+
+  memset(&pr, 0, sizeof(pr));
+  pr.type = TYPE_IMAGE;
+  pr.path = r->path;
+  pr.size = r->size;
+  pr.flags = r->flags;
+  pr._scan = s;
+
+  buffer_init(&buf, BUF_SIZE);
+
+  if (offset) {
+    pr._fp = r->_fp;
+    pr._buf = (void *)&buf;
+
+    if (SeekFile(r->_fp, (int64_t)offset, SEEK_SET) != 0 || !buffer_check_load(&buf, r->_fp, 8, BUF_SIZE))
+      goto out;
+  }
+  else {
+    pr._buf = (void *)data;
+
+    if (buffer_len(data) < 8)
+      goto out;
+  }
+
+  i = image_create();
+  i->path = r->path;
+
+  if (!image_read_header(i, &pr, 0)) {
+    LOG_DEBUG("Unable to read embedded picture (%s)\n", r->path);
+    goto out;
+  }
+
+  LOG_DEBUG("Using embedded %s picture of %d x %d for thumbnails (%s)\n", i->codec, i->width, i->height, r->path);
+
+  for (x = 0; x < s->nthumbspecs; x++)
+    src[x] = cached[x] ? NULL : i;
+
+  // A JPEG is scaled down while it's decoded
+  largest_spec = largest_spec_for(s, src, i);
+  if (largest_spec && !image_load(i, largest_spec))
+    goto out;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    if (cached[x])
+      add_thumbnail(s, r, cached[x], x);
+    else
+      create_thumbnail(s, r, i, x);
+  }
+
+  ret = 1;
+
+out:
+  if (i)
+    image_destroy(i);
+
+  // A JPEG picture may have had its EXIF data read
+  if (pr._tag)
+    tag_destroy(pr._tag);
+
+  buffer_free(&buf);
+
+  return ret;
+}
+
+// Create thumbnails from the cover art in the tags of an audio file
+static void create_audio_thumbnails(MediaScan *s, MediaScanResult *r) {
+  MediaScanImage *cached[MAX_THUMBS];
+  Buffer data;
+  uint64_t offset;
+  uint32_t size;
+  int x;
+
+  if (!get_cached_thumbnails(s, r, cached)) {
+    for (x = 0; x < s->nthumbspecs; x++)
+      add_thumbnail(s, r, cached[x], x);
+    return;
+  }
+
+  buffer_init(&data, 0);
+
+  if (!tag_find_picture(r, &data, &offset, &size)
+      || !create_thumbnails_from_picture(s, r, cached, &data, offset)) {
+    for (x = 0; x < s->nthumbspecs; x++) {
+      if (cached[x])
+        image_destroy(cached[x]);
+    }
+  }
+
+  buffer_free(&data);
+}
+
+// Scan an audio file with the native parsers in audio.c, FFmpeg isn't needed for any of them
+static int scan_audio(MediaScanResult *r) {
+  MediaScanAudio *a = NULL;
+  MediaScan *s = (MediaScan *)r->_scan;
+  int ret = 1;
+
+  if (!ensure_opened_with_buf(r, 10)) {
+    r->error = error_create(r->path, MS_ERROR_FILE, "Unable to open file for reading");
+    ret = 0;
+    goto out;
+  }
+
+  a = r->audio = audio_create();
+
+  if (!audio_read_header(a, r)) {
+    // The parser may have set a more specific error
+    if (!r->error)
+      r->error = error_create(r->path, MS_ERROR_READ, "Invalid, corrupt or unsupported audio file");
+    ret = 0;
+    goto out;
+  }
+
+  // Guess a mime type based on the file extension
+  if (!r->mime_type) {
+    r->mime_type = find_mime_type(r->path);
+  }
+
+  // Thumbnails of an audio file are made from its cover art
+  if (s->nthumbspecs)
+    create_audio_thumbnails(s, r);
+
+  // Loudness needs every sample decoded, so it is only measured when asked for
+  if (s->flags & MS_AUDIO_LOUDNESS)
+    loudness_scan(r);
+
+out:
+  // Close the file here, to avoid stacking up a bunch of open files in async mode
+  if (r->_fp) {
+    fclose(r->_fp);
+    r->_fp = NULL;
+  }
+
+  return ret;
+}
+
+// Create thumbnails from the cover art of a video file. Matroska keeps it as an attachment, which
+// FFmpeg has already read, and MP4 in its iTunes tags. Returns 0 if there is none.
+static int create_video_cover_thumbnails(MediaScan *s, MediaScanResult *r, MediaScanImage **cached) {
+  AVFormatContext *avf = (AVFormatContext *)r->_avf;
+  Buffer data;
+  uint64_t offset = 0;
+  uint32_t size;
+  unsigned int x;
+  int ret = 0;
+
+  buffer_init(&data, 0);
+
+  for (x = 0; x < avf->nb_streams; x++) {
+    AVStream *st = avf->streams[x];
+    AVDictionaryEntry *mime = av_dict_get(st->metadata, "mimetype", NULL, 0);
+    AVDictionaryEntry *filename = av_dict_get(st->metadata, "filename", NULL, 0);
+
+    if (st->codec->codec_type != AVMEDIA_TYPE_ATTACHMENT || !st->codec->extradata_size || !mime
+        || (strcasecmp(mime->value, "image/jpeg") && strcasecmp(mime->value, "image/png")))
+      continue;
+
+    // The Matroska cover is named cover.jpg or cover.png, other pictures are used if there isn't one
+    if (filename && !strncasecmp(filename->value, "cover.", 6)) {
+      buffer_clear(&data);
+      buffer_append(&data, st->codec->extradata, st->codec->extradata_size);
+      break;
+    }
+
+    if (!buffer_len(&data))
+      buffer_append(&data, st->codec->extradata, st->codec->extradata_size);
+  }
+
+  if (buffer_len(&data)) {
+    ret = create_thumbnails_from_picture(s, r, cached, &data, 0);
+  }
+  else if (strstr(avf->iformat->name, "mp4") && ensure_opened_with_buf(r, 8)) {
+    // FFmpeg has read the tags already, these are only looked at for the picture
+    MediaScanTag *tag = r->_tag;
+
+    r->_tag = NULL;
+
+    if (audio_mp4_read_tags(r) && tag_find_picture(r, &data, &offset, &size))
+      ret = create_thumbnails_from_picture(s, r, cached, &data, offset);
+
+    if (r->_tag)
+      tag_destroy(r->_tag);
+
+    r->_tag = tag;
+  }
+
+  // Close the file here, to avoid stacking up a bunch of open files in async mode
+  if (r->_fp) {
+    fclose(r->_fp);
+    r->_fp = NULL;
+  }
+
+  buffer_free(&data);
+
+  return ret;
+}
+
 ///-------------------------------------------------------------------------------------------------
 ///  Scan a video file with libavformat
 ///
@@ -339,12 +583,11 @@ static int scan_video(MediaScanResult *r) {
   }
 
   if (stream_ctx_is_audio(codecs)) {
-    // XXX some extensions (e.g. mp4) can be either video or audio,
-    // if after checking we don't find a video stream, we need to
-    // send the result through the audio path
-    r->error =
-      error_create(r->path, MS_ERROR_READ, "Skipping audio file passed to scan_video. (This will be fixed later.)");
-    ret = 0;
+    // Some extensions (e.g. mp4) can be either video or audio, without a video stream
+    // the file goes through the audio path instead
+    LOG_INFO("No video stream in %s, scanning as audio\n", r->path);
+    r->type = TYPE_AUDIO;
+    ret = scan_audio(r);
     goto out;
   }
 
@@ -431,22 +674,33 @@ static int scan_video(MediaScanResult *r) {
     tag_add_item(r->_tag, tag->key, tag->value);
   }
 
-  // Create thumbnail(s) if we found a valid video decoder above
+  // Create thumbnail(s) from cover art, or a frame if we found a valid video decoder above
   s = (MediaScan *)r->_scan;
-  if (s->nthumbspecs && v->_avc) {
+  if (s->nthumbspecs) {
     int x;
-    MediaScanImage *i = video_create_image_from_frame(v, r);  // Decode and load a frame of video we'll use for the thumbnail
-    if (i) {
-      // XXX sort from biggest to smallest, resize in series
+    MediaScanImage *cached[MAX_THUMBS];
+    MediaScanImage *i = NULL;
 
-      for (x = 0; x < s->nthumbspecs; x++) {
-        MediaScanImage *thumb = thumb_create_from_image(i, s->thumbspecs[x]);
-        if (thumb)
-          result_add_thumbnail(r, thumb);
-      }
+    // Cover art spares decoding a frame of video, which is only needed if the thumbnails weren't all cached
+    if (get_cached_thumbnails(s, r, cached)) {
+      if (create_video_cover_thumbnails(s, r, cached))
+        goto out;
 
-      image_destroy(i);
+      if (v->_avc)
+        i = video_create_image_from_frame(v, r);
+    }
+
+    // XXX sort from biggest to smallest, resize in series
+
+    for (x = 0; x < s->nthumbspecs; x++) {
+      if (cached[x])
+        add_thumbnail(s, r, cached[x], x);
+      else if (i)
+        create_thumbnail(s, r, i, x);
     }
+
+    if (i)
+      image_destroy(i);
   }
 
 out:
@@ -461,6 +715,7 @@ out:
 static int scan_image(MediaScanResult *r) {
   int ret = 1;
   MediaScanImage *i = NULL;
+  MediaScanImage *preview = NULL;
   MediaScan *s;
   int w, h;
 
@@ -474,7 +729,9 @@ static int scan_image(MediaScanResult *r) {
   i = r->image = image_create();
   i->path = r->path;
 
-  if (!image_read_header(i, r)) {
+  // Without thumbnails there's no need to set up any decoders
+  s = (MediaScan *)r->_scan;
+  if (!image_read_header(i, r, !s->nthumbspecs)) {
     r->error = error_create(r->path, MS_ERROR_READ, "Invalid or corrupt image file");
     ret = 0;
     goto out;
@@ -490,30 +747,61 @@ static int scan_image(MediaScanResult *r) {
   h = i->height;
 
   // Create thumbnail(s)
-  s = (MediaScan *)r->_scan;
   if (s->nthumbspecs) {
     int x;
-    MediaScanThumbSpec *largest_spec = NULL;
+    MediaScanThumbSpec *largest_spec;
+    MediaScanImage *src[MAX_THUMBS];
+    MediaScanImage *cached[MAX_THUMBS];
+    int decodable = image_is_decodable(i);
+
+    // Nothing needs to be decoded if every thumbnail was cached by an earlier scan
+    if (!get_cached_thumbnails(s, r, cached)) {
+      for (x = 0; x < s->nthumbspecs; x++)
+        add_thumbnail(s, r, cached[x], x);
+
+      goto out;
+    }
+
+    // Pick the source for each thumbnail, the embedded preview is used where allowed and large enough.
+    // Formats we can't decode (RAW) always use their preview.
+    if (!decodable || thumb_want_embedded(s))
+      preview = image_get_embedded(i);
 
-    // Figure out the largest size we're thumbnailing
     for (x = 0; x < s->nthumbspecs; x++) {
-      int sw = s->thumbspecs[x]->width;
-      int sh = s->thumbspecs[x]->height;
-      if (!largest_spec || (sw > largest_spec->width || sh > largest_spec->height))
-        largest_spec = s->thumbspecs[x];
+      src[x] = i;
+      if (preview && (!decodable || thumb_embedded_usable(i, preview, s->thumbspecs[x])))
+        src[x] = preview;
     }
 
-    // Load the source image into memory, we pass the spec to give a hint
+    if (preview) {
+      largest_spec = largest_spec_for(s, src, preview);
+
+      // Fall back to the full image if the preview can't be decoded
+      if (largest_spec && !image_load(preview, largest_spec)) {
+        LOG_DEBUG("Unable to decode embedded preview, using full image (%s)\n", r->path);
+        for (x = 0; x < s->nthumbspecs; x++)
+          src[x] = i;
+      }
+    }
+
+    // Load the source image into memory if still needed, we pass the spec to give a hint
     // to the loader when it can optimize the loaded size (JPEG)
-    if (!image_load(i, largest_spec))
+    largest_spec = largest_spec_for(s, src, i);
+    if (largest_spec && !image_load(i, largest_spec)) {
+      for (x = 0; x < s->nthumbspecs; x++) {
+        if (cached[x])
+          image_destroy(cached[x]);
+      }
       goto out;
+    }
 
     // XXX sort specs from biggest to smallest, resize in series
 
     for (x = 0; x < s->nthumbspecs; x++) {
-      MediaScanImage *thumb = thumb_create_from_image(i, s->thumbspecs[x]);
-      if (thumb)
-        result_add_thumbnail(r, thumb);
+      if (cached[x])
+        add_thumbnail(s, r, cached[x], x);
+      else
+        create_thumbnail(s, r, src[x], x);
     }
   }
 
@@ -522,6 +810,9 @@ static int scan_image(MediaScanResult *r) {
   i->height = h;
 
 out:
+  if (preview)
+    image_destroy(preview);
+
   // Close the file here, to avoid stacking up a bunch of open files in async mode
   if (r->_fp) {
     fclose(r->_fp);
@@ -590,6 +881,10 @@ int result_scan(MediaScanResult *r) {
       return scan_image(r);
       break;
 
+    case TYPE_AUDIO:
+      return scan_audio(r);
+      break;
+
     default:
       break;
   }
@@ -616,6 +911,9 @@ void result_destroy(MediaScanResult *r) {
   if (r->path)
     free(r->path);
 
+  if (r->moved_from)
+    free(r->moved_from);
+
   if (r->error)
     error_destroy(r->error);
 
@@ -665,6 +963,10 @@ void ms_dump_result(MediaScanResult *r) {
   int i;
 
   LOG_OUTPUT("%s\n", r->path);
+  if (r->moved_from)
+    LOG_OUTPUT("  Moved from:   %s\n", r->moved_from);
+  if (r->has_signature)
+    LOG_OUTPUT("  Signature:    %016llx, color %06x\n", (unsigned long long)r->signature, r->color);
   LOG_OUTPUT("  MIME type:    %s\n", r->mime_type);
   LOG_OUTPUT("  DLNA profile: %s\n", r->dlna_profile);
   LOG_OUTPUT("  File size:    %llu\n", r->size);
@@ -699,6 +1001,10 @@ void ms_dump_result(MediaScanResult *r) {
       LOG_OUTPUT("    Bitrate:    %d bps\n", r->audio->bitrate);
       LOG_OUTPUT("    Samplerate: %d kHz\n", r->audio->samplerate);
       LOG_OUTPUT("    Channels:   %d\n", r->audio->channels);
+      if (r->audio->has_loudness) {
+        LOG_OUTPUT("    Loudness:   %.1f LUFS\n", r->audio->loudness);
+        LOG_OUTPUT("    True peak:  %.1f dBTP\n", r->audio->true_peak);
+      }
       break;
 
     default:
@@ -709,6 +1015,10 @@ void ms_dump_result(MediaScanResult *r) {
   for (i = 0; i < r->nthumbnails; i++) {
     Buffer *dbuf;
     MediaScanImage *thumb = r->_thumbs[i];
+    if (thumb->saved_path) {
+      LOG_OUTPUT("    Thumbnail:  %d x %d %s (%s)\n", thumb->width, thumb->height, thumb->codec, thumb->saved_path);
+      continue;
+    }
     if (!thumb->_dbuf)
       continue;
     dbuf = (Buffer *)thumb->_dbuf;
@@ -721,6 +1031,8 @@ void ms_dump_result(MediaScanResult *r) {
       char file[MAX_PATH_STR_LEN];
       if (!strcmp("JPEG", thumb->codec))
         sprintf(file, "thumb%d.jpg", tcount++);
+      else if (!strcmp("WebP", thumb->codec))
+        sprintf(file, "thumb%d.webp", tcount++);
       else
         sprintf(file, "thumb%d.png", tcount++);
       tfp = fopen(file, "wb");
@@ -731,70 +1043,3 @@ void ms_dump_result(MediaScanResult *r) {
 #endif
   }
 }                               /* ms_dump_result() */
-
-/*
-static type_handler *
-get_type_handler(char *ext, type_ext *types, type_handler *handlers)
-{
-  int typeindex = -1;
-  int i, j;
-  type_handler *hdl = NULL;
-  
-  for (i = 0; typeindex == -1 && types[i].type; i++) {
-    for (j = 0; typeindex == -1 && types[i].ext[j]; j++) {
-#ifdef _MSC_VER
-      if (!stricmp(types[i].ext[j], ext)) {
-#else
-      if (!strcasecmp(types[i].ext[j], ext)) {
-#endif
-        typeindex = i;
-        break;
-      }
-    }
-  }
-  
-  LOG_DEBUG("typeindex: %d\n", typeindex);
-    
-  if (typeindex > -1) {
-    for (hdl = handlers; hdl->type; ++hdl)
-      if (!strcmp(hdl->type, types[typeindex].type))
-        break;
-  }
-  
-  if (hdl)
-    LOG_DEBUG("type handler: %s\n", hdl->type);
-  
-  return hdl;
-}
-
-static void
-scan_audio(ScanData s)
-{
-  char *ext = strrchr(s->path, '.');
-  if (ext == NULL)
-    return;
-  
-  type_handler *hdl = get_type_handler(ext + 1, audio_types, audio_handlers);
-  if (hdl == NULL)
-    return;
-  
-  // Open the file unless we already have an open fd
-  int opened = s->fp != NULL;
-  if (!opened) {
-    if ((s->fp = fopen(s->path, "rb")) == NULL) {
-      LOG_WARN("Cannot open %s: %s\n", s->path, strerror(errno));
-      return;
-    }
-  }
-
-  hdl->scan(s);
-
-  // Close the file if we opened it
-  if (!opened) {
-    fclose(s->fp);
-    s->fp = NULL;
-  }
-  
-  return;
-}
-*/
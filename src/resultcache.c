@@ -0,0 +1,532 @@
+
+#include <libmediascan.h>
+#include <stdlib.h>
+#include <string.h>
+#include <db.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include "common.h"
+#include "buffer.h"
+#include "audio.h"
+#include "image.h"
+#include "video.h"
+#include "result.h"
+#include "mediascan.h"
+#include "tag.h"
+#include "thumb.h"
+#include "resultcache.h"
+#include "thumbcache.h"
+#include "database.h"
+#include "util.h"
+
+// Persistent store of complete scan results, enabled by the MS_CACHE_RESULTS flag.
+//
+// Each result is serialized into a compact native-endian record keyed by path, so a later scan
+// can rebuild it without opening the file. Like the thumbnail cache it lives in its own BDB file,
+// which means it survives MS_FULL_SCAN clearing the main database. Records are only replayed
+// if the file's HashFile identity and the thumbnail specs in use both still match. Thumbnails
+// the thumbnail cache holds are stored as a reference to it rather than a second copy.
+
+typedef struct {
+  DB *dbp;
+  int failed;                   // set if the database couldn't be opened, the cache is then skipped
+} ResultCache;
+
+typedef struct {
+  uint32_t version;
+  uint32_t hash;                // file identity from HashFile
+  uint32_t spec_hash;           // thumbnail specs the stored thumbnails were made with
+} ResultCacheHeader;
+
+// Bump when the record layout changes, older records are then ignored
+#define RESULTCACHE_VERSION 5
+
+static ResultCache *resultcache_open(MediaScan *s) {
+  ResultCache *rc = (ResultCache *)s->_resultcache;
+  char dbpath[MAX_PATH_STR_LEN];
+  DB_ENV *env = NULL;
+  int ret;
+
+  if (rc)
+    return rc->failed ? NULL : rc;
+
+  // With a shared cache dir, open the database in the locking environment of the scan database
+  if ((s->flags & MS_SHARED_CACHE) && !(env = bdb_env(s)))
+    return NULL;
+
+  rc = (ResultCache *)calloc(sizeof(ResultCache), 1);
+  s->_resultcache = (void *)rc;
+  LOG_MEM("new ResultCache @ %p\n", rc);
+
+  snprintf(dbpath, sizeof(dbpath), "%s/results.db", s->cachedir ? s->cachedir : ".");
+
+  ret = db_create(&rc->dbp, env, 0);
+  if (ret == 0)
+    ret = rc->dbp->open(rc->dbp, NULL, dbpath, NULL, DB_BTREE, DB_CREATE, 0);
+
+  if (ret != 0) {
+    LOG_ERROR("Result cache open failed: %s\n", db_strerror(ret));
+    if (rc->dbp)
+      rc->dbp->close(rc->dbp, 0);
+    rc->dbp = NULL;
+    rc->failed = 1;
+    return NULL;
+  }
+
+  return rc;
+}
+
+static uint32_t resultcache_spec_hash(MediaScan *s) {
+  uint32_t v[MAX_THUMBS];
+  int x;
+
+  for (x = 0; x < s->nthumbspecs; x++)
+    v[x] = thumb_spec_hash(s->thumbspecs[x]);
+
+  // A result stored without a signature or loudness can't be used once they are wanted
+  return hashlittle(v, s->nthumbspecs * sizeof(uint32_t),
+                    s->nthumbspecs | ((s->flags & MS_IMAGE_SIGNATURES) ? 0x100 : 0)
+                    | ((s->flags & MS_AUDIO_LOUDNESS) ? 0x200 : 0));
+}
+
+static void put_int(Buffer *b, int32_t v) {
+  buffer_append(b, &v, sizeof(v));
+}
+
+static void put_int64(Buffer *b, uint64_t v) {
+  buffer_append(b, &v, sizeof(v));
+}
+
+// Strings are stored with their terminator so they can be used in place after loading,
+// a length of 0 means NULL
+static void put_str(Buffer *b, const char *str) {
+  uint32_t len = str ? strlen(str) + 1 : 0;
+
+  buffer_append(b, &len, sizeof(len));
+  if (len)
+    buffer_append(b, str, len);
+}
+
+static int get_int(Buffer *b, int32_t *v) {
+  return buffer_get_ret(b, v, sizeof(*v)) == 0;
+}
+
+static int get_int64(Buffer *b, uint64_t *v) {
+  return buffer_get_ret(b, v, sizeof(*v)) == 0;
+}
+
+// Returns a pointer into the buffer, which must stay allocated as long as the string is used
+static int get_str(Buffer *b, const char **str) {
+  uint32_t len;
+
+  if (buffer_get_ret(b, &len, sizeof(len)) != 0 || len > buffer_len(b))
+    return 0;
+
+  *str = NULL;
+  if (len) {
+    *str = (const char *)buffer_ptr(b);
+    if ((*str)[len - 1] != '\0')
+      return 0;
+    buffer_consume(b, len);
+  }
+
+  return 1;
+}
+
+static void resultcache_serialize(MediaScan *s, MediaScanResult *r, Buffer *b) {
+  int x;
+
+  put_int(b, r->type);
+  put_str(b, r->mime_type);
+  put_str(b, r->dlna_profile);
+  put_int(b, r->bitrate);
+  put_int(b, r->duration_ms);
+
+  put_int(b, r->has_signature);
+  if (r->has_signature) {
+    put_int64(b, r->signature);
+    put_int(b, r->color);
+  }
+
+  put_int(b, r->audio != NULL);
+  if (r->audio) {
+    MediaScanAudio *a = r->audio;
+    put_str(b, a->codec);
+    put_int64(b, a->audio_offset);
+    put_int64(b, a->audio_size);
+    put_int(b, a->bitrate);
+    put_int(b, a->vbr);
+    put_int(b, a->samplerate);
+    put_int(b, a->channels);
+    put_int(b, a->has_loudness);
+    if (a->has_loudness) {
+      buffer_append(b, &a->loudness, sizeof(a->loudness));
+      buffer_append(b, &a->true_peak, sizeof(a->true_peak));
+    }
+  }
+
+  put_int(b, r->video != NULL);
+  if (r->video) {
+    MediaScanVideo *v = r->video;
+    put_str(b, v->codec);
+    put_int(b, v->width);
+    put_int(b, v->height);
+    buffer_append(b, &v->fps, sizeof(v->fps));
+  }
+
+  put_int(b, r->image != NULL);
+  if (r->image) {
+    MediaScanImage *i = r->image;
+    put_str(b, i->codec);
+    put_int(b, i->width);
+    put_int(b, i->height);
+    put_int(b, i->channels);
+    put_int(b, i->has_alpha);
+    put_int(b, i->offset);
+    put_int(b, i->orientation);
+  }
+
+  put_int(b, r->_tag ? r->_tag->nitems : -1);
+  if (r->_tag) {
+    put_str(b, r->_tag->type);
+    for (x = 0; x < r->_tag->nitems; x++) {
+      MediaScanTagItem *ti = r->_tag->items[x];
+
+      put_str(b, ti->key);
+      put_int(b, ti->type);
+      if (ti->type == TYPE_BINARY) {
+        put_int64(b, ti->offset);
+        put_int(b, ti->size);
+      }
+      else {
+        put_str(b, tag_item_get_value(ti));
+      }
+    }
+  }
+
+  // Thumbnails written to disk keep a reference to the file, and ones in the thumbnail cache
+  // the spec they are stored under there instead of their data
+  put_int(b, r->nthumbnails);
+  for (x = 0; x < r->nthumbnails; x++) {
+    MediaScanImage *thumb = r->_thumbs[x];
+    Buffer *data = (Buffer *)thumb->_dbuf;
+    int32_t cached = thumbcache_find(s, r, thumb);
+
+    put_str(b, thumb->codec);
+    put_int(b, thumb->width);
+    put_int(b, thumb->height);
+    put_str(b, thumb->saved_path);
+    put_int(b, cached);
+    put_int(b, data && cached < 0 ? buffer_len(data) : 0);
+    if (data && cached < 0)
+      buffer_append(b, buffer_ptr(data), buffer_len(data));
+  }
+}
+
+// Rebuild a result from a stored record. String fields point into b, which the result takes
+// ownership of. Returns 0 if the record is damaged or refers to a thumbnail file or thumbnail
+// cache entry that is gone.
+static int resultcache_deserialize(MediaScan *s, MediaScanResult *r, Buffer *b) {
+  int32_t present, count, x;
+  const char *codec, *saved_path, *key, *value;
+
+  if (!get_int(b, (int32_t *)&r->type) || !get_str(b, &r->mime_type) || !get_str(b, &r->dlna_profile)
+      || !get_int(b, &r->bitrate) || !get_int(b, &r->duration_ms))
+    return 0;
+
+  if (!get_int(b, &r->has_signature))
+    return 0;
+  if (r->has_signature && (!get_int64(b, &r->signature) || !get_int(b, (int32_t *)&r->color)))
+    return 0;
+
+  if (!get_int(b, &present))
+    return 0;
+  if (present) {
+    MediaScanAudio *a = r->audio = audio_create();
+    if (!get_str(b, &a->codec) || !get_int64(b, &a->audio_offset) || !get_int64(b, &a->audio_size)
+        || !get_int(b, &a->bitrate) || !get_int(b, &a->vbr) || !get_int(b, &a->samplerate)
+        || !get_int(b, &a->channels) || !get_int(b, &a->has_loudness))
+      return 0;
+    if (a->has_loudness && (buffer_get_ret(b, &a->loudness, sizeof(a->loudness)) != 0
+                            || buffer_get_ret(b, &a->true_peak, sizeof(a->true_peak)) != 0))
+      return 0;
+  }
+
+  if (!get_int(b, &present))
+    return 0;
+  if (present) {
+    MediaScanVideo *v = r->video = video_create();
+    v->path = r->path;
+    if (!get_str(b, &v->codec) || !get_int(b, &v->width) || !get_int(b, &v->height)
+        || buffer_get_ret(b, &v->fps, sizeof(v->fps)) != 0)
+      return 0;
+  }
+
+  if (!get_int(b, &present))
+    return 0;
+  if (present) {
+    MediaScanImage *i = r->image = image_create();
+    i->path = r->path;
+    if (!get_str(b, &i->codec) || !get_int(b, &i->width) || !get_int(b, &i->height)
+        || !get_int(b, &i->channels) || !get_int(b, &i->has_alpha) || !get_int(b, &i->offset)
+        || !get_int(b, (int32_t *)&i->orientation))
+      return 0;
+  }
+
+  if (!get_int(b, &count) || count >= MAX_TAG_ITEMS)
+    return 0;
+  if (count >= 0) {
+    const char *type;
+
+    if (!get_str(b, &type))
+      return 0;
+
+    r->_tag = tag_create(type);
+    for (x = 0; x < count; x++) {
+      int32_t type, size;
+      uint64_t offset;
+
+      if (!get_str(b, &key) || !get_int(b, &type) || !key)
+        return 0;
+
+      if (type == TYPE_BINARY) {
+        if (!get_int64(b, &offset) || !get_int(b, &size))
+          return 0;
+        tag_add_binary_item(r->_tag, key, offset, (uint32_t)size);
+      }
+      else {
+        if (!get_str(b, &value) || !value)
+          return 0;
+        tag_add_item(r->_tag, key, value);
+      }
+    }
+  }
+
+  if (!get_int(b, &count) || count < 0 || count >= MAX_THUMBS)
+    return 0;
+  for (x = 0; x < count; x++) {
+    MediaScanImage *thumb;
+    int32_t width, height, cached, len;
+
+    if (!get_str(b, &codec) || !get_int(b, &width) || !get_int(b, &height) || !get_str(b, &saved_path)
+        || !get_int(b, &cached) || cached >= s->nthumbspecs || !get_int(b, &len) || len < 0 || len > buffer_len(b))
+      return 0;
+
+    if (saved_path) {
+      FILE *fp = fopen(saved_path, "rb");
+      if (!fp) {
+        LOG_DEBUG("Cached thumbnail %s is missing, rescanning %s\n", saved_path, r->path);
+        return 0;
+      }
+      fclose(fp);
+    }
+
+    if (cached >= 0) {
+      // The thumbnail cache may have evicted it since
+      thumb = thumbcache_get(s, r, cached);
+      if (!thumb) {
+        LOG_DEBUG("Cached thumbnail %d is no longer stored, rescanning %s\n", cached, r->path);
+        return 0;
+      }
+    }
+    else {
+      thumb = image_create();
+      thumb->path = r->path;
+    }
+
+    thumb->codec = codec;
+    thumb->width = width;
+    thumb->height = height;
+    if (saved_path)
+      thumb->saved_path = strdup(saved_path);
+
+    if (len) {
+      Buffer *data = (Buffer *)malloc(sizeof(Buffer));
+      buffer_init(data, len);
+      buffer_append(data, buffer_ptr(b), len);
+      buffer_consume(b, len);
+      thumb->_dbuf = (void *)data;
+    }
+
+    result_add_thumbnail(r, thumb);
+  }
+
+  return 1;
+}
+
+// Undo a partially loaded record so the file can be scanned normally
+static void resultcache_reset(MediaScanResult *r) {
+  int x;
+
+  if (r->audio)
+    audio_destroy(r->audio);
+  if (r->video)
+    video_destroy(r->video);
+  if (r->image)
+    image_destroy(r->image);
+  if (r->_tag)
+    tag_destroy(r->_tag);
+
+  for (x = 0; x < r->nthumbnails; x++)
+    image_destroy(r->_thumbs[x]);
+
+  r->audio = NULL;
+  r->video = NULL;
+  r->image = NULL;
+  r->_tag = NULL;
+  r->nthumbnails = 0;
+  r->mime_type = NULL;
+  r->dlna_profile = NULL;
+  r->has_signature = 0;
+}
+
+// Fill in r from the cache if it holds an up to date result for r->path, returns 1 on a hit.
+// r->path and the HashFile identity (r->hash) must already be set.
+int resultcache_get(MediaScan *s, MediaScanResult *r) {
+  ResultCache *rc;
+  ResultCacheHeader hdr;
+  enum media_type type = r->type;
+  Buffer *b;
+  DBT key, data;
+
+  if (!(s->flags & MS_CACHE_RESULTS) || !(rc = resultcache_open(s)))
+    return 0;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = r->path;
+  key.size = strlen(r->path) + 1;
+  data.flags = DB_DBT_MALLOC;
+
+  if (rc->dbp->get(rc->dbp, NULL, &key, &data, 0) != 0)
+    return 0;
+
+  if (data.size < sizeof(hdr)) {
+    free(data.data);
+    return 0;
+  }
+
+  memcpy(&hdr, data.data, sizeof(hdr));
+  if (hdr.version != RESULTCACHE_VERSION || hdr.hash != r->hash || hdr.spec_hash != resultcache_spec_hash(s)) {
+    free(data.data);
+    return 0;
+  }
+
+  b = (Buffer *)malloc(sizeof(Buffer));
+  buffer_init(b, data.size - sizeof(hdr));
+  buffer_append(b, (unsigned char *)data.data + sizeof(hdr), data.size - sizeof(hdr));
+  free(data.data);
+
+  if (!resultcache_deserialize(s, r, b)) {
+    LOG_WARN("Ignoring damaged or stale result cache entry for %s\n", r->path);
+    resultcache_reset(r);
+    r->type = type;
+    buffer_free(b);
+    free(b);
+    return 0;
+  }
+
+  // The result owns the record so its strings stay valid
+  r->_buf = (void *)b;
+  LOG_MEM("new result buffer @ %p\n", r->_buf);
+
+  LOG_DEBUG("Using cached result for %s\n", r->path);
+
+  return 1;
+}
+
+// Store a newly scanned result
+void resultcache_put(MediaScan *s, MediaScanResult *r) {
+  ResultCache *rc;
+  ResultCacheHeader hdr;
+  Buffer value;
+  DBT key, data;
+  int ret;
+
+  if (!(s->flags & MS_CACHE_RESULTS) || !(rc = resultcache_open(s)))
+    return;
+
+  hdr.version = RESULTCACHE_VERSION;
+  hdr.hash = r->hash;
+  hdr.spec_hash = resultcache_spec_hash(s);
+
+  buffer_init(&value, 1024);
+  buffer_append(&value, &hdr, sizeof(hdr));
+  resultcache_serialize(s, r, &value);
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = r->path;
+  key.size = strlen(r->path) + 1;
+  data.data = buffer_ptr(&value);
+  data.size = buffer_len(&value);
+
+  ret = rc->dbp->put(rc->dbp, NULL, &key, &data, 0);
+  if (ret != 0) {
+    LOG_WARN("Result cache store failed: %s\n", db_strerror(ret));
+  }
+
+  buffer_free(&value);
+}
+
+// Move the stored result of a file that was moved from old_path to r->path. r->path and the
+// HashFile identity (r->hash) must already be set.
+void resultcache_move(MediaScan *s, MediaScanResult *r, const char *old_path) {
+  ResultCache *rc;
+  ResultCacheHeader hdr;
+  DBT key, data;
+  int ret;
+
+  if (!(s->flags & MS_CACHE_RESULTS) || !(rc = resultcache_open(s)))
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = (char *)old_path;
+  key.size = strlen(old_path) + 1;
+  data.flags = DB_DBT_MALLOC;
+
+  if (rc->dbp->get(rc->dbp, NULL, &key, &data, 0) != 0)
+    return;
+
+  // Only an up to date result is worth keeping, the file's identity changes with its path
+  memcpy(&hdr, data.data, MIN(data.size, sizeof(hdr)));
+  if (data.size >= sizeof(hdr) && hdr.hash == HashFileIdentity(old_path, r->mtime, r->size)) {
+    hdr.hash = r->hash;
+    memcpy(data.data, &hdr, sizeof(hdr));
+
+    key.data = r->path;
+    key.size = strlen(r->path) + 1;
+
+    ret = rc->dbp->put(rc->dbp, NULL, &key, &data, 0);
+    if (ret != 0) {
+      LOG_WARN("Result cache store failed: %s\n", db_strerror(ret));
+    }
+    else {
+      LOG_DEBUG("Moved cached result for %s from %s\n", r->path, old_path);
+    }
+
+    key.data = (char *)old_path;
+    key.size = strlen(old_path) + 1;
+  }
+
+  rc->dbp->del(rc->dbp, NULL, &key, 0);
+  free(data.data);
+}
+
+void resultcache_destroy(MediaScan *s) {
+  ResultCache *rc = (ResultCache *)s->_resultcache;
+
+  if (!rc)
+    return;
+
+  if (rc->dbp)
+    rc->dbp->close(rc->dbp, 0);
+
+  LOG_MEM("destroy ResultCache @ %p\n", rc);
+  free(rc);
+  s->_resultcache = NULL;
+}
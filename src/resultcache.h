@@ -0,0 +1,9 @@
+#ifndef _RESULTCACHE_H
+#define _RESULTCACHE_H
+
+int resultcache_get(MediaScan *s, MediaScanResult *r);
+void resultcache_put(MediaScan *s, MediaScanResult *r);
+void resultcache_move(MediaScan *s, MediaScanResult *r, const char *old_path);
+void resultcache_destroy(MediaScan *s);
+
+#endif // _RESULTCACHE_H
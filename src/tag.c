@@ -1,10 +1,22 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include <libmediascan.h>
 
 #include "common.h"
+#include "buffer.h"
 #include "tag.h"
 #include "tag_item.h"
+#include "tag_ape.h"
+#include "tag_id3.h"
+#include "tag_vorbis.h"
+#include "util.h"
+
+// Enough of a picture item to get past its MIME type and description
+#define TAG_PICTURE_HEADER_SIZE 1024
+
+// Base64 pictures bigger than this aren't read
+#define TAG_MAX_BASE64_SIZE (16 * 1024 * 1024)
 
 MediaScanTag *tag_create(const char *type) {
   MediaScanTag *t = (MediaScanTag *)calloc(sizeof(MediaScanTag), 1);
@@ -34,9 +46,191 @@ void tag_destroy(MediaScanTag *t) {
   free(t);
 }
 
+// Items past the limit are dropped before anything is allocated for them
+#define TAG_IS_FULL(t) ((t)->nitems >= MAX_TAG_ITEMS - 1)
+
 void tag_add_item(MediaScanTag *t, const char *key, const char *value) {
-  MediaScanTagItem *ti = tag_item_create(key, value);
+  MediaScanTagItem *ti;
+
+  if (TAG_IS_FULL(t))
+    return;
 
-  if (t->nitems < MAX_TAG_ITEMS - 1)
+  if ((ti = tag_item_create(key, value)))
     t->items[t->nitems++] = ti;
 }
+
+void tag_add_raw_item(MediaScanTag *t, const char *key, const void *raw, uint32_t len, enum tag_format format) {
+  MediaScanTagItem *ti;
+
+  if (TAG_IS_FULL(t))
+    return;
+
+  if ((ti = tag_item_create_raw(key, raw, len, format)))
+    t->items[t->nitems++] = ti;
+}
+
+void tag_add_binary_item(MediaScanTag *t, const char *key, uint64_t offset, uint32_t size) {
+  MediaScanTagItem *ti;
+
+  if (TAG_IS_FULL(t))
+    return;
+
+  if ((ti = tag_item_create_binary(key, offset, size)))
+    t->items[t->nitems++] = ti;
+}
+
+MediaScanTagItem *tag_find_item(MediaScanTag *t, const char *key) {
+  int i;
+
+  for (i = 0; i < t->nitems; i++) {
+    if (!strcasecmp(t->items[i]->key, key))
+      return t->items[i];
+  }
+
+  return NULL;
+}
+
+// Decode base64 text into buf, stopping at anything that isn't part of it
+static void tag_decode_base64(Buffer *buf, const unsigned char *src, uint32_t len) {
+  uint32_t i, bits = 0;
+  int nbits = 0;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = src[i];
+    int v;
+
+    if (c >= 'A' && c <= 'Z')
+      v = c - 'A';
+    else if (c >= 'a' && c <= 'z')
+      v = c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+      v = c - '0' + 52;
+    else if (c == '+')
+      v = 62;
+    else if (c == '/')
+      v = 63;
+    else if (c == '\r' || c == '\n')
+      continue;
+    else
+      break;
+
+    bits = (bits << 6) | v;
+    nbits += 6;
+    if (nbits >= 8) {
+      nbits -= 8;
+      buffer_put_char(buf, (bits >> nbits) & 0xFF);
+    }
+  }
+}
+
+// Read len bytes of the file of r at offset, returns how many were read
+static uint32_t tag_read(MediaScanResult *r, uint64_t offset, void *dst, uint32_t len) {
+  if (SeekFile(r->_fp, (int64_t)offset, SEEK_SET) != 0)
+    return 0;
+
+  return (uint32_t)fread(dst, 1, len, r->_fp);
+}
+
+// Locate the image of a picture item, returns its picture type or -1 if it has none
+static int tag_locate_picture(MediaScanResult *r, MediaScanTagItem *ti, Buffer *data, uint64_t *offset,
+                              uint32_t *size) {
+  unsigned char head[TAG_PICTURE_HEADER_SIZE];
+  uint32_t len, skip = 0;
+  int type = -1;
+
+  buffer_clear(data);
+
+  // Base64 pictures are decoded into memory, the old COVERART comment is an image on its own
+  if (!strcasecmp(ti->key, "METADATA_BLOCK_PICTURE") || !strcasecmp(ti->key, "COVERART")) {
+    if (ti->type == TYPE_BINARY) {
+      unsigned char *text;
+
+      if (ti->size > TAG_MAX_BASE64_SIZE)
+        return -1;
+
+      text = (unsigned char *)malloc(ti->size);
+      len = tag_read(r, ti->offset, text, ti->size);
+      tag_decode_base64(data, text, len);
+      free(text);
+    }
+    else {
+      const char *text = tag_item_get_value(ti);
+
+      if (text)
+        tag_decode_base64(data, (const unsigned char *)text, strlen(text));
+    }
+
+    *offset = 0;
+    *size = buffer_len(data);
+
+    if (!strcasecmp(ti->key, "COVERART"))
+      return *size ? TAG_PICTURE_FRONT_COVER : -1;
+
+    type = tag_vorbis_picture(buffer_ptr(data), buffer_len(data), &skip, size);
+    if (type >= 0) {
+      buffer_consume(data, skip);
+      buffer_consume_end(data, buffer_len(data) - *size);
+    }
+
+    return type;
+  }
+
+  if (ti->type != TYPE_BINARY)
+    return -1;
+
+  *offset = ti->offset;
+  *size = ti->size;
+
+  // MP4 cover art is only the image
+  if (!strcmp(ti->key, "covr"))
+    return TAG_PICTURE_FRONT_COVER;
+
+  if (strcmp(ti->key, "APIC") && strcmp(ti->key, "PIC") && strcmp(ti->key, "PICTURE")
+      && strncasecmp(ti->key, "Cover Art (", 11))
+    return -1;
+
+  len = tag_read(r, ti->offset, head, MIN(ti->size, sizeof(head)));
+
+  if (!strcmp(ti->key, "PICTURE"))
+    type = tag_vorbis_picture(head, len, &skip, size);
+  else if (ti->key[0] == 'C' || ti->key[0] == 'c')
+    type = tag_ape_picture(ti->key, head, len, &skip);
+  else
+    type = tag_id3_picture(ti->key, head, len, &skip);
+
+  if (type < 0 || skip >= ti->size)
+    return -1;
+
+  // FLAC gives the image size, the others run to the end of the item
+  *offset += skip;
+  if (strcmp(ti->key, "PICTURE"))
+    *size -= skip;
+
+  return type;
+}
+
+int tag_find_picture(MediaScanResult *r, Buffer *data, uint64_t *offset, uint32_t *size) {
+  MediaScanTag *t = r->_tag;
+  int i, type, found = -1;
+
+  if (!t || !r->_fp)
+    return 0;
+
+  for (i = 0; i < t->nitems; i++) {
+    type = tag_locate_picture(r, t->items[i], data, offset, size);
+
+    if (type == TAG_PICTURE_FRONT_COVER)
+      return 1;
+
+    if (type >= 0 && found < 0)
+      found = i;
+  }
+
+  // Any other picture is better than none, this locates it again
+  if (found >= 0)
+    return tag_locate_picture(r, t->items[found], data, offset, size) >= 0;
+
+  buffer_clear(data);
+
+  return 0;
+}
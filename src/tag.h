@@ -1,8 +1,25 @@
 #ifndef _TAG_H
 #define _TAG_H
 
+#include "tag_item.h"
+
+// Picture types shared by ID3 and FLAC
+#define TAG_PICTURE_OTHER       0
+#define TAG_PICTURE_FRONT_COVER 3
+
 MediaScanTag *tag_create(const char *type);
 void tag_add_item(MediaScanTag *t, const char *key, const char *value);
+void tag_add_raw_item(MediaScanTag *t, const char *key, const void *raw, uint32_t len, enum tag_format format);
+void tag_add_binary_item(MediaScanTag *t, const char *key, uint64_t offset, uint32_t size);
+
+// Keys are matched without regard to case, Vorbis comments and APE keys are case-insensitive
+MediaScanTagItem *tag_find_item(MediaScanTag *t, const char *key);
+
+// Find the picture to use as cover art among the tag items of r, whose file must be open. The front
+// cover is preferred. A picture stored as it is in the file is returned by offset and size, one that
+// had to be decoded (base64) is put in data with an offset of 0. Returns 0 if there is no picture.
+int tag_find_picture(MediaScanResult *r, Buffer *data, uint64_t *offset, uint32_t *size);
+
 void tag_destroy(MediaScanTag *t);
 
 #endif // _TAG_H
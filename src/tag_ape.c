@@ -0,0 +1,136 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "result.h"
+#include "tag.h"
+#include "tag_ape.h"
+#include "util.h"
+
+#define APE_FOOTER_SIZE 32
+#define APE_MAX_KEY_SIZE 255
+
+// Item flags, the type is in bits 1-2
+#define APE_ITEM_TYPE(flags) (((flags) >> 1) & 0x03)
+#define APE_ITEM_BINARY 1
+
+// Text items bigger than this are left in the file like binary ones
+#define APE_MAX_TEXT_SIZE 16384
+
+static int ape_valid_key(const char *key, uint32_t len) {
+  uint32_t i;
+
+  if (len < 2)
+    return 0;
+
+  for (i = 0; i < len; i++) {
+    if (key[i] < 0x20 || key[i] > 0x7E)
+      return 0;
+  }
+
+  return 1;
+}
+
+int tag_ape_index(MediaScanResult *r, uint64_t offset) {
+  Buffer buf;
+  unsigned char footer[APE_FOOTER_SIZE];
+  uint64_t start;
+  uint32_t len, count, pos = 0;
+  int ret = 0;
+
+  if (SeekFile(r->_fp, (int64_t)offset, SEEK_SET) != 0 || fread(footer, 1, APE_FOOTER_SIZE, r->_fp) != APE_FOOTER_SIZE
+      || memcmp(footer, "APETAGEX", 8))
+    return 0;
+
+  // The size covers the items and the footer, but not the optional header before the items
+  len = get_u32le(footer + 12);
+  count = get_u32le(footer + 16);
+  if (len < APE_FOOTER_SIZE || len > offset + APE_FOOTER_SIZE)
+    return 0;
+
+  len -= APE_FOOTER_SIZE;
+  start = offset - len;
+
+  if (SeekFile(r->_fp, (int64_t)start, SEEK_SET) != 0)
+    return 0;
+
+  LOG_DEBUG("APE tag of %d bytes with %d items\n", len, count);
+
+  if (!r->_tag)
+    result_create_tag(r, "APE");
+
+  buffer_init(&buf, BUF_SIZE);
+
+  while (count-- && pos + 8 < len) {
+    unsigned char *bptr, *end;
+    char key[APE_MAX_KEY_SIZE + 1];
+    uint32_t size, flags, key_len, want;
+
+    want = MIN(len - pos, 8 + APE_MAX_KEY_SIZE + 1);
+    if (!buffer_check_load(&buf, r->_fp, want, BUF_SIZE))
+      goto out;
+
+    bptr = buffer_ptr(&buf);
+    size = get_u32le(bptr);
+    flags = get_u32le(bptr + 4);
+
+    end = (unsigned char *)memchr(bptr + 8, 0, want - 8);
+    if (!end)
+      break;
+
+    key_len = end - bptr - 8;
+    memcpy(key, bptr + 8, key_len + 1);
+    buffer_consume(&buf, 8 + key_len + 1);
+    pos += 8 + key_len + 1;
+
+    if (size > len - pos) {
+      LOG_DEBUG("Invalid APE item of size %d\n", size);
+      break;
+    }
+
+    if (!ape_valid_key(key, key_len)) {
+      LOG_DEBUG("Skipping APE item with an invalid key\n");
+    }
+    else if (APE_ITEM_TYPE(flags) == APE_ITEM_BINARY || size > APE_MAX_TEXT_SIZE) {
+      // Cover art and other binary items stay in the file
+      tag_add_binary_item(r->_tag, key, start + pos, size);
+    }
+    else {
+      if (!buffer_check_load(&buf, r->_fp, size, BUF_SIZE))
+        goto out;
+
+      tag_add_raw_item(r->_tag, key, buffer_ptr(&buf), size, TAG_FORMAT_UTF8);
+    }
+
+    if (!buffer_skip(&buf, r->_fp, size))
+      goto out;
+
+    pos += size;
+  }
+
+  ret = 1;
+
+out:
+  buffer_free(&buf);
+
+  return ret;
+}
+
+int tag_ape_picture(const char *key, const unsigned char *head, uint32_t len, uint32_t *skip) {
+  unsigned char *end;
+
+  if (strncasecmp(key, "Cover Art (", 11))
+    return -1;
+
+  // The image follows its file name
+  end = (unsigned char *)memchr(head, 0, len);
+  if (!end)
+    return -1;
+
+  *skip = end - head + 1;
+
+  return strcasecmp(key, "Cover Art (Front)") ? TAG_PICTURE_OTHER : TAG_PICTURE_FRONT_COVER;
+}
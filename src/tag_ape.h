@@ -0,0 +1,11 @@
+#ifndef _TAG_APE_H
+#define _TAG_APE_H
+
+// Index the items of the APE tag whose footer is at offset. Returns 0 if there is no valid tag.
+int tag_ape_index(MediaScanResult *r, uint64_t offset);
+
+// Parse the start of a Cover Art item read into head. Returns the picture type, with the number
+// of bytes before the image in skip, or -1 if it isn't a picture.
+int tag_ape_picture(const char *key, const unsigned char *head, uint32_t len, uint32_t *skip);
+
+#endif // _TAG_APE_H
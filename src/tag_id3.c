@@ -0,0 +1,345 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "result.h"
+#include "tag.h"
+#include "tag_id3.h"
+
+#define ID3_HEADER_SIZE 10
+
+// Header flags
+#define ID3_UNSYNC        0x80
+#define ID3_EXT_HEADER    0x40
+#define ID3_FOOTER        0x10
+
+// Frame flags, these moved between versions
+#define ID3V23_COMPRESSED 0x0080
+#define ID3V23_ENCRYPTED  0x0040
+#define ID3V23_GROUPED    0x0020
+#define ID3V24_GROUPED    0x0040
+#define ID3V24_COMPRESSED 0x0008
+#define ID3V24_ENCRYPTED  0x0004
+#define ID3V24_UNSYNC     0x0002
+#define ID3V24_DATA_LEN   0x0001
+
+// Text frames bigger than this are left in the file like binary ones
+#define ID3_MAX_TEXT_SIZE 16384
+
+// ID3v2.2 frame IDs for their later names. PIC isn't renamed, its header differs from APIC.
+// *INDENT-OFF*
+static const char *id3_v22_frames[][2] = {
+  { "COM", "COMM" }, { "TAL", "TALB" }, { "TBP", "TBPM" }, { "TCM", "TCOM" }, { "TCO", "TCON" },
+  { "TCP", "TCMP" }, { "TCR", "TCOP" }, { "TDA", "TDAT" }, { "TDY", "TDLY" }, { "TEN", "TENC" },
+  { "TFT", "TFLT" }, { "TIM", "TIME" }, { "TKE", "TKEY" }, { "TLA", "TLAN" }, { "TLE", "TLEN" },
+  { "TMT", "TMED" }, { "TOA", "TOPE" }, { "TOF", "TOFN" }, { "TOL", "TOLY" }, { "TOR", "TORY" },
+  { "TOT", "TOAL" }, { "TP1", "TPE1" }, { "TP2", "TPE2" }, { "TP3", "TPE3" }, { "TP4", "TPE4" },
+  { "TPA", "TPOS" }, { "TPB", "TPUB" }, { "TRC", "TSRC" }, { "TRK", "TRCK" }, { "TS2", "TSO2" },
+  { "TSA", "TSOA" }, { "TSC", "TSOC" }, { "TSP", "TSOP" }, { "TSS", "TSSE" }, { "TST", "TSOT" },
+  { "TT1", "TIT1" }, { "TT2", "TIT2" }, { "TT3", "TIT3" }, { "TXT", "TEXT" }, { "TXX", "TXXX" },
+  { "TYE", "TYER" }, { "ULT", "USLT" }, { "WAF", "WOAF" }, { "WAR", "WOAR" }, { "WAS", "WOAS" },
+  { "WCM", "WCOM" }, { "WCP", "WCOP" }, { "WPB", "WPUB" }, { "WXX", "WXXX" }, { "UFI", "UFID" },
+  { "GEO", "GEOB" }, { "CNT", "PCNT" }, { "POP", "POPM" }, { "RVA", "RVAD" }, { "SLT", "SYLT" },
+  { NULL, NULL }
+};
+// *INDENT-ON*
+
+// Undo unsynchronisation, which put a 0 after every 0xFF. Returns the new length.
+static uint32_t id3_unsync(unsigned char *data, uint32_t len) {
+  uint32_t i, j;
+
+  for (i = 0, j = 0; i < len; i++) {
+    data[j++] = data[i];
+    if (data[i] == 0xFF && i + 1 < len && data[i + 1] == 0x00)
+      i++;
+  }
+
+  return j;
+}
+
+// Length of the null-terminated string at the start of data, including its terminator
+static uint32_t id3_string_len(const unsigned char *data, uint32_t len, int encoding) {
+  uint32_t i;
+
+  if (encoding == 1 || encoding == 2) {
+    for (i = 0; i + 1 < len; i += 2) {
+      if (!data[i] && !data[i + 1])
+        return i + 2;
+    }
+  }
+  else {
+    for (i = 0; i < len; i++) {
+      if (!data[i])
+        return i + 1;
+    }
+  }
+
+  return len;
+}
+
+static enum tag_format id3_format(int encoding) {
+  return encoding <= 3 ? TAG_FORMAT_LATIN1 + encoding : TAG_FORMAT_LATIN1;
+}
+
+// Text frames are copied as they are, the text is only decoded if it's asked for
+static void id3_index_text(MediaScanTag *t, const char *id, const unsigned char *data, uint32_t len) {
+  int encoding;
+
+  // URL frames are always ISO-8859-1, with no encoding byte
+  if (id[0] == 'W' && strcmp(id, "WXXX")) {
+    tag_add_raw_item(t, id, data, len, TAG_FORMAT_LATIN1);
+    return;
+  }
+
+  if (!len)
+    return;
+
+  encoding = data[0];
+  data++;
+  len--;
+
+  if (!strcmp(id, "TXXX") || !strcmp(id, "WXXX") || !strcmp(id, "COMM")) {
+    char *desc;
+    char key[64];
+    uint32_t desc_len;
+
+    // Comments start with a language
+    if (id[0] == 'C') {
+      if (len < 3)
+        return;
+      data += 3;
+      len -= 3;
+    }
+
+    // User-defined frames are keyed by their description, comments only when they have one
+    desc_len = id3_string_len(data, len, encoding);
+    desc = tag_item_decode(id, data, desc_len, id3_format(encoding));
+
+    if (!*desc)
+      snprintf(key, sizeof(key), "%s", id);
+    else if (id[0] == 'C')
+      snprintf(key, sizeof(key), "COMM:%s", desc);
+    else
+      snprintf(key, sizeof(key), "%s", desc);
+
+    free(desc);
+
+    tag_add_raw_item(t, key, data + desc_len, len - desc_len,
+                     id[0] == 'W' ? TAG_FORMAT_LATIN1 : id3_format(encoding));
+    return;
+  }
+
+  tag_add_raw_item(t, id, data, len, id3_format(encoding));
+}
+
+uint32_t tag_id3_index(MediaScanResult *r, Buffer *buf, uint64_t offset) {
+  unsigned char *bptr;
+  Buffer unsync;
+  Buffer *src = buf;
+  FILE *fp = r->_fp;
+  uint32_t tag_size, total, pos = 0;
+  int version, flags;
+  int hsize, idlen;
+
+  if (!buffer_check_load(buf, r->_fp, ID3_HEADER_SIZE, BUF_SIZE))
+    return 0;
+
+  bptr = buffer_ptr(buf);
+  version = bptr[3];
+  flags = bptr[5];
+
+  if (memcmp(bptr, "ID3", 3) || version < 2 || version > 4)
+    return 0;
+
+  buffer_consume(buf, 6);
+  tag_size = buffer_get_syncsafe(buf, 4);
+  total = ID3_HEADER_SIZE + tag_size + (flags & ID3_FOOTER ? ID3_HEADER_SIZE : 0);
+  hsize = version == 2 ? 6 : 10;
+  idlen = version == 2 ? 3 : 4;
+
+  LOG_DEBUG("ID3v2.%d tag of %d bytes\n", version, total);
+
+  if (!r->_tag)
+    result_create_tag(r, "ID3v2");
+
+  // Before v2.4 unsynchronisation applies to the whole tag, which then has to be read at once.
+  // Frame positions no longer match the file so binary frames can't be kept.
+  buffer_init(&unsync, 0);
+  if (flags & ID3_UNSYNC && version < 4) {
+    if (!buffer_check_load(buf, r->_fp, tag_size, tag_size)) {
+      total = 0;
+      goto out;
+    }
+
+    buffer_append(&unsync, buffer_ptr(buf), tag_size);
+    buffer_consume(buf, tag_size);
+    tag_size = id3_unsync(buffer_ptr(&unsync), tag_size);
+    unsync.end = unsync.offset + tag_size;
+
+    src = &unsync;
+    fp = NULL;
+  }
+
+  if (flags & ID3_EXT_HEADER && version > 2) {
+    uint32_t ext_size;
+
+    if (tag_size < 4 || !buffer_check_load(src, fp, 4, BUF_SIZE))
+      goto skip;
+
+    // The v2.4 size includes itself
+    ext_size = version == 4 ? buffer_get_syncsafe(src, 4) : buffer_get_int(src) + 4;
+    if (ext_size < 4 || ext_size > tag_size || !buffer_skip(src, fp, ext_size - 4))
+      goto skip;
+
+    pos += ext_size;
+  }
+
+  while (pos + hsize <= tag_size) {
+    char id[5];
+    uint32_t size, prefix = 0;
+    uint16_t fflags = 0;
+    int frame_unsync = 0, skip = 0;
+    int i;
+
+    if (!buffer_check_load(src, fp, hsize, BUF_SIZE))
+      break;
+
+    bptr = buffer_ptr(src);
+
+    // Padding, or a broken frame
+    for (i = 0; i < idlen; i++) {
+      if (!((bptr[i] >= 'A' && bptr[i] <= 'Z') || (bptr[i] >= '0' && bptr[i] <= '9')))
+        goto skip;
+    }
+
+    memcpy(id, bptr, idlen);
+    id[idlen] = '\0';
+
+    if (version == 2) {
+      size = get_u24(bptr + 3);
+    }
+    else {
+      size = get_u32(bptr + 4);
+      fflags = get_u16(bptr + 8);
+
+      // v2.4 sizes are syncsafe, except when written by old versions of iTunes
+      if (version == 4 && !(size & 0x80808080))
+        size = ((size & 0x7F000000) >> 3) | ((size & 0x7F0000) >> 2) | ((size & 0x7F00) >> 1) | (size & 0x7F);
+    }
+
+    buffer_consume(src, hsize);
+    pos += hsize;
+
+    if (size > tag_size - pos) {
+      LOG_DEBUG("Invalid ID3v2 frame %s of size %d\n", id, size);
+      break;
+    }
+
+    if (version == 2) {
+      for (i = 0; id3_v22_frames[i][0]; i++) {
+        if (!strcmp(id, id3_v22_frames[i][0])) {
+          strcpy(id, id3_v22_frames[i][1]);
+          break;
+        }
+      }
+    }
+    else if (version == 3) {
+      skip = fflags & (ID3V23_COMPRESSED | ID3V23_ENCRYPTED);
+      if (fflags & ID3V23_GROUPED)
+        prefix++;
+    }
+    else {
+      skip = fflags & (ID3V24_COMPRESSED | ID3V24_ENCRYPTED);
+      frame_unsync = fflags & ID3V24_UNSYNC || flags & ID3_UNSYNC;
+      if (fflags & ID3V24_GROUPED)
+        prefix++;
+      if (fflags & ID3V24_DATA_LEN)
+        prefix += 4;
+    }
+
+    if (prefix > size)
+      skip = 1;
+
+    if (skip) {
+      LOG_DEBUG("Skipping compressed or encrypted ID3v2 frame %s\n", id);
+    }
+    else if ((id[0] == 'T' || id[0] == 'W' || !strcmp(id, "COMM")) && size - prefix <= ID3_MAX_TEXT_SIZE) {
+      uint32_t len = size - prefix;
+
+      if (!buffer_check_load(src, fp, size, BUF_SIZE))
+        break;
+
+      bptr = (unsigned char *)buffer_ptr(src) + prefix;
+
+      if (frame_unsync) {
+        unsigned char *data = (unsigned char *)malloc(len ? len : 1);
+
+        memcpy(data, bptr, len);
+        id3_index_text(r->_tag, id, data, id3_unsync(data, len));
+        free(data);
+      }
+      else {
+        id3_index_text(r->_tag, id, bptr, len);
+      }
+    }
+    else if (!fp || frame_unsync) {
+      LOG_DEBUG("Unable to keep unsynchronised ID3v2 frame %s\n", id);
+    }
+    else {
+      // Pictures, lyrics and everything else stay in the file
+      tag_add_binary_item(r->_tag, id, offset + ID3_HEADER_SIZE + pos + prefix, size - prefix);
+    }
+
+    if (!buffer_skip(src, fp, size)) {
+      total = 0;
+      goto out;
+    }
+
+    pos += size;
+  }
+
+skip:
+  // Padding and the footer
+  if (fp && !buffer_skip(buf, fp, total - ID3_HEADER_SIZE - pos))
+    total = 0;
+  if (!fp && flags & ID3_FOOTER && !buffer_skip(buf, r->_fp, ID3_HEADER_SIZE))
+    total = 0;
+
+out:
+  buffer_free(&unsync);
+
+  return total;
+}
+
+int tag_id3_picture(const char *key, const unsigned char *head, uint32_t len, uint32_t *skip) {
+  uint32_t pos;
+  int encoding, type;
+
+  if (len < 2)
+    return -1;
+
+  encoding = head[0];
+
+  // v2.2 has a 3 character image format instead of a MIME type
+  if (!strcmp(key, "PIC"))
+    pos = 4;
+  else
+    pos = 1 + id3_string_len(head + 1, len - 1, 0);
+
+  if (pos >= len)
+    return -1;
+
+  type = head[pos++];
+  pos += id3_string_len(head + pos, len - pos, encoding);
+
+  // The description didn't fit in what was read
+  if (pos >= len)
+    return -1;
+
+  *skip = pos;
+
+  return type;
+}
@@ -0,0 +1,12 @@
+#ifndef _TAG_ID3_H
+#define _TAG_ID3_H
+
+// Index the frames of the ID3v2 tag at the start of buf, which is at offset in the file.
+// Returns the size of the tag, which has been consumed from buf, or 0 if it can't be read.
+uint32_t tag_id3_index(MediaScanResult *r, Buffer *buf, uint64_t offset);
+
+// Parse the start of an APIC or PIC frame read into head. Returns the picture type, with the
+// number of bytes before the image in skip, or -1 if it isn't a picture.
+int tag_id3_picture(const char *key, const unsigned char *head, uint32_t len, uint32_t *skip);
+
+#endif // _TAG_ID3_H
@@ -4,9 +4,15 @@
 #include <libmediascan.h>
 
 #include "common.h"
+#include "buffer.h"
 #include "tag_item.h"
 
-MediaScanTagItem *tag_item_create(const char *key, const char *value) {
+// MP4 data atom types
+#define MP4_DATA_IMPLICIT 0
+#define MP4_DATA_UTF8     1
+#define MP4_DATA_INTEGER  21
+
+static MediaScanTagItem *tag_item_alloc(const char *key) {
   MediaScanTagItem *ti = (MediaScanTagItem *)calloc(sizeof(MediaScanTagItem), 1);
   if (ti == NULL) {
     ms_errno = MSENO_MEMERROR;
@@ -15,15 +21,182 @@ MediaScanTagItem *tag_item_create(const char *key, const char *value) {
   }
 
   ti->key = strdup(key);
-  ti->value = strdup(value);
+  ti->type = TYPE_UTF8;
 
   LOG_MEM("new MediaScanTagItem @ %p\n", ti);
   return ti;
 }
 
+MediaScanTagItem *tag_item_create(const char *key, const char *value) {
+  MediaScanTagItem *ti = tag_item_alloc(key);
+
+  if (ti)
+    ti->value = strdup(value);
+
+  return ti;
+}
+
+MediaScanTagItem *tag_item_create_raw(const char *key, const void *raw, uint32_t len, enum tag_format format) {
+  MediaScanTagItem *ti = tag_item_alloc(key);
+
+  if (ti) {
+    ti->_raw = malloc(len ? len : 1);
+    memcpy(ti->_raw, raw, len);
+    ti->_raw_size = len;
+    ti->_format = format;
+  }
+
+  return ti;
+}
+
+MediaScanTagItem *tag_item_create_binary(const char *key, uint64_t offset, uint32_t size) {
+  MediaScanTagItem *ti = tag_item_alloc(key);
+
+  if (ti) {
+    ti->type = TYPE_BINARY;
+    ti->offset = offset;
+    ti->size = size;
+  }
+
+  return ti;
+}
+
+// Decode one null-terminated string and append it to utf8
+static void tag_item_get_string(Buffer *raw, Buffer *utf8, enum tag_format format) {
+  unsigned char *bptr = buffer_ptr(raw);
+  uint8_t byteorder = UTF16_BYTEORDER_BE;
+
+  switch (format) {
+    case TAG_FORMAT_LATIN1:
+      buffer_get_latin1_as_utf8(raw, utf8, buffer_len(raw));
+      break;
+
+    case TAG_FORMAT_UTF16:
+      // Each string has its own byte order mark, without one it's most likely from Windows
+      byteorder = UTF16_BYTEORDER_LE;
+      if (buffer_len(raw) >= 2 && ((bptr[0] == 0xFE && bptr[1] == 0xFF) || (bptr[0] == 0xFF && bptr[1] == 0xFE))) {
+        byteorder = bptr[0] == 0xFE ? UTF16_BYTEORDER_BE : UTF16_BYTEORDER_LE;
+        buffer_consume(raw, 2);
+      }
+      // fall through
+
+    case TAG_FORMAT_UTF16BE:
+      if (buffer_len(raw))
+        buffer_get_utf16_as_utf8(raw, utf8, buffer_len(raw), byteorder);
+      else
+        buffer_put_char(utf8, 0);
+      break;
+
+    default:
+      buffer_get_utf8(raw, utf8, buffer_len(raw));
+      break;
+  }
+}
+
+// Decode every string in raw, joining several values with a slash like ID3v2.3 does
+static char *tag_item_decode_text(const void *raw, uint32_t len, enum tag_format format) {
+  Buffer in, one, out;
+  char *value;
+
+  buffer_init(&in, len + 1);
+  buffer_init(&one, len * 2 + 1);
+  buffer_init(&out, len * 2 + 1);
+  buffer_append(&in, raw, len);
+
+  while (buffer_len(&in)) {
+    const char *str;
+
+    buffer_clear(&one);
+    tag_item_get_string(&in, &one, format);
+    str = (const char *)buffer_ptr(&one);
+
+    // Padding and empty values are left out
+    if (!*str)
+      continue;
+
+    if (buffer_len(&out))
+      buffer_put_char(&out, '/');
+    buffer_append(&out, str, strlen(str));
+  }
+
+  buffer_put_char(&out, 0);
+  value = strdup((const char *)buffer_ptr(&out));
+
+  buffer_free(&in);
+  buffer_free(&one);
+  buffer_free(&out);
+
+  return value;
+}
+
+// An MP4 data atom's payload follows its type and locale
+static char *tag_item_decode_mp4(const char *key, const unsigned char *raw, uint32_t len) {
+  const unsigned char *bptr = raw + 8;
+  uint32_t type;
+  char tmp[32];
+
+  if (len < 8)
+    return strdup("");
+
+  type = get_u32(raw) & 0xFFFFFF;
+  len -= 8;
+
+  if (type == MP4_DATA_UTF8)
+    return tag_item_decode_text(bptr, len, TAG_FORMAT_UTF8);
+
+  // Track and disc numbers are a number and a total
+  if (type == MP4_DATA_IMPLICIT && len >= 4 && (!strcmp(key, "trkn") || !strcmp(key, "disk"))) {
+    if (len >= 6 && get_u16(bptr + 4))
+      sprintf(tmp, "%d/%d", get_u16(bptr + 2), get_u16(bptr + 4));
+    else
+      sprintf(tmp, "%d", get_u16(bptr + 2));
+    return strdup(tmp);
+  }
+
+  // Flags such as cpil, tmpo and gnre are integers, often without saying so
+  if (type == MP4_DATA_IMPLICIT || type == MP4_DATA_INTEGER) {
+    switch (len) {
+      case 1:
+        sprintf(tmp, "%d", (int8_t)bptr[0]);
+        return strdup(tmp);
+      case 2:
+        sprintf(tmp, "%d", (int16_t)get_u16(bptr));
+        return strdup(tmp);
+      case 4:
+        sprintf(tmp, "%d", (int32_t)get_u32(bptr));
+        return strdup(tmp);
+      case 8:
+        sprintf(tmp, "%lld", (long long)get_u64(bptr));
+        return strdup(tmp);
+    }
+  }
+
+  return tag_item_decode_text(bptr, len, TAG_FORMAT_UTF8);
+}
+
+char *tag_item_decode(const char *key, const void *raw, uint32_t len, enum tag_format format) {
+  if (format == TAG_FORMAT_MP4)
+    return tag_item_decode_mp4(key, (const unsigned char *)raw, len);
+
+  return tag_item_decode_text(raw, len, format);
+}
+
+const char *tag_item_get_value(MediaScanTagItem *ti) {
+  if (ti->value || !ti->_raw)
+    return ti->value;
+
+  ti->value = tag_item_decode(ti->key, ti->_raw, ti->_raw_size, (enum tag_format)ti->_format);
+
+  free(ti->_raw);
+  ti->_raw = NULL;
+
+  return ti->value;
+}
+
 void tag_item_destroy(MediaScanTagItem *ti) {
   free(ti->key);
   free(ti->value);
+  free(ti->_raw);
 
   LOG_MEM("destroy MediaScanTagItem @ %p\n", ti);
   free(ti);
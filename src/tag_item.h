@@ -1,7 +1,28 @@
 #ifndef _TAG_ITEM_H
 #define _TAG_ITEM_H
 
+// How the raw value of an item is encoded until it is decoded. The text encodings are in the
+// order of the ID3v2 encoding byte.
+enum tag_format {
+  TAG_FORMAT_LATIN1 = 1,
+  TAG_FORMAT_UTF16,             // each string starts with a byte order mark
+  TAG_FORMAT_UTF16BE,
+  TAG_FORMAT_UTF8,
+  TAG_FORMAT_MP4                // MP4 data atom, starting with its type and locale
+};
+
 MediaScanTagItem *tag_item_create(const char *key, const char *value);
+
+// The value is copied but not decoded until tag_item_get_value is called
+MediaScanTagItem *tag_item_create_raw(const char *key, const void *raw, uint32_t len, enum tag_format format);
+
+// Binary data is left in the file
+MediaScanTagItem *tag_item_create_binary(const char *key, uint64_t offset, uint32_t size);
+
+// Decode raw to a new UTF-8 string, several values are joined with a slash
+char *tag_item_decode(const char *key, const void *raw, uint32_t len, enum tag_format format);
+
+const char *tag_item_get_value(MediaScanTagItem *ti);
 void tag_item_destroy(MediaScanTagItem *ti);
 
 #endif // _TAG_ITEM_H
@@ -0,0 +1,124 @@
+#include <libmediascan.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "result.h"
+#include "tag.h"
+#include "tag_vorbis.h"
+
+// Comments bigger than this are left in the file like pictures are
+#define VORBIS_MAX_COMMENT_SIZE 16384
+
+#define VORBIS_MAX_KEY_SIZE 64
+
+int tag_vorbis_index(MediaScanResult *r, Buffer *buf, FILE *fp, uint32_t len, uint64_t offset) {
+  uint32_t pos = 8;
+  uint32_t vendor_len, count;
+
+  // A broken block is passed over, the audio can still be read
+  if (len < 8)
+    return buffer_skip(buf, fp, len);
+
+  if (!buffer_check_load(buf, fp, 4, BUF_SIZE))
+    return 0;
+
+  vendor_len = buffer_get_int_le(buf);
+  if (vendor_len > len - pos) {
+    LOG_DEBUG("Invalid Vorbis comment vendor string of size %d\n", vendor_len);
+    return buffer_skip(buf, fp, len - 4);
+  }
+
+  if (!buffer_skip(buf, fp, vendor_len) || !buffer_check_load(buf, fp, 4, BUF_SIZE))
+    return 0;
+
+  count = buffer_get_int_le(buf);
+  pos += vendor_len;
+
+  if (!r->_tag)
+    result_create_tag(r, "VorbisComment");
+
+  LOG_DEBUG("%d Vorbis comments\n", count);
+
+  while (count-- && pos + 4 <= len) {
+    unsigned char *bptr, *eq;
+    char key[VORBIS_MAX_KEY_SIZE];
+    uint32_t size, want;
+
+    if (!buffer_check_load(buf, fp, 4, BUF_SIZE))
+      return 0;
+
+    size = buffer_get_int_le(buf);
+    pos += 4;
+
+    if (size > len - pos) {
+      LOG_DEBUG("Invalid Vorbis comment of size %d\n", size);
+      break;
+    }
+
+    // Only the key of a big comment is read
+    want = MIN(size, VORBIS_MAX_COMMENT_SIZE);
+    if (!buffer_check_load(buf, fp, want, BUF_SIZE))
+      return 0;
+
+    bptr = buffer_ptr(buf);
+    eq = (unsigned char *)memchr(bptr, '=', MIN(want, VORBIS_MAX_KEY_SIZE));
+
+    if (eq && eq > bptr) {
+      uint32_t key_len = eq - bptr;
+
+      memcpy(key, bptr, key_len);
+      key[key_len] = '\0';
+
+      // Pictures are base64 encoded FLAC picture blocks. Ones that aren't in one piece in the file
+      // are kept whole if they were read.
+      if (size > VORBIS_MAX_COMMENT_SIZE || !strcasecmp(key, "METADATA_BLOCK_PICTURE")) {
+        if (offset)
+          tag_add_binary_item(r->_tag, key, offset + pos + key_len + 1, size - key_len - 1);
+        else if (!fp && buffer_len(buf) >= size)
+          tag_add_raw_item(r->_tag, key, (unsigned char *)buffer_ptr(buf) + key_len + 1, size - key_len - 1,
+                           TAG_FORMAT_UTF8);
+      }
+      else {
+        tag_add_raw_item(r->_tag, key, eq + 1, size - key_len - 1, TAG_FORMAT_UTF8);
+      }
+    }
+
+    if (!buffer_skip(buf, fp, size))
+      return 0;
+
+    pos += size;
+  }
+
+  // Anything left, such as the Vorbis framing bit
+  if (pos < len && !buffer_skip(buf, fp, len - pos))
+    return 0;
+
+  return 1;
+}
+
+int tag_vorbis_picture(const unsigned char *head, uint32_t len, uint32_t *skip, uint32_t *size) {
+  uint32_t pos = 4;
+  int i;
+
+  // Type, MIME type, description, 4 numbers about the image, then its length
+  for (i = 0; i < 2; i++) {
+    if (pos + 4 > len || get_u32(head + pos) > len - pos - 4)
+      return -1;
+    pos += 4 + get_u32(head + pos);
+  }
+
+  pos += 16;
+  if (pos + 4 > len || pos + 4 > *size)
+    return -1;
+
+  if (get_u32(head + pos) > *size - pos - 4)
+    return -1;
+
+  *size = get_u32(head + pos);
+  *skip = pos + 4;
+
+  return (int)get_u32(head);
+}
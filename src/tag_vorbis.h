@@ -0,0 +1,12 @@
+#ifndef _TAG_VORBIS_H
+#define _TAG_VORBIS_H
+
+// Index the Vorbis comment block in the next len bytes of buf, which are consumed. offset is
+// where they are in the file, or 0 if they aren't stored in one piece. Returns 0 on a read error.
+int tag_vorbis_index(MediaScanResult *r, Buffer *buf, FILE *fp, uint32_t len, uint64_t offset);
+
+// Parse the start of a FLAC picture block read into head, size is the size of the whole block.
+// Returns the picture type, with the offset and size of the image in skip and size, or -1.
+int tag_vorbis_picture(const unsigned char *head, uint32_t len, uint32_t *skip, uint32_t *size);
+
+#endif // _TAG_VORBIS_H
@@ -18,6 +18,7 @@
 #include "result.h"
 #include "progress.h"
 #include "error.h"
+#include "duplicate.h"
 #include "thread.h"
 #include "queue.h"
 
@@ -32,6 +33,22 @@ struct equeue_entry {
 };
 TAILQ_HEAD(equeue, equeue_entry);
 
+// Passed to thread_start so the new thread logs at the level of the thread that created it
+struct thread_start_data {
+  void *(*func) (void *);
+  void *arg;
+  enum log_level log_level;
+};
+
+static void *thread_start(void *data) {
+  struct thread_start_data start = *(struct thread_start_data *)data;
+
+  free(data);
+  Debug = start.log_level;
+
+  return start.func(start.arg);
+}
+
 #ifdef WIN32
 /* socketpair.c
  * Copyright 2007 by Nathan C. Myers <ncm@cantrip.org>; some rights reserved.
@@ -105,6 +122,7 @@ static int win32_socketpair(int socks[2]) {
 
 MediaScanThread *thread_create(void *(*func) (void *), thread_data_type *thread_data, int optional_fds[4]) {
   int err;
+  struct thread_start_data *start;
   MediaScanThread *t = (MediaScanThread *)calloc(sizeof(MediaScanThread), 1);
   if (t == NULL) {
     LOG_ERROR("Out of memory for new MediaScanThread object\n");
@@ -143,9 +161,15 @@ MediaScanThread *thread_create(void *(*func) (void *), thread_data_type *thread_
   }
 
   // Launch thread
-  err = pthread_create(&t->tid, NULL, func, (void *)thread_data);
+  start = (struct thread_start_data *)malloc(sizeof(struct thread_start_data));
+  start->func = func;
+  start->arg = (void *)thread_data;
+  start->log_level = Debug;
+
+  err = pthread_create(&t->tid, NULL, thread_start, (void *)start);
   if (err != 0) {
     LOG_ERROR("Unable to create thread (%s)\n", strerror(err));
+    free(start);
     goto fail;
   }
 
@@ -299,6 +323,10 @@ void thread_destroy(MediaScanThread *t) {
           error_destroy((MediaScanError *)entry->data);
           break;
 
+        case EVENT_TYPE_DUPLICATES:
+          duplicates_destroy((MediaScanDuplicates *)entry->data);
+          break;
+
         case EVENT_TYPE_FINISH:
         default:
           break;
@@ -2,6 +2,14 @@
 #include <libmediascan.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#include <sys/types.h>
+#else
+#include <direct.h>
+#endif
 
 #ifdef WIN32
 #include "mediascan_win32.h"
@@ -13,11 +21,95 @@
 #include "thumb.h"
 #include "image_jpeg.h"
 #include "image_png.h"
+#include "image_webp.h"
 #include "fixed.h"
+#include "util.h"
+
+// Dimensions of the grid the difference hash is computed from, one bit per horizontal neighbour pair
+#define SIGNATURE_COLS 9
+#define SIGNATURE_ROWS 8
+
+// Compute r's perceptual signature from the resized pixels of thumb, leaving out any padding.
+// The signature is a difference hash (dHash): the image is reduced to a 9 x 8 grid of average
+// brightness, and each bit records whether a cell is darker than the one to its right.
+static void thumb_signature(MediaScanImage *thumb, MediaScanThumbSpec *spec, int orientation, MediaScanResult *r) {
+  uint32_t gray[SIGNATURE_ROWS][SIGNATURE_COLS];
+  uint32_t count[SIGNATURE_ROWS][SIGNATURE_COLS];
+  uint64_t red = 0, green = 0, blue = 0, n;
+  uint64_t signature = 0;
+  int px = spec->width_padding, py = spec->height_padding;
+  int iw = spec->width_inner ? spec->width_inner : thumb->width;
+  int ih = spec->height_inner ? spec->height_inner : thumb->height;
+  int x, y, gx, gy, tmp;
+
+  // Padding was worked out before the thumbnail was rotated
+  if (orientation >= 5) {
+    tmp = px, px = py, py = tmp;
+    tmp = iw, iw = ih, ih = tmp;
+  }
+
+  iw = MIN(iw, thumb->width - px);
+  ih = MIN(ih, thumb->height - py);
+  if (iw < 1 || ih < 1)
+    return;
+
+  memset(gray, 0, sizeof(gray));
+  memset(count, 0, sizeof(count));
+
+  for (y = 0; y < ih; y++) {
+    pix *row = &thumb->_pixbuf[(py + y) * thumb->width + px];
+
+    gy = y * SIGNATURE_ROWS / ih;
+    for (x = 0; x < iw; x++) {
+      pix col = row[x];
+
+      gx = x * SIGNATURE_COLS / iw;
+      gray[gy][gx] += (COL_RED(col) * 77 + COL_GREEN(col) * 150 + COL_BLUE(col) * 29) >> 8;
+      count[gy][gx]++;
+
+      red += COL_RED(col);
+      green += COL_GREEN(col);
+      blue += COL_BLUE(col);
+    }
+  }
 
-MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *spec_orig) {
+  // Cells of an image smaller than the grid borrow their left neighbour
+  for (gy = 0; gy < SIGNATURE_ROWS; gy++) {
+    for (gx = 0; gx < SIGNATURE_COLS; gx++) {
+      if (count[gy][gx])
+        gray[gy][gx] /= count[gy][gx];
+      else if (gx)
+        gray[gy][gx] = gray[gy][gx - 1];
+      else if (gy)
+        gray[gy][gx] = gray[gy - 1][gx];
+    }
+  }
+
+  for (gy = 0; gy < SIGNATURE_ROWS; gy++) {
+    for (gx = 0; gx < SIGNATURE_COLS - 1; gx++) {
+      signature <<= 1;
+      if (gray[gy][gx] < gray[gy][gx + 1])
+        signature |= 1;
+    }
+  }
+
+  n = (uint64_t)iw * ih;
+  r->signature = signature;
+  r->color = (uint32_t)((red / n) << 16 | (green / n) << 8 | (blue / n));
+  r->has_signature = 1;
+}
+
+// Resize i to a new thumbnail for spec_orig. If r is given, r's signature is computed from the
+// resized pixels (see MS_IMAGE_SIGNATURES).
+MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *spec_orig, MediaScanResult *r) {
   MediaScanImage *thumb;
 
+  // Encoder state lives on the original spec, so it is reused for every thumbnail made from it
+  if (!spec_orig->_encoder) {
+    spec_orig->_encoder = calloc(sizeof(ThumbEncoder), 1);
+    LOG_MEM("new ThumbEncoder @ %p\n", spec_orig->_encoder);
+  }
+
   // Create a copy of the spec, so we can adjust width/height as needed
   MediaScanThumbSpec *spec = (MediaScanThumbSpec *)calloc(sizeof(MediaScanThumbSpec), 1);
   memcpy(spec, spec_orig, sizeof(MediaScanThumbSpec));
@@ -62,6 +154,9 @@ MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *s
   if (!thumb_resize(i, thumb, spec))
     goto err;
 
+  if (r)
+    thumb_signature(thumb, spec, i->orientation, r);
+
   if (spec->format == THUMB_AUTO) {
     // Transparent source always gets output as PNG
     if (i->has_alpha)
@@ -80,6 +175,12 @@ MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *s
         goto err;
       break;
 
+    case THUMB_WEBP:
+      thumb->codec = "WebP";
+      if (!image_webp_compress(thumb, spec))
+        goto err;
+      break;
+
     case THUMB_PNG:
     default:
       thumb->codec = "PNG";
@@ -91,6 +192,9 @@ MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *s
   // Free uncompressed resize data we no longer need
   image_free_pixbuf(thumb);
 
+  // Remember the output size so the next thumbnail's buffer can be allocated up front
+  spec_orig->_last_size = buffer_len((Buffer *)thumb->_dbuf);
+
   goto ok;
 
 err:
@@ -105,6 +209,270 @@ ok:
   return thumb;
 }
 
+// Allocate a buffer for compressed thumbnail data, sized from the previous thumbnail for this spec
+Buffer *thumb_encoder_buffer(MediaScanThumbSpec *spec) {
+  uint32_t size = BUF_SIZE;
+  Buffer *buf;
+
+  // Leave some headroom so a slightly larger thumbnail doesn't need to grow the buffer
+  if (spec->_last_size + spec->_last_size / 4 > size)
+    size = spec->_last_size + spec->_last_size / 4;
+
+  buf = (Buffer *)malloc(sizeof(Buffer));
+  buffer_init(buf, size);
+
+  return buf;
+}
+
+// Return a scratch row of at least size bytes, kept until the spec is destroyed
+unsigned char *thumb_encoder_row(MediaScanThumbSpec *spec, int size) {
+  ThumbEncoder *enc = (ThumbEncoder *)spec->_encoder;
+
+  if (enc->row_size < size) {
+    if (enc->row) {
+      LOG_MEM("destroy ThumbEncoder row @ %p\n", enc->row);
+      free(enc->row);
+    }
+
+    enc->row = (unsigned char *)malloc(size);
+    enc->row_size = size;
+    LOG_MEM("new ThumbEncoder row @ %p (%d bytes)\n", enc->row, size);
+  }
+
+  return enc->row;
+}
+
+void thumb_encoder_destroy(MediaScanThumbSpec *spec) {
+  ThumbEncoder *enc = (ThumbEncoder *)spec->_encoder;
+
+  if (!enc)
+    return;
+
+  if (enc->jpeg)
+    image_jpeg_encoder_destroy(enc->jpeg);
+
+  if (enc->row) {
+    LOG_MEM("destroy ThumbEncoder row @ %p\n", enc->row);
+    free(enc->row);
+  }
+
+  LOG_MEM("destroy ThumbEncoder @ %p\n", enc);
+  free(enc);
+  spec->_encoder = NULL;
+}
+
+// Hash of the settings that determine a spec's output, used to key cached thumbnails
+uint32_t thumb_spec_hash(MediaScanThumbSpec *spec) {
+  int32_t v[10];
+
+  v[0] = spec->format;
+  v[1] = spec->width;
+  v[2] = spec->height;
+  v[3] = spec->keep_aspect;
+  v[4] = spec->bgcolor;
+  v[5] = spec->jpeg_quality;
+  v[6] = spec->flags;
+  v[7] = spec->png_level;
+  v[8] = spec->png_filters;
+  v[9] = spec->png_strategy;
+
+  return hashlittle(v, sizeof(v), 0);
+}
+
+// Expand the ms_set_thumbnail_path template for a thumbnail, returns 0 if the result is too long
+static int thumb_expand_path(MediaScan *s, MediaScanImage *thumb, int index, char *path, int size) {
+  const char *t = s->thumbpath;
+  int len = 0;
+
+  while (*t) {
+    char field[32];
+    const char *value = field;
+    int n;
+
+    if (*t != '%' || !t[1]) {
+      field[0] = *t++;
+      field[1] = '\0';
+    }
+    else {
+      switch (t[1]) {
+        case 'c':
+          value = s->cachedir ? s->cachedir : ".";
+          break;
+        case 'k':{
+            uint32_t pc = 0, pb = 0;
+            hashlittle2(thumb->path, strlen(thumb->path), &pc, &pb);
+            sprintf(field, "%08x%08x", pc, pb);
+            break;
+          }
+        case 'i':
+          sprintf(field, "%d", index);
+          break;
+        case 'w':
+          sprintf(field, "%d", thumb->width);
+          break;
+        case 'h':
+          sprintf(field, "%d", thumb->height);
+          break;
+        case 'e':
+          value = !strcmp("JPEG", thumb->codec) ? "jpg" : !strcmp("WebP", thumb->codec) ? "webp" : "png";
+          break;
+        default:               // %% and unknown fields are copied as-is
+          field[0] = t[1];
+          field[1] = '\0';
+          break;
+      }
+      t += 2;
+    }
+
+    n = strlen(value);
+    if (len + n >= size)
+      return 0;
+
+    memcpy(path + len, value, n);
+    len += n;
+  }
+
+  path[len] = '\0';
+
+  return 1;
+}
+
+// Create all missing parent directories of path
+static void thumb_make_dirs(const char *path) {
+  char dir[MAX_PATH_STR_LEN];
+  char *p;
+
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+
+  for (p = dir + 1; *p; p++) {
+    if (*p == '/' || *p == '\\') {
+      char c = *p;
+      *p = '\0';
+#ifdef WIN32
+      _mkdir(dir);
+#else
+      mkdir(dir, 0755);
+#endif
+      *p = c;
+    }
+  }
+}
+
+// Write a thumbnail to the file given by the ms_set_thumbnail_path template and release its
+// compressed data. If the file can't be written the thumbnail is left in memory and 0 is returned.
+int thumb_save(MediaScan *s, MediaScanImage *thumb, int index) {
+  char path[MAX_PATH_STR_LEN];
+  Buffer *buf = (Buffer *)thumb->_dbuf;
+  FILE *fp;
+  int ok;
+
+  if (!thumb_expand_path(s, thumb, index, path, sizeof(path))) {
+    LOG_WARN("Thumbnail path too long for %s\n", thumb->path);
+    return 0;
+  }
+
+  fp = fopen(path, "wb");
+  if (!fp && errno == ENOENT) {
+    thumb_make_dirs(path);
+    fp = fopen(path, "wb");
+  }
+
+  if (!fp) {
+    LOG_WARN("Unable to write thumbnail %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+
+  ok = fwrite(buffer_ptr(buf), 1, buffer_len(buf), fp) == buffer_len(buf);
+  if (fclose(fp) != 0)
+    ok = 0;
+
+  if (!ok) {
+    LOG_WARN("Unable to write thumbnail %s: %s\n", path, strerror(errno));
+    remove(path);
+    return 0;
+  }
+
+  LOG_DEBUG("Saved thumbnail to %s (%d bytes)\n", path, buffer_len(buf));
+
+  thumb->saved_path = strdup(path);
+
+  buffer_free(buf);
+  LOG_MEM("destroy image data buf @ %p\n", buf);
+  free(buf);
+  thumb->_dbuf = NULL;
+
+  return 1;
+}
+
+// Determine the smallest source dimensions, before any rotation, that can produce the thumbnail
+// described by spec without upscaling. Both values are 0 if there is no spec.
+void thumb_get_source_size(MediaScanImage *i, MediaScanThumbSpec *spec, int *width, int *height) {
+  int iw = i->width;
+  int ih = i->height;
+  int tw = spec ? spec->width : 0;
+  int th = spec ? spec->height : 0;
+
+  // If the image will be rotated 90 degrees, the thumbnail width comes from the source height
+  if (i->orientation >= 5) {
+    int tmp = tw;
+    tw = th;
+    th = tmp;
+  }
+
+  if (tw || th) {
+    if (!tw)
+      tw = (int)((float)iw / ih * th);
+    else if (!th)
+      th = (int)((float)ih / iw * tw);
+    else if (spec->keep_aspect) {
+      // Only the inner, aspect-correct part of a padded thumbnail needs source pixels
+      if ((float)iw / ih >= (float)tw / th)
+        th = (int)((float)ih / iw * tw);
+      else
+        tw = (int)((float)iw / ih * th);
+    }
+  }
+
+  *width = tw;
+  *height = th;
+}
+
+// Returns true if any thumbnail spec may be created from an embedded preview
+int thumb_want_embedded(MediaScan *s) {
+  int x;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    if (s->thumbspecs[x]->flags & THUMB_USE_EMBEDDED)
+      return 1;
+  }
+
+  return 0;
+}
+
+// Returns true if the embedded preview can stand in for image i when creating this thumbnail.
+// The preview must be at least the size needed and have the same aspect ratio, previews with
+// a different aspect ratio are usually letterboxed.
+int thumb_embedded_usable(MediaScanImage *i, MediaScanImage *preview, MediaScanThumbSpec *spec) {
+  float aspect, diff;
+  int w, h;
+
+  if (!(spec->flags & THUMB_USE_EMBEDDED) || !preview->width || !preview->height)
+    return 0;
+
+  aspect = (float)i->width / i->height;
+  diff = aspect - (float)preview->width / preview->height;
+  if (diff < 0)
+    diff = -diff;
+
+  if (diff > aspect * 0.02)
+    return 0;
+
+  thumb_get_source_size(i, spec, &w, &h);
+
+  return preview->width >= w && preview->height >= h;
+}
+
 void thumb_bgcolor_fill(pix *buf, int size, pix bgcolor) {
   int i;
 
@@ -117,6 +485,94 @@ void thumb_bgcolor_fill(pix *buf, int size, pix bgcolor) {
   }
 }
 
+// Square tiles keep both the reads and the strided writes of a rotation within cache
+#define ORIENT_TILE 32
+
+// Apply EXIF orientation to a resized image as a separate pass, swapping width/height for 90/270 rotations.
+// Each orientation is expressed as an output offset plus per-pixel x and y steps, so the copy loop has no branches.
+void thumb_orient(MediaScanImage *i, int orientation) {
+  int w = i->width;
+  int h = i->height;
+  int base, dx, dy;
+  int tx, ty, x, y;
+  pix *out;
+
+  switch (orientation) {
+    case ORIENTATION_NORMAL:   // 1
+      return;
+    case ORIENTATION_MIRROR_HORIZ: // 2
+      base = w - 1;
+      dx = -1;
+      dy = w;
+      break;
+    case ORIENTATION_180:      // 3
+      base = (h - 1) * w + w - 1;
+      dx = -1;
+      dy = -w;
+      break;
+    case ORIENTATION_MIRROR_VERT:  // 4
+      base = (h - 1) * w;
+      dx = 1;
+      dy = -w;
+      break;
+    case ORIENTATION_MIRROR_HORIZ_270_CCW: // 5
+      base = 0;
+      dx = h;
+      dy = 1;
+      break;
+    case ORIENTATION_90_CCW:   // 6
+      base = h - 1;
+      dx = h;
+      dy = -1;
+      break;
+    case ORIENTATION_MIRROR_HORIZ_90_CCW:  // 7
+      base = (w - 1) * h + h - 1;
+      dx = -h;
+      dy = -1;
+      break;
+    case ORIENTATION_270_CCW:  // 8
+      base = (w - 1) * h;
+      dx = -h;
+      dy = 1;
+      break;
+    default:
+      LOG_WARN("Cannot rotate image, unknown orientation value: %d (%s)\n", orientation, i->path);
+      return;
+  }
+
+  out = (pix *)malloc(i->_pixbuf_size);
+  LOG_MEM("new pixbuf @ %p for rotated image (%d bytes)\n", out, i->_pixbuf_size);
+
+  for (ty = 0; ty < h; ty += ORIENT_TILE) {
+    int ymax = ty + ORIENT_TILE < h ? ty + ORIENT_TILE : h;
+
+    for (tx = 0; tx < w; tx += ORIENT_TILE) {
+      int xmax = tx + ORIENT_TILE < w ? tx + ORIENT_TILE : w;
+
+      for (y = ty; y < ymax; y++) {
+        pix *in = &i->_pixbuf[y * w];
+        pix *o = &out[base + y * dy];
+
+        for (x = tx; x < xmax; x++)
+          o[x * dx] = in[x];
+      }
+    }
+  }
+
+  LOG_MEM("destroy pixbuf @ %p of size %d bytes\n", i->_pixbuf, i->_pixbuf_size);
+  free(i->_pixbuf);
+  i->_pixbuf = out;
+
+  // 90 and 270 rotations swap the width/height
+  // This is needed for the save_*() functions to output the correct size
+  if (orientation >= 5) {
+    i->width = h;
+    i->height = w;
+
+    LOG_DEBUG("Image was rotated, dst now %d x %d\n", i->width, i->height);
+  }
+}
+
 int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec) {
   int ret = 1;
 
@@ -159,15 +615,8 @@ int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *s
 
   thumb_resize_gd_fixed(src, dst, spec);
 
-  // If the image was rotated, swap the width/height if necessary
-  // This is needed for the save_*() functions to output the correct size
-  if (src->orientation >= 5) {
-    int tmp = dst->height;
-    dst->height = dst->width;
-    dst->width = tmp;
-
-    LOG_DEBUG("Image was rotated, dst now %d x %d\n", dst->width, dst->height);
-  }
+  if (src->orientation != ORIENTATION_NORMAL)
+    thumb_orient(dst, src->orientation);
 
 out:
   return ret;
@@ -181,49 +630,6 @@ static inline void put_pix(MediaScanImage *i, int32_t x, int32_t y, pix col) {
   i->_pixbuf[(y * i->width) + x] = col;
 }
 
-static inline void put_pix_rotated(MediaScanImage *i, int32_t x, int32_t y, int32_t rotated_width, pix col) {
-  i->_pixbuf[(y * rotated_width) + x] = col;
-}
-
-static inline void get_rotated_coords(MediaScanImage *src, MediaScanImage *dst, int x, int y, int *ox, int *oy) {
-  switch (src->orientation) {
-    case ORIENTATION_MIRROR_HORIZ: // 2
-      *ox = dst->width - 1 - x;
-      *oy = y;
-      break;
-    case ORIENTATION_180:      // 3
-      *ox = dst->width - 1 - x;
-      *oy = dst->height - 1 - y;
-      break;
-    case ORIENTATION_MIRROR_VERT:  // 4
-      *ox = x;
-      *oy = dst->height - 1 - y;
-      break;
-    case ORIENTATION_MIRROR_HORIZ_270_CCW: // 5
-      *ox = y;
-      *oy = x;
-      break;
-    case ORIENTATION_90_CCW:   // 6
-      *ox = dst->height - 1 - y;
-      *oy = x;
-      break;
-    case ORIENTATION_MIRROR_HORIZ_90_CCW:  // 7
-      *ox = dst->height - 1 - y;
-      *oy = dst->width - 1 - x;
-      break;
-    case ORIENTATION_270_CCW:  // 8
-      *ox = y;
-      *oy = dst->width - 1 - x;
-      break;
-    default:
-      if (x == 0 && y == 0)
-        LOG_WARN("Cannot rotate image, unknown orientation value: %d (%s)\n", src->orientation, src->path);
-      *ox = x;
-      *oy = y;
-      break;
-  }
-}
-
 // This is a fixed-point resizer inspired by libgd's copyResampled function
 void thumb_resize_gd_fixed(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec) {
   int x, y;
@@ -379,26 +785,7 @@ void thumb_resize_gd_fixed(MediaScanImage *src, MediaScanImage *dst, MediaScanTh
          fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha));
        */
 
-      if (src->orientation != ORIENTATION_NORMAL) {
-        int ox, oy;             // new destination pixel coordinates after rotating
-
-        get_rotated_coords(src, dst, x, y, &ox, &oy);
-
-        if (src->orientation >= 5) {
-          // 90 and 270 rotations, width/height are swapped so we have to use alternate put_pix method
-          put_pix_rotated(dst, ox, oy, dst->height,
-                          COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha))
-            );
-        }
-        else {
-          put_pix(dst, ox, oy, COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha))
-            );
-        }
-      }
-      else {
-        put_pix(dst, x, y, COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha))
-          );
-      }
+      put_pix(dst, x, y, COL_FULL(fixed_to_int(red), fixed_to_int(green), fixed_to_int(blue), fixed_to_int(alpha)));
     }
   }
 }
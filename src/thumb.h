@@ -3,9 +3,28 @@
 
 typedef uint32_t pix;
 
-MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *spec);
+// Used by ms_set_thumbnail_path when no template is given
+#define DEFAULT_THUMB_PATH "%c/thumbs/%k-%i.%e"
+
+// Encoder state kept on a MediaScanThumbSpec so it can be reused between thumbnails
+typedef struct {
+  void *jpeg;                   // JPEG compressor, owned by image_jpeg.c
+  unsigned char *row;           // Scratch row for encoders that need to repack pixels
+  int row_size;
+} ThumbEncoder;
+
+MediaScanImage *thumb_create_from_image(MediaScanImage *i, MediaScanThumbSpec *spec, MediaScanResult *r);
+void thumb_get_source_size(MediaScanImage *i, MediaScanThumbSpec *spec, int *width, int *height);
+int thumb_want_embedded(MediaScan *s);
+int thumb_embedded_usable(MediaScanImage *i, MediaScanImage *preview, MediaScanThumbSpec *spec);
 int thumb_resize(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec);
+void thumb_orient(MediaScanImage *i, int orientation);
 void thumb_bgcolor_fill(pix *buf, int size, pix bgcolor);
+Buffer *thumb_encoder_buffer(MediaScanThumbSpec *spec);
+unsigned char *thumb_encoder_row(MediaScanThumbSpec *spec, int size);
+void thumb_encoder_destroy(MediaScanThumbSpec *spec);
+uint32_t thumb_spec_hash(MediaScanThumbSpec *spec);
+int thumb_save(MediaScan *s, MediaScanImage *thumb, int index);
 void thumb_resize_gd_fixed(MediaScanImage *src, MediaScanImage *dst, MediaScanThumbSpec *spec);
 
 #endif // _THUMB_H
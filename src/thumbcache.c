@@ -0,0 +1,398 @@
+
+#include <libmediascan.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <db.h>
+
+#ifdef WIN32
+#include "mediascan_win32.h"
+#endif
+
+#include "common.h"
+#include "buffer.h"
+#include "image.h"
+#include "thumb.h"
+#include "thumbcache.h"
+#include "database.h"
+#include "util.h"
+
+// Persistent store of encoded thumbnails, see ms_set_thumbnail_cache_size.
+//
+// Thumbnails are kept in their own BDB file so they survive MS_FULL_SCAN clearing the main
+// database. Keys are the file identity (path, mtime, size) plus a hash of the spec, so a changed
+// file or spec simply misses. Each value starts with a small header holding the time it was
+// last used, which drives LRU eviction once the store grows past its byte limit.
+
+typedef struct {
+  DB *dbp;
+  uint64_t used;                // bytes of thumbnail data currently stored
+  int failed;                   // set if the database couldn't be opened, the cache is then skipped
+} ThumbCache;
+
+typedef struct {
+  uint32_t last_used;
+  uint32_t size;                // bytes of thumbnail data following the header
+  uint32_t width;
+  uint32_t height;
+  uint32_t format;
+  uint32_t has_signature;       // the file's signature, see MS_IMAGE_SIGNATURES
+  uint32_t color;
+  uint64_t signature;
+} ThumbCacheHeader;
+
+typedef struct {
+  uint32_t last_used;
+  uint32_t size;
+  DBT key;
+} ThumbCacheEntry;
+
+// Evict down to this fraction of the limit so eviction doesn't run on every insert
+#define THUMBCACHE_LOW_WATER 0.9
+
+static const char *thumbcache_codecs[] = { "JPEG", "PNG", "WebP" };
+
+// Build the key for a file/spec pair, the file being at path, returns the key length
+static int thumbcache_key(MediaScanResult *r, const char *path, MediaScanThumbSpec *spec, unsigned char *key, int size) {
+  int len = strlen(path) + 1;
+  uint32_t spec_hash = thumb_spec_hash(spec);
+
+  if (len + sizeof(r->mtime) + sizeof(r->size) + sizeof(spec_hash) > size)
+    return 0;
+
+  memcpy(key, path, len);
+  memcpy(key + len, &r->mtime, sizeof(r->mtime));
+  len += sizeof(r->mtime);
+  memcpy(key + len, &r->size, sizeof(r->size));
+  len += sizeof(r->size);
+  memcpy(key + len, &spec_hash, sizeof(spec_hash));
+  len += sizeof(spec_hash);
+
+  return len;
+}
+
+static ThumbCache *thumbcache_open(MediaScan *s) {
+  ThumbCache *tc = (ThumbCache *)s->_thumbcache;
+  char dbpath[MAX_PATH_STR_LEN];
+  DBC *cursor;
+  DBT key, data;
+  ThumbCacheHeader hdr;
+  DB_ENV *env = NULL;
+  int ret;
+
+  if (tc)
+    return tc->failed ? NULL : tc;
+
+  // Other processes may use a shared cache dir at the same time, the database then has to be
+  // opened in the locking environment of the scan database
+  if ((s->flags & MS_SHARED_CACHE) && !(env = bdb_env(s)))
+    return NULL;
+
+  tc = (ThumbCache *)calloc(1, sizeof(ThumbCache));
+  s->_thumbcache = (void *)tc;
+  LOG_MEM("new ThumbCache @ %p\n", tc);
+
+  snprintf(dbpath, sizeof(dbpath), "%s/thumbcache.db", s->cachedir ? s->cachedir : ".");
+
+  ret = db_create(&tc->dbp, env, 0);
+  if (ret == 0)
+    ret = tc->dbp->open(tc->dbp, NULL, dbpath, NULL, DB_BTREE, DB_CREATE, 0);
+
+  if (ret != 0) {
+    LOG_ERROR("Thumbnail cache open failed: %s\n", db_strerror(ret));
+    if (tc->dbp)
+      tc->dbp->close(tc->dbp, 0);
+    tc->dbp = NULL;
+    tc->failed = 1;
+    return NULL;
+  }
+
+  // Add up the size of everything already stored, only the headers need to be read
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  data.data = &hdr;
+  data.ulen = data.dlen = sizeof(hdr);
+  data.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+
+  if (tc->dbp->cursor(tc->dbp, NULL, &cursor, 0) == 0) {
+    while (cursor->get(cursor, &key, &data, DB_NEXT) == 0)
+      tc->used += sizeof(hdr) + hdr.size;
+    cursor->close(cursor);
+  }
+
+  LOG_DEBUG("Thumbnail cache %s holds %llu bytes\n", dbpath, (unsigned long long)tc->used);
+
+  return tc;
+}
+
+static int thumbcache_entry_cmp(const void *a, const void *b) {
+  const ThumbCacheEntry *ea = (const ThumbCacheEntry *)a;
+  const ThumbCacheEntry *eb = (const ThumbCacheEntry *)b;
+
+  return ea->last_used < eb->last_used ? -1 : ea->last_used > eb->last_used;
+}
+
+// Delete the least recently used thumbnails until the store is under the low water mark
+static void thumbcache_evict(MediaScan *s, ThumbCache *tc) {
+  uint64_t target = (uint64_t)(s->thumbcache_size * THUMBCACHE_LOW_WATER);
+  ThumbCacheEntry *entries = NULL;
+  int nentries = 0, maxentries = 0, x;
+  DBC *cursor;
+  DBT key, data;
+  ThumbCacheHeader hdr;
+
+  if (tc->dbp->cursor(tc->dbp, NULL, &cursor, 0) != 0)
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  data.data = &hdr;
+  data.ulen = data.dlen = sizeof(hdr);
+  data.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+
+  while (cursor->get(cursor, &key, &data, DB_NEXT) == 0) {
+    if (nentries == maxentries) {
+      maxentries = maxentries ? maxentries * 2 : 1024;
+      entries = (ThumbCacheEntry *)realloc(entries, maxentries * sizeof(ThumbCacheEntry));
+    }
+
+    entries[nentries].last_used = hdr.last_used;
+    entries[nentries].size = sizeof(hdr) + hdr.size;
+    memset(&entries[nentries].key, 0, sizeof(DBT));
+    entries[nentries].key.data = malloc(key.size);
+    entries[nentries].key.size = key.size;
+    memcpy(entries[nentries].key.data, key.data, key.size);
+    nentries++;
+  }
+  cursor->close(cursor);
+
+  qsort(entries, nentries, sizeof(ThumbCacheEntry), thumbcache_entry_cmp);
+
+  for (x = 0; x < nentries; x++) {
+    if (tc->used > target && tc->dbp->del(tc->dbp, NULL, &entries[x].key, 0) == 0)
+      tc->used -= entries[x].size;
+
+    free(entries[x].key.data);
+  }
+
+  LOG_DEBUG("Thumbnail cache evicted down to %llu bytes\n", (unsigned long long)tc->used);
+
+  if (entries)
+    free(entries);
+}
+
+// Look up a stored thumbnail for spec index of this result's file. Returns a new thumbnail
+// image holding the encoded data, or NULL if there is none.
+MediaScanImage *thumbcache_get(MediaScan *s, MediaScanResult *r, int index) {
+  ThumbCache *tc;
+  unsigned char k[MAX_PATH_STR_LEN + 32];
+  ThumbCacheHeader *hdr;
+  MediaScanImage *thumb;
+  Buffer *buf;
+  DBT key, data;
+
+  if (!s->thumbcache_size || !(tc = thumbcache_open(s)))
+    return NULL;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = k;
+  key.size = thumbcache_key(r, r->path, s->thumbspecs[index], k, sizeof(k));
+  data.flags = DB_DBT_MALLOC;
+
+  if (!key.size || tc->dbp->get(tc->dbp, NULL, &key, &data, 0) != 0)
+    return NULL;
+
+  hdr = (ThumbCacheHeader *)data.data;
+  if (data.size < sizeof(ThumbCacheHeader) || data.size != sizeof(ThumbCacheHeader) + hdr->size
+      || hdr->format >= sizeof(thumbcache_codecs) / sizeof(char *)) {
+    free(data.data);
+    return NULL;
+  }
+
+  thumb = image_create();
+  thumb->path = r->path;
+  thumb->codec = thumbcache_codecs[hdr->format];
+  thumb->width = hdr->width;
+  thumb->height = hdr->height;
+
+  if (hdr->has_signature) {
+    r->has_signature = 1;
+    r->signature = hdr->signature;
+    r->color = hdr->color;
+  }
+
+  buf = (Buffer *)malloc(sizeof(Buffer));
+  buffer_init(buf, data.size - sizeof(ThumbCacheHeader));
+  buffer_append(buf, (unsigned char *)data.data + sizeof(ThumbCacheHeader), data.size - sizeof(ThumbCacheHeader));
+  thumb->_dbuf = (void *)buf;
+
+  LOG_DEBUG("Using cached %s thumbnail %d x %d for %s\n", thumb->codec, thumb->width, thumb->height, r->path);
+
+  // Mark as recently used, only the timestamp at the start of the value is rewritten
+  hdr->last_used = (uint32_t)time(NULL);
+  data.size = data.dlen = sizeof(uint32_t);
+  data.doff = 0;
+  data.flags = DB_DBT_PARTIAL;
+  tc->dbp->put(tc->dbp, NULL, &key, &data, 0);
+
+  free(hdr);
+
+  return thumb;
+}
+
+// Spec index the cache holds exactly this thumbnail of the result's file under, or -1 if it
+// isn't stored. Lets the result cache refer to the thumbnail instead of storing it a second time.
+int thumbcache_find(MediaScan *s, MediaScanResult *r, MediaScanImage *thumb) {
+  ThumbCache *tc;
+  unsigned char k[MAX_PATH_STR_LEN + 32];
+  Buffer *buf = (Buffer *)thumb->_dbuf;
+  DBT key, data;
+  int x, found = -1;
+
+  if (!s->thumbcache_size || !buf || !(tc = thumbcache_open(s)))
+    return -1;
+
+  for (x = 0; x < s->nthumbspecs && found < 0; x++) {
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = k;
+    key.size = thumbcache_key(r, r->path, s->thumbspecs[x], k, sizeof(k));
+    data.flags = DB_DBT_MALLOC;
+
+    if (!key.size || tc->dbp->get(tc->dbp, NULL, &key, &data, 0) != 0)
+      continue;
+
+    if (data.size == sizeof(ThumbCacheHeader) + buffer_len(buf)
+        && !memcmp((unsigned char *)data.data + sizeof(ThumbCacheHeader), buffer_ptr(buf), buffer_len(buf)))
+      found = x;
+
+    free(data.data);
+  }
+
+  return found;
+}
+
+// Bytes stored under key, or 0 if there is nothing there. Only the header is read.
+static uint32_t thumbcache_stored_size(ThumbCache *tc, DBT *key) {
+  ThumbCacheHeader hdr;
+  DBT data;
+
+  memset(&data, 0, sizeof(DBT));
+  data.data = &hdr;
+  data.ulen = data.dlen = sizeof(hdr);
+  data.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+
+  if (tc->dbp->get(tc->dbp, NULL, key, &data, 0) != 0 || data.size < sizeof(hdr))
+    return 0;
+
+  return sizeof(hdr) + hdr.size;
+}
+
+// Store a newly created thumbnail for spec index of this result's file
+void thumbcache_put(MediaScan *s, MediaScanResult *r, int index, MediaScanImage *thumb) {
+  ThumbCache *tc;
+  unsigned char k[MAX_PATH_STR_LEN + 32];
+  ThumbCacheHeader hdr;
+  Buffer *buf = (Buffer *)thumb->_dbuf;
+  Buffer value;
+  DBT key, data;
+  uint32_t old;
+  int ret;
+
+  if (!s->thumbcache_size || !buf || !(tc = thumbcache_open(s)))
+    return;
+
+  memset(&key, 0, sizeof(DBT));
+  memset(&data, 0, sizeof(DBT));
+  key.data = k;
+  key.size = thumbcache_key(r, r->path, s->thumbspecs[index], k, sizeof(k));
+  if (!key.size)
+    return;
+
+  hdr.last_used = (uint32_t)time(NULL);
+  hdr.size = buffer_len(buf);
+  hdr.width = thumb->width;
+  hdr.height = thumb->height;
+  hdr.format = !strcmp("JPEG", thumb->codec) ? 0 : !strcmp("PNG", thumb->codec) ? 1 : 2;
+  hdr.has_signature = r->has_signature;
+  hdr.color = r->color;
+  hdr.signature = r->signature;
+
+  buffer_init(&value, sizeof(hdr) + buffer_len(buf));
+  buffer_append(&value, &hdr, sizeof(hdr));
+  buffer_append(&value, buffer_ptr(buf), buffer_len(buf));
+
+  data.data = buffer_ptr(&value);
+  data.size = buffer_len(&value);
+
+  // A rescan may replace a thumbnail that is already stored, its bytes no longer count
+  old = thumbcache_stored_size(tc, &key);
+
+  ret = tc->dbp->put(tc->dbp, NULL, &key, &data, 0);
+  if (ret != 0) {
+    LOG_WARN("Thumbnail cache store failed: %s\n", db_strerror(ret));
+  }
+  else {
+    tc->used -= MIN(tc->used, old);
+    tc->used += data.size;
+  }
+
+  buffer_free(&value);
+
+  if (tc->used > s->thumbcache_size)
+    thumbcache_evict(s, tc);
+}
+
+// Move the stored thumbnails of a file that was moved from old_path to r->path
+void thumbcache_move(MediaScan *s, MediaScanResult *r, const char *old_path) {
+  ThumbCache *tc;
+  unsigned char k[MAX_PATH_STR_LEN + 32];
+  DBT key, data;
+  uint32_t old;
+  int x;
+
+  if (!s->thumbcache_size || !(tc = thumbcache_open(s)))
+    return;
+
+  for (x = 0; x < s->nthumbspecs; x++) {
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = k;
+    key.size = thumbcache_key(r, old_path, s->thumbspecs[x], k, sizeof(k));
+    data.flags = DB_DBT_MALLOC;
+
+    if (!key.size || tc->dbp->get(tc->dbp, NULL, &key, &data, 0) != 0)
+      continue;
+
+    tc->dbp->del(tc->dbp, NULL, &key, 0);
+
+    key.size = thumbcache_key(r, r->path, s->thumbspecs[x], k, sizeof(k));
+    old = key.size ? thumbcache_stored_size(tc, &key) : 0;
+
+    if (key.size && tc->dbp->put(tc->dbp, NULL, &key, &data, 0) == 0) {
+      tc->used -= MIN(tc->used, old);
+      LOG_DEBUG("Moved cached thumbnail %d for %s from %s\n", x, r->path, old_path);
+    }
+    else {
+      // The stored data is gone with the old key
+      tc->used -= MIN(tc->used, data.size);
+    }
+
+    free(data.data);
+  }
+}
+
+void thumbcache_destroy(MediaScan *s) {
+  ThumbCache *tc = (ThumbCache *)s->_thumbcache;
+
+  if (!tc)
+    return;
+
+  if (tc->dbp)
+    tc->dbp->close(tc->dbp, 0);
+
+  LOG_MEM("destroy ThumbCache @ %p\n", tc);
+  free(tc);
+  s->_thumbcache = NULL;
+}
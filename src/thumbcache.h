@@ -0,0 +1,10 @@
+#ifndef _THUMBCACHE_H
+#define _THUMBCACHE_H
+
+MediaScanImage *thumbcache_get(MediaScan *s, MediaScanResult *r, int index);
+int thumbcache_find(MediaScan *s, MediaScanResult *r, MediaScanImage *thumb);
+void thumbcache_put(MediaScan *s, MediaScanResult *r, int index, MediaScanImage *thumb);
+void thumbcache_move(MediaScan *s, MediaScanResult *r, const char *old_path);
+void thumbcache_destroy(MediaScan *s);
+
+#endif // _THUMBCACHE_H
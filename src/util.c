@@ -54,8 +54,6 @@
 ///-------------------------------------------------------------------------------------------------
 
 uint32_t HashFile(const char *file, int *mtime, uint64_t *size) {
-  uint32_t hash;
-  char fileData[MAX_PATH_STR_LEN];
 
 #ifndef WIN32
   STAT_TYPE buf;
@@ -82,14 +80,145 @@ uint32_t HashFile(const char *file, int *mtime, uint64_t *size) {
   }
 #endif
 
+  return HashFileIdentity(file, *mtime, *size);
+}                               /* HashFile() */
+
+// The hash HashFile returns for a file with this path, modified time and size
+uint32_t HashFileIdentity(const char *file, int mtime, uint64_t size) {
+  char fileData[MAX_PATH_STR_LEN];
+
   // Generate a hash of the full file path, modified time, and file size
   memset(fileData, 0, sizeof(fileData));
-  snprintf(fileData, sizeof(fileData) - 1, "%s%d%llu", file, *mtime, *size);
-  hash = hashlittle(fileData, strlen(fileData), 0);
+  snprintf(fileData, sizeof(fileData) - 1, "%s%d%llu", file, mtime, (unsigned long long)size);
 
-  return hash;
-}                               /* HashFile() */
+  return hashlittle(fileData, strlen(fileData), 0);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Get the numbers identifying a file independently of its path, which stay the same when the
+///  file is renamed or moved within its filesystem.
+///
+/// @param [in] file File to identify
+/// @param [out] dev Device (volume) the file is on
+/// @param [out] ino Inode (file index) of the file on that device
+///
+/// @return 0 if the file can't be read or its filesystem has no stable ids
+///-------------------------------------------------------------------------------------------------
+
+int FileId(const char *file, uint64_t *dev, uint64_t *ino) {
+#ifdef WIN32
+  HANDLE h;
+  BY_HANDLE_FILE_INFORMATION info;
+  BOOL fOk;
+
+  h = CreateFile(file, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                 FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (h == INVALID_HANDLE_VALUE)
+    return 0;
+
+  fOk = GetFileInformationByHandle(h, &info);
+  CloseHandle(h);
+  if (!fOk)
+    return 0;
+
+  *dev = info.dwVolumeSerialNumber;
+  *ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+#else
+  STAT_TYPE buf;
+
+  if (STAT_FUNC(file, &buf) == -1)
+    return 0;
+
+  *dev = (uint64_t)buf.st_dev;
+  *ino = (uint64_t)buf.st_ino;
+#endif
+
+  return *ino != 0;
+}
+
+// Bytes read from each end of a file for its fingerprint
+#define FINGERPRINT_CHUNK (64 * 1024)
+
+///-------------------------------------------------------------------------------------------------
+///  Calculate a cheap fingerprint of a file's content from its first and last 64 KB, used to
+///  confirm that a file found under a new path is the one that was stored under an old one.
+///
+/// @param [in] file File to fingerprint
+/// @param size File size, as returned by HashFile
+///
+/// @return 32-bit fingerprint, 0 if the file can't be read
+///-------------------------------------------------------------------------------------------------
+
+uint32_t FingerprintFile(const char *file, uint64_t size) {
+  unsigned char *buf;
+  uint32_t hash = 0;
+  size_t len;
+  FILE *fp;
+
+  fp = fopen(file, "rb");
+  if (!fp)
+    return 0;
+
+  buf = (unsigned char *)malloc(FINGERPRINT_CHUNK);
+
+  len = fread(buf, 1, FINGERPRINT_CHUNK, fp);
+  hash = hashlittle(buf, len, (uint32_t)size);
+
+  if (size > FINGERPRINT_CHUNK && fseek(fp, -FINGERPRINT_CHUNK, SEEK_END) == 0) {
+    len = fread(buf, 1, FINGERPRINT_CHUNK, fp);
+    hash = hashlittle(buf, len, hash);
+  }
+
+  free(buf);
+  fclose(fp);
+
+  // 0 means no fingerprint
+  return hash ? hash : 1;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Seek within a file using a 64-bit offset, so positions past 2 GB work where long is 32 bits.
+///
+/// @param [in] fp File to seek in
+/// @param offset Offset, relative to whence
+/// @param whence SEEK_SET, SEEK_CUR or SEEK_END
+///
+/// @return 0 on success, non-zero on failure
+///-------------------------------------------------------------------------------------------------
+
+int SeekFile(FILE *fp, int64_t offset, int whence) {
+#if defined(WIN32)
+  return _fseeki64(fp, offset, whence);
+#elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+  return fseeko(fp, (off_t)offset, whence);
+#else
+  return fseeko64(fp, (off64_t)offset, whence);
+#endif
+}
 
+// Position in a file as a 64-bit offset, -1 on failure, see SeekFile
+int64_t TellFile(FILE *fp) {
+#if defined(WIN32)
+  return _ftelli64(fp);
+#elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__APPLE__)
+  return (int64_t)ftello(fp);
+#else
+  return (int64_t)ftello64(fp);
+#endif
+}
+
+// Number of set bits. The GCC builtin is a single instruction when building for a CPU that has
+// one (e.g. -mpopcnt), otherwise the same bit-parallel count as the fallback.
+int popcount64(uint64_t v) {
+#if defined(__GNUC__)
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
 
 // http://sws.dett.de/mini/hexdump-c/
 void hex_dump(void *data, int size) {
@@ -23,6 +23,7 @@
 #include "common.h"
 #include "image.h"
 #include "video.h"
+#include "pixel.h"
 #include "error.h"
 #include "util.h"
 #include "libdlna/profiles.h"
@@ -59,7 +60,7 @@ MediaScanImage *video_create_image_from_frame(MediaScanVideo *v, MediaScanResult
   int got_picture;
   int64_t duration_tb = ((double)avf->duration / AV_TIME_BASE) / av_q2d(codecs->vs->time_base);
   uint8_t *src;
-  int x, y;
+  int y;
   int ofs = 0;
   int no_keyframe_found = 0;
   int skipped_frames = 0;
@@ -199,10 +200,9 @@ MediaScanImage *video_create_image_from_frame(MediaScanVideo *v, MediaScanResult
     src = frame_rgb->data[0];
     ofs = 0;
     for (y = 0; y < i->height; y++) {
-      for (x = 0; x < i->width * 3; x += 3) {
-        i->_pixbuf[ofs++] = COL(src[x], src[x + 1], src[x + 2]);
-      }
-      src += i->width * 3;
+      pixel_rgb_to_pix(&i->_pixbuf[ofs], src, i->width);
+      ofs += i->width;
+      src += frame_rgb->linesize[0];
     }
 
     // Free the frame
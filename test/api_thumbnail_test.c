@@ -63,8 +63,8 @@ static void my_result_callback(MediaScan *s, MediaScanResult *r, void *userdata)
 	if(r->error)
 		memcpy(result.error, r->error, sizeof(MediaScanError));
 
-	result.mime_type = strdup(r->mime_type);
-	result.dlna_profile = strdup(r->dlna_profile);
+	result.mime_type = r->mime_type ? strdup(r->mime_type) : NULL;
+	result.dlna_profile = r->dlna_profile ? strdup(r->dlna_profile) : NULL;
 	result.size = r->size;
 	result.mtime = r->mtime;
 	result.bitrate = r->bitrate;
@@ -425,6 +425,36 @@ void test_thumbnailing(void)	{
 	ms_destroy(s);
 } /* test_thumbnailing() */
 
+///-------------------------------------------------------------------------------------------------
+///  Test thumbnails made from the cover art embedded in an audio file
+///-------------------------------------------------------------------------------------------------
+
+void test_cover_art_thumbnailing(void)	{
+#ifdef WIN32
+	char mp3_file[MAX_PATH_STR_LEN] = "data\\audio\\mp3\\v2.3-itunes81.mp3";
+#else
+	char mp3_file[MAX_PATH_STR_LEN] = "data/audio/mp3/v2.3-itunes81.mp3";
+#endif
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, my_result_callback);
+	ms_set_error_callback(s, my_error_callback);
+
+	ms_add_thumbnail_spec(s, THUMB_PNG, 32,32, TRUE, 0, 90);
+
+	result.nthumbnails = 0;
+	ms_scan_file(s, mp3_file, TYPE_AUDIO);
+
+	// The APIC frame is a JPEG, the audio keeps its own mime type
+	CU_ASSERT(result.type == TYPE_AUDIO);
+	CU_ASSERT_STRING_EQUAL(result.mime_type, "audio/mpeg");
+	CU_ASSERT(result.nthumbnails == 1);
+
+	ms_destroy(s);
+} /* test_cover_art_thumbnailing() */
+
 void generate_thumbnails()
 {
 	FILE *tfp;
@@ -483,7 +513,8 @@ int setup_thumbnail_tests() {
    /* add the tests to the background scanning suite */
    if (
 	   NULL == CU_add_test(pSuite, "Test thumbnail API", test_image_reading) ||
-	   NULL == CU_add_test(pSuite, "Test thumbnail creation", test_thumbnailing)
+	   NULL == CU_add_test(pSuite, "Test thumbnail creation", test_thumbnailing) ||
+	   NULL == CU_add_test(pSuite, "Test cover art thumbnails", test_cover_art_thumbnailing)
 	   )
    {
       CU_cleanup_registry();
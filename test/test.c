@@ -1,25 +1,46 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
 #ifdef WIN32
 #include <Windows.h>
 #include <direct.h>
+#else
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#define _rmdir rmdir
 #endif
 
 #include <limits.h>
 #include <libmediascan.h>
 #include <libavformat/avformat.h>
+#include <db.h>
 
 #include "../src/mediascan.h"
 #include "../src/common.h"
+#include "../src/bloom.h"
+#include "../src/buffer.h"
+#include "../src/database.h"
+#include "../src/image.h"
+#include "../src/pixel.h"
+#include "../src/result.h"
+#include "../src/resultcache.h"
+#include "../src/thumb.h"
+#include "../src/thumbcache.h"
 #include "CUnit/CUnit/Headers/Basic.h"
 
 int setupbackground_tests();
 int setup_thumbnail_tests();
 int setupdefect_tests();
 
+// From src/util.h, which can't be included because of the TouchFile below
+uint32_t HashFile(const char *file, int *mtime, uint64_t *size);
+uint32_t HashFileIdentity(const char *file, int mtime, uint64_t size);
+void hashlittle2(const void *key, size_t length, uint32_t *pc, uint32_t *pb);
+
 #ifdef _MSC_VER
 /*
 int strcasecmp(const char *string1, const char *string2 )
@@ -463,6 +484,88 @@ void test_ms_file_asf_audio(void)	{
 } /* test_ms_file_asf_audio */
 
 
+static MediaScanAudio audio_result;
+static int audio_duration_ms;
+static char audio_title[64];
+static uint32_t audio_picture_size;
+
+static void my_audio_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	const char *title;
+	uint64_t offset;
+	int i;
+
+	memset(&audio_result, 0, sizeof(audio_result));
+	if(r->audio)
+		memcpy(&audio_result, r->audio, sizeof(MediaScanAudio));
+
+	title = ms_result_get_tag_value(r, "TIT2");
+	strncpy(audio_title, title ? title : "", sizeof(audio_title) - 1);
+
+	audio_picture_size = 0;
+	for(i = 0; i < ms_result_get_tag_count(r); i++)
+		ms_result_get_tag_data(r, i, &offset, &audio_picture_size);
+
+	audio_duration_ms = r->duration_ms;
+	result_called = TRUE;
+} /* my_audio_result_callback() */
+
+void test_ms_file_audio(void)	{
+#ifdef WIN32
+	char mp3_file[MAX_PATH_STR_LEN] = "data\\audio\\mp3\\no-tags-mp1l3-vbr.mp3";
+	char flac_file[MAX_PATH_STR_LEN] = "data\\audio\\flac\\tiny.flac";
+	char wav_file[MAX_PATH_STR_LEN] = "data\\audio\\wav\\id3.wav";
+#else
+	char mp3_file[MAX_PATH_STR_LEN] = "data/audio/mp3/no-tags-mp1l3-vbr.mp3";
+	char flac_file[MAX_PATH_STR_LEN] = "data/audio/flac/tiny.flac";
+	char wav_file[MAX_PATH_STR_LEN] = "data/audio/wav/id3.wav";
+#endif
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, my_audio_result_callback);
+	ms_set_error_callback(s, my_error_callback);
+
+	// VBR MP3, the duration comes from the Xing frame count
+	result_called = FALSE;
+	ms_scan_file(s, mp3_file, TYPE_AUDIO);
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT_STRING_EQUAL(audio_result.codec, "mp3");
+	CU_ASSERT(audio_result.samplerate == 32000);
+	CU_ASSERT(audio_result.channels == 2);
+	CU_ASSERT(audio_result.vbr == 1);
+	CU_ASSERT(audio_duration_ms == 1024);
+
+	// FLAC, from the STREAMINFO block
+	result_called = FALSE;
+	ms_scan_file(s, flac_file, TYPE_AUDIO);
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT_STRING_EQUAL(audio_result.codec, "flac");
+	CU_ASSERT(audio_result.samplerate == 44100);
+	CU_ASSERT(audio_result.channels == 2);
+	CU_ASSERT(audio_duration_ms == 1019);
+
+	// WAV with an ID3 chunk, the picture is left in the file
+	result_called = FALSE;
+	ms_scan_file(s, wav_file, TYPE_AUDIO);
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT_STRING_EQUAL(audio_title, "WAV Title");
+	CU_ASSERT(audio_picture_size == 2116);
+	CU_ASSERT(audio_result.has_loudness == 0);
+
+	// The same WAV decoded for its loudness, shorter than a gating block so measured whole
+	ms_set_flags(s, MS_USE_EXTENSION | MS_FULL_SCAN | MS_AUDIO_LOUDNESS);
+	result_called = FALSE;
+	ms_scan_file(s, wav_file, TYPE_AUDIO);
+	CU_ASSERT(result_called == TRUE);
+	CU_ASSERT(audio_result.has_loudness == 1);
+	CU_ASSERT(audio_result.loudness < 0 && audio_result.loudness > -30);
+	CU_ASSERT(audio_result.true_peak >= -6.5 && audio_result.true_peak < 0);
+
+	ms_destroy(s);
+} /* test_ms_file_audio */
+
+
 ///-------------------------------------------------------------------------------------------------
 ///  Test ms_set_async and ms_set_log_level
 ///
@@ -558,6 +661,1768 @@ void test_ms_db(void)	{
 	ms_destroy(s);
 } /* test_ms_db() */
 
+#define PARALLEL_SCANS 8
+
+typedef struct {
+	char *path;
+	char *mime_type;
+	int width;
+	int height;
+	int nthumbnails;
+} parallel_result_type;
+
+typedef struct {
+	int index;
+	int results;
+	int errors;
+	int ms_errno;
+	parallel_result_type *items;
+} parallel_scan_type;
+
+///-------------------------------------------------------------------------------------------------
+///  Delete the files in a cache directory and then the directory itself.
+///-------------------------------------------------------------------------------------------------
+
+static void remove_cachedir(const char *dir)	{
+	char file[MAX_PATH_STR_LEN];
+#ifdef WIN32
+	WIN32_FIND_DATA fd;
+	HANDLE h;
+
+	sprintf(file, "%s\\*", dir);
+	h = FindFirstFile(file, &fd);
+	if (h != INVALID_HANDLE_VALUE) {
+		do {
+			if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				sprintf(file, "%s\\%s", dir, fd.cFileName);
+				DeleteFile(file);
+			}
+		} while (FindNextFile(h, &fd));
+		FindClose(h);
+	}
+	_rmdir(dir);
+#else
+	DIR *d = opendir(dir);
+	struct dirent *e;
+
+	if (d) {
+		while ((e = readdir(d)) != NULL) {
+			if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+				continue;
+			sprintf(file, "%s/%s", dir, e->d_name);
+			unlink(file);
+		}
+		closedir(d);
+	}
+	rmdir(dir);
+#endif
+} /* remove_cachedir() */
+
+static void parallel_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	parallel_scan_type *p = (parallel_scan_type *)userdata;
+	parallel_result_type *item;
+
+	p->items = (parallel_result_type *)realloc(p->items, (p->results + 1) * sizeof(parallel_result_type));
+	item = &p->items[p->results++];
+
+	item->path = strdup(r->path);
+	item->mime_type = r->mime_type ? strdup(r->mime_type) : NULL;
+	item->width = r->image ? r->image->width : (r->video ? r->video->width : 0);
+	item->height = r->image ? r->image->height : (r->video ? r->video->height : 0);
+	item->nthumbnails = r->nthumbnails;
+}
+
+static void parallel_error_callback(MediaScan *s, MediaScanError *error, void *userdata) {
+	((parallel_scan_type *)userdata)->errors++;
+}
+
+static parallel_result_type *parallel_find_result(parallel_scan_type *p, const char *path) {
+	int i;
+
+	for (i = 0; i < p->results; i++) {
+		if (!strcmp(p->items[i].path, path))
+			return &p->items[i];
+	}
+
+	return NULL;
+}
+
+static void *parallel_scan(void *userdata) {
+	parallel_scan_type *p = (parallel_scan_type *)userdata;
+	char cachedir[MAX_PATH_STR_LEN];
+	MediaScan *s;
+
+	// Each scanner needs its own database
+	sprintf(cachedir, "parallel_scan_%d", p->index);
+#ifdef WIN32
+	_mkdir(cachedir);
+#else
+	mkdir(cachedir, 0755);
+#endif
+
+	s = ms_create();
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_FULL_SCAN);
+	ms_set_result_callback(s, parallel_result_callback);
+	ms_set_error_callback(s, parallel_error_callback);
+	ms_set_userdata(s, p);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 100, TRUE, 0, 90);
+	ms_add_path(s, "data");
+
+	ms_scan(s);
+	p->ms_errno = ms_errno;
+
+	ms_destroy(s);
+
+	remove_cachedir(cachedir);
+
+	return NULL;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Run several scans of the same files at once, each in its own thread with its own MediaScan
+/// 	object, and make sure they all see the same results for every file.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_parallel_scans(void)	{
+	pthread_t threads[PARALLEL_SCANS];
+	parallel_scan_type scans[PARALLEL_SCANS];
+	int i, j;
+
+	memset(scans, 0, sizeof(scans));
+
+	for (i = 0; i < PARALLEL_SCANS; i++) {
+		scans[i].index = i;
+		CU_ASSERT_FATAL(pthread_create(&threads[i], NULL, parallel_scan, &scans[i]) == 0);
+	}
+
+	for (i = 0; i < PARALLEL_SCANS; i++)
+		pthread_join(threads[i], NULL);
+
+	CU_ASSERT(scans[0].results > 0);
+
+	for (i = 0; i < PARALLEL_SCANS; i++) {
+		CU_ASSERT(scans[i].ms_errno == 0);
+		CU_ASSERT(scans[i].results == scans[0].results);
+		CU_ASSERT(scans[i].errors == scans[0].errors);
+
+		// A thread that lost a thumbnail or a decode shows up as a different result for that file
+		for (j = 0; i > 0 && j < scans[0].results; j++) {
+			parallel_result_type *want = &scans[0].items[j];
+			parallel_result_type *got = parallel_find_result(&scans[i], want->path);
+
+			CU_ASSERT_FATAL(got != NULL);
+			CU_ASSERT((want->mime_type == NULL) == (got->mime_type == NULL));
+			if (want->mime_type && got->mime_type)
+				CU_ASSERT_STRING_EQUAL(got->mime_type, want->mime_type);
+			CU_ASSERT(got->width == want->width);
+			CU_ASSERT(got->height == want->height);
+			CU_ASSERT(got->nthumbnails == want->nthumbnails);
+		}
+	}
+
+	for (i = 0; i < PARALLEL_SCANS; i++) {
+		for (j = 0; j < scans[i].results; j++) {
+			free(scans[i].items[j].path);
+			free(scans[i].items[j].mime_type);
+		}
+		free(scans[i].items);
+	}
+} /* test_ms_parallel_scans() */
+
+///-------------------------------------------------------------------------------------------------
+///  Copy a file, changing its last byte if flip is set so the copy has the same size but
+/// 	different content.
+///-------------------------------------------------------------------------------------------------
+
+static int copy_file(const char *src, const char *dst, int flip)	{
+	char buf[4096];
+	FILE *in, *out;
+	size_t len;
+	int last = 0;
+
+	in = fopen(src, "rb");
+	if (!in)
+		return 0;
+
+	out = fopen(dst, "wb");
+	if (!out) {
+		fclose(in);
+		return 0;
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+		fwrite(buf, 1, len, out);
+		last = (unsigned char)buf[len - 1];
+	}
+
+	if (flip) {
+		fseek(out, -1, SEEK_END);
+		fputc(last ^ 0xFF, out);
+	}
+
+	fclose(out);
+	fclose(in);
+
+	return 1;
+} /* copy_file() */
+
+static int dup_groups;
+static int dup_npaths;
+static int dup_has_changed;
+
+static void dup_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+}
+
+static void dup_callback(MediaScan *s, MediaScanDuplicates *d, void *userdata) {
+	int i;
+
+	dup_groups++;
+	dup_npaths = d->npaths;
+
+	for (i = 0; i < d->npaths; i++) {
+		if (strstr(d->paths[i], "changed.jpg"))
+			dup_has_changed = 1;
+	}
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Two copies of a file are one group of duplicates, a file of the same size with different
+/// 	content is not in it, and links to a file already in the scan are the same file rather
+/// 	than more duplicates.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_duplicates(void)	{
+#ifdef WIN32
+	char src[MAX_PATH_STR_LEN] = "data\\image\\jpg\\exif_180.jpg";
+	char dir[MAX_PATH_STR_LEN] = "dup_test";
+	char cachedir[MAX_PATH_STR_LEN] = "dup_test_cache";
+	char a[MAX_PATH_STR_LEN] = "dup_test\\a.jpg";
+	char b[MAX_PATH_STR_LEN] = "dup_test\\b.jpg";
+	char changed[MAX_PATH_STR_LEN] = "dup_test\\changed.jpg";
+#else
+	char src[MAX_PATH_STR_LEN] = "data/image/jpg/exif_180.jpg";
+	char dir[MAX_PATH_STR_LEN] = "dup_test";
+	char cachedir[MAX_PATH_STR_LEN] = "dup_test_cache";
+	char a[MAX_PATH_STR_LEN] = "dup_test/a.jpg";
+	char b[MAX_PATH_STR_LEN] = "dup_test/b.jpg";
+	char changed[MAX_PATH_STR_LEN] = "dup_test/changed.jpg";
+	char target[MAX_PATH_STR_LEN];
+#endif
+	MediaScan *s;
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(dir);
+	_mkdir(cachedir);
+#else
+	mkdir(dir, 0755);
+	mkdir(cachedir, 0755);
+#endif
+
+	CU_ASSERT_FATAL(copy_file(src, a, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, b, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, changed, TRUE));
+
+#ifndef WIN32
+	// A symlink resolves to the path of a.jpg, a hard link has a new path but the same inode
+	CU_ASSERT_FATAL(realpath(a, target) != NULL);
+	CU_ASSERT(symlink(target, "dup_test/symlink.jpg") == 0);
+	CU_ASSERT(link(a, "dup_test/hardlink.jpg") == 0);
+#endif
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION | MS_FULL_SCAN | MS_CLEARDB);
+	ms_set_result_callback(s, dup_result_callback);
+	ms_set_duplicate_callback(s, dup_callback);
+	ms_add_path(s, dir);
+
+	dup_groups = 0;
+	dup_npaths = 0;
+	dup_has_changed = 0;
+	ms_scan(s);
+
+	CU_ASSERT(dup_groups == 1);
+	CU_ASSERT(dup_npaths == 2);
+	CU_ASSERT(dup_has_changed == 0);
+
+	ms_destroy(s);
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+} /* test_ms_duplicates() */
+
+static int move_results;
+static char move_path[MAX_PATH_STR_LEN];
+static char move_from[MAX_PATH_STR_LEN];
+
+static void move_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	move_results++;
+	strcpy(move_path, r->path);
+	strcpy(move_from, r->moved_from ? r->moved_from : "");
+}
+
+// Rescan dir with result and thumbnail caching, so unchanged files are skipped, the results are left in the move_* variables
+static void move_scan(const char *dir, const char *cachedir)	{
+	MediaScan *s = ms_create();
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION | MS_RESCAN | MS_CACHE_RESULTS);
+	ms_set_result_callback(s, move_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 32, 32, TRUE, 0, 90);
+	ms_set_thumbnail_cache_size(s, 1024 * 1024);
+	ms_add_path(s, dir);
+
+	move_results = 0;
+	move_path[0] = '\0';
+	move_from[0] = '\0';
+	ms_scan(s);
+
+	ms_destroy(s);
+}
+
+// Check whether the result and thumbnail caches in cachedir hold entries for the file now at
+// file, as if it were stored under path
+static void move_cached(const char *cachedir, const char *file, const char *path, int *result, int *thumb)	{
+	MediaScan *s = ms_create();
+	MediaScanResult *r;
+	MediaScanImage *i;
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION | MS_CACHE_RESULTS);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 32, 32, TRUE, 0, 90);
+	ms_set_thumbnail_cache_size(s, 1024 * 1024);
+
+	r = result_create(s);
+	r->type = TYPE_IMAGE;
+	r->path = strdup(path);
+	HashFile(file, &r->mtime, &r->size);
+	r->hash = HashFileIdentity(path, r->mtime, r->size);
+
+	i = thumbcache_get(s, r, 0);
+	*thumb = i != NULL;
+	if (i)
+		image_destroy(i);
+
+	*result = resultcache_get(s, r);
+
+	result_destroy(r);
+	ms_destroy(s);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A renamed file is reported with the path it was moved from, and keeps its cached result and
+/// 	thumbnail under the new path while the old path is forgotten. A hard link to a file that
+/// 	is still in place is a new file rather than a move.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_move_detection(void)	{
+#ifdef WIN32
+	char src[MAX_PATH_STR_LEN] = "data\\image\\jpg\\exif_180.jpg";
+	char dir[MAX_PATH_STR_LEN] = "move_test";
+	char cachedir[MAX_PATH_STR_LEN] = "move_test_cache";
+	char a[MAX_PATH_STR_LEN] = "move_test\\a.jpg";
+	char b[MAX_PATH_STR_LEN] = "move_test\\b.jpg";
+#else
+	char src[MAX_PATH_STR_LEN] = "data/image/jpg/exif_180.jpg";
+	char dir[MAX_PATH_STR_LEN] = "move_test";
+	char cachedir[MAX_PATH_STR_LEN] = "move_test_cache";
+	char a[MAX_PATH_STR_LEN] = "move_test/a.jpg";
+	char b[MAX_PATH_STR_LEN] = "move_test/b.jpg";
+#endif
+	char old_path[MAX_PATH_STR_LEN];
+	char new_path[MAX_PATH_STR_LEN];
+	int result, thumb;
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(dir);
+	_mkdir(cachedir);
+#else
+	mkdir(dir, 0755);
+	mkdir(cachedir, 0755);
+#endif
+
+	CU_ASSERT_FATAL(copy_file(src, a, FALSE));
+
+	move_scan(dir, cachedir);
+	CU_ASSERT_FATAL(move_results == 1);
+	CU_ASSERT(move_from[0] == '\0');
+	strcpy(old_path, move_path);
+
+	// Renamed, the file is scanned at its new path and reported as moved
+	CU_ASSERT_FATAL(rename(a, b) == 0);
+	move_scan(dir, cachedir);
+	CU_ASSERT_FATAL(move_results == 1);
+	CU_ASSERT(strstr(move_path, "b.jpg") != NULL);
+	CU_ASSERT(!strcmp(move_from, old_path));
+	strcpy(new_path, move_path);
+
+	// The cached result and thumbnail were re-keyed to the new path
+	move_cached(cachedir, b, new_path, &result, &thumb);
+	CU_ASSERT(result == 1);
+	CU_ASSERT(thumb == 1);
+
+	move_cached(cachedir, b, old_path, &result, &thumb);
+	CU_ASSERT(result == 0);
+	CU_ASSERT(thumb == 0);
+
+	// Moved back, it must not be skipped as unchanged, which would mean the old path was still stored
+	CU_ASSERT_FATAL(rename(b, a) == 0);
+	move_scan(dir, cachedir);
+	CU_ASSERT(move_results == 1);
+	CU_ASSERT(!strcmp(move_from, new_path));
+
+#ifndef WIN32
+	// A hard link has a new path and the same inode, but the file is also still at its old path
+	CU_ASSERT(link(a, "move_test/link.jpg") == 0);
+	move_scan(dir, cachedir);
+	CU_ASSERT(move_results == 1);
+	CU_ASSERT(strstr(move_path, "link.jpg") != NULL);
+	CU_ASSERT(move_from[0] == '\0');
+#endif
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+} /* test_ms_move_detection() */
+
+static int clear_results;
+
+static void clear_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	clear_results++;
+}
+
+// Scan one or two paths into cachedir, returns the number of results
+static int clear_scan(const char *cachedir, const char *path1, const char *path2, int flags)	{
+	MediaScan *s = ms_create();
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION | flags);
+	ms_set_result_callback(s, clear_result_callback);
+	ms_add_path(s, path1);
+	if (path2)
+		ms_add_path(s, path2);
+
+	clear_results = 0;
+	ms_scan(s);
+
+	ms_destroy(s);
+
+	return clear_results;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A full scan of one path starts over for that path only, the entries another scan stored in
+/// 	the same database survive, including those of a sibling whose name starts with the path.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_full_scan_paths(void)	{
+#ifdef WIN32
+	char src[MAX_PATH_STR_LEN] = "data\\image\\jpg\\exif_180.jpg";
+	char one[MAX_PATH_STR_LEN] = "clear_one";
+	char two[MAX_PATH_STR_LEN] = "clear_one-2";
+	char one_file[MAX_PATH_STR_LEN] = "clear_one\\a.jpg";
+	char two_file[MAX_PATH_STR_LEN] = "clear_one-2\\a.jpg";
+#else
+	char src[MAX_PATH_STR_LEN] = "data/image/jpg/exif_180.jpg";
+	char one[MAX_PATH_STR_LEN] = "clear_one";
+	char two[MAX_PATH_STR_LEN] = "clear_one-2";
+	char one_file[MAX_PATH_STR_LEN] = "clear_one/a.jpg";
+	char two_file[MAX_PATH_STR_LEN] = "clear_one-2/a.jpg";
+#endif
+	char cachedir[MAX_PATH_STR_LEN] = "clear_test_cache";
+
+	remove_cachedir(one);
+	remove_cachedir(two);
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(one);
+	_mkdir(two);
+	_mkdir(cachedir);
+#else
+	mkdir(one, 0755);
+	mkdir(two, 0755);
+	mkdir(cachedir, 0755);
+#endif
+
+	CU_ASSERT_FATAL(copy_file(src, one_file, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, two_file, FALSE));
+
+	// Both paths are stored, so a rescan of either finds nothing new
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 2);
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 0);
+
+	// The full scan forgets and rescans its own path
+	CU_ASSERT(clear_scan(cachedir, one, NULL, MS_FULL_SCAN) == 1);
+
+	// Neither path lost its entries
+	CU_ASSERT(clear_scan(cachedir, two, NULL, MS_RESCAN) == 0);
+	CU_ASSERT(clear_scan(cachedir, one, NULL, MS_RESCAN) == 0);
+
+	remove_cachedir(one);
+	remove_cachedir(two);
+	remove_cachedir(cachedir);
+} /* test_ms_full_scan_paths() */
+
+static int sig_has_signature;
+static uint64_t sig_signature;
+static const char *sig_save_thumb;
+
+static void sig_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	const uint8_t *data;
+	int length = 0;
+	FILE *out;
+
+	sig_has_signature = r->has_signature;
+	sig_signature = r->signature;
+
+	// Keep the thumbnail as a resized copy of the image
+	if (sig_save_thumb && (data = ms_result_get_thumbnail_data(r, 0, &length)) != NULL) {
+		out = fopen(sig_save_thumb, "wb");
+		if (out) {
+			fwrite(data, 1, length, out);
+			fclose(out);
+		}
+	}
+}
+
+///-------------------------------------------------------------------------------------------------
+///  An image and a resized copy of it have signatures a few bits apart, an unrelated image has
+/// 	one that differs in many bits.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_signatures(void)	{
+#ifdef WIN32
+	char image[MAX_PATH_STR_LEN] = "data\\image\\jpg\\rgb.jpg";
+	char unrelated[MAX_PATH_STR_LEN] = "data\\image\\png\\rgb.png";
+	char resized[MAX_PATH_STR_LEN] = "sig_test\\resized.jpg";
+#else
+	char image[MAX_PATH_STR_LEN] = "data/image/jpg/rgb.jpg";
+	char unrelated[MAX_PATH_STR_LEN] = "data/image/png/rgb.png";
+	char resized[MAX_PATH_STR_LEN] = "sig_test/resized.jpg";
+#endif
+	char dir[MAX_PATH_STR_LEN] = "sig_test";
+	uint64_t image_sig, resized_sig, unrelated_sig;
+	FILE *fp;
+	MediaScan *s;
+
+	remove_cachedir(dir);
+#ifdef WIN32
+	_mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+
+	// Signatures are computed from the smallest thumbnail, which is also the resized copy
+	ms_set_flags(s, MS_IMAGE_SIGNATURES);
+	ms_set_result_callback(s, sig_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 120, 0, FALSE, 0, 90);
+
+	sig_has_signature = 0;
+	sig_save_thumb = resized;
+	ms_scan_file(s, image, TYPE_IMAGE);
+	sig_save_thumb = NULL;
+	CU_ASSERT_FATAL(sig_has_signature);
+	image_sig = sig_signature;
+
+	fp = fopen(resized, "rb");
+	CU_ASSERT_FATAL(fp != NULL);
+	fclose(fp);
+
+	sig_has_signature = 0;
+	ms_scan_file(s, resized, TYPE_IMAGE);
+	CU_ASSERT_FATAL(sig_has_signature);
+	resized_sig = sig_signature;
+
+	sig_has_signature = 0;
+	ms_scan_file(s, unrelated, TYPE_IMAGE);
+	CU_ASSERT_FATAL(sig_has_signature);
+	unrelated_sig = sig_signature;
+
+	CU_ASSERT(ms_signature_distance(image_sig, image_sig) == 0);
+	CU_ASSERT(ms_signature_distance(image_sig, resized_sig) <= 10);
+	CU_ASSERT(ms_signature_distance(image_sig, unrelated_sig) >= 20);
+	CU_ASSERT(ms_signature_distance(resized_sig, unrelated_sig) >= 20);
+
+	ms_destroy(s);
+
+	remove_cachedir(dir);
+} /* test_ms_signatures() */
+
+typedef struct {
+	const char *name;
+	pixel_row_func *func;
+	int bpp;
+} pixel_func_type;
+
+///-------------------------------------------------------------------------------------------------
+///  Each SIMD row converter gives the same pixels as the portable one, for widths that end
+/// 	before, inside and after a full vector, and writes nothing past the end of the row.
+///-------------------------------------------------------------------------------------------------
+
+void test_pixel_converters(void)	{
+	pixel_func_type funcs[] = {
+		{ "rgb", &pixel_rgb_to_pix, 3 },
+		{ "bgr", &pixel_bgr_to_pix, 3 },
+		{ "bgrx", &pixel_bgrx_to_pix, 4 },
+		{ "rgba", &pixel_rgba_to_pix, 4 },
+		{ "gray", &pixel_gray_to_pix, 1 },
+		{ "graya", &pixel_graya_to_pix, 2 },
+		{ "cmyk", &pixel_cmyk_to_pix, 4 }
+	};
+	const int nfuncs = sizeof(funcs) / sizeof(pixel_func_type);
+	const int widths[] = { 1, 15, 17, 33 };
+	pixel_row_func portable[7];
+	pixel_row_func simd[7];
+	unsigned char src[33 * 4];
+	uint32_t expected[33 + 1];
+	uint32_t got[33 + 1];
+	int f, w, i;
+
+	for (i = 0; i < (int)sizeof(src); i++)
+		src[i] = (unsigned char)(rand() & 0xFF);
+
+	pixel_init_portable();
+	for (f = 0; f < nfuncs; f++)
+		portable[f] = *funcs[f].func;
+
+	pixel_init();
+	for (f = 0; f < nfuncs; f++)
+		simd[f] = *funcs[f].func;
+
+	for (f = 0; f < nfuncs; f++) {
+		for (w = 0; w < 4; w++) {
+			// The last entry is a guard that must survive the conversion
+			memset(expected, 0xAB, sizeof(expected));
+			memset(got, 0xAB, sizeof(got));
+
+			portable[f](expected, src, widths[w]);
+			simd[f](got, src, widths[w]);
+
+			if (memcmp(expected, got, sizeof(got)))
+				printf("pixel_%s_to_pix differs at width %d\n", funcs[f].name, widths[w]);
+			CU_ASSERT(!memcmp(expected, got, sizeof(got)));
+			CU_ASSERT(got[widths[w]] == 0xABABABAB);
+		}
+	}
+} /* test_pixel_converters() */
+
+// Corners of the source image, as indexes into the coordinates below
+enum { TL, TR, BL, BR };
+
+///-------------------------------------------------------------------------------------------------
+///  Every EXIF orientation moves the source corners to where the EXIF spec puts them, on an image
+/// 	that is neither square nor a multiple of the rotation tile size.
+///-------------------------------------------------------------------------------------------------
+
+void test_thumb_orient(void)	{
+	// Source corner found at the output's top left, top right, bottom left and bottom right
+	const int corners[8][4] = {
+		{ TL, TR, BL, BR },		// 1 normal
+		{ TR, TL, BR, BL },		// 2 mirror horizontal
+		{ BR, BL, TR, TL },		// 3 rotate 180
+		{ BL, BR, TL, TR },		// 4 mirror vertical
+		{ TL, BL, TR, BR },		// 5 mirror horizontal and rotate 270 CW
+		{ BL, TL, BR, TR },		// 6 rotate 90 CW
+		{ BR, TR, BL, TL },		// 7 mirror horizontal and rotate 90 CW
+		{ TR, BR, TL, BL }		// 8 rotate 270 CW
+	};
+	const int w = 45, h = 70;
+	const int cx[4] = { 0, w - 1, 0, w - 1 };
+	const int cy[4] = { 0, 0, h - 1, h - 1 };
+	int o, x, y;
+
+	for (o = 0; o < 8; o++) {
+		MediaScanImage *i = image_create();
+		int ow, oh;
+
+		image_alloc_pixbuf(i, w, h);
+		i->width = w;
+		i->height = h;
+		i->path = "orient";
+
+		// Each pixel holds its own source coordinates
+		for (y = 0; y < h; y++) {
+			for (x = 0; x < w; x++)
+				i->_pixbuf[y * w + x] = (y << 16) | x;
+		}
+
+		thumb_orient(i, o + 1);
+
+		ow = o >= 4 ? h : w;
+		oh = o >= 4 ? w : h;
+		CU_ASSERT(i->width == ow);
+		CU_ASSERT(i->height == oh);
+
+		CU_ASSERT(i->_pixbuf[0] == ((cy[corners[o][0]] << 16) | cx[corners[o][0]]));
+		CU_ASSERT(i->_pixbuf[ow - 1] == ((cy[corners[o][1]] << 16) | cx[corners[o][1]]));
+		CU_ASSERT(i->_pixbuf[(oh - 1) * ow] == ((cy[corners[o][2]] << 16) | cx[corners[o][2]]));
+		CU_ASSERT(i->_pixbuf[(oh - 1) * ow + ow - 1] == ((cy[corners[o][3]] << 16) | cx[corners[o][3]]));
+
+		image_destroy(i);
+	}
+} /* test_thumb_orient() */
+
+///-------------------------------------------------------------------------------------------------
+///  Read the header of an image file the way a scan does. The result owns the open file, the
+/// 	buffer and the returned image, so the caller only destroys the result.
+///-------------------------------------------------------------------------------------------------
+
+static MediaScanImage *read_image_header(MediaScan *s, const char *file, int header_only, MediaScanResult **rp)	{
+	MediaScanResult *r = result_create(s);
+	MediaScanImage *i = image_create();
+	Buffer *buf = (Buffer *)malloc(sizeof(Buffer));
+
+	buffer_init(buf, BUF_SIZE);
+	r->type = TYPE_IMAGE;
+	r->path = strdup(file);
+	r->_buf = (void *)buf;
+	r->_fp = fopen(file, "rb");
+	r->image = i;
+	i->path = r->path;
+
+	if (!r->_fp || !buffer_check_load(buf, r->_fp, 8, BUF_SIZE) || !image_read_header(i, r, header_only)) {
+		image_destroy(i);
+		r->image = i = NULL;
+	}
+
+	*rp = r;
+	return i;
+}
+
+static int raw_results;
+static int raw_width;
+static int raw_height;
+static int raw_thumb_width;
+static int raw_thumb_height;
+static int raw_thumb_jpeg;
+
+static void raw_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	MediaScanImage *thumb = ms_result_get_thumbnail(r, 0);
+	const uint8_t *data;
+	int length = 0;
+
+	raw_results++;
+	raw_width = r->image ? r->image->width : 0;
+	raw_height = r->image ? r->image->height : 0;
+
+	if (thumb) {
+		raw_thumb_width = thumb->width;
+		raw_thumb_height = thumb->height;
+		data = ms_result_get_thumbnail_data(r, 0, &length);
+		raw_thumb_jpeg = data && length > 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+	}
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A DNG reports the size of its sensor data, and its thumbnail is made from the JPEG preview
+/// 	in IFD0 since the sensor data itself is never decoded.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_raw_preview(void)	{
+#ifdef WIN32
+	char file[MAX_PATH_STR_LEN] = "data\\image\\raw\\preview.dng";
+#else
+	char file[MAX_PATH_STR_LEN] = "data/image/raw/preview.dng";
+#endif
+	MediaScan *s = ms_create();
+	MediaScanResult *r;
+	MediaScanImage *i, *preview;
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	// The sensor data in the SubIFD is 256 x 192, the preview a 160 x 120 JPEG
+	i = read_image_header(s, file, 0, &r);
+	CU_ASSERT_FATAL(i != NULL);
+	CU_ASSERT(!strcmp(i->codec, "RAW"));
+	CU_ASSERT(i->width == 256);
+	CU_ASSERT(i->height == 192);
+	CU_ASSERT(i->orientation == ORIENTATION_NORMAL);
+
+	preview = image_get_embedded(i);
+	CU_ASSERT(preview != NULL);
+	if (preview) {
+		CU_ASSERT(!strcmp(preview->codec, "JPEG"));
+		CU_ASSERT(preview->width == 160);
+		CU_ASSERT(preview->height == 120);
+		image_destroy(preview);
+	}
+
+	result_destroy(r);
+
+	ms_set_result_callback(s, raw_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 80, 0, FALSE, 0, 90);
+
+	raw_results = 0;
+	raw_thumb_width = raw_thumb_height = raw_thumb_jpeg = 0;
+	ms_scan_file(s, file, TYPE_IMAGE);
+
+	CU_ASSERT(raw_results == 1);
+	CU_ASSERT(raw_width == 256);
+	CU_ASSERT(raw_height == 192);
+	CU_ASSERT(raw_thumb_width == 80);
+	CU_ASSERT(raw_thumb_height == 60);
+	CU_ASSERT(raw_thumb_jpeg);
+
+	ms_destroy(s);
+} /* test_ms_raw_preview() */
+
+
+static const char *fast_save_thumb[2];
+
+static void fast_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	const uint8_t *data;
+	int length = 0;
+	int x;
+	FILE *out;
+
+	for (x = 0; x < 2; x++) {
+		if ((data = ms_result_get_thumbnail_data(r, x, &length)) != NULL) {
+			out = fopen(fast_save_thumb[x], "wb");
+			if (out) {
+				fwrite(data, 1, length, out);
+				fclose(out);
+			}
+		}
+	}
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A THUMB_FAST_ENCODE thumbnail is still a JPEG that decodes at the requested size, and its
+/// 	pixels stay close to those of a thumbnail made with the default DCT method.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_fast_encode(void)	{
+#ifdef WIN32
+	char image[MAX_PATH_STR_LEN] = "data\\image\\jpg\\rgb.jpg";
+	char normal[MAX_PATH_STR_LEN] = "fast_test\\normal.jpg";
+	char fast[MAX_PATH_STR_LEN] = "fast_test\\fast.jpg";
+#else
+	char image[MAX_PATH_STR_LEN] = "data/image/jpg/rgb.jpg";
+	char normal[MAX_PATH_STR_LEN] = "fast_test/normal.jpg";
+	char fast[MAX_PATH_STR_LEN] = "fast_test/fast.jpg";
+#endif
+	char dir[MAX_PATH_STR_LEN] = "fast_test";
+	MediaScan *s;
+	MediaScanResult *rn = NULL, *rf = NULL;
+	MediaScanImage *in, *f;
+	uint64_t diff = 0;
+	int x;
+
+	remove_cachedir(dir);
+#ifdef WIN32
+	_mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, fast_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 100, 0, FALSE, 0, 90);
+	ms_set_thumbnail_spec_flags(s, 1, THUMB_FAST_ENCODE);
+
+	fast_save_thumb[0] = normal;
+	fast_save_thumb[1] = fast;
+	ms_scan_file(s, image, TYPE_IMAGE);
+
+	in = read_image_header(s, normal, 0, &rn);
+	f = read_image_header(s, fast, 0, &rf);
+	CU_ASSERT_FATAL(in != NULL);
+	CU_ASSERT_FATAL(f != NULL);
+
+	CU_ASSERT(!strcmp(f->codec, "JPEG"));
+	CU_ASSERT(f->width == 100);
+	CU_ASSERT(f->width == in->width);
+	CU_ASSERT(f->height == in->height);
+
+	// The fast encoder must produce a complete image, not just a valid header
+	CU_ASSERT_FATAL(image_load(in, NULL));
+	CU_ASSERT_FATAL(image_load(f, NULL));
+
+	for (x = 0; x < f->width * f->height; x++) {
+		diff += abs((int)COL_RED(f->_pixbuf[x]) - (int)COL_RED(in->_pixbuf[x]));
+		diff += abs((int)COL_GREEN(f->_pixbuf[x]) - (int)COL_GREEN(in->_pixbuf[x]));
+		diff += abs((int)COL_BLUE(f->_pixbuf[x]) - (int)COL_BLUE(in->_pixbuf[x]));
+	}
+
+	// Average difference per channel of at most a few levels
+	CU_ASSERT(diff <= (uint64_t)f->width * f->height * 3 * 4);
+
+	result_destroy(rn);
+	result_destroy(rf);
+	ms_destroy(s);
+
+	remove_cachedir(dir);
+} /* test_ms_fast_encode() */
+
+
+typedef struct {
+	int results;
+	int type;
+	char mime_type[64];
+	char dlna_profile[64];
+	int bitrate;
+	int duration_ms;
+	MediaScanAudio audio;
+	int ntags;
+	char tags[1024];
+	int nthumbs;
+	int thumb_width;
+	int thumb_height;
+	char thumb_codec[8];
+	int thumb_length;
+	uint8_t thumb_data[16384];
+} rc_snapshot_type;
+
+static rc_snapshot_type rc_snapshot;
+
+static void rc_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	rc_snapshot_type *sn = &rc_snapshot;
+	const char *key, *value;
+	const uint8_t *data;
+	MediaScanImage *thumb;
+	int i, length = 0;
+
+	sn->results++;
+	sn->type = r->type;
+	strncpy(sn->mime_type, r->mime_type ? r->mime_type : "", sizeof(sn->mime_type) - 1);
+	strncpy(sn->dlna_profile, r->dlna_profile ? r->dlna_profile : "", sizeof(sn->dlna_profile) - 1);
+	sn->bitrate = r->bitrate;
+	sn->duration_ms = r->duration_ms;
+
+	if (r->audio)
+		memcpy(&sn->audio, r->audio, sizeof(MediaScanAudio));
+
+	// Keys and values of every tag, in order
+	sn->ntags = ms_result_get_tag_count(r);
+	for (i = 0; i < sn->ntags; i++) {
+		ms_result_get_tag(r, i, &key, &value);
+		snprintf(sn->tags + strlen(sn->tags), sizeof(sn->tags) - strlen(sn->tags), "%s=%s;", key, value ? value : "");
+	}
+
+	sn->nthumbs = r->nthumbnails;
+	if ((thumb = ms_result_get_thumbnail(r, 0)) != NULL) {
+		sn->thumb_width = thumb->width;
+		sn->thumb_height = thumb->height;
+		strncpy(sn->thumb_codec, thumb->codec, sizeof(sn->thumb_codec) - 1);
+		data = ms_result_get_thumbnail_data(r, 0, &length);
+		if (data && length <= (int)sizeof(sn->thumb_data)) {
+			sn->thumb_length = length;
+			memcpy(sn->thumb_data, data, length);
+		}
+	}
+}
+
+// Scan file with result and thumbnail caching and loudness, leaving the result in rc_snapshot
+static void rc_scan(const char *file, const char *cachedir)	{
+	MediaScan *s = ms_create();
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION | MS_CACHE_RESULTS | MS_AUDIO_LOUDNESS);
+	ms_set_result_callback(s, rc_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 32, 32, TRUE, 0, 90);
+	ms_set_thumbnail_cache_size(s, 1024 * 1024);
+
+	memset(&rc_snapshot, 0, sizeof(rc_snapshot));
+	ms_scan_file(s, file, TYPE_AUDIO);
+
+	ms_destroy(s);
+}
+
+// Whether the result cache in cachedir holds a usable result for file
+static int rc_cached(const char *file, const char *cachedir)	{
+	MediaScan *s = ms_create();
+	MediaScanResult *r;
+	int cached;
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION | MS_CACHE_RESULTS | MS_AUDIO_LOUDNESS);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 32, 32, TRUE, 0, 90);
+	ms_set_thumbnail_cache_size(s, 1024 * 1024);
+
+	r = result_create(s);
+	r->type = TYPE_AUDIO;
+	r->path = strdup(file);
+	r->hash = HashFile(file, &r->mtime, &r->size);
+
+	cached = resultcache_get(s, r);
+
+	result_destroy(r);
+	ms_destroy(s);
+
+	return cached;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A result replayed from the result cache is the same as the scan that stored it, down to its
+/// 	tags, thumbnail data and loudness. The thumbnail itself is only kept in the thumbnail
+/// 	cache, so the stored result can't be used once that is gone.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_result_cache(void)	{
+#ifdef WIN32
+	char src[MAX_PATH_STR_LEN] = "data\\audio\\wav\\id3.wav";
+	char file[MAX_PATH_STR_LEN] = "rc_test\\id3.wav";
+	char thumbcache[MAX_PATH_STR_LEN] = "rc_test_cache\\thumbcache.db";
+#else
+	char src[MAX_PATH_STR_LEN] = "data/audio/wav/id3.wav";
+	char file[MAX_PATH_STR_LEN] = "rc_test/id3.wav";
+	char thumbcache[MAX_PATH_STR_LEN] = "rc_test_cache/thumbcache.db";
+#endif
+	char dir[MAX_PATH_STR_LEN] = "rc_test";
+	char cachedir[MAX_PATH_STR_LEN] = "rc_test_cache";
+	rc_snapshot_type *first = (rc_snapshot_type *)malloc(sizeof(rc_snapshot_type));
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(dir);
+	_mkdir(cachedir);
+#else
+	mkdir(dir, 0755);
+	mkdir(cachedir, 0755);
+#endif
+
+	CU_ASSERT_FATAL(first != NULL);
+	CU_ASSERT_FATAL(copy_file(src, file, FALSE));
+	CU_ASSERT(!rc_cached(file, cachedir));
+
+	rc_scan(file, cachedir);
+	memcpy(first, &rc_snapshot, sizeof(rc_snapshot_type));
+	CU_ASSERT_FATAL(first->results == 1);
+	CU_ASSERT(first->ntags > 0);
+	CU_ASSERT(first->nthumbs == 1);
+	CU_ASSERT(first->thumb_length > 0);
+	CU_ASSERT(first->audio.has_loudness == 1);
+
+	// The second scan is replayed, and reports exactly what the first did
+	CU_ASSERT(rc_cached(file, cachedir));
+	rc_scan(file, cachedir);
+	CU_ASSERT(rc_snapshot.results == 1);
+	CU_ASSERT(rc_snapshot.type == first->type);
+	CU_ASSERT_STRING_EQUAL(rc_snapshot.mime_type, first->mime_type);
+	CU_ASSERT_STRING_EQUAL(rc_snapshot.dlna_profile, first->dlna_profile);
+	CU_ASSERT(rc_snapshot.bitrate == first->bitrate);
+	CU_ASSERT(rc_snapshot.duration_ms == first->duration_ms);
+	CU_ASSERT(rc_snapshot.audio.audio_offset == first->audio.audio_offset);
+	CU_ASSERT(rc_snapshot.audio.audio_size == first->audio.audio_size);
+	CU_ASSERT(rc_snapshot.audio.bitrate == first->audio.bitrate);
+	CU_ASSERT(rc_snapshot.audio.samplerate == first->audio.samplerate);
+	CU_ASSERT(rc_snapshot.audio.channels == first->audio.channels);
+	CU_ASSERT(rc_snapshot.audio.has_loudness == first->audio.has_loudness);
+	CU_ASSERT(rc_snapshot.audio.loudness == first->audio.loudness);
+	CU_ASSERT(rc_snapshot.audio.true_peak == first->audio.true_peak);
+	CU_ASSERT(rc_snapshot.ntags == first->ntags);
+	CU_ASSERT_STRING_EQUAL(rc_snapshot.tags, first->tags);
+	CU_ASSERT(rc_snapshot.nthumbs == first->nthumbs);
+	CU_ASSERT(rc_snapshot.thumb_width == first->thumb_width);
+	CU_ASSERT(rc_snapshot.thumb_height == first->thumb_height);
+	CU_ASSERT_STRING_EQUAL(rc_snapshot.thumb_codec, first->thumb_codec);
+	CU_ASSERT(rc_snapshot.thumb_length == first->thumb_length);
+	CU_ASSERT(!memcmp(rc_snapshot.thumb_data, first->thumb_data, first->thumb_length));
+
+	// Without the thumbnail cache the stored result is incomplete and the file is scanned again
+	CU_ASSERT(unlink(thumbcache) == 0);
+	CU_ASSERT(!rc_cached(file, cachedir));
+	rc_scan(file, cachedir);
+	CU_ASSERT(rc_snapshot.results == 1);
+	CU_ASSERT(rc_snapshot.thumb_length == first->thumb_length);
+
+	free(first);
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+} /* test_ms_result_cache() */
+
+
+static int tc_thumb_length;
+
+static void tc_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	tc_thumb_length = 0;
+	ms_result_get_thumbnail_data(r, 0, &tc_thumb_length);
+}
+
+// Scan file with a 64 x 64 thumbnail of the given JPEG quality, keeping it in the thumbnail
+// cache in cachedir limited to max_bytes. Returns the length of the thumbnail.
+static int tc_scan(const char *file, const char *cachedir, uint64_t max_bytes, int quality)	{
+	MediaScan *s = ms_create();
+
+	ms_set_cachedir(s, cachedir);
+	ms_set_flags(s, MS_USE_EXTENSION);
+	ms_set_result_callback(s, tc_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 64, 64, TRUE, 0, quality);
+	ms_set_thumbnail_cache_size(s, max_bytes);
+
+	tc_thumb_length = 0;
+	ms_scan_file(s, file, TYPE_IMAGE);
+
+	ms_destroy(s);
+
+	return tc_thumb_length;
+}
+
+// Length of the thumbnail the cache in cachedir holds for file with the tc_scan spec of the
+// given quality, or 0 if there is none. A hit marks the thumbnail as recently used.
+static int tc_get(const char *file, const char *cachedir, int quality)	{
+	MediaScan *s = ms_create();
+	MediaScanResult *r;
+	MediaScanImage *i;
+	int length = 0;
+
+	ms_set_cachedir(s, cachedir);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 64, 64, TRUE, 0, quality);
+	ms_set_thumbnail_cache_size(s, 1024 * 1024);
+
+	r = result_create(s);
+	r->type = TYPE_IMAGE;
+	r->path = strdup(file);
+	HashFile(file, &r->mtime, &r->size);
+
+	i = thumbcache_get(s, r, 0);
+	if (i) {
+		CU_ASSERT(!strcmp(i->codec, "JPEG"));
+		CU_ASSERT(i->width == 64 || i->height == 64);
+		length = buffer_len((Buffer *)i->_dbuf);
+		image_destroy(i);
+	}
+
+	result_destroy(r);
+	ms_destroy(s);
+
+	return length;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A thumbnail is found again for the same file and spec but not for a spec that differs
+/// 	only in quality, and once the cache outgrows its limit the least recently used thumbnail
+/// 	is the one evicted.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_thumb_cache(void)	{
+#ifdef WIN32
+	char src[MAX_PATH_STR_LEN] = "data\\image\\jpg\\rgb.jpg";
+	char a[MAX_PATH_STR_LEN] = "tc_test\\a.jpg";
+	char b[MAX_PATH_STR_LEN] = "tc_test\\b.jpg";
+	char c[MAX_PATH_STR_LEN] = "tc_test\\c.jpg";
+#else
+	char src[MAX_PATH_STR_LEN] = "data/image/jpg/rgb.jpg";
+	char a[MAX_PATH_STR_LEN] = "tc_test/a.jpg";
+	char b[MAX_PATH_STR_LEN] = "tc_test/b.jpg";
+	char c[MAX_PATH_STR_LEN] = "tc_test/c.jpg";
+#endif
+	char dir[MAX_PATH_STR_LEN] = "tc_test";
+	char cachedir[MAX_PATH_STR_LEN] = "tc_test_cache";
+	int length;
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(dir);
+	_mkdir(cachedir);
+#else
+	mkdir(dir, 0755);
+	mkdir(cachedir, 0755);
+#endif
+
+	// Copies of one image have thumbnails of the same length
+	CU_ASSERT_FATAL(copy_file(src, a, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, b, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, c, FALSE));
+
+	length = tc_scan(a, cachedir, 1024 * 1024, 90);
+	CU_ASSERT_FATAL(length > 0);
+	CU_ASSERT(tc_scan(b, cachedir, 1024 * 1024, 90) == length);
+
+	// A spec with another quality hashes differently and misses
+	CU_ASSERT(tc_get(a, cachedir, 90) == length);
+	CU_ASSERT(tc_get(a, cachedir, 80) == 0);
+
+	// Use a.jpg a second later than b.jpg was stored, making b.jpg the least recently used
+#ifdef WIN32
+	Sleep(1000);
+#else
+	sleep(1);
+#endif
+	CU_ASSERT(tc_get(a, cachedir, 90) == length);
+
+	// Two thumbnails fit in the limit but three don't, so storing c.jpg's evicts b.jpg's
+	CU_ASSERT(tc_scan(c, cachedir, length * 5 / 2, 90) == length);
+	CU_ASSERT(tc_get(a, cachedir, 90) == length);
+	CU_ASSERT(tc_get(b, cachedir, 90) == 0);
+	CU_ASSERT(tc_get(c, cachedir, 90) == length);
+
+	remove_cachedir(dir);
+	remove_cachedir(cachedir);
+} /* test_ms_thumb_cache() */
+
+
+static int webp_results;
+static char webp_codec[8];
+static int webp_width;
+static uint8_t webp_header[32];
+static int webp_length;
+
+static void webp_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	MediaScanImage *thumb = ms_result_get_thumbnail(r, 0);
+	const uint8_t *data;
+
+	webp_results++;
+	webp_codec[0] = '\0';
+	webp_width = 0;
+	webp_length = 0;
+
+	if (thumb) {
+		strncpy(webp_codec, thumb->codec, sizeof(webp_codec) - 1);
+		webp_width = thumb->width;
+		data = ms_result_get_thumbnail_data(r, 0, &webp_length);
+		if (data && webp_length >= (int)sizeof(webp_header))
+			memcpy(webp_header, data, sizeof(webp_header));
+	}
+}
+
+// Whether the header of a WebP thumbnail is RIFF....WEBP with a RIFF size matching its length
+static int webp_valid_header(void)	{
+	uint32_t riff_size = webp_header[4] | (webp_header[5] << 8) | (webp_header[6] << 16) | ((uint32_t)webp_header[7] << 24);
+
+	return webp_length >= (int)sizeof(webp_header) && !memcmp(webp_header, "RIFF", 4)
+		&& !memcmp(webp_header + 8, "WEBP", 4) && riff_size == (uint32_t)webp_length - 8;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A THUMB_WEBP spec makes a WebP thumbnail, a plain lossy one for an opaque image and an
+/// 	extended one with an alpha channel for a transparent image.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_webp_thumbnail(void)	{
+#ifdef WIN32
+	char opaque[MAX_PATH_STR_LEN] = "data\\image\\jpg\\rgb.jpg";
+	char transparent[MAX_PATH_STR_LEN] = "data\\image\\png\\rgba.png";
+#else
+	char opaque[MAX_PATH_STR_LEN] = "data/image/jpg/rgb.jpg";
+	char transparent[MAX_PATH_STR_LEN] = "data/image/png/rgba.png";
+#endif
+	MediaScan *s = ms_create();
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, webp_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_WEBP, 100, 0, FALSE, 0, 0);
+
+	webp_results = 0;
+	ms_scan_file(s, opaque, TYPE_IMAGE);
+	CU_ASSERT(webp_results == 1);
+	CU_ASSERT_STRING_EQUAL(webp_codec, "WebP");
+	CU_ASSERT(webp_width == 100);
+	CU_ASSERT(webp_valid_header());
+	CU_ASSERT(!memcmp(webp_header + 12, "VP8 ", 4));
+
+	webp_results = 0;
+	ms_scan_file(s, transparent, TYPE_IMAGE);
+	CU_ASSERT(webp_results == 1);
+	CU_ASSERT_STRING_EQUAL(webp_codec, "WebP");
+	CU_ASSERT(webp_width == 100);
+	CU_ASSERT(webp_valid_header());
+	CU_ASSERT(!memcmp(webp_header + 12, "VP8X", 4));
+	CU_ASSERT(webp_header[20] & 0x10);
+
+	ms_destroy(s);
+} /* test_ms_webp_thumbnail() */
+
+
+///-------------------------------------------------------------------------------------------------
+///  The header-only probe of each image format reports the same dimensions and orientation as
+/// 	the full header read.
+///-------------------------------------------------------------------------------------------------
+
+void test_image_probe(void)	{
+	const char *files[][2] = {
+		{ "jpg", "rgb.jpg" }, { "jpg", "gray.jpg" }, { "jpg", "cmyk.jpg" }, { "jpg", "rgb_progressive.jpg" },
+		{ "jpg", "large-exif.jpg" }, { "jpg", "exif_90_ccw.jpg" }, { "jpg", "exif_180.jpg" },
+		{ "jpg", "exif_mirror_horiz_270_ccw.jpg" },
+		{ "png", "rgb.png" }, { "png", "rgba16.png" }, { "png", "palette.png" }, { "png", "gray_interlaced.png" },
+		{ "gif", "white.gif" }, { "gif", "transparent.gif" }, { "gif", "interlaced_256.gif" },
+		{ "bmp", "1bit.bmp" }, { "bmp", "8bit_os2.bmp" }, { "bmp", "8bit_rle.bmp" }, { "bmp", "24bit.bmp" },
+		{ "bmp", "32bit_alpha.bmp" },
+		{ NULL, NULL }
+	};
+	char file[MAX_PATH_STR_LEN];
+	MediaScan *s = ms_create();
+	MediaScanResult *rp, *rf;
+	MediaScanImage *probe, *full;
+	int x;
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	for (x = 0; files[x][0]; x++) {
+#ifdef WIN32
+		sprintf(file, "data\\image\\%s\\%s", files[x][0], files[x][1]);
+#else
+		sprintf(file, "data/image/%s/%s", files[x][0], files[x][1]);
+#endif
+		probe = read_image_header(s, file, 1, &rp);
+		full = read_image_header(s, file, 0, &rf);
+		CU_ASSERT(probe != NULL);
+		CU_ASSERT(full != NULL);
+
+		if (probe && full) {
+			CU_ASSERT_STRING_EQUAL(probe->codec, full->codec);
+			CU_ASSERT(probe->width == full->width);
+			CU_ASSERT(probe->height == full->height);
+			CU_ASSERT(probe->orientation == full->orientation);
+
+			// Both must actually have read the EXIF orientation
+			if (!strncmp(files[x][1], "exif_", 5))
+				CU_ASSERT(probe->orientation != ORIENTATION_NORMAL);
+		}
+
+		result_destroy(rp);
+		result_destroy(rf);
+	}
+
+	ms_destroy(s);
+} /* test_image_probe() */
+
+
+static int tp_nthumbs;
+static int tp_width[2];
+static int tp_height[2];
+static char tp_saved[2][MAX_PATH_STR_LEN];
+static int tp_has_data;
+
+static void tp_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	MediaScanImage *thumb;
+	const char *path;
+	int x, length;
+
+	tp_nthumbs = r->nthumbnails;
+	tp_has_data = 0;
+
+	for (x = 0; x < r->nthumbnails && x < 2; x++) {
+		thumb = ms_result_get_thumbnail(r, x);
+		tp_width[x] = thumb->width;
+		tp_height[x] = thumb->height;
+		path = ms_result_get_thumbnail_path(r, x);
+		strcpy(tp_saved[x], path ? path : "");
+
+		length = 0;
+		if (ms_result_get_thumbnail_data(r, x, &length) || length)
+			tp_has_data = 1;
+	}
+}
+
+// Whether file exists and starts with len bytes of magic
+static int tp_file_starts_with(const char *file, const char *magic, int len)	{
+	char buf[8];
+	FILE *fp = fopen(file, "rb");
+	int ok;
+
+	if (!fp)
+		return 0;
+
+	ok = fread(buf, 1, len, fp) == len && !memcmp(buf, magic, len);
+	fclose(fp);
+
+	return ok;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Thumbnails written with ms_set_thumbnail_path go to the file the template expands to, with
+/// 	every field substituted, and are reported by that path instead of with their data.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_thumbnail_path(void)	{
+#ifdef WIN32
+	char image[MAX_PATH_STR_LEN] = "data\\image\\jpg\\rgb.jpg";
+	char subdir[MAX_PATH_STR_LEN] = "tp_test_cache\\t%";
+#else
+	char image[MAX_PATH_STR_LEN] = "data/image/jpg/rgb.jpg";
+	char subdir[MAX_PATH_STR_LEN] = "tp_test_cache/t%";
+#endif
+	char cachedir[MAX_PATH_STR_LEN] = "tp_test_cache";
+	char expected[MAX_PATH_STR_LEN];
+	uint32_t pc = 0, pb = 0;
+	MediaScan *s;
+
+	remove_cachedir(subdir);
+	remove_cachedir(cachedir);
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+
+	// The t% directory doesn't exist yet and is created for the first thumbnail
+	ms_set_cachedir(s, cachedir);
+	ms_set_result_callback(s, tp_result_callback);
+	ms_add_thumbnail_spec(s, THUMB_JPEG, 80, 0, FALSE, 0, 90);
+	ms_add_thumbnail_spec(s, THUMB_PNG, 40, 40, TRUE, 0, 0);
+	ms_set_thumbnail_path(s, "%c/t%%/%i-%wx%h-%k.%e");
+
+	tp_nthumbs = 0;
+	ms_scan_file(s, image, TYPE_IMAGE);
+	CU_ASSERT_FATAL(tp_nthumbs == 2);
+	CU_ASSERT(!tp_has_data);
+
+	// The key is the same for every thumbnail of a file, it comes from the source path
+	hashlittle2(image, strlen(image), &pc, &pb);
+
+	sprintf(expected, "%s/t%%/0-%dx%d-%08x%08x.jpg", cachedir, tp_width[0], tp_height[0], pc, pb);
+	CU_ASSERT(tp_width[0] == 80);
+	CU_ASSERT_STRING_EQUAL(tp_saved[0], expected);
+	CU_ASSERT(tp_file_starts_with(tp_saved[0], "\xFF\xD8\xFF", 3));
+
+	sprintf(expected, "%s/t%%/1-40x40-%08x%08x.png", cachedir, pc, pb);
+	CU_ASSERT(tp_width[1] == 40 && tp_height[1] == 40);
+	CU_ASSERT_STRING_EQUAL(tp_saved[1], expected);
+	CU_ASSERT(tp_file_starts_with(tp_saved[1], "\x89PNG", 4));
+
+	ms_destroy(s);
+
+	remove_cachedir(subdir);
+	remove_cachedir(cachedir);
+} /* test_ms_thumbnail_path() */
+
+
+static char dlna_result_profile[64];
+static char dlna_result_mime[64];
+
+static void dlna_result_callback(MediaScan *s, MediaScanResult *r, void *userdata) {
+	strncpy(dlna_result_profile, r->dlna_profile ? r->dlna_profile : "", sizeof(dlna_result_profile) - 1);
+	strncpy(dlna_result_mime, r->mime_type ? r->mime_type : "", sizeof(dlna_result_mime) - 1);
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Each DLNA sample video gets its profile from the indexed probes. The files are scanned twice
+/// 	by one MediaScan so the second pass uses the remembered probe results, and the NTSC and PAL
+/// 	files share a container and codecs so only their dimensions and frame rate tell them apart.
+///-------------------------------------------------------------------------------------------------
+
+void test_ms_dlna_profiles(void)	{
+	const char *files[][2] = {
+		{ "MPEG1.mpg", "MPEG1" },
+		{ "MPEG_PS_NTSC-lpcm.mpg", "MPEG_PS_NTSC" },
+		{ "MPEG_PS_NTSC-ac3.mpg", "MPEG_PS_NTSC" },
+		{ "MPEG_PS_PAL-ac3.mpg", "MPEG_PS_PAL" },
+		{ "MPEG_TS_SD_NA_ISO.ts", "MPEG_TS_SD_NA_ISO" },
+		{ NULL, NULL }
+	};
+	char file[MAX_PATH_STR_LEN];
+	MediaScan *s = ms_create();
+	int pass, x;
+
+	CU_ASSERT_FATAL(s != NULL);
+
+	ms_set_result_callback(s, dlna_result_callback);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (x = 0; files[x][0]; x++) {
+#ifdef WIN32
+			sprintf(file, "data\\video\\dlna\\%s", files[x][0]);
+#else
+			sprintf(file, "data/video/dlna/%s", files[x][0]);
+#endif
+			dlna_result_profile[0] = '\0';
+			dlna_result_mime[0] = '\0';
+			ms_scan_file(s, file, TYPE_VIDEO);
+
+			CU_ASSERT_STRING_EQUAL(dlna_result_profile, files[x][1]);
+			CU_ASSERT_STRING_EQUAL(dlna_result_mime, "video/mpeg");
+		}
+	}
+
+	ms_destroy(s);
+} /* test_ms_dlna_profiles() */
+
+// Path of the nth file of the batch tests, only its directory and name matter to the database
+static void batch_path(char *path, int n)	{
+#ifdef WIN32
+	sprintf(path, "C:\\batch_test\\file%03d.jpg", n);
+#else
+	sprintf(path, "/batch_test/file%03d.jpg", n);
+#endif
+}
+
+///-------------------------------------------------------------------------------------------------
+///  Updates to the scan database are queued and committed together, 256 at a time or when
+/// 	bdb_flush is called. A queued update can't be looked up until its batch is committed, and
+/// 	every committed one is still there when the database is opened again.
+///-------------------------------------------------------------------------------------------------
+
+void test_bdb_batches(void)	{
+	char cachedir[MAX_PATH_STR_LEN] = "batch_test_cache";
+	char path[MAX_PATH_STR_LEN];
+	MediaScan *s;
+	int x, found;
+
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(cachedir);
+#else
+	mkdir(cachedir, 0755);
+#endif
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+	ms_set_cachedir(s, cachedir);
+	CU_ASSERT_FATAL(init_bdb(s));
+
+	// One short of a batch, nothing is written yet
+	for (x = 0; x < 255; x++) {
+		batch_path(path, x);
+		bdb_put(s, path, x + 1);
+	}
+	batch_path(path, 0);
+	CU_ASSERT(!bdb_lookup(s, path, 1));
+	batch_path(path, 254);
+	CU_ASSERT(!bdb_lookup(s, path, 255));
+
+	// The 256th update commits the batch
+	batch_path(path, 255);
+	bdb_put(s, path, 256);
+	found = 0;
+	for (x = 0; x < 256; x++) {
+		batch_path(path, x);
+		found += bdb_lookup(s, path, x + 1);
+	}
+	CU_ASSERT(found == 256);
+
+	// The next one starts a new batch, committed by bdb_flush
+	batch_path(path, 256);
+	bdb_put(s, path, 257);
+	CU_ASSERT(!bdb_lookup(s, path, 257));
+	bdb_flush(s);
+	CU_ASSERT(bdb_lookup(s, path, 257));
+
+	// A queued change of hash leaves the stored one in place, until ms_destroy flushes it
+	batch_path(path, 0);
+	bdb_put(s, path, 1000);
+	CU_ASSERT(bdb_lookup(s, path, 1));
+	CU_ASSERT(!bdb_lookup(s, path, 1000));
+	ms_destroy(s);
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+	ms_set_cachedir(s, cachedir);
+	CU_ASSERT_FATAL(init_bdb(s));
+
+	found = 0;
+	for (x = 1; x < 257; x++) {
+		batch_path(path, x);
+		found += bdb_lookup(s, path, x + 1);
+	}
+	CU_ASSERT(found == 256);
+
+	batch_path(path, 0);
+	CU_ASSERT(bdb_lookup(s, path, 1000));
+	CU_ASSERT(!bdb_lookup(s, path, 1));
+
+	ms_destroy(s);
+
+	remove_cachedir(cachedir);
+} /* test_bdb_batches() */
+
+// Rewrite file with its first byte flipped, or cut to half its length
+static int damage_file(const char *file, int truncate)	{
+	FILE *fp;
+	char *buf;
+	long size;
+
+	if ((fp = fopen(file, "rb")) == NULL)
+		return FALSE;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	buf = (char *)malloc(size);
+	if (size < 2 || fread(buf, 1, size, fp) != (size_t)size) {
+		fclose(fp);
+		free(buf);
+		return FALSE;
+	}
+	fclose(fp);
+
+	if (truncate)
+		size /= 2;
+	else
+		buf[0] ^= 0xff;
+
+	fp = fopen(file, "wb");
+	fwrite(buf, 1, size, fp);
+	fclose(fp);
+	free(buf);
+
+	return TRUE;
+}
+
+///-------------------------------------------------------------------------------------------------
+///  A Bloom filter saved to a file loads with the same keys, and a damaged file is rejected rather
+/// 	than loaded with keys missing. The scan database then rebuilds its filter from the stored
+/// 	entries, so no stored file is mistaken for a new one.
+///-------------------------------------------------------------------------------------------------
+
+void test_bloom_save_load(void)	{
+#ifdef WIN32
+	char file[MAX_PATH_STR_LEN] = "bloom_test_cache\\test.bloom";
+	char saved[MAX_PATH_STR_LEN] = "bloom_test_cache\\libmediascan.bloom";
+#else
+	char file[MAX_PATH_STR_LEN] = "bloom_test_cache/test.bloom";
+	char saved[MAX_PATH_STR_LEN] = "bloom_test_cache/libmediascan.bloom";
+#endif
+	char cachedir[MAX_PATH_STR_LEN] = "bloom_test_cache";
+	char key[MAX_PATH_STR_LEN];
+	MediaScan *s;
+	Bloom *b, *loaded;
+	int x, found, false_positives;
+
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(cachedir);
+#else
+	mkdir(cachedir, 0755);
+#endif
+
+	b = bloom_create(0);
+	CU_ASSERT_FATAL(b != NULL);
+	for (x = 0; x < 1000; x++) {
+		sprintf(key, "key%d", x);
+		bloom_add(b, key, strlen(key));
+	}
+	CU_ASSERT_FATAL(bloom_save(b, file));
+
+	loaded = bloom_load(file);
+	CU_ASSERT_FATAL(loaded != NULL);
+	CU_ASSERT(bloom_count(loaded) == bloom_count(b));
+
+	found = 0;
+	false_positives = 0;
+	for (x = 0; x < 1000; x++) {
+		sprintf(key, "key%d", x);
+		found += bloom_check(loaded, key, strlen(key));
+		sprintf(key, "absent%d", x);
+		false_positives += bloom_check(loaded, key, strlen(key));
+	}
+	CU_ASSERT(found == 1000);
+	CU_ASSERT(false_positives < 10);
+	bloom_destroy(loaded);
+
+	// Cut short
+	CU_ASSERT_FATAL(damage_file(file, TRUE));
+	CU_ASSERT(bloom_load(file) == NULL);
+
+	// Not a filter file at all
+	CU_ASSERT(bloom_save(b, file));
+	CU_ASSERT_FATAL(damage_file(file, FALSE));
+	CU_ASSERT(bloom_load(file) == NULL);
+
+	bloom_destroy(b);
+
+	// The scan database saves its filter when closed
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+	ms_set_cachedir(s, cachedir);
+	CU_ASSERT_FATAL(init_bdb(s));
+	for (x = 0; x < 100; x++) {
+		batch_path(key, x);
+		bdb_put(s, key, x + 1);
+	}
+	ms_destroy(s);
+
+	CU_ASSERT_FATAL(damage_file(saved, TRUE));
+
+	s = ms_create();
+	CU_ASSERT_FATAL(s != NULL);
+	ms_set_cachedir(s, cachedir);
+	CU_ASSERT_FATAL(init_bdb(s));
+
+	found = 0;
+	for (x = 0; x < 100; x++) {
+		batch_path(key, x);
+		found += bdb_lookup(s, key, x + 1);
+	}
+	CU_ASSERT(found == 100);
+
+	ms_destroy(s);
+
+	remove_cachedir(cachedir);
+} /* test_bloom_save_load() */
+
+///-------------------------------------------------------------------------------------------------
+///  Files are stored under their directory's id and their name, so files with the same name in
+/// 	two directories are separate entries. Each rescan uses a new MediaScan, so the entries and
+/// 	the directory ids survive the database being closed and opened again.
+///-------------------------------------------------------------------------------------------------
+
+void test_bdb_rescan_keys(void)	{
+#ifdef WIN32
+	char src[MAX_PATH_STR_LEN] = "data\\image\\jpg\\exif_180.jpg";
+	char other[MAX_PATH_STR_LEN] = "data\\image\\jpg\\exif_270_ccw.jpg";
+	char one_a[MAX_PATH_STR_LEN] = "key_one\\a.jpg";
+	char one_b[MAX_PATH_STR_LEN] = "key_one\\b.jpg";
+	char one_c[MAX_PATH_STR_LEN] = "key_one\\c.jpg";
+	char two_a[MAX_PATH_STR_LEN] = "key_two\\a.jpg";
+	char two_b[MAX_PATH_STR_LEN] = "key_two\\b.jpg";
+	char two_c[MAX_PATH_STR_LEN] = "key_two\\c.jpg";
+#else
+	char src[MAX_PATH_STR_LEN] = "data/image/jpg/exif_180.jpg";
+	char other[MAX_PATH_STR_LEN] = "data/image/jpg/exif_270_ccw.jpg";
+	char one_a[MAX_PATH_STR_LEN] = "key_one/a.jpg";
+	char one_b[MAX_PATH_STR_LEN] = "key_one/b.jpg";
+	char one_c[MAX_PATH_STR_LEN] = "key_one/c.jpg";
+	char two_a[MAX_PATH_STR_LEN] = "key_two/a.jpg";
+	char two_b[MAX_PATH_STR_LEN] = "key_two/b.jpg";
+	char two_c[MAX_PATH_STR_LEN] = "key_two/c.jpg";
+#endif
+	char one[MAX_PATH_STR_LEN] = "key_one";
+	char two[MAX_PATH_STR_LEN] = "key_two";
+	char cachedir[MAX_PATH_STR_LEN] = "key_test_cache";
+
+	remove_cachedir(one);
+	remove_cachedir(two);
+	remove_cachedir(cachedir);
+#ifdef WIN32
+	_mkdir(one);
+	_mkdir(two);
+	_mkdir(cachedir);
+#else
+	mkdir(one, 0755);
+	mkdir(two, 0755);
+	mkdir(cachedir, 0755);
+#endif
+
+	CU_ASSERT_FATAL(copy_file(src, one_a, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, one_b, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, two_a, FALSE));
+	CU_ASSERT_FATAL(copy_file(src, two_b, FALSE));
+
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 4);
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 0);
+
+	// A change to one a.jpg leaves the other's entry alone, its size tells the rescan it changed
+	CU_ASSERT_FATAL(copy_file(other, two_a, FALSE));
+	CU_ASSERT(clear_scan(cachedir, one, NULL, MS_RESCAN) == 0);
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 1);
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 0);
+
+	// A name already stored for one directory is still new in the other
+	CU_ASSERT_FATAL(copy_file(src, one_c, FALSE));
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 1);
+	CU_ASSERT_FATAL(copy_file(src, two_c, FALSE));
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 1);
+	CU_ASSERT(clear_scan(cachedir, one, two, MS_RESCAN) == 0);
+
+	remove_cachedir(one);
+	remove_cachedir(two);
+	remove_cachedir(cachedir);
+} /* test_bdb_rescan_keys() */
+
 
 ///-------------------------------------------------------------------------------------------------
 ///  ------------------------------------------------------------------------------------------
@@ -601,7 +2466,26 @@ int run_unit_tests()
 //NULL == CU_add_test(pSuite, "Test of scanning LOTS of files", test_ms_large_directory) ||
 	   NULL == CU_add_test(pSuite, "Test of misc functions", test_ms_misc_functions) ||
   	   NULL == CU_add_test(pSuite, "Simple test of ASF audio file", test_ms_file_asf_audio) ||
-   	   NULL == CU_add_test(pSuite, "Test Berkeley database functionality", test_ms_db)
+  	   NULL == CU_add_test(pSuite, "Test of native audio scanning", test_ms_file_audio) ||
+   	   NULL == CU_add_test(pSuite, "Test Berkeley database functionality", test_ms_db) ||
+   	   NULL == CU_add_test(pSuite, "Test of several scans running at once", test_ms_parallel_scans) ||
+   	   NULL == CU_add_test(pSuite, "Test of duplicate detection", test_ms_duplicates) ||
+   	   NULL == CU_add_test(pSuite, "Test of moved file detection", test_ms_move_detection) ||
+   	   NULL == CU_add_test(pSuite, "Test of a full scan sharing a database", test_ms_full_scan_paths) ||
+   	   NULL == CU_add_test(pSuite, "Test of image signatures", test_ms_signatures) ||
+   	   NULL == CU_add_test(pSuite, "Test of the SIMD pixel converters", test_pixel_converters) ||
+   	   NULL == CU_add_test(pSuite, "Test of thumbnail EXIF orientation", test_thumb_orient) ||
+   	   NULL == CU_add_test(pSuite, "Test of camera RAW previews", test_ms_raw_preview) ||
+   	   NULL == CU_add_test(pSuite, "Test of fast JPEG thumbnail encoding", test_ms_fast_encode) ||
+   	   NULL == CU_add_test(pSuite, "Test of replaying cached results", test_ms_result_cache) ||
+   	   NULL == CU_add_test(pSuite, "Test of the thumbnail cache", test_ms_thumb_cache) ||
+   	   NULL == CU_add_test(pSuite, "Test of WebP thumbnails", test_ms_webp_thumbnail) ||
+   	   NULL == CU_add_test(pSuite, "Test of header-only image probes", test_image_probe) ||
+   	   NULL == CU_add_test(pSuite, "Test of writing thumbnails to files", test_ms_thumbnail_path) ||
+   	   NULL == CU_add_test(pSuite, "Test of DLNA profile detection", test_ms_dlna_profiles) ||
+   	   NULL == CU_add_test(pSuite, "Test of batched database updates", test_bdb_batches) ||
+   	   NULL == CU_add_test(pSuite, "Test of saving and loading Bloom filters", test_bloom_save_load) ||
+   	   NULL == CU_add_test(pSuite, "Test of database keys surviving a rescan", test_bdb_rescan_keys)
 			 
 	   )
    {